@@ -2,21 +2,104 @@ CC=g++
 CFLAGS= -g -Wall -std=c++17
 
 # If on Windows (/MinGW), use windows libs
+ifeq ($(OS),Windows_NT)
 LIBS = -lws2_32
+else
+LIBS = -lpthread
+endif
 
 all: proxy
 
-proxy: proxy_server_with_cache.o proxy_parse.o
+.PHONY: bench loadtest
+
+proxy: proxy_server_with_cache.o proxy_parse.o proxy_cache.o proxy_event_loop.o proxy_upstream.o proxy_inflight.o proxy_resolver.o proxy_buffer.o proxy_slab.o proxy_freshness.o proxy_scan.o proxy_policy.o proxy_disk.o proxy_pool.o proxy_log.o proxy_metrics.o proxy_tunnel.o proxy_range.o proxy_slices.o proxy_uring.o
 	$(CC) $(CFLAGS) -o proxy $^ $(LIBS)
 
-proxy_server_with_cache.o: proxy_server_with_cache.cpp proxy_parse.h
+proxy_server_with_cache.o: proxy_server_with_cache.cpp proxy_server_with_cache.h proxy_socket.h proxy_event_loop.h proxy_uring.h proxy_parse.h proxy_scan.h proxy_cache.h proxy_policy.h proxy_disk.h proxy_upstream.h proxy_inflight.h proxy_resolver.h proxy_pool.h proxy_log.h proxy_metrics.h proxy_tunnel.h proxy_buffer.h proxy_slab.h proxy_freshness.h proxy_slices.h proxy_range.h
 	$(CC) $(CFLAGS) -c proxy_server_with_cache.cpp
 
-proxy_parse.o: proxy_parse.cpp proxy_parse.h
+proxy_parse.o: proxy_parse.cpp proxy_parse.h proxy_scan.h proxy_log.h
 	$(CC) $(CFLAGS) -c proxy_parse.cpp
 
+proxy_cache.o: proxy_cache.cpp proxy_cache.h proxy_policy.h proxy_disk.h proxy_parse.h proxy_scan.h proxy_buffer.h proxy_slab.h proxy_freshness.h
+	$(CC) $(CFLAGS) -c proxy_cache.cpp
+
+proxy_event_loop.o: proxy_event_loop.cpp proxy_event_loop.h proxy_server_with_cache.h proxy_socket.h proxy_parse.h proxy_scan.h proxy_cache.h proxy_policy.h proxy_disk.h proxy_upstream.h proxy_inflight.h proxy_resolver.h proxy_pool.h proxy_log.h proxy_metrics.h proxy_tunnel.h proxy_buffer.h proxy_slab.h proxy_freshness.h proxy_slices.h proxy_range.h
+	$(CC) $(CFLAGS) -c proxy_event_loop.cpp
+
+proxy_upstream.o: proxy_upstream.cpp proxy_upstream.h proxy_socket.h proxy_parse.h proxy_scan.h
+	$(CC) $(CFLAGS) -c proxy_upstream.cpp
+
+proxy_inflight.o: proxy_inflight.cpp proxy_inflight.h proxy_buffer.h proxy_slab.h
+	$(CC) $(CFLAGS) -c proxy_inflight.cpp
+
+proxy_resolver.o: proxy_resolver.cpp proxy_resolver.h proxy_socket.h proxy_metrics.h
+	$(CC) $(CFLAGS) -c proxy_resolver.cpp
+
+proxy_buffer.o: proxy_buffer.cpp proxy_buffer.h proxy_slab.h proxy_socket.h
+	$(CC) $(CFLAGS) -c proxy_buffer.cpp
+
+proxy_freshness.o: proxy_freshness.cpp proxy_freshness.h proxy_parse.h proxy_scan.h
+	$(CC) $(CFLAGS) -c proxy_freshness.cpp
+
+proxy_policy.o: proxy_policy.cpp proxy_policy.h proxy_cache.h proxy_parse.h proxy_scan.h proxy_buffer.h proxy_slab.h proxy_freshness.h
+	$(CC) $(CFLAGS) -c proxy_policy.cpp
+
+proxy_disk.o: proxy_disk.cpp proxy_disk.h proxy_cache.h proxy_policy.h proxy_parse.h proxy_scan.h proxy_buffer.h proxy_slab.h proxy_freshness.h proxy_socket.h
+	$(CC) $(CFLAGS) -c proxy_disk.cpp
+
+proxy_pool.o: proxy_pool.cpp proxy_pool.h
+	$(CC) $(CFLAGS) -c proxy_pool.cpp
+
+proxy_slab.o: proxy_slab.cpp proxy_slab.h
+	$(CC) $(CFLAGS) -c proxy_slab.cpp
+
+proxy_log.o: proxy_log.cpp proxy_log.h
+	$(CC) $(CFLAGS) -c proxy_log.cpp
+
+proxy_metrics.o: proxy_metrics.cpp proxy_metrics.h proxy_socket.h proxy_log.h
+	$(CC) $(CFLAGS) -c proxy_metrics.cpp
+
+proxy_tunnel.o: proxy_tunnel.cpp proxy_tunnel.h proxy_socket.h proxy_metrics.h proxy_log.h
+	$(CC) $(CFLAGS) -c proxy_tunnel.cpp
+
+proxy_range.o: proxy_range.cpp proxy_range.h proxy_parse.h proxy_scan.h
+	$(CC) $(CFLAGS) -c proxy_range.cpp
+
+proxy_slices.o: proxy_slices.cpp proxy_slices.h proxy_range.h proxy_server_with_cache.h proxy_socket.h proxy_parse.h proxy_scan.h proxy_cache.h proxy_policy.h proxy_disk.h proxy_upstream.h proxy_inflight.h proxy_resolver.h proxy_pool.h proxy_log.h proxy_metrics.h proxy_tunnel.h proxy_buffer.h proxy_slab.h proxy_freshness.h
+	$(CC) $(CFLAGS) -c proxy_slices.cpp
+
+proxy_uring.o: proxy_uring.cpp proxy_uring.h proxy_event_loop.h proxy_server_with_cache.h proxy_socket.h proxy_parse.h proxy_scan.h proxy_cache.h proxy_policy.h proxy_disk.h proxy_upstream.h proxy_inflight.h proxy_resolver.h proxy_pool.h proxy_log.h proxy_metrics.h proxy_tunnel.h proxy_buffer.h proxy_slab.h proxy_freshness.h
+	$(CC) $(CFLAGS) -c proxy_uring.cpp
+
+# Always optimized: the SIMD intrinsics are slower than memchr at -O0
+proxy_scan.o: proxy_scan.cpp proxy_scan.h
+	$(CC) $(CFLAGS) -O2 -c proxy_scan.cpp
+
+# Microbenchmarks, cache policy trace replay, and the load-test tools; not part of all
+bench: bench/parse_bench bench/cache_replay bench/cache_bench bench/stub_origin bench/load_gen
+
+# Runs the whole load-test suite; see bench/load_test.sh
+loadtest: proxy bench
+	./bench/load_test.sh
+
+bench/parse_bench: bench/parse_bench.cpp proxy_parse.o proxy_scan.o proxy_log.o proxy_parse.h proxy_scan.h
+	$(CC) $(CFLAGS) -O2 -o bench/parse_bench bench/parse_bench.cpp proxy_parse.o proxy_scan.o proxy_log.o $(LIBS)
+
+bench/cache_replay: bench/cache_replay.cpp proxy_cache.o proxy_policy.o proxy_disk.o proxy_parse.o proxy_scan.o proxy_buffer.o proxy_slab.o proxy_freshness.o proxy_log.o proxy_cache.h proxy_policy.h
+	$(CC) $(CFLAGS) -O2 -o bench/cache_replay bench/cache_replay.cpp proxy_cache.o proxy_policy.o proxy_disk.o proxy_parse.o proxy_scan.o proxy_buffer.o proxy_slab.o proxy_freshness.o proxy_log.o $(LIBS)
+
+bench/cache_bench: bench/cache_bench.cpp proxy_cache.o proxy_policy.o proxy_disk.o proxy_parse.o proxy_scan.o proxy_buffer.o proxy_slab.o proxy_freshness.o proxy_log.o proxy_cache.h proxy_policy.h
+	$(CC) $(CFLAGS) -O2 -o bench/cache_bench bench/cache_bench.cpp proxy_cache.o proxy_policy.o proxy_disk.o proxy_parse.o proxy_scan.o proxy_buffer.o proxy_slab.o proxy_freshness.o proxy_log.o $(LIBS)
+
+bench/stub_origin: bench/stub_origin.cpp proxy_socket.h
+	$(CC) $(CFLAGS) -O2 -o bench/stub_origin bench/stub_origin.cpp $(LIBS)
+
+bench/load_gen: bench/load_gen.cpp proxy_upstream.o proxy_parse.o proxy_scan.o proxy_log.o proxy_upstream.h proxy_socket.h
+	$(CC) $(CFLAGS) -O2 -o bench/load_gen bench/load_gen.cpp proxy_upstream.o proxy_parse.o proxy_scan.o proxy_log.o $(LIBS)
+
 clean:
-	-rm -f proxy *.o proxy.exe
+	-rm -f proxy *.o proxy.exe bench/parse_bench bench/cache_replay bench/cache_bench bench/stub_origin bench/load_gen
 
 tar:
-	tar -cvzf proxy-server.tgz proxy_server_with_cache.cpp proxy_parse.cpp proxy_parse.h README.md Makefile.mk
+	tar -cvzf proxy-server.tgz proxy_server_with_cache.cpp proxy_server_with_cache.h proxy_socket.h proxy_event_loop.cpp proxy_event_loop.h proxy_parse.cpp proxy_parse.h proxy_cache.cpp proxy_cache.h proxy_upstream.cpp proxy_upstream.h proxy_inflight.cpp proxy_inflight.h proxy_resolver.cpp proxy_resolver.h proxy_buffer.cpp proxy_buffer.h proxy_freshness.cpp proxy_freshness.h proxy_scan.cpp proxy_scan.h proxy_policy.cpp proxy_policy.h proxy_disk.cpp proxy_disk.h proxy_slab.cpp proxy_slab.h proxy_pool.cpp proxy_pool.h proxy_log.cpp proxy_log.h proxy_metrics.cpp proxy_metrics.h proxy_tunnel.cpp proxy_tunnel.h proxy_range.cpp proxy_range.h proxy_slices.cpp proxy_slices.h proxy_uring.cpp proxy_uring.h bench/parse_bench.cpp bench/cache_replay.cpp bench/cache_bench.cpp bench/stub_origin.cpp bench/load_gen.cpp bench/load_test.sh README.md Makefile.mk
@@ -0,0 +1,168 @@
+/*
+  cache_bench.cpp -- microbenchmarks for cache lookup and eviction, under
+  each cache policy.
+
+  Build with: make -f Makefile.mk bench
+  Run as:     ./bench/cache_bench [--threads=N]
+
+  lookup_hit and lookup_miss time ProxyCache::find on a populated cache from
+  1 and N threads, so shard lock contention shows up. evict times
+  CacheShard::add into a full shard, where every add makes the policy pick
+  victims (or, under tinylfu, turn the newcomer away).
+
+  Prints one JSON object per benchmark. Operations are timed in batches of
+  CACHE_BENCH_BATCH, so the percentiles are of per-operation batch means.
+*/
+
+#include "../proxy_cache.h"
+#include <thread>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#define CACHE_BENCH_OBJECTS 50000
+#define CACHE_BENCH_BODY 1024
+#define CACHE_BENCH_OPS 2000000     //lookups per thread
+#define CACHE_BENCH_EVICT_OPS 200000    //adds into a full shard; each needs its own entry built up front
+#define CACHE_BENCH_BATCH 64
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchResult {
+    std::vector<double> batch_ns;   // mean ns per operation of each batch
+    double seconds = 0;
+    size_t ops = 0;
+};
+
+static void report(const char* bench, const char* policy, int threads, std::vector<BenchResult>& results) {
+    std::vector<double> samples;
+    size_t ops = 0;
+    double seconds = 0;
+    for (auto& r : results) {
+        samples.insert(samples.end(), r.batch_ns.begin(), r.batch_ns.end());
+        ops += r.ops;
+        seconds = std::max(seconds, r.seconds);
+    }
+    std::sort(samples.begin(), samples.end());
+    auto at = [&](double q) { return samples.empty() ? 0 : samples[std::min(samples.size() - 1, (size_t)(q * samples.size()))]; };
+    printf("{\"bench\":\"%s\",\"policy\":\"%s\",\"threads\":%d,\"ops\":%zu,\"ops_per_sec\":%.0f,"
+           "\"p50_ns\":%.1f,\"p99_ns\":%.1f,\"p999_ns\":%.1f}\n",
+           bench, policy, threads, ops, ops / seconds, at(0.50), at(0.99), at(0.999));
+}
+
+// Runs op(thread, i) ops times on each of threads threads
+template <typename Op>
+static std::vector<BenchResult> run_threads(int threads, size_t ops, Op op) {
+    std::vector<BenchResult> results(threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            BenchResult& r = results[t];
+            r.batch_ns.reserve(ops / CACHE_BENCH_BATCH);
+            Clock::time_point start = Clock::now();
+            for (size_t i = 0; i + CACHE_BENCH_BATCH <= ops; i += CACHE_BENCH_BATCH) {
+                Clock::time_point batch_start = Clock::now();
+                for (size_t j = i; j < i + CACHE_BENCH_BATCH; j++) op(t, j);
+                r.batch_ns.push_back(std::chrono::duration<double, std::nano>(Clock::now() - batch_start).count() / CACHE_BENCH_BATCH);
+            }
+            r.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            r.ops = ops / CACHE_BENCH_BATCH * CACHE_BENCH_BATCH;
+        });
+    }
+    for (auto& w : workers) w.join();
+    return results;
+}
+
+static std::string request_for(size_t object) {
+    return "GET http://bench.test/obj/" + std::to_string(object) + " HTTP/1.1\r\nHost: bench.test\r\n\r\n";
+}
+
+static BufferChain response_body() {
+    std::string response = "HTTP/1.1 200 OK\r\nCache-Control: max-age=3600\r\nContent-Length: " + std::to_string(CACHE_BENCH_BODY) + "\r\n\r\n";
+    response.append(CACHE_BENCH_BODY, 'x');
+    BufferChain chain;
+    chain.append(response.data(), response.size());
+    chain.shrink_to_fit();
+    return chain;
+}
+
+static void lookups(const char* policy, int threads) {
+    ProxyCache cache((size_t)CACHE_BENCH_OBJECTS * 4 * CACHE_BENCH_BODY, CACHE_BENCH_BODY * 4);
+    cache.set_policy(policy);
+    BufferChain body = response_body();
+    std::vector<CacheKey> hit_keys, miss_keys;
+    ParsedRequest request;
+    for (size_t i = 0; i < CACHE_BENCH_OBJECTS; i++) {
+        std::string text = request_for(i);
+        request.reset();
+        request.parse(text.data(), text.size());
+        cache.add(body, request, true);
+        hit_keys.push_back(cache.key_for(request));
+
+        std::string missing = request_for(CACHE_BENCH_OBJECTS + i);
+        request.reset();
+        request.parse(missing.data(), missing.size());
+        miss_keys.push_back(cache.key_for(request));
+    }
+
+    // Walk the keys in a shuffled order, different per thread
+    std::vector<std::vector<uint32_t>> orders(threads);
+    for (int t = 0; t < threads; t++) {
+        orders[t].resize(CACHE_BENCH_OBJECTS);
+        for (size_t i = 0; i < CACHE_BENCH_OBJECTS; i++) orders[t][i] = (uint32_t)i;
+        std::shuffle(orders[t].begin(), orders[t].end(), std::mt19937(t + 1));
+    }
+
+    auto hits = run_threads(threads, CACHE_BENCH_OPS, [&](int t, size_t i) {
+        CacheEntryPtr entry = cache.find(hit_keys[orders[t][i % CACHE_BENCH_OBJECTS]]);
+        if (!entry) abort();
+    });
+    report("lookup_hit", policy, threads, hits);
+
+    auto misses = run_threads(threads, CACHE_BENCH_OPS, [&](int t, size_t i) {
+        if (cache.find(miss_keys[orders[t][i % CACHE_BENCH_OBJECTS]])) abort();
+    });
+    report("lookup_miss", policy, threads, misses);
+}
+
+static void evictions(const char* policy) {
+    // Room for a quarter of the objects, filled before timing starts
+    const size_t objects = CACHE_BENCH_EVICT_OPS + CACHE_BENCH_OBJECTS;
+    BufferChain body = response_body();
+    std::vector<CacheEntryPtr> entries;
+    entries.reserve(objects);
+    for (size_t i = 0; i < objects; i++) {
+        std::string key = "GET bench.test:80/obj/" + std::to_string(i);
+        size_t hash = std::hash<std::string>()(key);
+        Freshness freshness;
+        freshness.storable = true;
+        freshness.expires = time(NULL) + 86400;
+        entries.push_back(make_cache_entry(CacheEntry{std::move(key), hash, body, true, std::move(freshness)}));
+    }
+    size_t budget = (size_t)CACHE_BENCH_OBJECTS / 4 * (CACHE_BENCH_BODY + 512);
+    CacheShard shard(budget, budget, policy);
+    for (size_t i = 0; i < CACHE_BENCH_OBJECTS; i++) shard.add(entries[i]);
+
+    auto adds = run_threads(1, CACHE_BENCH_EVICT_OPS, [&](int, size_t i) { shard.add(entries[CACHE_BENCH_OBJECTS + i]); });
+    report("evict", policy, 1, adds);
+}
+
+int main(int argc, char** argv) {
+    int threads = std::max(2u, std::thread::hardware_concurrency());
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--threads=", 0) == 0) threads = atoi(arg.c_str() + 10);
+        else {
+            fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+    for (const char* policy : {"lru", "tinylfu"}) {
+        lookups(policy, 1);
+        lookups(policy, threads);
+        evictions(policy);
+    }
+    return 0;
+}
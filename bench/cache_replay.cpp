@@ -0,0 +1,156 @@
+/*
+  cache_replay.cpp -- replays a request trace against each cache policy and
+  reports hit ratio and byte hit ratio, then how much memory the cache's
+  bodies took from the slab allocator.
+
+  Build with: make -f Makefile.mk bench
+  Run as:     ./bench/cache_replay [TRACE] [--size=MB]
+
+  A trace has one request per line, "key size_in_bytes", with '#' comments.
+  Without a trace, a synthetic one is generated: Zipf-distributed requests
+  over a fixed catalogue, interrupted by crawler scans of one-off objects.
+*/
+
+#include "../proxy_cache.h"
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#define REPLAY_DEFAULT_SIZE_MB 64
+#define SYNTHETIC_REQUESTS 400000
+#define SYNTHETIC_OBJECTS 20000
+#define SYNTHETIC_ZIPF 0.9
+#define SCAN_EVERY 50000            //requests between crawler scans
+#define SCAN_LENGTH 10000           //one-off objects fetched by each scan
+
+struct TraceRequest {
+    std::string key;
+    size_t size;
+};
+
+static bool load_trace(const char* path, std::vector<TraceRequest>& trace) {
+    std::ifstream file(path);
+    if (!file) return false;
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t hash = line.find('#');
+        if (hash != std::string::npos) line.resize(hash);
+        std::istringstream fields(line);
+        TraceRequest request;
+        if (fields >> request.key >> request.size) trace.push_back(std::move(request));
+    }
+    return true;
+}
+
+// Object sizes are log-uniform between 1KB and 1MB, fixed per object
+static size_t object_size(std::mt19937_64& rng) {
+    std::uniform_real_distribution<double> exponent(10, 20);
+    return (size_t)std::pow(2.0, exponent(rng));
+}
+
+static void synthesize(std::vector<TraceRequest>& trace) {
+    std::mt19937_64 rng(42);
+    std::vector<size_t> sizes(SYNTHETIC_OBJECTS);
+    for (auto& size : sizes) size = object_size(rng);
+
+    // Zipf by inverse transform over the cumulative weights
+    std::vector<double> cumulative(SYNTHETIC_OBJECTS);
+    double total = 0;
+    for (int i = 0; i < SYNTHETIC_OBJECTS; i++) {
+        total += 1.0 / std::pow(i + 1, SYNTHETIC_ZIPF);
+        cumulative[i] = total;
+    }
+    std::uniform_real_distribution<double> uniform(0, total);
+
+    int scan_object = 0;
+    for (int i = 0; i < SYNTHETIC_REQUESTS; i++) {
+        if (i > 0 && i % SCAN_EVERY == 0) {
+            for (int j = 0; j < SCAN_LENGTH; j++, scan_object++) {
+                trace.push_back({"scan/" + std::to_string(scan_object), object_size(rng)});
+            }
+        }
+        size_t object = std::lower_bound(cumulative.begin(), cumulative.end(), uniform(rng)) - cumulative.begin();
+        trace.push_back({"obj/" + std::to_string(object), sizes[object]});
+    }
+}
+
+static void print_slab_stats() {
+    SlabStats stats = slab_allocator().stats();
+    printf("slabs: %.1f MB reserved, %.1f MB in use, fragmentation %.1f%%\n",
+           stats.reserved / 1048576.0, stats.in_use / 1048576.0, 100.0 * stats.fragmentation());
+    for (const auto& size_class : stats.classes) {
+        printf("  %6zu B blocks: %4zu arenas, %7zu in use, %7zu free, occupancy %5.1f%%\n",
+               size_class.block_size, size_class.arenas, size_class.in_use, size_class.free, 100.0 * size_class.occupancy());
+    }
+}
+
+static void replay(const char* policy, const std::vector<TraceRequest>& trace, size_t cache_size) {
+    CacheShard shard(cache_size, cache_size, policy);
+    std::string body(BUFFER_SLAB_SIZE, 'x');
+    size_t requests = 0, hits = 0;
+    size_t bytes = 0, hit_bytes = 0;
+
+    for (const auto& request : trace) {
+        CacheKey key;
+        key.text = request.key;
+        key.url_len = key.text.size();
+        key.hash = key.url_hash = std::hash<std::string>()(key.text);
+
+        requests++;
+        bytes += request.size;
+        if (shard.find(key)) {
+            hits++;
+            hit_bytes += request.size;
+            continue;
+        }
+
+        BufferChain data;
+        for (size_t left = request.size; left > 0;) {
+            size_t n = std::min(left, body.size());
+            data.append(body.data(), n);
+            left -= n;
+        }
+        data.shrink_to_fit();
+        Freshness freshness;
+        freshness.storable = true;
+        freshness.expires = time(NULL) + 86400;
+        shard.add(make_cache_entry(CacheEntry{std::move(key.text), key.hash, std::move(data), true, std::move(freshness)}));
+    }
+
+    CacheStats stats = shard.stats();
+    printf("%-8s hit ratio %6.2f%%  byte hit ratio %6.2f%%  evictions %zu  rejections %zu\n",
+           policy, 100.0 * hits / requests, 100.0 * hit_bytes / bytes, stats.evictions, stats.rejections);
+    printf("         %.1f MB charged for %.1f MB of bodies\n", stats.size / 1048576.0, stats.body_bytes / 1048576.0);
+    print_slab_stats();
+}
+
+int main(int argc, char** argv) {
+    const char* trace_path = nullptr;
+    size_t size_mb = REPLAY_DEFAULT_SIZE_MB;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--size=", 0) == 0) size_mb = atoi(arg.c_str() + 7);
+        else trace_path = argv[i];
+    }
+
+    std::vector<TraceRequest> trace;
+    if (trace_path) {
+        if (!load_trace(trace_path, trace)) {
+            fprintf(stderr, "Can't read trace: %s\n", trace_path);
+            return 1;
+        }
+    }
+    else {
+        synthesize(trace);
+    }
+    printf("%zu requests, %zu MB cache\n", trace.size(), size_mb);
+
+    for (const char* policy : {"lru", "tinylfu"}) {
+        replay(policy, trace, size_mb << 20);
+    }
+
+    return 0;
+}
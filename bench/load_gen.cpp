@@ -0,0 +1,273 @@
+/*
+  load_gen.cpp -- multi-threaded HTTP load generator for the proxy.
+
+  Build with: make -f Makefile.mk bench
+  Run as:     ./bench/load_gen --proxy=HOST:PORT [--origin=HOST:PORT]
+                               [--threads=N] [--duration=SECONDS]
+                               [--objects=N] [--zipf=S] [--seed=N]
+                               [--mode=closed|open] [--rate=RPS] [--check]
+
+  Each thread keeps one keep-alive connection to the proxy and asks it for
+  http://ORIGIN/obj/I, with I drawn from a Zipf distribution over --objects
+  objects. In closed-loop mode a thread sends its next request as soon as the
+  last response is in, so throughput is whatever the proxy sustains. In
+  open-loop mode requests are due at a fixed total --rate, spread over the
+  threads, and latency is measured from when a request was due rather than
+  when it was sent, so a stalled proxy can't hide its queueing delay.
+
+  --check also compares every body with what stub_origin serves and counts
+  any difference as corrupt, so concurrent misses, coalesced fetches and
+  revalidations can be checked for correctness as well as timed. The exit
+  status is then non-zero if any request failed.
+
+  Prints one JSON object: request, error and corrupt counts, throughput, and
+  latency percentiles in milliseconds. The same seed gives the same request
+  sequence.
+*/
+
+#include "../proxy_upstream.h"
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define LOAD_DEFAULT_THREADS 8
+#define LOAD_DEFAULT_DURATION 10
+#define LOAD_DEFAULT_OBJECTS 10000
+#define LOAD_DEFAULT_ZIPF 0.9
+#define LOAD_RECV_TIMEOUT 10        //seconds to wait on a response before counting it as an error
+#define STUB_SEND_CHUNK 65536       //stub_origin's body pattern starts over every this many bytes
+
+using Clock = std::chrono::steady_clock;
+
+struct LoadConfig {
+    std::string proxy_host = "127.0.0.1";
+    int proxy_port = 0;
+    std::string origin = "127.0.0.1:9900";
+    int threads = LOAD_DEFAULT_THREADS;
+    double duration = LOAD_DEFAULT_DURATION;
+    int objects = LOAD_DEFAULT_OBJECTS;
+    double zipf = LOAD_DEFAULT_ZIPF;
+    uint64_t seed = 1;
+    bool open_loop = false;
+    double rate = 0;                // requests per second over all threads, open loop only
+    bool check = false;             // check bodies against stub_origin's
+};
+
+// What one thread saw
+struct ThreadResult {
+    std::vector<uint32_t> latencies_us;
+    size_t errors = 0;
+    size_t corrupt = 0;             // of the errors, responses whose body wasn't stub_origin's
+    size_t reconnects = 0;
+    size_t bytes = 0;
+};
+
+static LoadConfig config;
+static std::vector<double> zipf_cumulative;
+
+static socket_t connect_proxy() {
+    socket_t s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET_VAL) return s;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.proxy_port);
+    inet_pton(AF_INET, config.proxy_host.c_str(), &addr.sin_addr);
+    if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close_socket(s);
+        return INVALID_SOCKET_VAL;
+    }
+    set_recv_timeout(s, LOAD_RECV_TIMEOUT);
+    return s;
+}
+
+enum class Exchange { OK, FAILED, CORRUPT, CLOSED };
+
+// Whether body is what stub_origin sends: 'a' to 'z' over and over, starting
+// again every STUB_SEND_CHUNK bytes
+static bool stub_body(const char* body, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (body[i] != 'a' + (char)(i % STUB_SEND_CHUNK % 26)) return false;
+    }
+    return true;
+}
+
+// Sends request and reads its whole response. CLOSED means the connection
+// was found closed before any response byte came, so the request can be
+// retried on a new one.
+static Exchange exchange(socket_t s, const std::string& request, size_t& bytes, bool& reusable) {
+    if (send(s, request.data(), (int)request.size(), 0) < (int)request.size()) return Exchange::CLOSED;
+    ResponseFramer framer;
+    char buffer[65536];
+    size_t received = 0;
+    std::string response;       // kept for --check
+    while (!framer.complete() && !framer.failed()) {
+        int n = recv(s, buffer, sizeof(buffer), 0);
+        if (n == 0) {
+            if (received == 0) return Exchange::CLOSED;
+            framer.on_eof();
+            break;
+        }
+        if (n < 0) return received == 0 ? Exchange::CLOSED : Exchange::FAILED;
+        received += n;
+        size_t used = framer.feed(buffer, n);
+        if (config.check) response.append(buffer, used);
+    }
+    bytes = received;
+    reusable = framer.reusable();
+    if (!framer.complete() || framer.status() != 200) return Exchange::FAILED;
+    if (config.check && !stub_body(response.data() + framer.head_length(), response.size() - framer.head_length())) return Exchange::CORRUPT;
+    return Exchange::OK;
+}
+
+static void run_thread(int index, Clock::time_point start, ThreadResult& result) {
+    std::mt19937_64 rng(config.seed * 1000003 + index);
+    std::uniform_real_distribution<double> uniform(0, zipf_cumulative.back());
+    Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(config.duration));
+
+    // Open loop: this thread's share of the rate, offset so threads don't fire together
+    Clock::duration interval{};
+    Clock::time_point due = start;
+    if (config.open_loop) {
+        interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(config.threads / config.rate));
+        due = start + interval * index / config.threads;
+    }
+
+    socket_t s = INVALID_SOCKET_VAL;
+    std::string request;
+    while (true) {
+        Clock::time_point began;
+        if (config.open_loop) {
+            if (due >= end) break;
+            std::this_thread::sleep_until(due);
+            began = due;
+            due += interval;
+        } else {
+            began = Clock::now();
+            if (began >= end) break;
+        }
+
+        size_t object = std::lower_bound(zipf_cumulative.begin(), zipf_cumulative.end(), uniform(rng)) - zipf_cumulative.begin();
+        request = "GET http://" + config.origin + "/obj/" + std::to_string(object) + " HTTP/1.1\r\nHost: " + config.origin + "\r\n\r\n";
+
+        Exchange outcome = Exchange::CLOSED;
+        size_t bytes = 0;
+        bool reusable = false;
+        // One retry, for a keep-alive connection the proxy closed while idle
+        for (int attempt = 0; attempt < 2 && outcome == Exchange::CLOSED; attempt++) {
+            if (s == INVALID_SOCKET_VAL || attempt > 0) {
+                if (s != INVALID_SOCKET_VAL) {
+                    close_socket(s);
+                    result.reconnects++;
+                }
+                s = connect_proxy();
+                if (s == INVALID_SOCKET_VAL) break;
+            }
+            outcome = exchange(s, request, bytes, reusable);
+        }
+        if (outcome != Exchange::OK) {
+            result.errors++;
+            if (outcome == Exchange::CORRUPT) result.corrupt++;
+            reusable = false;
+        } else {
+            result.bytes += bytes;
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - began).count();
+            result.latencies_us.push_back((uint32_t)std::min<long long>(us, UINT32_MAX));
+        }
+        if (!reusable && s != INVALID_SOCKET_VAL) {
+            close_socket(s);
+            s = INVALID_SOCKET_VAL;
+        }
+    }
+    if (s != INVALID_SOCKET_VAL) close_socket(s);
+}
+
+// Latency at quantile q of sorted, in milliseconds
+static double percentile_ms(const std::vector<uint32_t>& sorted, double q) {
+    if (sorted.empty()) return 0;
+    size_t rank = (size_t)std::ceil(q * sorted.size());
+    return sorted[rank == 0 ? 0 : rank - 1] / 1000.0;
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--proxy=", 0) == 0) {
+            std::string value = arg.substr(8);
+            size_t colon = value.rfind(':');
+            if (colon != std::string::npos) {
+                config.proxy_host = value.substr(0, colon);
+                config.proxy_port = atoi(value.c_str() + colon + 1);
+            }
+        }
+        else if (arg.rfind("--origin=", 0) == 0) config.origin = arg.substr(9);
+        else if (arg.rfind("--threads=", 0) == 0) config.threads = atoi(arg.c_str() + 10);
+        else if (arg.rfind("--duration=", 0) == 0) config.duration = atof(arg.c_str() + 11);
+        else if (arg.rfind("--objects=", 0) == 0) config.objects = atoi(arg.c_str() + 10);
+        else if (arg.rfind("--zipf=", 0) == 0) config.zipf = atof(arg.c_str() + 7);
+        else if (arg.rfind("--seed=", 0) == 0) config.seed = strtoull(arg.c_str() + 7, nullptr, 10);
+        else if (arg == "--mode=open") config.open_loop = true;
+        else if (arg == "--mode=closed") config.open_loop = false;
+        else if (arg.rfind("--rate=", 0) == 0) config.rate = atof(arg.c_str() + 7);
+        else if (arg == "--check") config.check = true;
+        else {
+            fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+    if (config.proxy_port <= 0 || config.threads <= 0 || config.objects <= 0 || (config.open_loop && config.rate <= 0)) {
+        fprintf(stderr, "Usage: %s --proxy=HOST:PORT [--origin=HOST:PORT] [--threads=N] [--duration=SECONDS] "
+                        "[--objects=N] [--zipf=S] [--seed=N] [--mode=closed|open] [--rate=RPS] [--check]\n", argv[0]);
+        fprintf(stderr, "--rate is required with --mode=open\n");
+        return 1;
+    }
+#ifdef _WIN32
+    WSADATA wsa_data;
+    WSAStartup(MAKEWORD(2, 2), &wsa_data);
+#endif
+
+    // Zipf by inverse transform over the cumulative weights
+    zipf_cumulative.resize(config.objects);
+    double total = 0;
+    for (int i = 0; i < config.objects; i++) {
+        total += 1.0 / std::pow(i + 1, config.zipf);
+        zipf_cumulative[i] = total;
+    }
+
+    std::vector<ThreadResult> results(config.threads);
+    std::vector<std::thread> threads;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < config.threads; i++) threads.emplace_back(run_thread, i, start, std::ref(results[i]));
+    for (auto& t : threads) t.join();
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<uint32_t> latencies;
+    size_t errors = 0, corrupt = 0, reconnects = 0, bytes = 0;
+    for (const auto& r : results) {
+        latencies.insert(latencies.end(), r.latencies_us.begin(), r.latencies_us.end());
+        errors += r.errors;
+        corrupt += r.corrupt;
+        reconnects += r.reconnects;
+        bytes += r.bytes;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    printf("{\"mode\":\"%s\",\"threads\":%d,\"objects\":%d,\"zipf\":%.2f,\"seed\":%llu,\"rate\":%.1f,"
+           "\"duration_s\":%.3f,\"requests\":%zu,\"errors\":%zu,\"corrupt\":%zu,\"reconnects\":%zu,\"bytes\":%zu,"
+           "\"throughput_rps\":%.1f,\"throughput_mbps\":%.2f,"
+           "\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"max_ms\":%.3f}\n",
+           config.open_loop ? "open" : "closed", config.threads, config.objects, config.zipf,
+           (unsigned long long)config.seed, config.rate, elapsed, latencies.size(), errors, corrupt, reconnects, bytes,
+           latencies.size() / elapsed, bytes * 8 / elapsed / 1e6,
+           percentile_ms(latencies, 0.50), percentile_ms(latencies, 0.99), percentile_ms(latencies, 0.999),
+           latencies.empty() ? 0 : latencies.back() / 1000.0);
+    if (config.check) return errors > 0 ? 1 : 0;
+    return errors > 0 && latencies.empty() ? 1 : 0;
+}
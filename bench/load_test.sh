@@ -0,0 +1,62 @@
+#!/bin/sh
+# load_test.sh -- the load-test suite: starts the stub origin, then runs the
+# load generator through the proxy in each I/O mode, closed loop and then
+# open loop, and finishes with the cache and parser microbenchmarks. Seeds
+# are fixed, so runs are comparable. Prints one JSON object per line.
+#
+# Each mode is also checked with coalesced revalidations: every thread asks
+# for one object that is always stale, so the proxy keeps revalidating it
+# with a slow 304 while the other requests follow that fetch. Every body is
+# checked, and the suite fails if any request does.
+#
+# Build with: make -f Makefile.mk proxy bench
+# Run as:     bench/load_test.sh [DURATION_SECONDS]
+#
+# ORIGIN_PORT, PROXY_PORT, THREADS and RATE override the defaults below.
+
+set -e
+cd "$(dirname "$0")/.."
+
+DURATION=${1:-10}
+ORIGIN_PORT=${ORIGIN_PORT:-19080}
+PROXY_PORT=${PROXY_PORT:-19081}
+STALE_ORIGIN_PORT=${STALE_ORIGIN_PORT:-19082}
+THREADS=${THREADS:-16}
+RATE=${RATE:-500}
+MODES="threads"
+[ "$(uname)" = "Linux" ] && MODES="threads epoll uring"
+
+# 1 KB to 256 KB objects, 2 ms origin latency, one in ten uncacheable
+./bench/stub_origin "$ORIGIN_PORT" --size=1024:262144 --latency-ms=2 --uncacheable=10 &
+ORIGIN=$!
+# 40 KB objects that are stale at once, revalidated with a 304 after 20 ms
+./bench/stub_origin "$STALE_ORIGIN_PORT" --size=40000 --latency-ms=20 --max-age=0 &
+STALE_ORIGIN=$!
+PROXY=
+trap 'kill $ORIGIN $STALE_ORIGIN $PROXY 2>/dev/null || true' EXIT
+sleep 0.2
+
+for mode in $MODES; do
+    ./proxy "$PROXY_PORT" --io="$mode" --log-level=warn > /dev/null &
+    PROXY=$!
+    sleep 0.5
+    for loop in closed open; do
+        ./bench/load_gen --proxy="127.0.0.1:$PROXY_PORT" --origin="127.0.0.1:$ORIGIN_PORT" \
+            --mode="$loop" --rate="$RATE" --threads="$THREADS" --duration="$DURATION" --seed=1 |
+            sed "s/^{/{\"io\":\"$mode\",/"
+    done
+    status=0
+    result=$(./bench/load_gen --proxy="127.0.0.1:$PROXY_PORT" --origin="127.0.0.1:$STALE_ORIGIN_PORT" \
+        --threads=6 --objects=1 --duration=3 --check) || status=$?
+    echo "$result" | sed "s/^{/{\"io\":\"$mode\",\"check\":\"coalesced-revalidation\",/"
+    if [ "$status" -ne 0 ]; then
+        echo "coalesced revalidation check failed in $mode mode" >&2
+        exit 1
+    fi
+    kill "$PROXY"
+    wait "$PROXY" 2>/dev/null || true
+    PROXY=
+done
+
+./bench/cache_bench
+./bench/parse_bench --json
@@ -0,0 +1,355 @@
+/*
+  parse_bench.cpp -- compares ParsedRequest::parse and the origin request
+  serialization with the strtok and stringstream versions they replaced.
+
+  Build and run with: make -f Makefile.mk bench && ./bench/parse_bench [--json]
+
+  --json prints one JSON object per measurement instead of the table.
+
+  ./bench/parse_bench --check [cases] times nothing. It runs every version
+  of scan_line() the CPU supports on random lines and exits non-zero if any
+  disagrees with scan_line_scalar().
+*/
+
+#include "../proxy_parse.h"
+#include "../proxy_scan.h"
+#include <chrono>
+#include <cstring>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+#define BENCH_ITERATIONS 500000
+#define CHECK_CASES 1000000         //random cases --check runs when not told how many
+
+static bool json = false;
+
+// The parser as it was before it worked in place: copies the request twice,
+// tokenizes with strtok_r and allocates a string per field and header.
+namespace legacy {
+
+struct ParsedHeader {
+    std::string key;
+    std::string value;
+};
+
+struct ParsedRequest {
+    std::string method, protocol, host, port, path, version;
+    std::vector<ParsedHeader> headers;
+
+    bool remove_header(const std::string& key) {
+        auto it = std::remove_if(headers.begin(), headers.end(),
+            [&](const ParsedHeader& h) { return strcasecmp(h.key.c_str(), key.c_str()) == 0; });
+        if (it == headers.end()) return false;
+        headers.erase(it, headers.end());
+        return true;
+    }
+
+    void set_header(const std::string& key, const std::string& value) {
+        remove_header(key);
+        headers.push_back({key, value});
+    }
+
+    int parse(const char* buf, int buflen) {
+        char* saveptr;
+        auto tmp_buf = std::make_unique<char[]>(buflen + 1);
+        memcpy(tmp_buf.get(), buf, buflen);
+        tmp_buf[buflen] = '\0';
+        if (strstr(tmp_buf.get(), "\r\n\r\n") == NULL) return -1;
+
+        char* index = strstr(tmp_buf.get(), "\r\n");
+        std::string request_line(tmp_buf.get(), index - tmp_buf.get());
+        auto req_line_buf = std::make_unique<char[]>(request_line.length() + 1);
+        strcpy(req_line_buf.get(), request_line.c_str());
+
+        char* method_ptr = strtok_r(req_line_buf.get(), " ", &saveptr);
+        if (method_ptr == nullptr) return -1;
+        method = method_ptr;
+        char* full_addr = strtok_r(NULL, " ", &saveptr);
+        if (full_addr == NULL) return -1;
+        version = full_addr + strlen(full_addr) + 1;
+        char* protocol_ptr = strtok_r(full_addr, "://", &saveptr);
+        if (protocol_ptr == nullptr) return -1;
+        protocol = protocol_ptr;
+        char* host_ptr = strtok_r(nullptr, "/", &saveptr);
+        if (host_ptr == nullptr) return -1;
+        char* path_ptr = strtok_r(nullptr, " ", &saveptr);
+        path = path_ptr == nullptr ? "/" : std::string("/") + path_ptr;
+        char* host_saveptr = nullptr;
+        host = strtok_r(host_ptr, ":", &host_saveptr);
+        char* port_ptr = strtok_r(nullptr, "/", &host_saveptr);
+        if (port_ptr != nullptr) {
+            port = port_ptr;
+            if (std::stoi(port) <= 0) return -1;
+        }
+
+        char* current = strstr(tmp_buf.get(), "\r\n") + 2;
+        while (current[0] != '\0' && !(current[0] == '\r' && current[1] == '\n')) {
+            char* next = strstr(current, "\r\n");
+            if (next == nullptr) break;
+            char* colon = strchr(current, ':');
+            if (colon == nullptr || colon > next) {
+                current = next + 2;
+                continue;
+            }
+            std::string key(current, colon - current);
+            char* value_start = colon + 1;
+            while (*value_start == ' ') value_start++;
+            set_header(key, std::string(value_start, next - value_start));
+            current = next + 2;
+        }
+        return 0;
+    }
+
+    std::string unparse_headers() {
+        std::stringstream ss;
+        for (const auto& header : headers) {
+            ss << header.key << ": " << header.value << "\r\n";
+        }
+        ss << "\r\n";
+        return ss.str();
+    }
+
+    // What origin_request() returned
+    std::string origin_request() {
+        return "GET " + path + " " + version + "\r\n" + unparse_headers();
+    }
+};
+
+// What the framing pass did before legacy::parse could run
+long frame(const char* buf, size_t len) {
+    std::string_view data(buf, len);
+    size_t end = data.find("\r\n\r\n");
+    if (end == std::string_view::npos) return 0;
+    std::string_view head = data.substr(0, end + 4);
+    if (!find_response_header(head, "Transfer-Encoding").empty()) return -1;
+    find_response_header(head, "Content-Length");
+    return (long)(end + 4);
+}
+
+} // namespace legacy
+
+static std::string browser_request() {
+    return "GET http://www.example.com/static/js/app.min.js?v=20240101 HTTP/1.1\r\n"
+           "Host: www.example.com\r\n"
+           "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 Firefox/120.0\r\n"
+           "Accept: */*\r\n"
+           "Accept-Language: en-US,en;q=0.5\r\n"
+           "Accept-Encoding: gzip, deflate\r\n"
+           "Referer: http://www.example.com/index.html\r\n"
+           "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark; _ga=GA1.2.123456789.1700000000\r\n"
+           "Connection: keep-alive\r\n"
+           "Cache-Control: max-age=0\r\n"
+           "If-None-Match: \"5f3e-61a2b3c4d5e6f\"\r\n"
+           "If-Modified-Since: Mon, 01 Jan 2024 00:00:00 GMT\r\n"
+           "\r\n";
+}
+
+static std::string many_headers_request(int count) {
+    std::string request = "GET http://origin.test:8080/ HTTP/1.1\r\n";
+    char line[64];
+    for (int i = 0; i < count; i++) {
+        snprintf(line, sizeof(line), "X-Header-%d: value-%d\r\n", i, i);
+        request += line;
+    }
+    return request + "\r\n";
+}
+
+// A browser request carrying large cookies and a full set of Accept-* fields
+static std::string cookie_heavy_request() {
+    std::string request = "GET http://shop.example.com/cart?item=12345 HTTP/1.1\r\n"
+                          "Host: shop.example.com\r\n"
+                          "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+                          "Accept-Language: en-GB,en;q=0.9,en-US;q=0.8,de;q=0.7,fr;q=0.6\r\n"
+                          "Accept-Encoding: gzip, deflate, br\r\n"
+                          "Accept-Charset: utf-8, iso-8859-1;q=0.5\r\n";
+    for (int i = 0; i < 4; i++) {
+        request += "Cookie: ";
+        for (int j = 0; j < 24; j++) {
+            char crumb[64];
+            snprintf(crumb, sizeof(crumb), "tracker_%d_%d=%016x%016x; ", i, j, i * 7919 + j, j * 104729 + i);
+            request += crumb;
+        }
+        request += "\r\n";
+    }
+    return request + "\r\n";
+}
+
+template <typename F>
+static double ns_per_request(F parse_one) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) parse_one();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / BENCH_ITERATIONS;
+}
+
+static void run(const char* name, const std::string& request) {
+    volatile long sink = 0;
+
+    double old_ns = ns_per_request([&]() {
+        long len = legacy::frame(request.data(), request.size());
+        legacy::ParsedRequest parsed;
+        sink = sink + len + parsed.parse(request.data(), (int)len) + (long)parsed.headers.size();
+    });
+
+    ParsedRequest parsed;
+    double new_ns = ns_per_request([&]() {
+        parsed.reset();
+        sink = sink + parsed.parse(request.data(), request.size());
+    });
+
+    // The same request arriving in 64-byte reads, as from a slow client
+    double partial_ns = ns_per_request([&]() {
+        parsed.reset();
+        long len = 0;
+        for (size_t have = 64; len == 0; have += 64) {
+            len = parsed.parse(request.data(), std::min(have, request.size()));
+        }
+        sink = sink + len;
+    });
+
+    if (json) {
+        printf("{\"bench\":\"parse\",\"case\":\"%s\",\"bytes\":%zu,\"legacy_ns\":%.1f,\"in_place_ns\":%.1f,\"partial_reads_ns\":%.1f}\n",
+               name, request.size(), old_ns, new_ns, partial_ns);
+        return;
+    }
+    printf("%-16s %5zu bytes  legacy %8.1f ns  in-place %7.1f ns (%.1fx)  64-byte reads %7.1f ns\n",
+           name, request.size(), old_ns, new_ns, old_ns / new_ns, partial_ns);
+}
+
+// Times the line scanner alone, dispatched version against the memchr one
+static void scan(const char* name, const std::string& head) {
+    volatile size_t sink = 0;
+    auto scan_all = [&](size_t (*scan_fn)(const char*, size_t, size_t, char, size_t&)) {
+        return ns_per_request([&]() {
+            for (size_t from = 0; from < head.size();) {
+                size_t mark = SCAN_NOT_FOUND;
+                size_t nl = scan_fn(head.data(), from, head.size(), ':', mark);
+                sink = sink + mark;
+                from = nl + 1;
+            }
+        });
+    };
+    double scalar_ns = scan_all(scan_line_scalar);
+    double simd_ns = scan_all(scan_line);
+    if (json) {
+        printf("{\"bench\":\"scan\",\"case\":\"%s\",\"bytes\":%zu,\"scalar_ns\":%.1f,\"impl\":\"%s\",\"simd_ns\":%.1f}\n",
+               name, head.size(), scalar_ns, scan_line_impl(), simd_ns);
+        return;
+    }
+    printf("scan %-16s %5zu bytes  scalar %7.1f ns  %s %7.1f ns (%.1fx)\n",
+           name, head.size(), scalar_ns, scan_line_impl(), simd_ns, scalar_ns / simd_ns);
+}
+
+// Times building the request sent to the origin, after the same rewrite
+// origin_request() does, from a buffer reused across requests against the
+// stringstream version
+static void serialize(const char* name, const std::string& request) {
+    volatile size_t sink = 0;
+
+    legacy::ParsedRequest old_parsed;
+    old_parsed.parse(request.data(), (int)request.size());
+    old_parsed.set_header("Connection", "keep-alive");
+    double old_ns = ns_per_request([&]() {
+        sink = sink + old_parsed.origin_request().size();
+    });
+
+    ParsedRequest parsed;
+    parsed.parse(request.data(), request.size());
+    parsed.set_header("Connection", "keep-alive");
+    std::string out;
+    double new_ns = ns_per_request([&]() {
+        out.clear();
+        out.reserve(parsed.get_path().size() + parsed.get_version().size() + 6 + parsed.headers_length());
+        out.append("GET ").append(parsed.get_path()).append(" ").append(parsed.get_version()).append("\r\n");
+        parsed.write_headers(out);
+        sink = sink + out.size();
+    });
+
+    if (json) {
+        printf("{\"bench\":\"serialize\",\"case\":\"%s\",\"stringstream_ns\":%.1f,\"reused_buffer_ns\":%.1f}\n",
+               name, old_ns, new_ns);
+        return;
+    }
+    printf("serialize %-16s stringstream %7.1f ns  reused buffer %6.1f ns (%.1fx)\n",
+           name, old_ns, new_ns, old_ns / new_ns);
+}
+
+// Runs each version of scan_line() against scan_line_scalar() on cases
+// random buffers. Newlines and marks are common, so they land on every
+// position in and across the SIMD blocks. Each buffer is scanned in one
+// call and again over a series of growing lengths, as a line arriving over
+// several reads is. Returns the number of disagreements.
+static size_t check(size_t cases) {
+    ScanLineImpl impls[SCAN_MAX_IMPLS];
+    size_t num_impls = scan_line_impls(impls);
+    std::mt19937_64 rng(12345);
+    const char alphabet[] = "\n: \rab";
+    std::vector<char> buf;
+    size_t failures = 0;
+
+    for (size_t n = 0; n < cases && failures < 10; n++) {
+        size_t len = rng() % 200;
+        buf.assign(len, 0);
+        // Runs of one kind of byte, some long enough to span a whole block
+        size_t density = 1 + rng() % 64;
+        for (auto& c : buf) c = rng() % density == 0 ? alphabet[rng() % 3] : alphabet[3 + rng() % 4];
+        char mark = rng() % 2 ? ':' : ' ';
+        size_t from = len ? rng() % (len + 1) : 0;
+        // A mark already found in an earlier part of the line must be kept
+        size_t earlier = rng() % 4 == 0 && from > 0 ? rng() % from : SCAN_NOT_FOUND;
+
+        size_t want_mark = earlier;
+        size_t want = scan_line_scalar(buf.data(), from, len, mark, want_mark);
+        for (size_t i = 1; i < num_impls; i++) {
+            size_t got_mark = earlier;
+            size_t got = impls[i].fn(buf.data(), from, len, mark, got_mark);
+
+            // The same line read in pieces, carrying on from where the last
+            // scan stopped
+            size_t piece_mark = earlier;
+            size_t at = from;
+            size_t piece = from;
+            while (at < len) {
+                size_t have = std::min(len, at + 1 + rng() % 48);
+                piece = impls[i].fn(buf.data(), at, have, mark, piece_mark);
+                if (piece < have) break;
+                at = have;
+                piece = len;
+            }
+
+            if (got != want || got_mark != want_mark || piece != want || piece_mark != want_mark) {
+                failures++;
+                printf("%s disagrees with scalar: len %zu from %zu mark '%c' earlier %zd: newline %zu/%zu (in pieces %zu), mark %zd/%zd (in pieces %zd)\n",
+                       impls[i].name, len, from, mark, (ssize_t)earlier, got, want, piece, (ssize_t)got_mark, (ssize_t)want_mark, (ssize_t)piece_mark);
+            }
+        }
+    }
+    printf("scan_line check: %zu cases,", cases);
+    for (size_t i = 1; i < num_impls; i++) printf(" %s", impls[i].name);
+    printf(" against scalar: %s\n", failures ? "MISMATCH" : "agree");
+    return failures;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "--check") == 0) {
+        size_t cases = argc > 2 ? strtoull(argv[2], nullptr, 10) : CHECK_CASES;
+        return check(cases) ? 1 : 0;
+    }
+    json = argc > 1 && strcmp(argv[1], "--json") == 0;
+
+    run("browser", browser_request());
+    run("cookie-heavy", cookie_heavy_request());
+    run("10 headers", many_headers_request(10));
+    run("50 headers", many_headers_request(50));
+    run("95 headers", many_headers_request(95));
+
+    serialize("browser", browser_request());
+    serialize("cookie-heavy", cookie_heavy_request());
+    serialize("50 headers", many_headers_request(50));
+
+    scan("browser", browser_request());
+    scan("cookie-heavy", cookie_heavy_request());
+    return 0;
+}
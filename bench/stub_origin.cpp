@@ -0,0 +1,255 @@
+/*
+  stub_origin.cpp -- a local origin server for load tests, with configurable
+  object sizes, latency and cacheability.
+
+  Build with: make -f Makefile.mk bench
+  Run as:     ./bench/stub_origin PORT [--size=MIN[:MAX]] [--latency-ms=N]
+                                  [--max-age=N] [--uncacheable=PERCENT]
+
+  Every path is an object. Its size is fixed per path: --size bytes, or
+  log-uniform between MIN and MAX, picked by a hash of the path so every run
+  serves the same sizes. --uncacheable marks that share of paths no-store,
+  again by hash; the rest get max-age and an ETag, and a request whose
+  If-None-Match names that ETag gets a 304. Each response waits
+  --latency-ms before its head is sent; the head and the start of the body
+  then go in one writev. A request's query can override its own object:
+  ?size=N&latency=MS. Connections are kept alive, with TCP_NODELAY; each
+  gets its own thread.
+
+  Bodies repeat 'a' to 'z' from their first byte, so a client can check
+  what it received (see load_gen --check).
+*/
+
+#include "../proxy_socket.h"
+#include <string>
+#include <string_view>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define STUB_DEFAULT_SIZE 16384
+#define STUB_DEFAULT_MAX_AGE 3600
+#define STUB_REQUEST_MAX 16384      //longest request head accepted
+#define STUB_SEND_CHUNK 65536       //body bytes handed to send() at a time
+
+struct StubConfig {
+    size_t min_size = STUB_DEFAULT_SIZE;
+    size_t max_size = STUB_DEFAULT_SIZE;
+    int latency_ms = 0;
+    int max_age = STUB_DEFAULT_MAX_AGE;
+    int uncacheable_percent = 0;
+};
+
+static StubConfig config;
+static char body_pattern[STUB_SEND_CHUNK];
+
+// Hash of path mixed into [0, 1)
+static double path_fraction(std::string_view path, size_t salt) {
+    size_t h = std::hash<std::string_view>()(path) ^ (salt * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (double)(h >> 11) / (double)(1ULL << 53);
+}
+
+static size_t object_size(std::string_view path) {
+    if (config.max_size <= config.min_size) return config.min_size;
+    double lo = std::log((double)config.min_size), hi = std::log((double)config.max_size);
+    return (size_t)std::exp(lo + (hi - lo) * path_fraction(path, 1));
+}
+
+// Value of name in query, or -1
+static long query_value(std::string_view query, std::string_view name) {
+    size_t at = 0;
+    while (at < query.size()) {
+        size_t end = query.find('&', at);
+        if (end == std::string_view::npos) end = query.size();
+        std::string_view pair = query.substr(at, end - at);
+        if (pair.size() > name.size() && pair.substr(0, name.size()) == name && pair[name.size()] == '=') {
+            return atol(std::string(pair.substr(name.size() + 1)).c_str());
+        }
+        at = end + 1;
+    }
+    return -1;
+}
+
+static bool send_all(socket_t socket, const char* data, size_t len) {
+    while (len > 0) {
+        int n = send(socket, data, (int)std::min(len, (size_t)STUB_SEND_CHUNK), 0);
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Sends head and a body of size bytes. The head goes out with the body's
+// first chunk, so a small response is a single segment.
+static bool send_response(socket_t socket, const char* head, size_t head_len, size_t size) {
+    size_t left = size;
+    while (head_len > 0) {
+        iovec_t iov[2];
+        size_t chunk = std::min(left, sizeof(body_pattern));
+        set_iovec(iov[0], head, head_len);
+        set_iovec(iov[1], body_pattern, chunk);
+        long n = send_iovec(socket, iov, chunk > 0 ? 2 : 1);
+        if (n <= 0) return false;
+        if ((size_t)n < head_len) {
+            head += n;
+            head_len -= n;
+            continue;
+        }
+        left -= (size_t)n - head_len;
+        head_len = 0;
+    }
+    // The pattern restarts every STUB_SEND_CHUNK bytes of body
+    while (left > 0) {
+        size_t at = (size - left) % sizeof(body_pattern);
+        size_t chunk = std::min(left, sizeof(body_pattern) - at);
+        if (!send_all(socket, body_pattern + at, chunk)) return false;
+        left -= chunk;
+    }
+    return true;
+}
+
+// Value of the header name in head, or an empty view
+static std::string_view header_value(std::string_view head, std::string_view name) {
+    size_t at = head.find("\r\n");
+    while (at != std::string_view::npos && at + 2 < head.size()) {
+        size_t end = head.find("\r\n", at + 2);
+        std::string_view line = head.substr(at + 2, end == std::string_view::npos ? end : end - at - 2);
+        if (line.size() > name.size() && line[name.size()] == ':' &&
+            std::equal(name.begin(), name.end(), line.begin(), [](char a, char b) { return tolower((unsigned char)a) == tolower((unsigned char)b); })) {
+            std::string_view value = line.substr(name.size() + 1);
+            while (!value.empty() && value.front() == ' ') value.remove_prefix(1);
+            return value;
+        }
+        at = end;
+    }
+    return std::string_view();
+}
+
+// Answers one request head. Returns false if the connection should close.
+static bool respond(socket_t socket, std::string_view head) {
+    size_t line_end = head.find("\r\n");
+    std::string_view line = head.substr(0, line_end);
+    size_t sp1 = line.find(' ');
+    size_t sp2 = line.find(' ', sp1 + 1);
+    if (sp1 == std::string_view::npos || sp2 == std::string_view::npos) return false;
+    std::string_view target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+    // The proxy sends origin-form; tolerate absolute-form from direct tests
+    size_t scheme = target.find("://");
+    if (scheme != std::string_view::npos) {
+        size_t slash = target.find('/', scheme + 3);
+        target = slash == std::string_view::npos ? std::string_view("/") : target.substr(slash);
+    }
+    size_t question = target.find('?');
+    std::string_view path = target.substr(0, question);
+    std::string_view query = question == std::string_view::npos ? std::string_view() : target.substr(question + 1);
+
+    size_t size = object_size(path);
+    long size_override = query_value(query, "size");
+    if (size_override >= 0) size = (size_t)size_override;
+    long latency = query_value(query, "latency");
+    if (latency < 0) latency = config.latency_ms;
+    bool cacheable = path_fraction(path, 2) * 100 >= config.uncacheable_percent;
+
+    if (latency > 0) std::this_thread::sleep_for(std::chrono::milliseconds(latency));
+
+    char response_head[256];
+    int n;
+    if (cacheable) {
+        // The object never changes, so one tag per size will do
+        char etag[32];
+        snprintf(etag, sizeof(etag), "\"%zu\"", size);
+        if (header_value(head, "If-None-Match") == etag) {
+            n = snprintf(response_head, sizeof(response_head),
+                         "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nCache-Control: max-age=%d\r\n\r\n", etag, config.max_age);
+            return send_all(socket, response_head, n);
+        }
+        n = snprintf(response_head, sizeof(response_head),
+                     "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %zu\r\nETag: %s\r\nCache-Control: max-age=%d\r\n\r\n",
+                     size, etag, config.max_age);
+    } else {
+        n = snprintf(response_head, sizeof(response_head),
+                     "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %zu\r\nCache-Control: no-store\r\n\r\n",
+                     size);
+    }
+    return send_response(socket, response_head, n, size);
+}
+
+static void serve(socket_t socket) {
+    std::string pending;
+    char buffer[4096];
+    while (true) {
+        size_t end;
+        while ((end = pending.find("\r\n\r\n")) == std::string::npos) {
+            if (pending.size() > STUB_REQUEST_MAX) {
+                close_socket(socket);
+                return;
+            }
+            int n = recv(socket, buffer, sizeof(buffer), 0);
+            if (n <= 0) {
+                close_socket(socket);
+                return;
+            }
+            pending.append(buffer, n);
+        }
+        if (!respond(socket, std::string_view(pending).substr(0, end + 4))) break;
+        pending.erase(0, end + 4);
+    }
+    close_socket(socket);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s PORT [--size=MIN[:MAX]] [--latency-ms=N] [--max-age=N] [--uncacheable=PERCENT]\n", argv[0]);
+        return 1;
+    }
+#ifdef _WIN32
+    WSADATA wsa_data;
+    WSAStartup(MAKEWORD(2, 2), &wsa_data);
+#endif
+    int port = atoi(argv[1]);
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--size=", 0) == 0) {
+            char* rest;
+            config.min_size = config.max_size = strtoull(arg.c_str() + 7, &rest, 10);
+            if (*rest == ':') config.max_size = strtoull(rest + 1, nullptr, 10);
+        }
+        else if (arg.rfind("--latency-ms=", 0) == 0) config.latency_ms = atoi(arg.c_str() + 13);
+        else if (arg.rfind("--max-age=", 0) == 0) config.max_age = atoi(arg.c_str() + 10);
+        else if (arg.rfind("--uncacheable=", 0) == 0) config.uncacheable_percent = atoi(arg.c_str() + 14);
+        else {
+            fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < sizeof(body_pattern); i++) body_pattern[i] = 'a' + i % 26;
+
+    socket_t listener = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 1024) < 0) {
+        fprintf(stderr, "Can't listen on port %d\n", port);
+        return 1;
+    }
+    while (true) {
+        socket_t client = accept(listener, nullptr, nullptr);
+        if (client == INVALID_SOCKET_VAL) continue;
+        set_nodelay(client);
+        std::thread(serve, client).detach();
+    }
+}
@@ -0,0 +1,117 @@
+/*
+  proxy_buffer.cpp -- slab chains and scatter-gather sends.
+*/
+
+#include "proxy_buffer.h"
+#include <algorithm>
+#include <cstring>
+
+char* BufferChain::reserve(size_t& avail) {
+    // The tail slab is full (or there is none)
+    if (slabs_.size() * BUFFER_SLAB_SIZE == size_) {
+        slabs_.emplace_back(slab_allocator().allocate(BUFFER_SLAB_SIZE));
+    }
+    size_t used = size_ % BUFFER_SLAB_SIZE;
+    if (slabs_.back()->capacity() < BUFFER_SLAB_SIZE) {
+        // Shrunk by shrink_to_fit(); back to a full slab to grow
+        SlabRef full(slab_allocator().allocate(BUFFER_SLAB_SIZE));
+        memcpy(full->data(), slabs_.back()->data(), used);
+        slabs_.back() = std::move(full);
+    }
+    avail = BUFFER_SLAB_SIZE - used;
+    return slabs_.back()->data() + used;
+}
+
+void BufferChain::commit(size_t n) {
+    size_ += n;
+}
+
+void BufferChain::append(const char* data, size_t len) {
+    while (len > 0) {
+        size_t avail;
+        char* dst = reserve(avail);
+        size_t n = std::min(avail, len);
+        memcpy(dst, data, n);
+        commit(n);
+        data += n;
+        len -= n;
+    }
+}
+
+void BufferChain::share_from(const BufferChain& other) {
+    for (size_t i = slabs_.size(); i < other.slabs_.size(); i++) {
+        slabs_.push_back(other.slabs_[i]);
+    }
+    size_ = other.size_;
+}
+
+size_t BufferChain::fill_iov(size_t offset, iovec_t* iov, size_t max_iov, size_t end) const {
+    size_t count = 0;
+    size_t slab = offset / BUFFER_SLAB_SIZE;
+    size_t at = offset % BUFFER_SLAB_SIZE;
+    end = std::min(end, size_);
+    while (count < max_iov && offset < end) {
+        size_t n = std::min(BUFFER_SLAB_SIZE - at, end - offset);
+        set_iovec(iov[count++], slabs_[slab]->data() + at, n);
+        offset += n;
+        slab++;
+        at = 0;
+    }
+    return count;
+}
+
+std::string BufferChain::copy(size_t offset, size_t len) const {
+    std::string out;
+    if (offset >= size_) return out;
+    len = std::min(len, size_ - offset);
+    out.reserve(len);
+    size_t slab = offset / BUFFER_SLAB_SIZE;
+    size_t at = offset % BUFFER_SLAB_SIZE;
+    while (len > 0) {
+        size_t n = std::min(BUFFER_SLAB_SIZE - at, len);
+        out.append(slabs_[slab]->data() + at, n);
+        len -= n;
+        slab++;
+        at = 0;
+    }
+    return out;
+}
+
+void BufferChain::clear() {
+    slabs_.clear();
+    size_ = 0;
+}
+
+void BufferChain::shrink_to_fit() {
+    slabs_.shrink_to_fit();
+    if (slabs_.empty()) return;
+    size_t used = size_ - (slabs_.size() - 1) * BUFFER_SLAB_SIZE;
+    SlabRef tail(slab_allocator().allocate(used));
+    if (tail->capacity() < slabs_.back()->capacity()) {
+        memcpy(tail->data(), slabs_.back()->data(), used);
+        slabs_.back() = std::move(tail);
+    }
+}
+
+size_t BufferChain::allocated() const {
+    size_t total = slabs_.capacity() * sizeof(SlabRef);
+    for (const auto& slab : slabs_) total += slab->block_size();
+    return total;
+}
+
+long send_chain(socket_t s, const BufferChain& chain, size_t offset, size_t end) {
+    iovec_t iov[MAX_SEND_IOV];
+    size_t n = chain.fill_iov(offset, iov, MAX_SEND_IOV, end);
+    if (n == 0) return 0;
+    return send_iovec(s, iov, (int)n);
+}
+
+bool send_chain_all(socket_t s, const BufferChain& chain, size_t offset, size_t end) {
+    end = std::min(end, chain.size());
+    while (offset < end) {
+        long n = send_chain(s, chain, offset, end);
+        if (n < 0) return false;
+        offset += n;
+    }
+    return true;
+}
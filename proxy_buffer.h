@@ -0,0 +1,82 @@
+/*
+ * proxy_buffer.h -- chains of fixed-size slabs for response bodies.
+ */
+#include "proxy_socket.h"
+#include "proxy_slab.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+#ifndef PROXY_BUFFER
+#define PROXY_BUFFER
+
+#define BUFFER_SLAB_SIZE (SLAB_MAX_BLOCK - sizeof(BufferSlab))   //payload bytes in a full slab
+#define MAX_SEND_IOV 64              //slabs handed to one scatter-gather send
+
+/*
+   BufferChain holds a byte sequence as a list of refcounted slabs, every one
+   full except the last. A response is read from the origin straight into the
+   tail slab and never moved again: the client is sent the slabs with one
+   scatter-gather call, and an in-flight fetch or a cache entry shares the
+   same slabs rather than copying them.
+
+   Only the chain that filled the slabs may append to them. A chain that
+   shares another's slabs through share_from() is read-only apart from further
+   share_from() calls.
+
+   Slabs come from slab_allocator(). A chain that is done growing can trade
+   its tail slab for the smallest size class that holds its bytes.
+ */
+class BufferChain {
+public:
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    // Returns writable space at the end of the chain, adding a slab if the
+    // tail is full, and sets avail to its length. Bytes written there become
+    // part of the chain once commit()ed.
+    char* reserve(size_t& avail);
+    void commit(size_t n);
+
+    void append(const char* data, size_t len);
+    void append(const std::string& data) { append(data.data(), data.size()); }
+
+    // Extends this chain to other.size() by sharing other's slabs. This chain
+    // must hold a prefix of other, as a follower's copy of a fetch does.
+    void share_from(const BufferChain& other);
+
+    // Points up to max_iov entries of iov at the bytes from offset onward,
+    // stopping at end if it comes first. Returns the number of entries used.
+    size_t fill_iov(size_t offset, iovec_t* iov, size_t max_iov, size_t end = SIZE_MAX) const;
+
+    // Copies len bytes at offset (clamped to the end of the chain).
+    std::string copy(size_t offset, size_t len) const;
+
+    void clear();
+
+    // Moves the bytes of the tail slab into the smallest block that holds
+    // them, leaving any other holder of the old tail with it. A later append
+    // moves them back into a full slab.
+    void shrink_to_fit();
+
+    // Bytes of slab memory and slab list the chain holds, counting shared
+    // slabs in full.
+    size_t allocated() const;
+
+private:
+    std::vector<SlabRef> slabs_;
+    size_t size_ = 0;
+};
+
+// Sends the bytes of chain from offset up to end (or the end of the chain)
+// with one scatter-gather call. Returns the number of bytes sent, or -1 on
+// error (errno / WSAGetLastError as for send).
+long send_chain(socket_t s, const BufferChain& chain, size_t offset, size_t end = SIZE_MAX);
+
+// Sends all of chain from offset up to end on a blocking socket. Returns
+// false if a send fails.
+bool send_chain_all(socket_t s, const BufferChain& chain, size_t offset, size_t end = SIZE_MAX);
+
+#endif
@@ -0,0 +1,578 @@
+/*
+  proxy_cache.cpp -- sharded, hashed cache for proxied responses.
+*/
+
+#include "proxy_cache.h"
+#include "proxy_disk.h"
+#include <new>
+#include <functional>
+#include <cctype>
+#include <cstdio>
+#include <algorithm>
+
+#define MAX_RESPONSE_HEAD 65536     //longest response head searched for Vary
+
+// Size of the block make_cache_entry() allocates for an entry and its
+// shared_ptr counts, recorded by the allocator as it hands the block out
+static std::atomic<size_t> entry_block_bytes{0};
+
+template <class T>
+struct EntryAllocator {
+    using value_type = T;
+
+    EntryAllocator() = default;
+    template <class U>
+    EntryAllocator(const EntryAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        entry_block_bytes.store(n * sizeof(T), std::memory_order_relaxed);
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T* p, size_t n) { std::allocator<T>().deallocate(p, n); }
+
+    template <class U>
+    bool operator==(const EntryAllocator<U>&) const { return true; }
+    template <class U>
+    bool operator!=(const EntryAllocator<U>&) const { return false; }
+};
+
+CacheEntryPtr make_cache_entry(CacheEntry entry) {
+    return std::allocate_shared<const CacheEntry>(EntryAllocator<CacheEntry>(), std::move(entry));
+}
+
+static std::string to_lower(std::string_view s) {
+    std::string out(s);
+    for (auto& c : out) c = (char)tolower((unsigned char)c);
+    return out;
+}
+
+CacheKey make_cache_key(const ParsedRequest& request, const std::vector<std::string>& vary) {
+    CacheKey key;
+    std::string_view port = request.get_port();
+    key.text.reserve(request.get_method().size() + request.get_host().size() + request.get_path().size() + 16);
+    key.text += request.get_method();
+    key.text += ' ';
+    key.text += to_lower(request.get_host());
+    key.text += ':';
+    key.text += port.empty() ? std::string_view("80") : port;
+    key.text += request.get_path();
+    key.url_len = key.text.size();
+
+    for (const auto& name : vary) {
+        const ParsedRequest::ParsedHeader* header = request.get_header(name);
+        key.text += '\n';
+        key.text += name;
+        key.text += ':';
+        if (header) key.text += header->value;
+    }
+
+    key.hash = std::hash<std::string_view>()(key.text);
+    key.url_hash = std::hash<std::string_view>()(key.url());
+    return key;
+}
+
+CacheKey make_slice_key(const CacheEntry& head, uint64_t index) {
+    std::string_view text = head.key;
+    size_t newline = text.find('\n');
+    std::string response = head.data.copy(0, MAX_RESPONSE_HEAD);
+    std::string version(find_response_header(response, "ETag"));
+    version += '\n';
+    version += find_response_header(response, "Last-Modified");
+    version += '\n';
+    version += std::to_string(head.sliced_length);
+    char tag[32];
+    snprintf(tag, sizeof(tag), "#%016zx:", std::hash<std::string>()(version));
+
+    CacheKey key;
+    key.text.reserve(text.size() + 40);
+    key.text += text.substr(0, newline);
+    key.text += tag;
+    key.text += std::to_string(index);
+    key.url_len = key.text.size();
+    if (newline != std::string_view::npos) key.text += text.substr(newline);
+
+    key.hash = std::hash<std::string_view>()(key.text);
+    key.url_hash = std::hash<std::string_view>()(key.url());
+    return key;
+}
+
+// Splits a Vary value into lowercase header names. Sets any to true for "*".
+static std::vector<std::string> parse_vary(std::string_view value, bool& any) {
+    std::vector<std::string> names;
+    any = false;
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        std::string_view name = value.substr(0, comma);
+        while (!name.empty() && (name.front() == ' ' || name.front() == '\t')) name.remove_prefix(1);
+        while (!name.empty() && (name.back() == ' ' || name.back() == '\t')) name.remove_suffix(1);
+        if (name == "*") any = true;
+        else if (!name.empty()) names.push_back(to_lower(name));
+        if (comma == std::string_view::npos) break;
+        value.remove_prefix(comma + 1);
+    }
+    return names;
+}
+
+// Recovers the url and Vary header names from the text of a key built by
+// make_cache_key: the url, then a "\nname:value" line per header.
+static std::string_view split_key(std::string_view text, std::vector<std::string>& vary) {
+    size_t newline = text.find('\n');
+    std::string_view url = text.substr(0, newline);
+    while (newline != std::string_view::npos) {
+        size_t next = text.find('\n', newline + 1);
+        std::string_view line = text.substr(newline + 1, next == std::string_view::npos ? next : next - newline - 1);
+        vary.emplace_back(line.substr(0, line.find(':')));
+        newline = next;
+    }
+    return url;
+}
+
+CacheShard::CacheShard(size_t max_size, size_t max_element_size, const std::string& policy)
+    : index_(0, IndexKeyHash(), std::equal_to<IndexKey>(), IndexMap::allocator_type(&stats_.size)),
+      vary_(0, std::hash<std::string>(), std::equal_to<std::string>(), VaryMap::allocator_type(&stats_.size)),
+      policy_(make_cache_policy(policy, max_size)), max_size_(max_size), max_element_size_(max_element_size) {
+    if (!policy_) policy_ = make_cache_policy(DEFAULT_CACHE_POLICY, max_size);
+    stats_.size += policy_->bytes();
+}
+
+CacheShard::~CacheShard() {
+    for (auto& indexed : index_) delete indexed.second;
+}
+
+void CacheShard::set_policy(std::unique_ptr<CachePolicy> policy) {
+    std::lock_guard<std::mutex> guard(lock_);
+    stats_.size = stats_.size - policy_->bytes() + policy->bytes();
+    policy_ = std::move(policy);
+}
+
+// Bytes s holds on the heap: a string allocates capacity() + 1 bytes once
+// its text no longer fits in the buffer inside the object
+static size_t heap_bytes(const std::string& s) {
+    const char* object = reinterpret_cast<const char*>(&s);
+    bool inline_buffer = s.data() >= object && s.data() < object + sizeof(s);
+    return inline_buffer ? 0 : s.capacity() + 1;
+}
+
+// What the cache allocates for entry alone: its slabs and slab list, its
+// strings, the block holding it and its shared_ptr counts, and its element.
+// Its index node is counted by the index's allocator. malloc's own
+// bookkeeping is left out.
+static size_t entry_size(const CacheEntry& entry) {
+    return entry.data.allocated() + heap_bytes(entry.key) + heap_bytes(entry.freshness.etag) + heap_bytes(entry.freshness.last_modified)
+        + entry_block_bytes.load(std::memory_order_relaxed) + sizeof(CacheElement);
+}
+
+// Heap bytes behind the strings of url's Vary list; vary_'s allocator counts
+// the node and bucket
+static size_t vary_size(const std::string& url, const std::vector<std::string>& names) {
+    size_t bytes = heap_bytes(url) + names.capacity() * sizeof(std::string);
+    for (const auto& name : names) bytes += heap_bytes(name);
+    return bytes;
+}
+
+void CacheShard::set_vary_nolock(VaryMap::iterator it, std::vector<std::string> names) {
+    size_t old_size = vary_size(it->first, it->second.names);
+    it->second.names = std::move(names);
+    stats_.size = stats_.size - old_size + vary_size(it->first, it->second.names);
+}
+
+void CacheShard::erase_vary_nolock(VaryMap::iterator it) {
+    stats_.size -= vary_size(it->first, it->second.names);
+    vary_.erase(it);
+}
+
+void CacheShard::add_variant_nolock(const CacheEntry& entry) {
+    std::vector<std::string> names;
+    std::string_view url = split_key(entry.key, names);
+    // A slice's Vary lines are its head's; only the head's url needs them
+    if (url.find('#') != std::string_view::npos) return;
+    auto it = vary_.find(std::string(url));
+    if (names.empty()) {
+        // The url's responses no longer vary; variants still cached under
+        // the old list are never found again and age out
+        if (it != vary_.end()) erase_vary_nolock(it);
+        return;
+    }
+    if (it == vary_.end()) {
+        it = vary_.emplace(std::string(url), VaryList()).first;
+        stats_.size += vary_size(it->first, it->second.names);
+    }
+    if (names != it->second.names) set_vary_nolock(it, std::move(names));
+    it->second.variants++;
+}
+
+void CacheShard::remove_variant_nolock(const CacheEntry& entry, bool demoted) {
+    size_t newline = entry.key.find('\n');
+    if (newline == std::string::npos) return;
+    auto it = vary_.find(entry.key.substr(0, newline));
+    if (it == vary_.end()) return;
+    if (it->second.variants > 0) it->second.variants--;
+    // Kept while the last variant is on the disk tier, where it is looked
+    // up with the list
+    if (it->second.variants == 0 && !demoted) erase_vary_nolock(it);
+}
+
+void CacheShard::remove_nolock(CacheElement* element, std::vector<CacheEntryPtr>& released) {
+    policy_->on_remove(element);
+    drop_nolock(element, released);
+}
+
+void CacheShard::evict_nolock(CacheElement* victim, std::vector<CacheEntryPtr>& released) {
+    // Only queued here; the disk tier writes it on its own thread
+    if (lower_) lower_->demote(victim->entry, policy_->frequency(victim->url_hash));
+    drop_nolock(victim, released, lower_ != nullptr);
+}
+
+void CacheShard::drop_nolock(CacheElement* element, std::vector<CacheEntryPtr>& released, bool demoted) {
+    index_.erase(IndexKey{element->entry->key, element->entry->hash});
+    remove_variant_nolock(*element->entry, demoted);
+    stats_.size -= element->charge;
+    stats_.body_bytes -= element->entry->data.size();
+    stats_.count--;
+    released.push_back(std::move(element->entry));
+    delete element;
+}
+
+void CacheShard::count_lower_hit(const CacheEntryPtr& entry) {
+    std::lock_guard<std::mutex> guard(lock_);
+    stats_.misses--;
+    stats_.hits++;
+    stats_.hit_bytes += entry->data.size();
+}
+
+CacheEntryPtr CacheShard::find(const CacheKey& key) {
+    // Declared before the guard so a dropped body is freed after unlocking
+    std::vector<CacheEntryPtr> released;
+    std::lock_guard<std::mutex> guard(lock_);
+
+    policy_->record_access(key.url_hash);
+    auto it = index_.find(IndexKey{key.text, key.hash});
+    if (it == index_.end()) {
+        stats_.misses++;
+        return nullptr;
+    }
+    CacheElement* site = it->second;
+    if (!site->entry->revalidatable() && !site->entry->fresh(time(NULL))) {
+        // Useless once stale; drop it and let the caller refetch
+        remove_nolock(site, released);
+        stats_.expired++;
+        stats_.misses++;
+        return nullptr;
+    }
+    stats_.hits++;
+    stats_.hit_bytes += site->entry->data.size();
+    policy_->on_hit(site);
+    site->lru_time_track = time(NULL);
+    return site->entry;
+}
+
+void CacheShard::evict_lru() {
+    std::vector<CacheEntryPtr> released;
+    std::lock_guard<std::mutex> guard(lock_);
+    CacheElement* victim = policy_->pop_victim();
+    if (victim != nullptr) {
+        evict_nolock(victim, released);
+        stats_.evictions++;
+    }
+}
+
+int CacheShard::add(CacheEntryPtr entry) {
+    size_t new_size = entry_size(*entry);
+    if (new_size > max_element_size_ || new_size > max_size_) {
+        return 0;
+    }
+
+    CacheElement* element = new (std::nothrow) CacheElement();
+    if (!element) {
+        return 0;
+    }
+    element->entry = std::move(entry);
+    element->lru_time_track = time(NULL);
+    element->charge = new_size;
+    std::string_view key = element->entry->key;
+    element->url_hash = std::hash<std::string_view>()(key.substr(0, key.find('\n')));
+
+    // Declared before the guard so evicted bodies are freed after unlocking
+    std::vector<CacheEntryPtr> released;
+    std::lock_guard<std::mutex> guard(lock_);
+
+    IndexKey index_key{element->entry->key, element->entry->hash};
+
+    // Counted before a stale copy goes, so the url's list outlives it
+    add_variant_nolock(*element->entry);
+
+    // Replace a stale copy rather than indexing the same key twice
+    auto it = index_.find(index_key);
+    if (it != index_.end()) {
+        remove_nolock(it->second, released);
+    }
+
+    index_.emplace(index_key, element);
+    stats_.size += new_size;
+    stats_.body_bytes += element->entry->data.size();
+    stats_.count++;
+
+    std::vector<CacheElement*> evicted;
+    policy_->on_insert(element, evicted);
+    bool admitted = true;
+    auto evict = [&](CacheElement* victim) {
+        if (victim == element) {
+            admitted = false;
+            stats_.rejections++;
+        }
+        else {
+            stats_.evictions++;
+        }
+        evict_nolock(victim, released);
+    };
+    for (CacheElement* victim : evicted) evict(victim);
+    // The policy budgets the elements alone; the index, the Vary lists and
+    // the policy's own state are made room for by evicting its least
+    // valuable ones
+    while (admitted && stats_.size > max_size_) {
+        CacheElement* victim = policy_->pop_victim();
+        if (victim == nullptr) break;
+        evict(victim);
+    }
+    if (!admitted) {
+        return 0;
+    }
+    stats_.insertions++;
+    return 1;
+}
+
+std::vector<std::string> CacheShard::vary_for(std::string_view url) const {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = vary_.find(std::string(url));
+    if (it == vary_.end()) return {};
+    return it->second.names;
+}
+
+void CacheShard::set_vary(std::string_view url, std::vector<std::string> vary) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = vary_.find(std::string(url));
+    if (vary.empty()) {
+        if (it != vary_.end()) erase_vary_nolock(it);
+        return;
+    }
+    if (it == vary_.end()) {
+        it = vary_.emplace(std::string(url), VaryList()).first;
+        stats_.size += vary_size(it->first, it->second.names);
+    }
+    set_vary_nolock(it, std::move(vary));
+}
+
+void CacheShard::record_accesses(size_t url_hash, unsigned count) {
+    std::lock_guard<std::mutex> guard(lock_);
+    for (unsigned i = 0; i < count; i++) policy_->record_access(url_hash);
+}
+
+void CacheShard::entries_by_recency(std::vector<std::pair<CacheEntryPtr, unsigned>>& out) const {
+    std::vector<const CacheElement*> elements;
+    std::lock_guard<std::mutex> guard(lock_);
+    elements.reserve(index_.size());
+    for (const auto& indexed : index_) elements.push_back(indexed.second);
+    std::stable_sort(elements.begin(), elements.end(), [](const CacheElement* a, const CacheElement* b) {
+        return a->lru_time_track < b->lru_time_track;
+    });
+    for (const CacheElement* element : elements) {
+        out.emplace_back(element->entry, policy_->frequency(element->url_hash));
+    }
+}
+
+CacheStats CacheShard::stats() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return stats_;
+}
+
+ProxyCache::ProxyCache(size_t max_size, size_t max_element_size, size_t num_shards) : max_size_(max_size) {
+    if (num_shards == 0) num_shards = 1;
+    shards_.reserve(num_shards);
+    for (size_t i = 0; i < num_shards; i++) {
+        shards_.push_back(std::make_unique<CacheShard>(max_size / num_shards, max_element_size));
+    }
+}
+
+CacheShard& ProxyCache::shard_for(size_t url_hash) const {
+    return *shards_[url_hash % shards_.size()];
+}
+
+CacheKey ProxyCache::key_for(const ParsedRequest& request) const {
+    CacheKey key = make_cache_key(request);
+    std::vector<std::string> vary = shard_for(key.url_hash).vary_for(key.url());
+    if (vary.empty()) {
+        return key;
+    }
+    return make_cache_key(request, vary);
+}
+
+CacheEntryPtr ProxyCache::find(const CacheKey& key) {
+    CacheShard& shard = shard_for(key.url_hash);
+    CacheEntryPtr entry = shard.find(key);
+    if (entry || !lower_) {
+        return entry;
+    }
+    entry = lower_->take(key);
+    if (entry) {
+        shard.count_lower_hit(entry);
+        shard.add(entry);
+    }
+    return entry;
+}
+
+int ProxyCache::add(BufferChain data, const ParsedRequest& request, bool delimited) {
+    miss_bytes_ += data.size();
+
+    // Only the head is copied out, to look for Vary and freshness headers
+    std::string head = data.copy(0, MAX_RESPONSE_HEAD);
+    Freshness freshness = compute_freshness(head, request, time(NULL));
+    if (!freshness.storable) {
+        return 0;
+    }
+    bool vary_any;
+    std::vector<std::string> vary = parse_vary(find_response_header(head, "Vary"), vary_any);
+    if (vary_any) {
+        return 0;
+    }
+
+    CacheKey key = make_cache_key(request, vary);
+    CacheShard& shard = shard_for(key.url_hash);
+
+    // The entry keeps its tail in the smallest slab class that holds it
+    data.shrink_to_fit();
+    auto entry = make_cache_entry(CacheEntry{std::move(key.text), key.hash, std::move(data), delimited, std::move(freshness)});
+    return shard.add(std::move(entry));
+}
+
+CacheEntryPtr ProxyCache::add_sliced(std::string head, const ParsedRequest& request, uint64_t length) {
+    Freshness freshness = compute_freshness(head, request, time(NULL));
+    if (!freshness.storable) {
+        return nullptr;
+    }
+    bool vary_any;
+    std::vector<std::string> vary = parse_vary(find_response_header(head, "Vary"), vary_any);
+    if (vary_any) {
+        return nullptr;
+    }
+
+    CacheKey key = make_cache_key(request, vary);
+    CacheShard& shard = shard_for(key.url_hash);
+
+    BufferChain data;
+    data.append(head);
+    data.shrink_to_fit();
+    CacheEntry entry{std::move(key.text), key.hash, std::move(data), true, std::move(freshness)};
+    entry.sliced_length = length;
+    auto cached = make_cache_entry(std::move(entry));
+    shard.add(cached);
+    return cached;
+}
+
+int ProxyCache::add_slice(const CacheKey& key, const CacheEntry& head, BufferChain data) {
+    miss_bytes_ += data.size();
+    data.shrink_to_fit();
+    auto entry = make_cache_entry(CacheEntry{key.text, key.hash, std::move(data), true, head.freshness});
+    return shard_for(key.url_hash).add(std::move(entry));
+}
+
+CacheEntryPtr ProxyCache::refresh(const CacheKey& key, const CacheEntryPtr& stale, std::string_view not_modified_head) {
+    std::string head = stale->data.copy(0, MAX_RESPONSE_HEAD);
+    Freshness freshness = refresh_freshness(head, not_modified_head, time(NULL));
+    CacheEntry refreshed{stale->key, stale->hash, stale->data, stale->delimited, std::move(freshness)};
+    refreshed.sliced_length = stale->sliced_length;
+    auto entry = make_cache_entry(std::move(refreshed));
+    if (entry->freshness.storable) {
+        shard_for(key.url_hash).add(entry);
+    }
+    return entry;
+}
+
+void ProxyCache::evict_lru() {
+    CacheShard* fullest = nullptr;
+    size_t fullest_size = 0;
+    for (auto& shard : shards_) {
+        size_t shard_size = shard->stats().size;
+        if (shard_size > fullest_size) {
+            fullest_size = shard_size;
+            fullest = shard.get();
+        }
+    }
+    if (fullest) fullest->evict_lru();
+}
+
+int ProxyCache::set_policy(const std::string& name) {
+    size_t shard_size = max_size_ / shards_.size();
+    if (!make_cache_policy(name, shard_size)) {
+        return -1;
+    }
+    for (auto& shard : shards_) shard->set_policy(make_cache_policy(name, shard_size));
+    return 0;
+}
+
+void ProxyCache::set_lower_tier(DiskCache* disk) {
+    lower_ = disk;
+    for (auto& shard : shards_) shard->set_lower_tier(disk);
+}
+
+void ProxyCache::warm_from_lower_tier() {
+    if (!lower_) return;
+    for (const auto& indexed : lower_->indexed_keys()) {
+        std::vector<std::string> vary;
+        std::string_view url = split_key(indexed.first, vary);
+        size_t url_hash = std::hash<std::string_view>()(url);
+        CacheShard& shard = shard_for(url_hash);
+        // A slice's Vary lines are its head's; only the head's url needs them
+        bool slice = url.find('#') != std::string_view::npos;
+        if (!vary.empty() && !slice) shard.set_vary(url, std::move(vary));
+        shard.record_accesses(url_hash, indexed.second);
+    }
+}
+
+int ProxyCache::persist() {
+    if (!lower_) return -1;
+    for (auto& shard : shards_) {
+        std::vector<std::pair<CacheEntryPtr, unsigned>> entries;
+        shard->entries_by_recency(entries);
+        for (const auto& entry : entries) lower_->persist(entry.first, entry.second);
+    }
+    lower_->flush();
+    return lower_->save_index();
+}
+
+size_t ProxyCache::size() const {
+    size_t total = 0;
+    for (const auto& shard : shards_) total += shard->stats().size;
+    return total;
+}
+
+size_t ProxyCache::count() const {
+    size_t total = 0;
+    for (const auto& shard : shards_) total += shard->stats().count;
+    return total;
+}
+
+std::vector<CacheStats> ProxyCache::shard_stats() const {
+    std::vector<CacheStats> out;
+    out.reserve(shards_.size());
+    for (const auto& shard : shards_) out.push_back(shard->stats());
+    return out;
+}
+
+CacheStats ProxyCache::stats() const {
+    CacheStats total;
+    for (const auto& shard : shards_) {
+        CacheStats s = shard->stats();
+        total.hits += s.hits;
+        total.misses += s.misses;
+        total.insertions += s.insertions;
+        total.evictions += s.evictions;
+        total.rejections += s.rejections;
+        total.expired += s.expired;
+        total.size += s.size;
+        total.body_bytes += s.body_bytes;
+        total.count += s.count;
+        total.hit_bytes += s.hit_bytes;
+    }
+    total.miss_bytes = miss_bytes_;
+    return total;
+}
@@ -0,0 +1,335 @@
+/*
+ * proxy_cache.h -- in-memory response cache for the proxy server.
+ */
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <mutex>
+#include <ctime>
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include "proxy_parse.h"
+#include "proxy_policy.h"
+#include "proxy_buffer.h"
+#include "proxy_freshness.h"
+
+#ifndef PROXY_CACHE
+#define PROXY_CACHE
+
+#define DEFAULT_CACHE_SHARDS 16
+#define CACHE_SLICE_SIZE (1<<20)     //body bytes per slice of an object cached in slices
+
+class DiskCache;
+
+/*
+   CacheKey is the canonical identity of a cached response: method, lowercased
+   host, effective port and path/query, followed by the request's values of
+   the headers named in the response's Vary. It is hashed once when built.
+ */
+struct CacheKey {
+    std::string text;
+    size_t url_len = 0;   // text[0, url_len) is the method and url
+    size_t hash = 0;
+    // Hash of the url part alone; picks the shard, so every variant of a url
+    // lives in the same shard as its Vary list.
+    size_t url_hash = 0;
+
+    std::string_view url() const { return std::string_view(text).substr(0, url_len); }
+};
+
+// Builds the key for request, adding the request's values of the (lowercase)
+// header names in vary.
+CacheKey make_cache_key(const ParsedRequest& request, const std::vector<std::string>& vary = {});
+
+struct CacheEntry;
+
+// Builds the key for slice index of the sliced object head: its url with
+// "#tag:index" appended, then head's Vary lines. The tag is a hash of the
+// object's validators and length, so slices of one version of the object
+// are never mixed with another's. Each slice hashes to its own shard.
+CacheKey make_slice_key(const CacheEntry& head, uint64_t index);
+
+// An immutable cached response. Readers pin it through a CacheEntryPtr for as
+// long as they send from it, so eviction only drops the cache's reference and
+// never frees a body that is still being written to a client.
+struct CacheEntry {
+    std::string key;
+    size_t hash;
+    // The response as read from the origin; hits are sent straight from
+    // these slabs
+    BufferChain data;
+    // The response carries its own length, so a keep-alive client
+    // connection can go on after it
+    bool delimited;
+    // When the response goes stale, and the validators to revalidate it with
+    Freshness freshness;
+    // For an object too large to cache whole, the length of its body, which
+    // is cached in CACHE_SLICE_SIZE slices under make_slice_key(); data then
+    // holds only the head. 0 for everything else.
+    uint64_t sliced_length = 0;
+
+    bool fresh(time_t now) const { return now < freshness.expires; }
+    bool revalidatable() const { return !freshness.etag.empty() || !freshness.last_modified.empty(); }
+};
+
+using CacheEntryPtr = std::shared_ptr<const CacheEntry>;
+
+// Allocates entry in one block with its shared_ptr counts. Every entry the
+// cache holds is made here, so the size of that block is known exactly.
+CacheEntryPtr make_cache_entry(CacheEntry entry);
+
+// An allocator that adds the bytes it hands out to *bytes, and takes back
+// the bytes returned to it, so a container's nodes and buckets are counted
+// as they are allocated.
+template <class T>
+struct CountingAllocator {
+    using value_type = T;
+
+    size_t* bytes;
+
+    explicit CountingAllocator(size_t* counter) : bytes(counter) {}
+    template <class U>
+    CountingAllocator(const CountingAllocator<U>& other) : bytes(other.bytes) {}
+
+    T* allocate(size_t n) {
+        T* p = std::allocator<T>().allocate(n);
+        *bytes += n * sizeof(T);
+        return p;
+    }
+    void deallocate(T* p, size_t n) {
+        *bytes -= n * sizeof(T);
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template <class U>
+    bool operator==(const CountingAllocator<U>& other) const { return bytes == other.bytes; }
+    template <class U>
+    bool operator!=(const CountingAllocator<U>& other) const { return bytes != other.bytes; }
+};
+
+// A C++ class for cache elements. Elements are threaded onto one of the
+// intrusive doubly-linked recency lists of the shard's CachePolicy.
+class CacheElement {
+public:
+    CacheEntryPtr entry;
+    time_t lru_time_track;
+    size_t charge = 0;      // bytes counted against the shard's budget
+    // Hash of the entry's url, which the policy counts accesses under: it is
+    // all a lookup knows before the url's Vary list is learned
+    size_t url_hash = 0;
+    CacheSegment segment = CacheSegment::NONE;
+    CacheElement* prev = nullptr;
+    CacheElement* next = nullptr;
+};
+
+// Per-shard counters, used to confirm load is spread evenly across shards.
+struct CacheStats {
+    size_t hits = 0;        // including lookups the disk tier answered
+    size_t misses = 0;
+    size_t insertions = 0;
+    size_t evictions = 0;
+    size_t rejections = 0;  // new entries the policy declined to keep
+    size_t expired = 0;     // stale entries dropped because they can't be revalidated
+    size_t size = 0;        // bytes the shard allocates: its entries (see entry_size()), index, Vary lists and policy
+    size_t body_bytes = 0;  // response bytes in the entries; size less this is overhead
+    size_t count = 0;
+    size_t hit_bytes = 0;   // response bytes served from the cache
+    size_t miss_bytes = 0;  // response bytes fetched from origins and offered to the cache
+
+    double hit_ratio() const { return hits + misses ? (double)hits / (hits + misses) : 0; }
+    double byte_hit_ratio() const { return hit_bytes + miss_bytes ? (double)hit_bytes / (hit_bytes + miss_bytes) : 0; }
+};
+
+/*
+   CacheShard keeps a hash index from key to CacheElement, and a CachePolicy
+   that orders the elements and chooses what to admit and evict within the
+   shard's byte budget. Lookup, promotion, insert and eviction are all O(1)
+   apart from the victims an insert displaces. Each shard has its own lock,
+   policy state and byte budget.
+ */
+class CacheShard {
+public:
+    CacheShard(size_t max_size, size_t max_element_size, const std::string& policy = DEFAULT_CACHE_POLICY);
+    ~CacheShard();
+
+    // Disable copy and assignment
+    CacheShard(const CacheShard&) = delete;
+    CacheShard& operator=(const CacheShard&) = delete;
+
+    // Returns the entry cached under key and marks it most recently used,
+    // or nullptr on a miss. The entry may be stale; a stale entry that can't
+    // be revalidated is dropped and reported as a miss.
+    CacheEntryPtr find(const CacheKey& key);
+
+    // Adds entry, evicting whatever the policy picks to make room.
+    // Returns 1 if the entry was added and 0 if it was rejected.
+    int add(CacheEntryPtr entry);
+
+    // Counts the last miss find() reported as a hit on entry instead, for
+    // when a lower tier answered it.
+    void count_lower_hit(const CacheEntryPtr& entry);
+
+    // Header names the cached responses for url vary on. add() learns them
+    // from the keys of the entries it is given; the list goes when the url's
+    // last entry leaves the shard, unless it went down to the disk tier.
+    std::vector<std::string> vary_for(std::string_view url) const;
+    // Sets the list for a url whose entries are only on the disk tier.
+    void set_vary(std::string_view url, std::vector<std::string> vary);
+
+    // Evicts the element the policy values least, if any.
+    void evict_lru();
+
+    // Replaces the policy. Only for an empty shard, before it is used.
+    void set_policy(std::unique_ptr<CachePolicy> policy);
+
+    // Entries the policy evicts or turns away are demoted to disk rather
+    // than discarded. Set before the shard is used.
+    void set_lower_tier(DiskCache* disk) { lower_ = disk; }
+
+    // Tells the policy the url with this hash was asked for count times, to
+    // restore the frequency it had before a restart.
+    void record_accesses(size_t url_hash, unsigned count);
+
+    // Appends every entry, least recently used first, with the policy's
+    // frequency for it.
+    void entries_by_recency(std::vector<std::pair<CacheEntryPtr, unsigned>>& out) const;
+
+    CacheStats stats() const;
+
+private:
+    // Takes element off the policy's lists, then drops it
+    void remove_nolock(CacheElement* element, std::vector<CacheEntryPtr>& released);
+    // Unindexes element, which is off the policy's lists, and hands its entry
+    // to released, so the last reference can be dropped after the shard lock
+    // is let go. demoted says whether it was handed to the disk tier.
+    void drop_nolock(CacheElement* element, std::vector<CacheEntryPtr>& released, bool demoted = false);
+    // Demotes victim, which is off the policy's lists, to the disk tier if
+    // there is one, then drops it
+    void evict_nolock(CacheElement* victim, std::vector<CacheEntryPtr>& released);
+
+    // Index keys view CacheEntry::key, which outlives its index entry, and
+    // carry the hash computed when the key was built.
+    struct IndexKey {
+        std::string_view text;
+        size_t hash;
+        bool operator==(const IndexKey& other) const { return text == other.text; }
+    };
+    struct IndexKeyHash {
+        size_t operator()(const IndexKey& key) const { return key.hash; }
+    };
+
+    // The Vary header names of a url, and how many of its entries, one per
+    // variant, are in the shard
+    struct VaryList {
+        std::vector<std::string> names;
+        size_t variants = 0;
+    };
+    using IndexMap = std::unordered_map<IndexKey, CacheElement*, IndexKeyHash, std::equal_to<IndexKey>,
+                                        CountingAllocator<std::pair<const IndexKey, CacheElement*>>>;
+    using VaryMap = std::unordered_map<std::string, VaryList, std::hash<std::string>, std::equal_to<std::string>,
+                                       CountingAllocator<std::pair<const std::string, VaryList>>>;
+
+    // Counts entry as a variant of its url, taking the url's list from its key
+    void add_variant_nolock(const CacheEntry& entry);
+    // Uncounts entry, dropping its url's list with the last variant
+    void remove_variant_nolock(const CacheEntry& entry, bool demoted);
+    void set_vary_nolock(VaryMap::iterator it, std::vector<std::string> names);
+    void erase_vary_nolock(VaryMap::iterator it);
+
+    mutable std::mutex lock_;
+    // Ahead of the maps, which count their allocations into stats_.size
+    CacheStats stats_;
+    IndexMap index_;
+    VaryMap vary_;
+    std::unique_ptr<CachePolicy> policy_;
+    DiskCache* lower_ = nullptr;
+    size_t max_size_;
+    size_t max_element_size_;
+};
+
+/*
+   ProxyCache splits the cache into independently locked shards picked by a
+   hash of the url, so hits on different keys don't queue on one mutex. Each
+   shard gets an equal share of the total size budget.
+ */
+class ProxyCache {
+public:
+    ProxyCache(size_t max_size, size_t max_element_size, size_t num_shards = DEFAULT_CACHE_SHARDS);
+
+    // Disable copy and assignment
+    ProxyCache(const ProxyCache&) = delete;
+    ProxyCache& operator=(const ProxyCache&) = delete;
+
+    // Builds the key for request, including the headers the cached
+    // responses for its url vary on.
+    CacheKey key_for(const ParsedRequest& request) const;
+
+    // Returns the entry cached under key from memory, or else from the disk
+    // tier, promoting it back into memory.
+    CacheEntryPtr find(const CacheKey& key);
+
+    // Caches the response to request under a key built from the response's
+    // Vary header. Responses that aren't storable (see compute_freshness) or
+    // have "Vary: *" are not cached. Adopts the slabs of data; the body is
+    // never copied into the entry.
+    int add(BufferChain data, const ParsedRequest& request, bool delimited);
+
+    // Caches head, the head of a response to request whose body of length
+    // bytes is cached separately in slices. Returns the entry, even if the
+    // policy turned it away, or nullptr if the response isn't storable or
+    // has "Vary: *".
+    CacheEntryPtr add_sliced(std::string head, const ParsedRequest& request, uint64_t length);
+
+    // Caches data, the bytes of one slice of the object head, under key.
+    // Slices are as fresh as their head; they are only found through it.
+    int add_slice(const CacheKey& key, const CacheEntry& head, BufferChain data);
+
+    // Replaces stale, cached under key, with a copy whose freshness comes from
+    // the head of the 304 that revalidated it. The body's slabs are shared.
+    // Returns the new entry.
+    CacheEntryPtr refresh(const CacheKey& key, const CacheEntryPtr& stale, std::string_view not_modified_head);
+
+    // Evicts the least valuable element of the fullest shard.
+    void evict_lru();
+
+    // Switches every shard to the named policy ("lru" or "tinylfu"). Must be
+    // called before the cache is used. Returns -1 for an unknown name.
+    int set_policy(const std::string& name);
+
+    // Adds disk as a second tier under the shards. Must be called before the
+    // cache is used.
+    void set_lower_tier(DiskCache* disk);
+
+    // Relearns the Vary lists and access frequencies of the entries the disk
+    // tier reloaded from an earlier run, so they are found and readmitted as
+    // before. Their bodies stay on disk until asked for.
+    void warm_from_lower_tier();
+
+    // Copies every entry to the disk tier, keeping it in memory too, and
+    // saves the disk tier's index once they are written. For a graceful
+    // shutdown. Returns 0, or -1 if there is no disk tier or the save failed.
+    int persist();
+
+    size_t size() const;
+    size_t count() const;
+
+    // One entry per shard, in shard order
+    std::vector<CacheStats> shard_stats() const;
+
+    // Totals over every shard
+    CacheStats stats() const;
+
+private:
+    CacheShard& shard_for(size_t url_hash) const;
+
+    std::vector<std::unique_ptr<CacheShard>> shards_;
+    DiskCache* lower_ = nullptr;
+    size_t max_size_;
+    std::atomic<size_t> miss_bytes_{0};
+};
+
+#endif
@@ -0,0 +1,624 @@
+/*
+  proxy_disk.cpp -- append-only, memory-mapped segment store for evicted entries.
+*/
+
+#include "proxy_disk.h"
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <cerrno>
+#include <chrono>
+#include <map>
+#include <set>
+
+#define DISK_RECORD_MAGIC 0x50524331u   //"PRC1", starts every record
+#define DISK_INDEX_MAGIC 0x50524931u    //"PRI1", starts the index file
+
+// Fixed part of a record; the key, etag, last_modified and body follow it.
+struct DiskRecordHeader {
+    uint32_t magic;
+    uint32_t key_len;
+    uint32_t etag_len;
+    uint32_t last_modified_len;
+    uint64_t body_len;
+    int64_t expires;
+    uint64_t checksum;          // of every byte after the header
+    uint8_t delimited;
+    uint8_t sliced;             // the body is an object's head; its length is the head's Content-Length
+    uint8_t pad[6];
+};
+
+// Start of the index file; a DiskIndexRecord and its key follow for each entry.
+struct DiskIndexHeader {
+    uint32_t magic;
+    uint32_t record_size;       // sizeof(DiskIndexRecord) when written
+    uint64_t count;
+    uint64_t next_segment_id;
+    uint64_t checksum;          // of every byte after the header
+};
+
+struct DiskIndexRecord {
+    uint64_t segment_id;
+    uint64_t offset;
+    uint64_t length;
+    uint32_t key_len;
+    uint8_t frequency;
+    uint8_t pad[3];
+};
+
+struct DiskSegment {
+    uint64_t id = 0;
+    std::string path;
+    int fd = -1;
+    char* map = nullptr;
+    uint64_t used = 0;              // bytes appended; only the writer thread changes it
+    // Keys written here and their offsets, in order, for unindexing on
+    // recycle and saving the index
+    std::vector<std::pair<std::string, uint64_t>> keys;
+    bool recycled = false;
+
+    ~DiskSegment() {
+        if (map) munmap(map, DISK_SEGMENT_SIZE);
+        if (fd >= 0) close(fd);
+        // Deleted only once the last reader is done with the mapping
+        if (recycled) unlink(path.c_str());
+    }
+};
+
+// Word-at-a-time FNV-1a style checksum; catches torn and corrupted records.
+// Bytes are taken eight at a time however they are split across update()
+// calls, so a record summed in pieces when written matches the sum of its
+// contiguous bytes when read back.
+struct Checksum {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    unsigned char partial[8];
+    size_t partial_len = 0;
+
+    void mix(uint64_t word) { h = (h ^ word) * 0x100000001b3ULL; }
+
+    void update(const char* data, size_t len) {
+        while (partial_len > 0 && partial_len < 8 && len > 0) {
+            partial[partial_len++] = (unsigned char)*data++;
+            len--;
+        }
+        if (partial_len == 8) {
+            uint64_t word;
+            memcpy(&word, partial, 8);
+            mix(word);
+            partial_len = 0;
+        }
+        while (len >= 8) {
+            uint64_t word;
+            memcpy(&word, data, 8);
+            mix(word);
+            data += 8;
+            len -= 8;
+        }
+        while (len > 0) {
+            partial[partial_len++] = (unsigned char)*data++;
+            len--;
+        }
+    }
+
+    uint64_t value() const {
+        uint64_t result = h;
+        for (size_t i = 0; i < partial_len; i++) result = (result ^ partial[i]) * 0x100000001b3ULL;
+        return result;
+    }
+};
+
+// Writes all of iov[0, n) at pos, advancing pos. Returns false on error.
+static bool pwrite_all(int fd, iovec_t* iov, size_t n, uint64_t& pos) {
+    while (n > 0) {
+        ssize_t written = pwritev(fd, iov, (int)n, (off_t)pos);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        pos += written;
+        while (n > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+static size_t entry_bytes(const CacheEntry& entry) {
+    return sizeof(DiskRecordHeader) + entry.key.size() + entry.freshness.etag.size() + entry.freshness.last_modified.size() + entry.data.size();
+}
+
+DiskCache::~DiskCache() {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    if (writer_.joinable()) writer_.join();
+}
+
+int DiskCache::open(const std::string& dir, uint64_t capacity) {
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> guard(lock_);
+    dir_ = dir;
+    max_segments_ = capacity / DISK_SEGMENT_SIZE;
+    if (max_segments_ < 2) max_segments_ = 2;
+    if (load_index() < 0) {
+        segments_.clear();
+        index_.clear();
+    }
+
+    DIR* d = opendir(dir.c_str());
+    if (d == nullptr) {
+        return -1;
+    }
+    // Segments the index doesn't name hold nothing that can be found
+    std::set<std::string> kept;
+    for (const auto& segment : segments_) kept.insert(segment->path);
+    while (struct dirent* file = readdir(d)) {
+        std::string path = dir + "/" + file->d_name;
+        if (strncmp(file->d_name, "segment-", 8) == 0 && kept.count(path) == 0) unlink(path.c_str());
+    }
+    closedir(d);
+
+    // The capacity may have shrunk since the index was saved
+    while (segments_.size() >= max_segments_) {
+        std::shared_ptr<DiskSegment> oldest = segments_.front();
+        segments_.pop_front();
+        for (const auto& written : oldest->keys) {
+            auto it = index_.find(written.first);
+            if (it != index_.end() && it->second.segment == oldest) index_.erase(it);
+        }
+        oldest->recycled = true;
+    }
+    stats_.restored = stats_.entries = index_.size();
+
+    if (!create_segment()) {
+        return -1;
+    }
+    enabled_ = true;
+    writer_ = std::thread(&DiskCache::writer, this);
+    return 0;
+}
+
+std::shared_ptr<DiskSegment> DiskCache::map_segment(uint64_t id, bool create) {
+    auto segment = std::make_shared<DiskSegment>();
+    segment->id = id;
+    segment->path = dir_ + "/segment-" + std::to_string(id) + ".dat";
+    segment->fd = ::open(segment->path.c_str(), create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+    if (segment->fd < 0) return nullptr;
+    // A failed segment is deleted along with its object
+    segment->recycled = true;
+    if (create) {
+        if (ftruncate(segment->fd, DISK_SEGMENT_SIZE) < 0) return nullptr;
+    }
+    else {
+        struct stat st;
+        if (fstat(segment->fd, &st) < 0 || st.st_size != DISK_SEGMENT_SIZE) return nullptr;
+        // Written by an earlier run; never appended to again
+        segment->used = DISK_SEGMENT_SIZE;
+    }
+    void* map = mmap(nullptr, DISK_SEGMENT_SIZE, PROT_READ, MAP_SHARED, segment->fd, 0);
+    if (map == MAP_FAILED) return nullptr;
+    segment->map = (char*)map;
+    segment->recycled = false;
+    return segment;
+}
+
+std::shared_ptr<DiskSegment> DiskCache::create_segment() {
+    std::shared_ptr<DiskSegment> segment = map_segment(next_segment_id_++, true);
+    if (!segment) return nullptr;
+    segments_.push_back(segment);
+    stats_.segments = segments_.size();
+    return segment;
+}
+
+int DiskCache::load_index() {
+    int fd = ::open((dir_ + "/" DISK_INDEX_FILE).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(DiskIndexHeader)) {
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    const char* data = (const char*)map;
+
+    DiskIndexHeader header;
+    memcpy(&header, data, sizeof(header));
+    Checksum sum;
+    sum.update(data + sizeof(header), size - sizeof(header));
+    if (header.magic != DISK_INDEX_MAGIC || header.record_size != sizeof(DiskIndexRecord) || header.checksum != sum.value()) {
+        munmap(map, size);
+        return -1;
+    }
+
+    // Segments by id, nullptr for those that are gone
+    std::map<uint64_t, std::shared_ptr<DiskSegment>> opened;
+    size_t pos = sizeof(header);
+    for (uint64_t i = 0; i < header.count; i++) {
+        DiskIndexRecord record;
+        if (size - pos < sizeof(record)) break;
+        memcpy(&record, data + pos, sizeof(record));
+        pos += sizeof(record);
+        if (size - pos < record.key_len) break;
+        std::string key(data + pos, record.key_len);
+        pos += record.key_len;
+
+        if (record.offset > DISK_SEGMENT_SIZE || record.length > DISK_SEGMENT_SIZE - record.offset) continue;
+        auto found = opened.find(record.segment_id);
+        if (found == opened.end()) {
+            found = opened.emplace(record.segment_id, map_segment(record.segment_id, false)).first;
+        }
+        if (!found->second) continue;
+        found->second->keys.emplace_back(key, record.offset);
+        index_[std::move(key)] = Location{found->second, record.offset, record.length, record.frequency};
+    }
+    munmap(map, size);
+
+    next_segment_id_ = header.next_segment_id;
+    for (auto& segment : opened) {
+        if (!segment.second) continue;
+        if (segment.first >= next_segment_id_) next_segment_id_ = segment.first + 1;
+        segments_.push_back(std::move(segment.second));
+    }
+    return 0;
+}
+
+int DiskCache::save_index() {
+    std::lock_guard<std::mutex> save_guard(save_lock_);
+    std::string out(sizeof(DiskIndexHeader), '\0');
+    DiskIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (!enabled_) return -1;
+        for (const auto& segment : segments_) {
+            for (const auto& written : segment->keys) {
+                auto it = index_.find(written.first);
+                if (it == index_.end() || it->second.segment != segment || it->second.offset != written.second) continue;
+                DiskIndexRecord record;
+                memset(&record, 0, sizeof(record));
+                record.segment_id = segment->id;
+                record.offset = it->second.offset;
+                record.length = it->second.length;
+                record.key_len = (uint32_t)written.first.size();
+                record.frequency = it->second.frequency;
+                out.append((const char*)&record, sizeof(record));
+                out += written.first;
+                header.count++;
+            }
+        }
+        header.next_segment_id = next_segment_id_;
+        index_changed_ = false;
+    }
+    header.magic = DISK_INDEX_MAGIC;
+    header.record_size = sizeof(DiskIndexRecord);
+    Checksum sum;
+    sum.update(out.data() + sizeof(header), out.size() - sizeof(header));
+    header.checksum = sum.value();
+    memcpy(&out[0], &header, sizeof(header));
+
+    // Written beside the old index and renamed over it, so a crash mid-save
+    // leaves the old one intact
+    std::string path = dir_ + "/" DISK_INDEX_FILE;
+    std::string temp = path + ".tmp";
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    bool ok = true;
+    for (size_t written = 0; ok && written < out.size();) {
+        ssize_t n = write(fd, out.data() + written, out.size() - written);
+        if (n < 0 && errno == EINTR) continue;
+        ok = n > 0;
+        if (ok) written += n;
+    }
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(temp.c_str(), path.c_str()) < 0) {
+        unlink(temp.c_str());
+        return -1;
+    }
+    std::lock_guard<std::mutex> guard(lock_);
+    stats_.snapshots++;
+    return 0;
+}
+
+std::vector<std::pair<std::string, unsigned>> DiskCache::indexed_keys() const {
+    std::vector<std::pair<std::string, unsigned>> keys;
+    std::lock_guard<std::mutex> guard(lock_);
+    keys.reserve(index_.size());
+    for (const auto& segment : segments_) {
+        for (const auto& written : segment->keys) {
+            auto it = index_.find(written.first);
+            if (it == index_.end() || it->second.segment != segment || it->second.offset != written.second) continue;
+            keys.emplace_back(written.first, it->second.frequency);
+        }
+    }
+    return keys;
+}
+
+std::shared_ptr<DiskSegment> DiskCache::segment_for(uint64_t length) {
+    if (segments_.back()->used + length <= DISK_SEGMENT_SIZE) {
+        return segments_.back();
+    }
+    if (segments_.size() >= max_segments_) {
+        std::shared_ptr<DiskSegment> oldest = segments_.front();
+        segments_.pop_front();
+        for (const auto& written : oldest->keys) {
+            auto it = index_.find(written.first);
+            if (it != index_.end() && it->second.segment == oldest) index_.erase(it);
+        }
+        oldest->recycled = true;
+        index_changed_ = true;
+        stats_.recycled++;
+        stats_.entries = index_.size();
+    }
+    return create_segment();
+}
+
+void DiskCache::enqueue(const CacheEntryPtr& entry, unsigned frequency, size_t bytes) {
+    queue_.emplace_back(entry, frequency);
+    queued_bytes_ += bytes;
+}
+
+void DiskCache::demote(const CacheEntryPtr& entry, unsigned frequency) {
+    if (!enabled_) return;
+    size_t bytes = entry_bytes(*entry);
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (queued_bytes_ + bytes > DISK_QUEUE_BYTES || bytes > DISK_SEGMENT_SIZE) {
+            stats_.dropped++;
+            return;
+        }
+        enqueue(entry, frequency, bytes);
+    }
+    cv_.notify_one();
+}
+
+void DiskCache::persist(const CacheEntryPtr& entry, unsigned frequency) {
+    if (!enabled_) return;
+    size_t bytes = entry_bytes(*entry);
+    if (bytes > DISK_SEGMENT_SIZE) return;
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        drained_cv_.wait(lock, [&]() { return stopping_ || queued_bytes_ + bytes <= DISK_QUEUE_BYTES; });
+        if (stopping_) return;
+        enqueue(entry, frequency, bytes);
+    }
+    cv_.notify_one();
+}
+
+void DiskCache::writer() {
+    auto next_save = std::chrono::steady_clock::now() + std::chrono::seconds(DISK_SNAPSHOT_INTERVAL);
+    while (true) {
+        std::pair<CacheEntryPtr, unsigned> demoted;
+        bool save = false;
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            cv_.wait_until(lock, next_save, [this]() { return stopping_ || !queue_.empty(); });
+            if (stopping_) return;
+            if (std::chrono::steady_clock::now() >= next_save) {
+                save = index_changed_;
+                next_save = std::chrono::steady_clock::now() + std::chrono::seconds(DISK_SNAPSHOT_INTERVAL);
+            }
+            if (!save) {
+                if (queue_.empty()) continue;
+                demoted = std::move(queue_.front());
+                queue_.pop_front();
+                writing_ = true;
+            }
+        }
+
+        if (save) {
+            // A failed save leaves the last index in place; try again next time
+            if (save_index() < 0) {
+                std::lock_guard<std::mutex> guard(lock_);
+                index_changed_ = true;
+            }
+            continue;
+        }
+
+        write_entry(*demoted.first, demoted.second);
+
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            queued_bytes_ -= entry_bytes(*demoted.first);
+            writing_ = false;
+        }
+        drained_cv_.notify_all();
+    }
+}
+
+void DiskCache::write_entry(const CacheEntry& entry, unsigned frequency) {
+    DiskRecordHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = DISK_RECORD_MAGIC;
+    header.key_len = (uint32_t)entry.key.size();
+    header.etag_len = (uint32_t)entry.freshness.etag.size();
+    header.last_modified_len = (uint32_t)entry.freshness.last_modified.size();
+    header.body_len = entry.data.size();
+    header.expires = (int64_t)entry.freshness.expires;
+    header.delimited = entry.delimited ? 1 : 0;
+    header.sliced = entry.sliced_length != 0 ? 1 : 0;
+
+    iovec_t iov[MAX_SEND_IOV];
+    size_t n = 0;
+    set_iovec(iov[n++], (const char*)&header, sizeof(header));
+    set_iovec(iov[n++], entry.key.data(), entry.key.size());
+    set_iovec(iov[n++], entry.freshness.etag.data(), entry.freshness.etag.size());
+    set_iovec(iov[n++], entry.freshness.last_modified.data(), entry.freshness.last_modified.size());
+
+    Checksum sum;
+    for (size_t i = 1; i < n; i++) sum.update((const char*)iov[i].iov_base, iov[i].iov_len);
+    for (size_t off = 0; off < entry.data.size();) {
+        iovec_t body[MAX_SEND_IOV];
+        size_t count = entry.data.fill_iov(off, body, MAX_SEND_IOV);
+        for (size_t i = 0; i < count; i++) {
+            sum.update((const char*)body[i].iov_base, body[i].iov_len);
+            off += body[i].iov_len;
+        }
+    }
+    header.checksum = sum.value();
+
+    uint64_t length = entry_bytes(entry);
+    std::shared_ptr<DiskSegment> segment;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        segment = segment_for(length);
+    }
+    if (!segment) return;
+
+    // Header and metadata, then the body a batch of slabs at a time
+    uint64_t offset = segment->used;
+    uint64_t pos = offset;
+    bool ok = pwrite_all(segment->fd, iov, n, pos);
+    for (size_t body_off = 0; ok && body_off < entry.data.size();) {
+        size_t count = entry.data.fill_iov(body_off, iov, MAX_SEND_IOV);
+        for (size_t i = 0; i < count; i++) body_off += iov[i].iov_len;
+        ok = pwrite_all(segment->fd, iov, count, pos);
+    }
+
+    std::lock_guard<std::mutex> guard(lock_);
+    // Past the length either way, so a torn record is never reused
+    segment->used = offset + length;
+    if (!ok || segment->recycled) return;
+    index_[entry.key] = Location{segment, offset, length, (uint8_t)std::min(frequency, 255u)};
+    segment->keys.emplace_back(entry.key, offset);
+    index_changed_ = true;
+    stats_.writes++;
+    stats_.bytes_written += length;
+    stats_.entries = index_.size();
+}
+
+CacheEntryPtr DiskCache::take(const CacheKey& key) {
+    if (!enabled_) return nullptr;
+    Location location;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        auto it = index_.find(key.text);
+        if (it == index_.end()) {
+            stats_.misses++;
+            return nullptr;
+        }
+        location = std::move(it->second);
+        index_.erase(it);
+        index_changed_ = true;
+        stats_.entries = index_.size();
+    }
+
+    // Copy out of the mapping; the segment stays mapped while location holds it
+    const char* record = location.segment->map + location.offset;
+    DiskRecordHeader header;
+    memcpy(&header, record, sizeof(header));
+    uint64_t length = sizeof(header) + (uint64_t)header.key_len + header.etag_len + header.last_modified_len + header.body_len;
+    const char* p = record + sizeof(header);
+    Checksum sum;
+    bool valid = header.magic == DISK_RECORD_MAGIC && length == location.length;
+    if (valid) {
+        sum.update(p, length - sizeof(header));
+        valid = header.checksum == sum.value() && std::string_view(p, header.key_len) == key.text;
+    }
+    if (!valid) {
+        std::lock_guard<std::mutex> guard(lock_);
+        stats_.corrupt++;
+        stats_.misses++;
+        return nullptr;
+    }
+
+    CacheEntry entry;
+    entry.key.assign(p, header.key_len);
+    p += header.key_len;
+    entry.hash = key.hash;
+    entry.freshness.storable = true;
+    entry.freshness.expires = (time_t)header.expires;
+    entry.freshness.etag.assign(p, header.etag_len);
+    p += header.etag_len;
+    entry.freshness.last_modified.assign(p, header.last_modified_len);
+    p += header.last_modified_len;
+    entry.data.append(p, header.body_len);
+    entry.data.shrink_to_fit();
+    entry.delimited = header.delimited != 0;
+    if (header.sliced) {
+        std::string head = entry.data.copy(0, entry.data.size());
+        entry.sliced_length = strtoull(std::string(find_response_header(head, "Content-Length")).c_str(), nullptr, 10);
+    }
+
+    std::lock_guard<std::mutex> guard(lock_);
+    if (!entry.revalidatable() && !entry.fresh(time(NULL))) {
+        stats_.misses++;
+        return nullptr;
+    }
+    stats_.hits++;
+    return make_cache_entry(std::move(entry));
+}
+
+void DiskCache::flush() {
+    std::unique_lock<std::mutex> lock(lock_);
+    drained_cv_.wait(lock, [this]() { return stopping_ || (queue_.empty() && !writing_); });
+}
+
+#else
+
+struct DiskSegment {};
+
+DiskCache::~DiskCache() {}
+
+int DiskCache::open(const std::string& dir, uint64_t capacity) {
+    (void)dir;
+    (void)capacity;
+    return -1;
+}
+
+void DiskCache::demote(const CacheEntryPtr& entry, unsigned frequency) {
+    (void)entry;
+    (void)frequency;
+}
+
+void DiskCache::persist(const CacheEntryPtr& entry, unsigned frequency) {
+    (void)entry;
+    (void)frequency;
+}
+
+int DiskCache::save_index() {
+    return -1;
+}
+
+std::vector<std::pair<std::string, unsigned>> DiskCache::indexed_keys() const {
+    return {};
+}
+
+CacheEntryPtr DiskCache::take(const CacheKey& key) {
+    (void)key;
+    return nullptr;
+}
+
+void DiskCache::flush() {}
+
+#endif
+
+DiskStats DiskCache::stats() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return stats_;
+}
@@ -0,0 +1,148 @@
+/*
+ * proxy_disk.h -- log-structured on-disk second tier under the memory cache.
+ */
+#include "proxy_cache.h"
+#include <string>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+#ifndef PROXY_DISK
+#define PROXY_DISK
+
+#define DISK_SEGMENT_SIZE (64*(1<<20))       //bytes per segment file
+#define DISK_QUEUE_BYTES (64*(1<<20))        //demoted bytes waiting to be written before more are dropped
+#define DISK_CACHE_DEFAULT_SIZE (4ULL<<30)   //capacity when --disk-cache-size isn't given
+#define DISK_SNAPSHOT_INTERVAL 60            //seconds between saves of the index
+#define DISK_INDEX_FILE "index.dat"
+
+// Counters exposed by DiskCache.
+struct DiskStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t writes = 0;          // entries appended to a segment
+    size_t bytes_written = 0;
+    size_t dropped = 0;         // demotions discarded because the write queue was full
+    size_t corrupt = 0;         // records that failed their checksum on read
+    size_t recycled = 0;        // segments deleted to make room
+    size_t restored = 0;        // entries reloaded from an earlier run's index
+    size_t snapshots = 0;       // times the index was saved
+    size_t entries = 0;
+    size_t segments = 0;
+};
+
+struct DiskSegment;
+
+/*
+   DiskCache keeps entries evicted from the memory cache in a directory of
+   DISK_SEGMENT_SIZE segment files. Entries are only ever appended, to the
+   newest segment, by a background writer thread, so demoting an entry
+   costs the memory cache nothing but a queue push. Segments are memory
+   mapped and reads copy straight out of the mapping. An in-memory index maps
+   each key to its record. When the directory would exceed its capacity, the
+   oldest segment is deleted whole with everything in it (FIFO, as in any
+   log-structured store).
+
+   A hit is taken out of the disk tier and promoted back into memory; the
+   record it leaves behind is dead space until its segment is recycled.
+   Every record carries a checksum of its bytes, verified when it is read.
+
+   The index is saved to DISK_INDEX_FILE every DISK_SNAPSHOT_INTERVAL
+   seconds and on a graceful shutdown. open() maps a saved index and reopens
+   the segments it names, so a restarted proxy has its old entries back
+   without reading them: a record is only paged in when its key is asked for.
+   An index that fails its checksum is ignored and the directory starts
+   empty. Records written after the last save are lost with a crash; their
+   space comes back when their segment is recycled.
+
+   POSIX only; open() fails on Windows.
+ */
+class DiskCache {
+public:
+    DiskCache() = default;
+    ~DiskCache();
+
+    // Disable copy and assignment
+    DiskCache(const DiskCache&) = delete;
+    DiskCache& operator=(const DiskCache&) = delete;
+
+    // Uses dir (created if missing) for up to capacity bytes of segments,
+    // reloading the entries named by its saved index and deleting any other
+    // segments. Returns 0, or -1 on error.
+    int open(const std::string& dir, uint64_t capacity);
+
+    bool enabled() const { return enabled_; }
+
+    // Queues entry to be written to disk, with the memory cache's access
+    // frequency for it. Dropped if the queue is full.
+    void demote(const CacheEntryPtr& entry, unsigned frequency = 0);
+
+    // Like demote(), but waits for room in the queue rather than dropping.
+    void persist(const CacheEntryPtr& entry, unsigned frequency);
+
+    // Removes and returns the entry stored under key, or nullptr if there is
+    // none (or it is corrupt, or stale with nothing to revalidate it with).
+    CacheEntryPtr take(const CacheKey& key);
+
+    // Blocks until everything queued so far is written.
+    void flush();
+
+    // Writes the index to DISK_INDEX_FILE, replacing the last one only once
+    // the new one is complete. Returns 0, or -1 on error.
+    int save_index();
+
+    // The indexed keys, oldest first, with their access frequencies.
+    std::vector<std::pair<std::string, unsigned>> indexed_keys() const;
+
+    DiskStats stats() const;
+
+private:
+    struct Location {
+        std::shared_ptr<DiskSegment> segment;
+        uint64_t offset;
+        uint64_t length;
+        uint8_t frequency;
+    };
+
+    void writer();
+    void write_entry(const CacheEntry& entry, unsigned frequency);
+    // Makes sure the newest segment has room for length more bytes, starting
+    // a new segment and recycling the oldest as needed. Called with lock_ held.
+    std::shared_ptr<DiskSegment> segment_for(uint64_t length);
+    std::shared_ptr<DiskSegment> create_segment();
+    // Maps segment id, creating it empty or reopening it as left by an
+    // earlier run. Returns nullptr on error.
+    std::shared_ptr<DiskSegment> map_segment(uint64_t id, bool create);
+    // Reloads the saved index and the segments it names. Returns -1 if there
+    // is no usable index. Called with lock_ held.
+    int load_index();
+    void enqueue(const CacheEntryPtr& entry, unsigned frequency, size_t bytes);
+
+    mutable std::mutex lock_;
+    std::condition_variable cv_;
+    std::condition_variable drained_cv_;
+    std::deque<std::pair<CacheEntryPtr, unsigned>> queue_;
+    size_t queued_bytes_ = 0;
+    bool writing_ = false;
+    bool stopping_ = false;
+    bool enabled_ = false;
+    bool index_changed_ = false;        // since the last save
+    std::thread writer_;
+    std::mutex save_lock_;              // one save_index() at a time
+
+    std::string dir_;
+    size_t max_segments_ = 0;
+    uint64_t next_segment_id_ = 0;
+    std::deque<std::shared_ptr<DiskSegment>> segments_;    // oldest first; the back one is written to
+    std::unordered_map<std::string, Location> index_;
+    DiskStats stats_;
+};
+
+#endif
@@ -0,0 +1,1120 @@
+/*
+  proxy_event_loop.cpp -- epoll event loops for the proxy server (Linux only).
+*/
+
+#include "proxy_event_loop.h"
+
+#ifdef __linux__
+
+#include "proxy_server_with_cache.h"
+#include "proxy_slices.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <unordered_set>
+#include <unordered_map>
+#include <chrono>
+#include <ctime>
+#include <cstdlib>
+
+#define MAX_EVENTS 256
+#define RELAY_HIGH_WATER (256*1024)     //stop reading the origin while this much is unsent to the client
+
+namespace {
+
+enum class ConnState {
+    READ_REQUEST,    // reading the client's next request
+    RESOLVE_ORIGIN,  // waiting for the resolver to look up the origin's name
+    CONNECT_ORIGIN,  // waiting for a non-blocking connect to the origin
+    WRITE_ORIGIN,    // sending the rewritten request to the origin
+    RELAY,           // forwarding the origin's (or an in-flight fetch's) response to the client
+    WRITE_CLIENT,    // sending a cache hit or an error page
+    TUNNEL,          // relaying a CONNECT tunnel both ways
+    SLICES,          // sending a large object's slices, or a range of a cached entry
+};
+
+struct Connection;
+
+// epoll_event.data.ptr points at one of these, so a wakeup knows which
+// socket of which connection fired.
+struct Endpoint {
+    Connection* conn;
+    bool origin;
+    uint32_t events = 0;    // interest currently registered with epoll
+};
+
+struct Connection {
+    ConnState state = ConnState::READ_REQUEST;
+    int client_fd;
+    std::string client;           // the client's address, for the access log
+    int origin_fd = -1;
+    Endpoint client_ep{this, false};
+    Endpoint origin_ep{this, true};
+
+    std::string in;               // bytes read from the client and not yet served
+    long request_len = 0;         // length of the request being served, at the front of in
+    ParsedRequest request;        // parsed in place from in, resuming as bytes arrive
+    int requests_served = 0;
+    bool keep_alive = false;      // the client asked to reuse the connection
+    bool eof = false;             // the client has sent all it will
+    time_t last_active;
+    std::string origin_out;       // request bytes for the origin
+    size_t origin_off = 0;
+
+    // Bytes for the client. On a hit out shares the pinned entry's slabs and
+    // for a follower the fetch's; otherwise it holds the origin's response as
+    // read, or an error page.
+    CacheEntryPtr hit;
+    BufferChain out;
+    size_t out_off = 0;
+    // A response too large to cache that nobody follows isn't held: out is
+    // emptied as it is sent, and out_base counts the bytes dropped
+    bool streaming = false;
+    size_t out_base = 0;
+    ResponseFramer framer;
+    bool origin_pooled = false;   // origin_fd came from upstream_pool
+    uint64_t resolve_id = 0;      // key in LoopThread::resolving_ while in RESOLVE_ORIGIN
+    size_t origin_bytes = 0;      // response bytes read from the current origin_fd
+    // When the origin connect began, then when the request to it was sent
+    std::chrono::steady_clock::time_point origin_started;
+    time_t origin_active = 0;     // when the origin last made progress, for ORIGIN_TIMEOUT
+    bool origin_done = false;
+    bool cacheable = false;
+    bool head_seen = false;       // the response's status has been looked at
+    bool oversized = false;       // the response is too large to cache whole
+    // A CONNECT: once the origin is connected, both sockets belong to tunnel
+    bool connect = false;
+    std::unique_ptr<TunnelRelay> tunnel;
+    // In SLICES, where the response comes from; send_blocked once the
+    // client's socket is full
+    std::unique_ptr<SliceReader> slices;
+    bool send_blocked = false;
+
+    // A miss either leads the single origin fetch for its key, publishing the
+    // response to lead, or follows another connection's fetch. A leader with
+    // a stale entry asks the origin to revalidate it.
+    CacheKey key;
+    CacheEntryPtr stale;
+    InflightFetchPtr lead;
+    InflightFetchPtr follow;
+
+    bool closed = false;          // closed this epoll batch; deleted after it
+    // When the current request was started; unset once it has been logged
+    std::chrono::steady_clock::time_point started;
+
+    Connection(int fd, std::string addr) : client_fd(fd), client(std::move(addr)), last_active(time(NULL)) {}
+
+    // Drops the served request and readies for the next one on the connection
+    void reset() {
+        in.erase(0, request_len);
+        request_len = 0;
+        request.reset();
+        origin_out.clear();
+        origin_off = 0;
+        hit.reset();
+        out.clear();
+        out_off = 0;
+        streaming = false;
+        out_base = 0;
+        framer = ResponseFramer();
+        origin_pooled = false;
+        resolve_id = 0;
+        origin_bytes = 0;
+        origin_done = false;
+        cacheable = false;
+        head_seen = false;
+        oversized = false;
+        slices.reset();
+        send_blocked = false;
+        key = CacheKey();
+        stale.reset();
+        lead.reset();
+        follow.reset();
+        state = ConnState::READ_REQUEST;
+        last_active = time(NULL);
+    }
+
+    // The origin's response is held back, from the client and from any
+    // followers, until its status is in, in case it is a 304 for our
+    // revalidation. Such a 304 is never passed on: the cached copy replaces
+    // it once it is complete.
+    bool holding() const {
+        return state == ConnState::RELAY && !follow && (!framer.has_status() || (stale && framer.status() == 304));
+    }
+
+    size_t pending() const {
+        if (holding()) return 0;
+        return out.size() - out_off;
+    }
+
+    // Response bytes sent to the client so far
+    size_t sent() const { return slices ? slices->sent() : out_base + out_off; }
+};
+
+class LoopThread {
+public:
+    LoopThread(int listen_fd) : listen_fd_(listen_fd) {}
+    void run();
+
+private:
+    void on_accept();
+    void on_client(Connection* c, uint32_t events);
+    void on_origin(Connection* c, uint32_t events);
+    void next_request(Connection* c);
+    void start_request(Connection* c);
+    void start_tunnel(Connection* c);
+    void open_tunnel(Connection* c);
+    void pump_tunnel(Connection* c);
+    void start_origin(Connection* c, bool use_pool);
+    void connect_origin(Connection* c, const ResolvedHost& host);
+    void end_lead(Connection* c, bool ok);
+    void pump_follower(Connection* c);
+    bool slice_origin(Connection* c);
+    void start_slices(Connection* c, std::unique_ptr<SliceReader> reader);
+    void pump_slices(Connection* c);
+    std::function<void()> waker() const;
+    void on_wake();
+    void drop_origin(Connection* c, bool reuse);
+    void send_error(Connection* c, int status_code);
+    bool flush_client(Connection* c);
+    void finish(Connection* c);
+    void log_request(Connection* c);
+    void close_connection(Connection* c);
+    void update_interest(Connection* c);
+    void set_events(int fd, Endpoint* ep, uint32_t events);
+    void close_idle();
+    void origin_timeout(Connection* c);
+
+    int listen_fd_;
+    int epfd_ = -1;
+    // Written by other threads when an in-flight fetch this loop follows
+    // gets new bytes or ends.
+    int wake_fd_ = -1;
+    Endpoint wake_ep_{nullptr, false};
+    std::unordered_set<Connection*> conns_;
+    std::unordered_set<Connection*> followers_;
+    // Connections waiting on the resolver, by Connection::resolve_id. A
+    // lookup that finishes after its connection closed finds no entry here.
+    std::unordered_map<uint64_t, Connection*> resolving_;
+    uint64_t next_resolve_id_ = 1;
+    // Answers delivered by resolver threads, picked up on the next wakeup
+    std::mutex resolved_lock_;
+    std::vector<std::pair<uint64_t, ResolvedHostPtr>> resolved_;
+    // Connections closed while handling the current batch of events. Later
+    // events in the batch may still point at them, so they're deleted after.
+    std::vector<Connection*> closed_;
+};
+
+void LoopThread::set_events(int fd, Endpoint* ep, uint32_t events) {
+    if (ep->events == events) return;
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = ep;
+    epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev);
+    ep->events = events;
+}
+
+// Derives both sockets' epoll interest from the connection state.
+void LoopThread::update_interest(Connection* c) {
+    uint32_t client_events = 0;
+    uint32_t origin_events = 0;
+
+    switch (c->state) {
+        case ConnState::READ_REQUEST:
+            client_events = EPOLLIN;
+            break;
+        case ConnState::RESOLVE_ORIGIN:
+            // Nothing to wait for on either socket; errors still arrive
+            break;
+        case ConnState::CONNECT_ORIGIN:
+        case ConnState::WRITE_ORIGIN:
+            origin_events = EPOLLOUT;
+            break;
+        case ConnState::RELAY:
+            if (c->pending() > 0) client_events = EPOLLOUT;
+            if (!c->origin_done && c->pending() < RELAY_HIGH_WATER) origin_events = EPOLLIN;
+            break;
+        case ConnState::WRITE_CLIENT:
+            client_events = EPOLLOUT;
+            break;
+        case ConnState::SLICES:
+            // A slice still arriving wakes the loop through its fetch
+            if (c->send_blocked) client_events = EPOLLOUT;
+            break;
+        case ConnState::TUNNEL:
+            if (c->tunnel->wants_read(TunnelRelay::CLIENT)) client_events |= EPOLLIN;
+            if (c->tunnel->wants_write(TunnelRelay::CLIENT)) client_events |= EPOLLOUT;
+            if (c->tunnel->wants_read(TunnelRelay::ORIGIN)) origin_events |= EPOLLIN;
+            if (c->tunnel->wants_write(TunnelRelay::ORIGIN)) origin_events |= EPOLLOUT;
+            break;
+    }
+
+    set_events(c->client_fd, &c->client_ep, client_events);
+    if (c->origin_fd >= 0) set_events(c->origin_fd, &c->origin_ep, origin_events);
+}
+
+// Records the current request in the access log and metrics, once.
+void LoopThread::log_request(Connection* c) {
+    if (c->started == std::chrono::steady_clock::time_point()) return;
+    if (c->tunnel) {
+        // The relay records its own metrics
+        log_access(c->client.c_str(), c->key.url(), "TUNNEL", c->tunnel->bytes_to_client(),
+                   std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - c->started).count());
+        c->started = std::chrono::steady_clock::time_point();
+        return;
+    }
+    RequestOutcome outcome;
+    if (c->hit) outcome = c->stale ? RequestOutcome::REVALIDATED : RequestOutcome::HIT;
+    else if (c->follow) outcome = RequestOutcome::COALESCED;
+    else if (c->state == ConnState::WRITE_CLIENT) outcome = RequestOutcome::ERR;    // an error page
+    else outcome = RequestOutcome::MISS;
+    auto latency = std::chrono::steady_clock::now() - c->started;
+    metrics_record_request(outcome, c->sent(), latency);
+    log_access(c->client.c_str(), c->key.url(), outcome_name(outcome), c->sent(),
+               std::chrono::duration<double, std::milli>(latency).count());
+    c->started = std::chrono::steady_clock::time_point();
+}
+
+void LoopThread::close_connection(Connection* c) {
+    if (c->closed) return;
+    c->closed = true;
+    log_request(c);
+    if (c->lead) end_lead(c, false);
+    followers_.erase(c);
+    if (c->resolve_id) resolving_.erase(c->resolve_id);
+    if (c->origin_fd >= 0) {
+        epoll_ctl(epfd_, EPOLL_CTL_DEL, c->origin_fd, nullptr);
+        close_socket(c->origin_fd);
+    }
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, c->client_fd, nullptr);
+    shutdown(c->client_fd, SD_BOTH);
+    close_socket(c->client_fd);
+    conns_.erase(c);
+    closed_.push_back(c);
+    log_message(LogLevel::DEBUG, "Client connection closed.");
+}
+
+void LoopThread::on_accept() {
+    while (true) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int fd = accept4(listen_fd_, (struct sockaddr*)&client_addr, &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_message(LogLevel::ERR, "Error in Accepting connection !");
+            }
+            return;
+        }
+        // Relayed pieces go out as they're written, not after an ACK
+        set_nodelay(fd);
+
+        char str[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, str, INET_ADDRSTRLEN);
+        log_message(LogLevel::DEBUG, "Client is connected with port number: %u and ip address: %s", (unsigned)ntohs(client_addr.sin_port), str);
+
+        Connection* c = new Connection(fd, std::string(str) + ":" + std::to_string(ntohs(client_addr.sin_port)));
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &c->client_ep;
+        c->client_ep.events = EPOLLIN;
+        if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close_socket(fd);
+            delete c;
+            continue;
+        }
+        conns_.insert(c);
+    }
+}
+
+void LoopThread::send_error(Connection* c, int status_code) {
+    if (c->lead) end_lead(c, false);
+    if (c->follow || c->slices) {
+        followers_.erase(c);
+        c->follow.reset();
+        c->slices.reset();
+    }
+    c->hit.reset();
+    c->out.clear();
+    c->out.append(error_response(status_code));
+    c->out_off = 0;
+    c->cacheable = false;
+    c->state = ConnState::WRITE_CLIENT;
+    if (flush_client(c)) update_interest(c);
+}
+
+// Writes as much pending output to the client as the socket takes. Returns
+// false if the connection was closed.
+bool LoopThread::flush_client(Connection* c) {
+    while (c->pending() > 0) {
+        ssize_t n = send_chain(c->client_fd, c->out, c->out_off);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            if (errno == EINTR) continue;
+            log_message(LogLevel::WARN, "Error in sending data to client socket.");
+            close_connection(c);
+            return false;
+        }
+        c->out_off += n;
+    }
+    if (c->streaming) {
+        c->out_base += c->out_off;
+        c->out_off = 0;
+        c->out.clear();
+    }
+
+    if (c->state == ConnState::WRITE_CLIENT || (c->state == ConnState::RELAY && c->origin_done)) {
+        finish(c);
+        return false;
+    }
+    return true;
+}
+
+// Completes the current request, then either closes the connection or moves
+// on to the client's next request.
+void LoopThread::finish(Connection* c) {
+    log_request(c);
+    bool delimited = false;
+    if (c->slices) {
+        // Every response a reader makes carries its length
+        delimited = true;
+        followers_.erase(c);
+    }
+    else if (c->hit) {
+        delimited = c->hit->delimited;
+        log_message(LogLevel::DEBUG, "Data retrieved from the Cache");
+    }
+    else if (c->follow) {
+        delimited = c->follow->delimited();
+        followers_.erase(c);
+        log_message(LogLevel::DEBUG, "Data retrieved from an in-flight fetch");
+    }
+    else if (c->state == ConnState::RELAY) {
+        delimited = c->framer.delimited();
+        if (c->cacheable && add_cache_element(std::move(c->out), c->request, delimited)) {
+            log_message(LogLevel::DEBUG, "Request handled and cached.");
+        }
+    }
+
+    // The client can only find the end of a response that carried its length
+    if (!delimited || !c->keep_alive || c->requests_served >= MAX_REQUESTS_PER_CONNECTION) {
+        close_connection(c);
+        return;
+    }
+    c->reset();
+    next_request(c);
+}
+
+// Starts on the next request if it is already buffered (pipelined), or waits
+// for more bytes from the client.
+void LoopThread::next_request(Connection* c) {
+    c->request_len = c->request.parse(c->in.data(), c->in.size());
+    if (c->request_len < 0) {
+        log_message(LogLevel::WARN, "Parsing failed");
+        send_error(c, 400);
+        return;
+    }
+    if (c->request_len == 0) {
+        // The client went away, or is sending more than any request can be
+        if (c->eof) {
+            close_connection(c);
+            return;
+        }
+        if (c->in.size() > MAX_CLIENT_BUFFER) {
+            log_message(LogLevel::WARN, "Request too long");
+            send_error(c, 400);
+            return;
+        }
+        update_interest(c);
+        return;
+    }
+    start_request(c);
+}
+
+void LoopThread::start_request(Connection* c) {
+    c->requests_served++;
+    c->started = std::chrono::steady_clock::now();
+    c->key = cache.key_for(c->request);
+
+    if (c->request.get_method() == "CONNECT") {
+        start_tunnel(c);
+        return;
+    }
+    if (c->request.get_method() != "GET") {
+        log_message(LogLevel::DEBUG, "This code doesn't support any method other than GET");
+        send_error(c, 501);
+        return;
+    }
+    if (c->request.get_host().empty() || c->request.get_path().empty() || checkHTTPversion(c->request.get_version()) != 1) {
+        send_error(c, 500);
+        return;
+    }
+
+    c->keep_alive = client_keep_alive(c->request);
+    c->hit = find(c->key);
+    // A stale entry, or one the client wants checked, goes to the origin for revalidation
+    if (c->hit && (!c->hit->fresh(time(NULL)) || request_wants_revalidation(c->request))) {
+        c->stale = std::move(c->hit);
+        c->hit.reset();
+    }
+    if (c->hit) {
+        // Slices, or a range, are sent a piece at a time
+        if (std::unique_ptr<SliceReader> reader = open_cached(c->request, c->hit)) {
+            start_slices(c, std::move(reader));
+            return;
+        }
+        c->out = c->hit->data;
+        c->out_off = 0;
+        c->state = ConnState::WRITE_CLIENT;
+        if (flush_client(c)) update_interest(c);
+        return;
+    }
+
+    // Only the first miss for a key goes to the origin; concurrent misses
+    // follow its fetch. A range of an object we can't serve is the origin's
+    // to answer, and its 206 can't be shared or cached, so it gets a fetch
+    // of its own.
+    bool leader = true;
+    InflightFetchPtr fetch;
+    if (c->request.get_header("Range") != nullptr) {
+        fetch = std::make_shared<InflightFetch>();
+        c->stale.reset();
+    }
+    else {
+        fetch = inflight.join(c->key.text, leader);
+    }
+    if (!leader) {
+        c->follow = std::move(fetch);
+        c->follow->watch(this, waker());
+        followers_.insert(c);
+        c->state = ConnState::RELAY;
+        pump_follower(c);
+        return;
+    }
+    c->lead = std::move(fetch);
+    origin_request(c->request, c->stale.get(), c->origin_out);
+    start_origin(c, true);
+}
+
+// Connects to a CONNECT request's target, if its port is allowed; the
+// tunnel opens once the connect completes.
+void LoopThread::start_tunnel(Connection* c) {
+    if (checkHTTPversion(c->request.get_version()) != 1) {
+        send_error(c, 500);
+        return;
+    }
+    if (!tunnel_admit(origin_port(c->request))) {
+        log_message(LogLevel::DEBUG, "CONNECT to port %d is not allowed", origin_port(c->request));
+        send_error(c, 403);
+        return;
+    }
+    c->connect = true;
+    start_origin(c, false);
+}
+
+// Hands both sockets to a relay, which first tells the client the tunnel is
+// up and passes on anything the client sent after its CONNECT head.
+void LoopThread::open_tunnel(Connection* c) {
+    c->tunnel.reset(new TunnelRelay(c->client_fd, c->origin_fd, TUNNEL_ESTABLISHED, c->in.substr(c->request_len)));
+    c->in.clear();
+    c->state = ConnState::TUNNEL;
+    pump_tunnel(c);
+}
+
+void LoopThread::pump_tunnel(Connection* c) {
+    if (c->tunnel->pump()) update_interest(c);
+    else close_connection(c);
+}
+
+// Ends this connection's leadership of its in-flight fetch, completing it for
+// followers if ok and failing them otherwise.
+void LoopThread::end_lead(Connection* c, bool ok) {
+    if (ok) c->lead->complete(c->hit ? c->hit->delimited : c->framer.delimited());
+    else c->lead->fail();
+    inflight.remove(c->key.text, c->lead);
+    c->lead.reset();
+}
+
+// Shares whatever the followed fetch has published into the client's output
+// and pushes it on.
+void LoopThread::pump_follower(Connection* c) {
+    FetchState state = c->follow->read(c->out, false);
+
+    if (state == FetchState::FAILED) {
+        // Nothing sent yet, so the client can still get a clean error
+        if (c->out_off == 0) send_error(c, 500);
+        else close_connection(c);
+        return;
+    }
+    if (state == FetchState::DONE) {
+        if (CacheEntryPtr head = c->follow->sliced()) {
+            std::unique_ptr<SliceReader> reader = open_cached(c->request, head);
+            if (reader) start_slices(c, std::move(reader));
+            else send_error(c, 500);
+            return;
+        }
+        c->origin_done = true;
+    }
+    if (flush_client(c)) update_interest(c);
+}
+
+// A callback for other threads to wake this loop with
+std::function<void()> LoopThread::waker() const {
+    int wake_fd = wake_fd_;
+    return [wake_fd]() {
+        uint64_t one = 1;
+        ssize_t rc = write(wake_fd, &one, sizeof(one));
+        (void)rc;
+    };
+}
+
+// Once the head of the origin's response is in: if it is a large object to
+// cache in slices, hands the origin connection to a slice fetcher and serves
+// the client from the slices. Returns true if it did.
+bool LoopThread::slice_origin(Connection* c) {
+    if (slice_length(c->out.copy(0, c->framer.head_length())) == 0) return false;
+
+    // The fetcher reads it blocking, and may close it at once, so the loop
+    // lets go of it first
+    int fd = c->origin_fd;
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    CacheEntryPtr head = slice_response(fd, c->request, c->framer, c->out);
+    if (head == nullptr) {
+        fcntl(fd, F_SETFL, flags);
+        struct epoll_event ev;
+        ev.events = c->origin_ep.events;
+        ev.data.ptr = &c->origin_ep;
+        epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev);
+        return false;
+    }
+    c->origin_fd = -1;
+    c->origin_ep.events = 0;
+    c->lead->complete_sliced(head);
+    inflight.remove(c->key.text, c->lead);
+    c->lead.reset();
+    c->cacheable = false;
+    c->out.clear();
+
+    std::unique_ptr<SliceReader> reader = open_cached(c->request, head);
+    if (reader) start_slices(c, std::move(reader));
+    else send_error(c, 500);
+    return true;
+}
+
+void LoopThread::start_slices(Connection* c, std::unique_ptr<SliceReader> reader) {
+    c->slices = std::move(reader);
+    c->slices->watch(this, waker());
+    followers_.insert(c);
+    c->state = ConnState::SLICES;
+    pump_slices(c);
+}
+
+// Sends what the reader has ready until the client's socket fills or the
+// reader has to wait for a slice.
+void LoopThread::pump_slices(Connection* c) {
+    while (true) {
+        size_t from, to;
+        SliceState state = c->slices->read(from, to, false);
+        if (state == SliceState::DONE) {
+            finish(c);
+            return;
+        }
+        if (state == SliceState::FAILED) {
+            log_message(LogLevel::WARN, "A slice of a cached object couldn't be fetched.");
+            // Nothing sent yet, so the client can still get a clean error
+            if (c->slices->sent() == 0) send_error(c, 500);
+            else close_connection(c);
+            return;
+        }
+        if (state == SliceState::WAIT) {
+            c->send_blocked = false;
+            update_interest(c);
+            return;
+        }
+        ssize_t n = send_chain(c->client_fd, c->slices->chain(), from, to);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                c->send_blocked = true;
+                update_interest(c);
+                return;
+            }
+            log_message(LogLevel::WARN, "Error in sending data to client socket.");
+            close_connection(c);
+            return;
+        }
+        c->slices->consumed(n);
+    }
+}
+
+void LoopThread::on_wake() {
+    uint64_t count;
+    ssize_t rc = read(wake_fd_, &count, sizeof(count));
+    (void)rc;
+
+    // pump_follower can finish or close a follower, so walk a copy
+    std::vector<Connection*> followers(followers_.begin(), followers_.end());
+    for (Connection* c : followers) {
+        if (c->closed) continue;
+        if (c->slices) pump_slices(c);
+        else if (c->follow) pump_follower(c);
+    }
+
+    std::vector<std::pair<uint64_t, ResolvedHostPtr>> resolved;
+    {
+        std::lock_guard<std::mutex> guard(resolved_lock_);
+        resolved.swap(resolved_);
+    }
+    for (auto& answer : resolved) {
+        auto it = resolving_.find(answer.first);
+        if (it == resolving_.end()) continue;
+        Connection* c = it->second;
+        resolving_.erase(it);
+        c->resolve_id = 0;
+        connect_origin(c, *answer.second);
+    }
+}
+
+// Detaches origin_fd from the connection, returning it to upstream_pool when
+// reuse is set and closing it otherwise.
+void LoopThread::drop_origin(Connection* c, bool reuse) {
+    if (c->origin_fd < 0) return;
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, c->origin_fd, nullptr);
+    if (reuse) upstream_pool.release(c->request.get_host(), origin_port(c->request), c->origin_fd);
+    else close_socket(c->origin_fd);
+    c->origin_fd = -1;
+    c->origin_ep.events = 0;
+}
+
+void LoopThread::start_origin(Connection* c, bool use_pool) {
+    c->origin_off = 0;
+    c->origin_bytes = 0;
+    c->origin_active = time(NULL);
+
+    if (use_pool) {
+        int fd = upstream_pool.acquire(c->request.get_host(), origin_port(c->request));
+        if (fd >= 0) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            c->origin_fd = fd;
+            c->origin_pooled = true;
+            struct epoll_event ev;
+            ev.events = EPOLLOUT;
+            ev.data.ptr = &c->origin_ep;
+            c->origin_ep.events = EPOLLOUT;
+            epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev);
+            c->state = ConnState::WRITE_ORIGIN;
+            update_interest(c);
+            return;
+        }
+    }
+    c->origin_pooled = false;
+
+    // Resolve the origin's name off the loop unless the answer is cached
+    ResolvedHostPtr host = resolver.cached(c->request.get_host());
+    if (host) {
+        connect_origin(c, *host);
+        return;
+    }
+    c->resolve_id = next_resolve_id_++;
+    resolving_[c->resolve_id] = c;
+    c->state = ConnState::RESOLVE_ORIGIN;
+    update_interest(c);
+
+    uint64_t id = c->resolve_id;
+    resolver.resolve(c->request.get_host(), [this, id](ResolvedHostPtr answer) {
+        {
+            std::lock_guard<std::mutex> guard(resolved_lock_);
+            resolved_.emplace_back(id, std::move(answer));
+        }
+        uint64_t one = 1;
+        ssize_t rc = write(wake_fd_, &one, sizeof(one));
+        (void)rc;
+    });
+}
+
+// Starts a non-blocking connect to the first address of host.
+void LoopThread::connect_origin(Connection* c, const ResolvedHost& host) {
+    if (host.addrs.empty()) {
+        log_message(LogLevel::WARN, "No such host exists.");
+        send_error(c, 500);
+        return;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_message(LogLevel::WARN, "Error in Creating Socket.");
+        send_error(c, 500);
+        return;
+    }
+    struct sockaddr_in server_addr = host.addrs.front();
+    server_addr.sin_port = htons(origin_port(c->request));
+    c->origin_started = std::chrono::steady_clock::now();
+    int rc = connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr));
+    if (rc < 0 && errno != EINPROGRESS) {
+        close_socket(fd);
+        log_message(LogLevel::WARN, "Error in connecting !");
+        send_error(c, 500);
+        return;
+    }
+
+    c->origin_fd = fd;
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = &c->origin_ep;
+    c->origin_ep.events = EPOLLOUT;
+    epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev);
+    c->state = ConnState::CONNECT_ORIGIN;
+    update_interest(c);
+}
+
+void LoopThread::on_client(Connection* c, uint32_t events) {
+    if (events & EPOLLERR) {
+        close_connection(c);
+        return;
+    }
+
+    if (c->state == ConnState::TUNNEL) {
+        pump_tunnel(c);
+        return;
+    }
+    if (c->state == ConnState::SLICES) {
+        if (events & EPOLLOUT) pump_slices(c);
+        else if (events & EPOLLHUP) close_connection(c);
+        return;
+    }
+    if (c->state == ConnState::READ_REQUEST) {
+        // Reads no further ahead than any one request could need; the rest
+        // waits in the socket until the buffered requests are served
+        char buf[MAX_BYTES];
+        while (!c->eof && c->in.size() <= MAX_CLIENT_BUFFER) {
+            ssize_t n = recv(c->client_fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                c->in.append(buf, n);
+                c->last_active = time(NULL);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n < 0) {
+                close_connection(c);
+                return;
+            }
+            // A half-close: the requests already sent are still answered
+            c->eof = true;
+        }
+        next_request(c);
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        if (flush_client(c)) {
+            // Pick up anything a followed fetch published since the last wakeup
+            if (c->follow) pump_follower(c);
+            else update_interest(c);
+        }
+        return;
+    }
+    if (events & EPOLLHUP) {
+        close_connection(c);
+    }
+}
+
+void LoopThread::on_origin(Connection* c, uint32_t events) {
+    if (c->state == ConnState::TUNNEL) {
+        // Reset by the origin
+        if (events & EPOLLERR) close_connection(c);
+        else pump_tunnel(c);
+        return;
+    }
+    if (c->state == ConnState::CONNECT_ORIGIN) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->origin_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            log_message(LogLevel::WARN, "Error in connecting !");
+            send_error(c, 500);
+            return;
+        }
+        metrics_record_origin(OriginStage::CONNECT, std::chrono::steady_clock::now() - c->origin_started);
+        if (c->connect) {
+            open_tunnel(c);
+            return;
+        }
+        c->state = ConnState::WRITE_ORIGIN;
+    }
+
+    if (c->state == ConnState::WRITE_ORIGIN) {
+        while (c->origin_off < c->origin_out.size()) {
+            ssize_t n = send(c->origin_fd, c->origin_out.data() + c->origin_off, c->origin_out.size() - c->origin_off, 0);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+                if (errno == EINTR) continue;
+                if (c->origin_pooled) {
+                    // The pooled connection went stale while idle
+                    drop_origin(c, false);
+                    start_origin(c, false);
+                    return;
+                }
+                send_error(c, 500);
+                return;
+            }
+            c->origin_off += n;
+            c->origin_active = time(NULL);
+        }
+        c->origin_started = std::chrono::steady_clock::now();
+        c->state = ConnState::RELAY;
+        c->cacheable = true;
+        update_interest(c);
+        return;
+    }
+
+    // RELAY: read what the origin has straight into the response chain, then
+    // push it on to the client
+    while (c->pending() < RELAY_HIGH_WATER) {
+        size_t avail;
+        char* buf = c->out.reserve(avail);
+        ssize_t n = recv(c->origin_fd, buf, avail, 0);
+        if (n > 0) {
+            if (c->origin_bytes == 0) metrics_record_origin(OriginStage::FIRST_BYTE, std::chrono::steady_clock::now() - c->origin_started);
+            c->origin_bytes += n;
+            c->origin_active = time(NULL);
+            // Only keep and forward the bytes that belong to this response
+            size_t used = c->framer.feed(buf, n);
+            c->out.commit(used);
+            bool too_large = c->out.size() > MAX_ELEMENT_SIZE;
+            if (!c->head_seen && c->framer.has_status()) {
+                c->head_seen = true;
+                if (slice_origin(c)) return;
+                std::string length(find_response_header(c->out.copy(0, c->framer.head_length()), "Content-Length"));
+                too_large = too_large || strtoull(length.c_str(), nullptr, 10) > MAX_ELEMENT_SIZE;
+            }
+            if (too_large && !c->oversized) {
+                c->oversized = true;
+                c->cacheable = false;
+                // It won't be cached, so once nobody else is following it
+                // there is no need to hold it
+                if (c->lead && inflight.remove_unshared(c->key.text, c->lead)) {
+                    c->lead.reset();
+                    c->streaming = true;
+                }
+            }
+            if (c->lead && !c->holding()) c->lead->publish(c->out);
+            if (c->framer.complete() || c->framer.failed()) {
+                c->origin_done = true;
+                break;
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (c->origin_pooled && c->origin_bytes == 0) {
+            // The pooled connection went stale while idle; retry on a fresh one
+            drop_origin(c, false);
+            start_origin(c, false);
+            return;
+        }
+        // A reset isn't the end of a body delimited by close
+        if (n == 0) c->framer.on_eof();
+        c->origin_done = true;
+        break;
+    }
+    (void)events;
+
+    if (c->origin_done) {
+        drop_origin(c, c->framer.reusable());
+        if (!c->framer.has_status()) {
+            // Nothing usable came back, and nothing has been sent
+            send_error(c, 500);
+            return;
+        }
+        if (c->stale && c->framer.complete() && c->framer.status() == 304) {
+            // The origin confirmed our copy; serve it in place of the 304
+            c->hit = cache.refresh(c->key, c->stale, c->out.copy(0, c->out.size()));
+            if (c->hit->sliced_length != 0) {
+                c->lead->complete_sliced(c->hit);
+                inflight.remove(c->key.text, c->lead);
+                c->lead.reset();
+                c->out.clear();
+                std::unique_ptr<SliceReader> reader = open_cached(c->request, c->hit);
+                if (reader) start_slices(c, std::move(reader));
+                else send_error(c, 500);
+                return;
+            }
+            c->out = c->hit->data;
+            c->out_off = 0;
+            c->state = ConnState::WRITE_CLIENT;
+            log_message(LogLevel::DEBUG, "Cached copy revalidated.");
+        }
+        if (!c->framer.complete()) c->cacheable = false;
+        if (c->lead) {
+            if (!c->holding()) c->lead->publish(c->out);
+            end_lead(c, c->framer.complete());
+        }
+    }
+    if (flush_client(c)) update_interest(c);
+}
+
+void LoopThread::run() {
+    epfd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd_ < 0) {
+        log_message(LogLevel::ERR, "epoll_create1 failed");
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;      // nullptr marks the listener
+    epoll_ctl(epfd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wake_ep_;
+    epoll_ctl(epfd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+
+    struct epoll_event events[MAX_EVENTS];
+    time_t last_sweep = time(NULL);
+    while (true) {
+        // Wake at least once a second to time out idle keep-alive clients
+        int n = epoll_wait(epfd_, events, MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_message(LogLevel::ERR, "epoll_wait failed");
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            Endpoint* ep = (Endpoint*)events[i].data.ptr;
+            if (ep == nullptr) {
+                on_accept();
+            }
+            else if (ep == &wake_ep_) {
+                on_wake();
+            }
+            else if (ep->conn->closed) {
+                continue;
+            }
+            else if (ep->origin) {
+                // The origin may have been detached earlier in this batch
+                if (ep->conn->origin_fd >= 0) on_origin(ep->conn, events[i].events);
+            }
+            else {
+                on_client(ep->conn, events[i].events);
+            }
+        }
+
+        time_t now = time(NULL);
+        if (now != last_sweep) {
+            last_sweep = now;
+            close_idle();
+        }
+
+        for (Connection* c : closed_) delete c;
+        closed_.clear();
+    }
+}
+
+void LoopThread::close_idle() {
+    time_t now = time(NULL);
+    std::vector<Connection*> idle;
+    std::vector<Connection*> stalled;
+    for (Connection* c : conns_) {
+        if (c->state == ConnState::READ_REQUEST && now - c->last_active > CLIENT_IDLE_TIMEOUT) {
+            idle.push_back(c);
+        }
+        else if (c->state == ConnState::TUNNEL && now - c->tunnel->last_active() > TUNNEL_IDLE_TIMEOUT) {
+            c->tunnel->expire();
+            idle.push_back(c);
+        }
+        else if (c->state == ConnState::RESOLVE_ORIGIN || c->state == ConnState::CONNECT_ORIGIN ||
+                 c->state == ConnState::WRITE_ORIGIN || (c->state == ConnState::RELAY && c->origin_fd >= 0 && !c->origin_done)) {
+            // An origin held back by a slow client isn't the one stalling
+            if (c->state == ConnState::RELAY && c->pending() >= RELAY_HIGH_WATER) c->origin_active = now;
+            else if (now - c->origin_active > ORIGIN_TIMEOUT) stalled.push_back(c);
+        }
+    }
+    for (Connection* c : idle) close_connection(c);
+    for (Connection* c : stalled) {
+        if (!c->closed) origin_timeout(c);
+    }
+}
+
+// Gives up on an origin that stopped responding. The fetch fails, so its
+// followers give up too.
+void LoopThread::origin_timeout(Connection* c) {
+    log_message(LogLevel::WARN, "Origin timed out");
+    if (c->resolve_id) {
+        resolving_.erase(c->resolve_id);
+        c->resolve_id = 0;
+    }
+    drop_origin(c, false);
+    // Nothing sent yet, so the client can still get a clean error
+    if (c->out_off == 0 && c->out_base == 0) send_error(c, 500);
+    else close_connection(c);
+}
+
+} // namespace
+
+int open_listener(int port_number) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_message(LogLevel::ERR, "Failed to create socket.");
+        return -1;
+    }
+
+    int reuse = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0)
+        log_message(LogLevel::WARN, "setsockopt(SO_REUSEADDR) failed");
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        log_message(LogLevel::WARN, "setsockopt(SO_REUSEPORT) failed");
+        close_socket(fd);
+        return -1;
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port_number);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        log_message(LogLevel::ERR, "Port is not free");
+        close_socket(fd);
+        return -1;
+    }
+    if (listen(fd, SOMAXCONN) < 0) {
+        log_message(LogLevel::ERR, "Error while Listening !");
+        close_socket(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+int run_event_loops(int port_number, int num_loops) {
+    // Open every listener up front so a busy port is reported before any
+    // loop starts serving.
+    std::vector<int> listeners;
+    for (int i = 0; i < num_loops; i++) {
+        int fd = open_listener(port_number);
+        if (fd < 0) {
+            for (int l : listeners) close_socket(l);
+            return 1;
+        }
+        listeners.push_back(fd);
+    }
+    log_message(LogLevel::INFO, "Binding on port: %d with %d epoll loops", port_number, num_loops);
+
+    std::vector<std::thread> threads;
+    for (int fd : listeners) {
+        threads.emplace_back([fd]() { LoopThread(fd).run(); });
+    }
+    for (auto& t : threads) t.join();
+    for (int fd : listeners) close_socket(fd);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,23 @@
+/*
+ * proxy_event_loop.h -- non-blocking, epoll-driven connection handling.
+ */
+
+#ifndef PROXY_EVENT_LOOP
+#define PROXY_EVENT_LOOP
+
+#ifdef __linux__
+/*
+   Runs num_loops event-loop threads, each with its own SO_REUSEPORT listener
+   on port_number so the kernel spreads accepted connections across them.
+   Every connection is a small state machine driven by epoll in place of the
+   blocking recv/send loops of thread_fn and handle_request.
+
+   Only returns (with a non-zero status) if the listeners can't be set up.
+ */
+int run_event_loops(int port_number, int num_loops);
+
+// Opens a non-blocking SO_REUSEPORT listener on port_number, or returns -1.
+int open_listener(int port_number);
+#endif
+
+#endif
@@ -0,0 +1,218 @@
+/*
+  proxy_freshness.cpp -- Cache-Control, Expires and validator handling.
+*/
+
+#include "proxy_freshness.h"
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+
+namespace {
+
+// Cache-Control directives we act on. A delta of -1 means absent.
+struct CacheControl {
+    bool no_store = false;
+    bool no_cache = false;
+    bool is_private = false;
+    bool is_public = false;
+    bool must_revalidate = false;
+    long max_age = -1;
+    long s_maxage = -1;
+};
+
+bool name_is(std::string_view a, const char* b) {
+    size_t n = strlen(b);
+    if (a.size() != n) return false;
+    for (size_t i = 0; i < n; i++) {
+        if (tolower((unsigned char)a[i]) != b[i]) return false;
+    }
+    return true;
+}
+
+void trim(std::string_view& s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+}
+
+long parse_delta(std::string_view value) {
+    if (!value.empty() && value.front() == '"' && value.size() >= 2 && value.back() == '"') {
+        value = value.substr(1, value.size() - 2);
+    }
+    if (value.empty()) return -1;
+    long n = 0;
+    for (char c : value) {
+        if (c < '0' || c > '9') return -1;
+        if (n < 0x7fffffff / 10) n = n * 10 + (c - '0');
+    }
+    return n;
+}
+
+CacheControl parse_cache_control(std::string_view value) {
+    CacheControl cc;
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        std::string_view directive = value.substr(0, comma);
+        std::string_view arg;
+        size_t eq = directive.find('=');
+        if (eq != std::string_view::npos) {
+            arg = directive.substr(eq + 1);
+            directive = directive.substr(0, eq);
+        }
+        trim(directive);
+        trim(arg);
+
+        if (name_is(directive, "no-store")) cc.no_store = true;
+        else if (name_is(directive, "no-cache")) cc.no_cache = true;
+        else if (name_is(directive, "private")) cc.is_private = true;
+        else if (name_is(directive, "public")) cc.is_public = true;
+        else if (name_is(directive, "must-revalidate") || name_is(directive, "proxy-revalidate")) cc.must_revalidate = true;
+        else if (name_is(directive, "max-age")) cc.max_age = parse_delta(arg);
+        else if (name_is(directive, "s-maxage")) cc.s_maxage = parse_delta(arg);
+
+        if (comma == std::string_view::npos) break;
+        value.remove_prefix(comma + 1);
+    }
+    return cc;
+}
+
+// Statuses a cache may store without explicit freshness (RFC 9110, 15.1)
+bool heuristically_cacheable(int status) {
+    switch (status) {
+        case 200: case 203: case 204: case 300: case 301: case 308:
+        case 404: case 405: case 410: case 414: case 501:
+            return true;
+        default:
+            return false;
+    }
+}
+
+int month_index(const char* name) {
+    static const char* months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    for (int i = 0; i < 12; i++) {
+        if (strncmp(name, months[i], 3) == 0) return i;
+    }
+    return -1;
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date, so no timegm is needed
+long days_from_civil(long y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    long era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = (unsigned)(y - era * 400);
+    unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (long)doe - 719468;
+}
+
+// Looks a header up in primary, then in fallback
+std::string_view header(std::string_view primary, std::string_view fallback, std::string_view key) {
+    std::string_view value = find_response_header(primary, key);
+    if (value.empty() && !fallback.empty()) value = find_response_header(fallback, key);
+    return value;
+}
+
+int status_of(std::string_view head) {
+    if (head.size() < 12 || head.compare(0, 5, "HTTP/") != 0) return 0;
+    return atoi(std::string(head.substr(9, 3)).c_str());
+}
+
+// status is that of the stored response; request is null when refreshing an
+// entry that was already judged storable.
+Freshness compute(std::string_view head, std::string_view fallback, int status, const ParsedRequest* request, time_t response_time) {
+    Freshness f;
+    if (status < 200 || status == 206 || status == 304) return f;
+
+    CacheControl cc = parse_cache_control(header(head, fallback, "Cache-Control"));
+    if (cc.no_store || cc.is_private) return f;
+
+    if (request) {
+        const ParsedRequest::ParsedHeader* req_cc = request->get_header("Cache-Control");
+        if (req_cc && parse_cache_control(req_cc->value).no_store) return f;
+        // Responses to authenticated requests are per-user unless marked shareable
+        if (request->get_header("Authorization") && !cc.is_public && cc.s_maxage < 0 && !cc.must_revalidate) return f;
+    }
+
+    f.etag = std::string(header(head, fallback, "ETag"));
+    f.last_modified = std::string(header(head, fallback, "Last-Modified"));
+
+    // Date and Age describe this message only, never the stored one
+    time_t date = parse_http_date(find_response_header(head, "Date"));
+    if (date < 0) date = response_time;
+    long age = parse_delta(find_response_header(head, "Age"));
+    if (age < 0) age = 0;
+    if (response_time > date) age += (long)(response_time - date);
+
+    long lifetime = -1;
+    bool explicit_lifetime = true;
+    if (cc.s_maxage >= 0) lifetime = cc.s_maxage;
+    else if (cc.max_age >= 0) lifetime = cc.max_age;
+    else {
+        std::string_view expires = header(head, fallback, "Expires");
+        if (!expires.empty()) {
+            // An invalid Expires (such as "0") means already expired
+            time_t at = parse_http_date(expires);
+            lifetime = at > date ? (long)(at - date) : 0;
+        }
+        else {
+            explicit_lifetime = false;
+            time_t modified = parse_http_date(f.last_modified);
+            if (modified >= 0 && modified < date && heuristically_cacheable(status)) {
+                lifetime = (long)(date - modified) / 10;
+                if (lifetime > HEURISTIC_MAX_TTL) lifetime = HEURISTIC_MAX_TTL;
+            }
+        }
+    }
+    if (!explicit_lifetime && !heuristically_cacheable(status)) return f;
+    if (cc.no_cache || lifetime < 0) lifetime = 0;
+
+    f.expires = response_time + (lifetime > age ? lifetime - age : 0);
+    // A response that is never fresh and can't be revalidated is no use stored
+    f.storable = f.expires > response_time || !f.etag.empty() || !f.last_modified.empty();
+    return f;
+}
+
+} // namespace
+
+time_t parse_http_date(std::string_view value) {
+    std::string s(value);
+    char wkday[16], mon[4];
+    int day, year, hour, min, sec;
+    int month = -1;
+
+    // IMF-fixdate: Sun, 06 Nov 1994 08:49:37 GMT
+    if (sscanf(s.c_str(), "%15[A-Za-z], %d %3s %d %d:%d:%d GMT", wkday, &day, mon, &year, &hour, &min, &sec) == 7) {
+        month = month_index(mon);
+    }
+    // RFC 850: Sunday, 06-Nov-94 08:49:37 GMT
+    else if (sscanf(s.c_str(), "%15[A-Za-z], %d-%3s-%d %d:%d:%d GMT", wkday, &day, mon, &year, &hour, &min, &sec) == 7) {
+        month = month_index(mon);
+        if (year < 100) year += year < 70 ? 2000 : 1900;
+    }
+    // asctime: Sun Nov  6 08:49:37 1994
+    else if (sscanf(s.c_str(), "%15[A-Za-z] %3s %d %d:%d:%d %d", wkday, mon, &day, &hour, &min, &sec, &year) == 7) {
+        month = month_index(mon);
+    }
+    if (month < 0 || day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60) return -1;
+
+    long days = days_from_civil(year, (unsigned)month + 1, (unsigned)day);
+    return (time_t)(days * 86400L + hour * 3600L + min * 60L + sec);
+}
+
+Freshness compute_freshness(std::string_view head, const ParsedRequest& request, time_t response_time) {
+    return compute(head, {}, status_of(head), &request, response_time);
+}
+
+Freshness refresh_freshness(std::string_view stored_head, std::string_view not_modified_head, time_t response_time) {
+    return compute(not_modified_head, stored_head, status_of(stored_head), nullptr, response_time);
+}
+
+bool request_wants_revalidation(const ParsedRequest& request) {
+    const ParsedRequest::ParsedHeader* cc = request.get_header("Cache-Control");
+    if (cc) {
+        CacheControl parsed = parse_cache_control(cc->value);
+        if (parsed.no_cache || parsed.max_age == 0) return true;
+    }
+    const ParsedRequest::ParsedHeader* pragma = request.get_header("Pragma");
+    return pragma && pragma->value.find("no-cache") != std::string_view::npos;
+}
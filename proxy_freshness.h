@@ -0,0 +1,50 @@
+/*
+ * proxy_freshness.h -- HTTP caching rules: what may be stored, and for how long.
+ */
+#include "proxy_parse.h"
+#include <string>
+#include <string_view>
+#include <ctime>
+
+#ifndef PROXY_FRESHNESS
+#define PROXY_FRESHNESS
+
+#define HEURISTIC_MAX_TTL 86400      //cap, in seconds, on freshness guessed from Last-Modified
+
+/*
+   Freshness is what a shared cache may do with a response: whether it can be
+   stored at all, when it goes stale, and the validators used to revalidate it
+   once it has.
+ */
+struct Freshness {
+    bool storable = false;
+    time_t expires = 0;          // the response is fresh while now < expires
+    std::string etag;
+    std::string last_modified;
+};
+
+/*
+   Applies the shared-cache rules of RFC 9111 to the response whose head is
+   head, received at response_time in answer to request. A response is stored
+   only if neither side sent no-store, it isn't private, its status is
+   cacheable, and it is either fresh for a while or can be revalidated.
+   Lifetime comes from s-maxage, max-age or Expires, else 10% of its age
+   since Last-Modified up to HEURISTIC_MAX_TTL. no-cache makes it stale at once.
+ */
+Freshness compute_freshness(std::string_view head, const ParsedRequest& request, time_t response_time);
+
+/*
+   Freshness of a stored response after a 304 revalidated it: headers in the
+   304's head override those in the stored head.
+ */
+Freshness refresh_freshness(std::string_view stored_head, std::string_view not_modified_head, time_t response_time);
+
+// Whether the client asked for a cached response to be revalidated even if
+// it is still fresh (Cache-Control: no-cache or max-age=0, Pragma: no-cache).
+bool request_wants_revalidation(const ParsedRequest& request);
+
+// Parses an HTTP date (IMF-fixdate, RFC 850 or asctime). Returns -1 if it
+// isn't one.
+time_t parse_http_date(std::string_view value);
+
+#endif
@@ -0,0 +1,122 @@
+/*
+  proxy_inflight.cpp -- single-flight origin fetches shared across clients.
+*/
+
+#include "proxy_inflight.h"
+
+void InflightFetch::notify() {
+    std::vector<std::function<void()>> wakes;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        for (auto& w : watchers_) wakes.push_back(w.second);
+    }
+    cv_.notify_all();
+    for (auto& wake : wakes) wake();
+}
+
+void InflightFetch::publish(const BufferChain& response) {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (state_ != FetchState::STREAMING || response.size() == data_.size()) return;
+        data_.share_from(response);
+    }
+    notify();
+}
+
+void InflightFetch::complete(bool delimited) {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (state_ != FetchState::STREAMING) return;
+        state_ = FetchState::DONE;
+        delimited_ = delimited;
+    }
+    notify();
+}
+
+void InflightFetch::fail() {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (state_ != FetchState::STREAMING) return;
+        state_ = FetchState::FAILED;
+    }
+    notify();
+}
+
+void InflightFetch::complete_sliced(std::shared_ptr<const CacheEntry> head) {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (state_ != FetchState::STREAMING) return;
+        state_ = FetchState::DONE;
+        delimited_ = true;
+        sliced_ = std::move(head);
+    }
+    notify();
+}
+
+FetchState InflightFetch::read(BufferChain& out, bool wait) {
+    std::unique_lock<std::mutex> lock(lock_);
+    if (wait) {
+        cv_.wait(lock, [&]() { return data_.size() > out.size() || state_ != FetchState::STREAMING; });
+    }
+    if (state_ != FetchState::FAILED) {
+        out.share_from(data_);
+    }
+    return state_;
+}
+
+bool InflightFetch::delimited() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return delimited_;
+}
+
+std::shared_ptr<const CacheEntry> InflightFetch::sliced() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return sliced_;
+}
+
+void InflightFetch::watch(const void* owner, std::function<void()> wake) {
+    std::lock_guard<std::mutex> guard(lock_);
+    for (auto& w : watchers_) {
+        if (w.first == owner) return;
+    }
+    watchers_.emplace_back(owner, std::move(wake));
+}
+
+InflightFetchPtr InflightTable::join(const std::string& key, bool& leader) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = fetches_.find(key);
+    if (it != fetches_.end()) {
+        leader = false;
+        stats_.followers++;
+        it->second->followers_++;
+        return it->second;
+    }
+    leader = true;
+    stats_.leaders++;
+    auto fetch = std::make_shared<InflightFetch>();
+    fetches_.emplace(key, fetch);
+    return fetch;
+}
+
+void InflightTable::remove(const std::string& key, const InflightFetchPtr& fetch) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = fetches_.find(key);
+    if (it != fetches_.end() && it->second == fetch) {
+        fetches_.erase(it);
+    }
+}
+
+bool InflightTable::remove_unshared(const std::string& key, const InflightFetchPtr& fetch) {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (fetch->followers_ > 0) return false;
+    auto it = fetches_.find(key);
+    if (it != fetches_.end() && it->second == fetch) {
+        fetches_.erase(it);
+    }
+    return true;
+}
+
+InflightStats InflightTable::stats() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return stats_;
+}
@@ -0,0 +1,104 @@
+/*
+ * proxy_inflight.h -- coalescing of concurrent cache misses (single-flight).
+ */
+#include "proxy_buffer.h"
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include <cstddef>
+
+#ifndef PROXY_INFLIGHT
+#define PROXY_INFLIGHT
+
+enum class FetchState { STREAMING, DONE, FAILED };
+
+struct CacheEntry;
+
+/*
+   InflightFetch is one origin fetch shared by every request for the same key.
+   The leader publishes its response chain as bytes arrive; followers share
+   its slabs while it is still streaming, so they get the bytes as soon as
+   the leader does rather than waiting for the whole response, and nothing
+   is copied.
+ */
+class InflightFetch {
+public:
+    // Leader side. publish() takes the leader's chain, which only ever grows
+    // between calls. complete() and fail() are terminal; the first one wins.
+    void publish(const BufferChain& response);
+    void complete(bool delimited);
+    void fail();
+    // Completes the fetch without publishing a body: the response is a large
+    // object cached in slices, and followers serve it from head instead.
+    void complete_sliced(std::shared_ptr<const CacheEntry> head);
+
+    // Follower side. Extends out, which holds a prefix of the response, to
+    // everything published so far. With wait set, blocks until there are bytes
+    // past out.size() or the fetch has ended.
+    FetchState read(BufferChain& out, bool wait);
+
+    // Whether the completed response carried its own length
+    bool delimited() const;
+
+    // The head complete_sliced() ended the fetch with, or nullptr
+    std::shared_ptr<const CacheEntry> sliced() const;
+
+    // Registers a callback run (without the fetch lock held) whenever bytes
+    // arrive or the fetch ends. owner dedupes registrations, so an event loop
+    // with many followers on one fetch is woken once.
+    void watch(const void* owner, std::function<void()> wake);
+
+private:
+    void notify();
+
+    mutable std::mutex lock_;
+    std::condition_variable cv_;
+    BufferChain data_;
+    FetchState state_ = FetchState::STREAMING;
+    bool delimited_ = false;
+    std::shared_ptr<const CacheEntry> sliced_;
+    std::vector<std::pair<const void*, std::function<void()>>> watchers_;
+    size_t followers_ = 0;      // requests that joined; guarded by the table's lock
+
+    friend class InflightTable;
+};
+
+using InflightFetchPtr = std::shared_ptr<InflightFetch>;
+
+// Counters exposed by InflightTable.
+struct InflightStats {
+    size_t leaders = 0;      // misses that went to the origin
+    size_t followers = 0;    // misses that attached to a fetch already in flight
+};
+
+/*
+   InflightTable maps a cache key to the fetch in flight for it. The first miss
+   for a key becomes the leader; later misses attach as followers until the
+   leader removes the fetch.
+ */
+class InflightTable {
+public:
+    // Returns the fetch for key, creating it if none is in flight. leader is
+    // set when the caller created it and must fetch from the origin.
+    InflightFetchPtr join(const std::string& key, bool& leader);
+
+    // Stops new requests joining fetch. Leaves a newer fetch for key alone.
+    void remove(const std::string& key, const InflightFetchPtr& fetch);
+
+    // Removes fetch if no request has joined it yet, so its leader can stop
+    // holding the response for followers. Returns false if one has.
+    bool remove_unshared(const std::string& key, const InflightFetchPtr& fetch);
+
+    InflightStats stats() const;
+
+private:
+    mutable std::mutex lock_;
+    std::unordered_map<std::string, InflightFetchPtr> fetches_;
+    InflightStats stats_;
+};
+
+#endif
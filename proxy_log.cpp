@@ -0,0 +1,238 @@
+/*
+  proxy_log.cpp -- per-thread log rings drained by a writer thread.
+*/
+
+#include "proxy_log.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cstdio>
+#include <cstdarg>
+#include <ctime>
+
+namespace {
+
+struct LogSlot {
+    int64_t time_ms;
+    LogLevel level;
+    uint16_t len;
+    char text[LOG_LINE_MAX];
+};
+
+// Written only by its owning thread (head) and read only by the writer
+// (tail); each side publishes its index with a release store.
+struct LogRing {
+    LogSlot slots[LOG_RING_SLOTS];
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+    std::atomic<size_t> dropped{0};
+    std::atomic<bool> retired{false};      // its thread has exited
+};
+
+const char* level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+class Logger {
+public:
+    Logger() {
+        std::thread(&Logger::run, this).detach();
+    }
+
+    std::shared_ptr<LogRing> add_ring() {
+        auto ring = std::make_shared<LogRing>();
+        std::lock_guard<std::mutex> guard(rings_lock_);
+        rings_.push_back(ring);
+        return ring;
+    }
+
+    // Writes out everything published so far
+    void flush() {
+        std::lock_guard<std::mutex> guard(drain_lock_);
+        drain();
+    }
+
+    LogStats stats() {
+        LogStats stats;
+        stats.written = written_;
+        stats.dropped = dropped_;
+        std::lock_guard<std::mutex> guard(rings_lock_);
+        stats.threads = rings_.size();
+        return stats;
+    }
+
+    std::atomic<uint8_t> level{(uint8_t)LogLevel::INFO};
+
+private:
+    void run() {
+        while (true) {
+            size_t lines;
+            {
+                std::lock_guard<std::mutex> guard(drain_lock_);
+                lines = drain();
+            }
+            if (lines == 0) std::this_thread::sleep_for(std::chrono::milliseconds(LOG_IDLE_SLEEP_MS));
+        }
+    }
+
+    void format(const LogSlot& slot) {
+        time_t seconds = (time_t)(slot.time_ms / 1000);
+        if (seconds != stamp_second_) {
+            struct tm tm_utc;
+#ifdef _WIN32
+            gmtime_s(&tm_utc, &seconds);
+#else
+            gmtime_r(&seconds, &tm_utc);
+#endif
+            strftime(stamp_, sizeof(stamp_), "%Y-%m-%dT%H:%M:%S", &tm_utc);
+            stamp_second_ = seconds;
+        }
+        char prefix[64];
+        int n = snprintf(prefix, sizeof(prefix), "%s.%03dZ %-5s ", stamp_, (int)(slot.time_ms % 1000), level_names[(int)slot.level]);
+        std::string& out = slot.level >= LogLevel::WARN ? err_ : out_;
+        out.append(prefix, n);
+        out.append(slot.text, slot.len);
+        out += '\n';
+    }
+
+    // Called with drain_lock_ held. Returns the number of lines written.
+    size_t drain() {
+        std::vector<std::shared_ptr<LogRing>> rings;
+        {
+            std::lock_guard<std::mutex> guard(rings_lock_);
+            rings = rings_;
+        }
+        size_t lines = 0;
+        size_t dropped = 0;
+        for (const auto& ring : rings) {
+            // Read retired first: once it is set, head won't move again
+            bool retired = ring->retired.load(std::memory_order_acquire);
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+            for (; tail < head; tail++) {
+                format(ring->slots[tail % LOG_RING_SLOTS]);
+                lines++;
+            }
+            ring->tail.store(tail, std::memory_order_release);
+            dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+            if (retired) {
+                std::lock_guard<std::mutex> guard(rings_lock_);
+                for (size_t i = 0; i < rings_.size(); i++) {
+                    if (rings_[i] == ring) {
+                        rings_.erase(rings_.begin() + i);
+                        break;
+                    }
+                }
+            }
+        }
+        if (dropped > 0) {
+            err_ += "log: dropped " + std::to_string(dropped) + " lines, writer fell behind\n";
+            dropped_ += dropped;
+        }
+        if (!out_.empty()) {
+            fwrite(out_.data(), 1, out_.size(), stdout);
+            fflush(stdout);
+            out_.clear();
+        }
+        if (!err_.empty()) {
+            fwrite(err_.data(), 1, err_.size(), stderr);
+            fflush(stderr);
+            err_.clear();
+        }
+        written_ += lines;
+        return lines;
+    }
+
+    std::mutex rings_lock_;
+    std::vector<std::shared_ptr<LogRing>> rings_;
+    std::mutex drain_lock_;     // one drain at a time; never taken by a logging thread
+    std::string out_;
+    std::string err_;
+    time_t stamp_second_ = -1;
+    char stamp_[32];
+    std::atomic<size_t> written_{0};
+    std::atomic<size_t> dropped_{0};
+};
+
+// Never destroyed, so threads can still log while static objects are torn down
+Logger& logger() {
+    static Logger* instance = [] {
+        Logger* created = new Logger();
+        atexit(log_flush);
+        return created;
+    }();
+    return *instance;
+}
+
+// Marks the thread's ring retired when the thread exits, so the writer
+// frees it once it is drained
+struct RingOwner {
+    std::shared_ptr<LogRing> ring;
+    ~RingOwner() {
+        if (ring) ring->retired.store(true, std::memory_order_release);
+    }
+};
+
+thread_local RingOwner ring_owner;
+
+}  // namespace
+
+void log_set_level(LogLevel level) {
+    logger().level = (uint8_t)level;
+}
+
+LogLevel log_level() {
+    return (LogLevel)logger().level.load(std::memory_order_relaxed);
+}
+
+bool log_parse_level(const std::string& name, LogLevel& level) {
+    for (int i = 0; i < 4; i++) {
+        std::string lower = level_names[i];
+        for (auto& c : lower) c = (char)(c - 'A' + 'a');
+        if (name == lower) {
+            level = (LogLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void log_message(LogLevel level, const char* format, ...) {
+    Logger& log = logger();
+    if ((uint8_t)level < log.level.load(std::memory_order_relaxed)) return;
+    if (!ring_owner.ring) ring_owner.ring = log.add_ring();
+    LogRing& ring = *ring_owner.ring;
+
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    if (head - ring.tail.load(std::memory_order_acquire) >= LOG_RING_SLOTS) {
+        ring.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    LogSlot& slot = ring.slots[head % LOG_RING_SLOTS];
+    slot.time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    slot.level = level;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(slot.text, LOG_LINE_MAX, format, args);
+    va_end(args);
+    slot.len = (uint16_t)(n < 0 ? 0 : n >= LOG_LINE_MAX ? LOG_LINE_MAX - 1 : n);
+    // Trailing newlines are the writer's job
+    while (slot.len > 0 && slot.text[slot.len - 1] == '\n') slot.len--;
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+void log_access(const char* client, std::string_view url, const char* outcome, size_t bytes, double latency_ms) {
+    if (log_level() > LogLevel::INFO) return;
+    // The url goes last, so a long one that overflows the slot loses only
+    // its own tail
+    log_message(LogLevel::INFO, "access %s %s %zu %.3fms %.*s", client, outcome, bytes, latency_ms, (int)url.size(), url.data());
+}
+
+void log_flush() {
+    logger().flush();
+}
+
+LogStats log_stats() {
+    return logger().stats();
+}
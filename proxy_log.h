@@ -0,0 +1,61 @@
+/*
+ * proxy_log.h -- asynchronous leveled logging and the access log.
+ */
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstddef>
+
+#ifndef PROXY_LOG
+#define PROXY_LOG
+
+#define LOG_RING_SLOTS 128          //lines one thread can have waiting for the writer
+#define LOG_LINE_MAX 200            //longest line kept; longer ones are cut short
+#define LOG_IDLE_SLEEP_MS 5         //how long the writer naps when every ring is empty
+
+// ERR rather than ERROR, which windows.h defines as a macro
+enum class LogLevel : uint8_t { DEBUG, INFO, WARN, ERR };
+
+// Counters exposed by the logger.
+struct LogStats {
+    size_t written = 0;
+    size_t dropped = 0;     // lines lost because their thread's ring was full
+    size_t threads = 0;     // rings currently registered
+};
+
+/*
+   Each thread that logs gets its own ring of LOG_RING_SLOTS fixed-size
+   slots, written only by that thread and read only by a background writer
+   thread, so logging never takes a lock or waits on the terminal: a line
+   is formatted straight into the next slot and published with one atomic
+   store. When the writer falls behind and a ring fills, further lines from
+   that thread are dropped and counted, and the writer reports the count.
+
+   The writer prints INFO and DEBUG lines to stdout and WARN and ERR lines
+   to stderr, each prefixed with a UTC timestamp and the level. Lines are
+   flushed at exit; call log_flush() before leaving through _exit().
+ */
+
+// Lines below level are skipped before they are formatted. INFO by default.
+void log_set_level(LogLevel level);
+LogLevel log_level();
+
+// Parses "debug", "info", "warn" or "error". Returns false for anything else.
+bool log_parse_level(const std::string& name, LogLevel& level);
+
+// Formats a line printf-style and queues it; never blocks.
+void log_message(LogLevel level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+// Logs one served request at INFO, as
+//   access CLIENT OUTCOME BYTES LATENCYms METHOD HOST:PORT/PATH
+// where OUTCOME is HIT, MISS, REVALIDATED, COALESCED or ERROR, or TUNNEL for
+// a CONNECT tunnel, whose BYTES are those relayed to the client. A url too
+// long for the line is cut short; the fields ahead of it never are.
+void log_access(const char* client, std::string_view url, const char* outcome, size_t bytes, double latency_ms);
+
+// Blocks until every line queued so far has been written.
+void log_flush();
+
+LogStats log_stats();
+
+#endif
@@ -0,0 +1,263 @@
+/*
+  proxy_metrics.cpp -- per-thread histograms and the Prometheus endpoint.
+*/
+
+#include "proxy_metrics.h"
+#include "proxy_socket.h"
+#include "proxy_log.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+const char* outcome_names[] = {"HIT", "MISS", "REVALIDATED", "COALESCED", "ERROR"};
+const char* outcome_labels[] = {"hit", "miss", "revalidated", "coalesced", "error"};
+
+// Bucket of value: values below 1<<HIST_SUB_BITS get one each, and each
+// power of two above is split into 1<<HIST_SUB_BITS equal parts.
+size_t hist_bucket(uint64_t value) {
+    const uint64_t sub_count = 1 << HIST_SUB_BITS;
+    if (value < sub_count) return (size_t)value;
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent >= HIST_MAX_BITS) return HIST_BUCKETS - 1;
+    size_t sub = (size_t)(value >> (exponent - HIST_SUB_BITS)) & (sub_count - 1);
+    return ((size_t)(exponent - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+// Largest value that falls in bucket
+uint64_t hist_bucket_max(size_t bucket) {
+    const uint64_t sub_count = 1 << HIST_SUB_BITS;
+    if (bucket < sub_count) return bucket;
+    int exponent = (int)(bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t sub = bucket & (sub_count - 1);
+    return ((sub_count + sub + 1) << (exponent - HIST_SUB_BITS)) - 1;
+}
+
+// Only the owning thread writes, so a plain load and store is enough to
+// count without a locked instruction
+inline void bump(std::atomic<uint64_t>& counter, uint64_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+struct Histogram {
+    std::atomic<uint64_t> buckets[HIST_BUCKETS] = {};
+    std::atomic<uint64_t> sum{0};
+
+    void record(uint64_t value) {
+        bump(buckets[hist_bucket(value)], 1);
+        bump(sum, value);
+    }
+};
+
+// One thread's metrics
+struct MetricsShard {
+    Histogram requests[REQUEST_OUTCOMES];   // microseconds
+    Histogram origin[ORIGIN_STAGES];        // microseconds
+    Histogram response_bytes;
+    Histogram tunnel_lifetime;              // microseconds
+    Histogram tunnel_throughput;            // bytes per second
+};
+
+// A histogram summed over every shard
+struct HistogramTotal {
+    uint64_t buckets[HIST_BUCKETS] = {};
+    uint64_t sum = 0;
+
+    void add(const Histogram& h) {
+        for (size_t i = 0; i < HIST_BUCKETS; i++) buckets[i] += h.buckets[i].load(std::memory_order_relaxed);
+        sum += h.sum.load(std::memory_order_relaxed);
+    }
+};
+
+std::mutex shards_lock;
+// Shards are never freed, so a thread's counts outlive it
+std::vector<MetricsShard*> shards;
+
+MetricsShard& local_shard() {
+    static thread_local MetricsShard* shard = [] {
+        MetricsShard* created = new MetricsShard();
+        std::lock_guard<std::mutex> guard(shards_lock);
+        shards.push_back(created);
+        return created;
+    }();
+    return *shard;
+}
+
+uint64_t to_micros(std::chrono::steady_clock::duration d) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    return us < 0 ? 0 : (uint64_t)us;
+}
+
+// Appends the bucket, sum and count lines of one histogram series. scale
+// converts recorded values to the exported unit; buckets above max_bits are
+// only counted in +Inf.
+void append_histogram(std::string& out, const char* name, const std::string& labels, const HistogramTotal& h, double scale, int max_bits) {
+    char line[256];
+    std::string sep = labels.empty() ? "" : labels + ",";
+    size_t last = hist_bucket(((uint64_t)1 << max_bits) - 1);
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i <= last; i++) {
+        cumulative += h.buckets[i];
+        snprintf(line, sizeof(line), "%s_bucket{%sle=\"%.12g\"} %llu\n", name, sep.c_str(), hist_bucket_max(i) * scale, (unsigned long long)cumulative);
+        out += line;
+    }
+    for (size_t i = last + 1; i < HIST_BUCKETS; i++) cumulative += h.buckets[i];
+    snprintf(line, sizeof(line), "%s_bucket{%sle=\"+Inf\"} %llu\n", name, sep.c_str(), (unsigned long long)cumulative);
+    out += line;
+    std::string braces = labels.empty() ? "" : "{" + labels + "}";
+    snprintf(line, sizeof(line), "%s_sum%s %.12g\n%s_count%s %llu\n", name, braces.c_str(), h.sum * scale, name, braces.c_str(), (unsigned long long)cumulative);
+    out += line;
+}
+
+void append_header(std::string& out, const char* name, const char* type, const char* help) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+// Answers one scrape on client
+void serve_scrape(socket_t client, const std::function<std::string()>& render) {
+    set_recv_timeout(client, ADMIN_REQUEST_TIMEOUT);
+    char request[1024];
+    size_t len = 0;
+    while (len < sizeof(request) - 1) {
+        int n = recv(client, request + len, (int)(sizeof(request) - 1 - len), 0);
+        if (n <= 0) break;
+        len += n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n")) break;
+    }
+    request[len] = '\0';
+
+    std::string body;
+    const char* status;
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET /metrics?", 13) == 0) {
+        status = "200 OK";
+        body = render();
+    } else {
+        status = "404 Not Found";
+        body = "Only /metrics is served here\n";
+    }
+    std::string response = std::string("HTTP/1.1 ") + status + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                           std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    size_t sent = 0;
+    while (sent < response.size()) {
+        int n = send(client, response.data() + sent, (int)(response.size() - sent), 0);
+        if (n <= 0) break;
+        sent += n;
+    }
+}
+
+}  // namespace
+
+const char* outcome_name(RequestOutcome outcome) {
+    return outcome_names[(int)outcome];
+}
+
+void metrics_record_request(RequestOutcome outcome, size_t bytes, std::chrono::steady_clock::duration latency) {
+    MetricsShard& shard = local_shard();
+    shard.requests[(int)outcome].record(to_micros(latency));
+    shard.response_bytes.record(bytes);
+}
+
+void metrics_record_origin(OriginStage stage, std::chrono::steady_clock::duration elapsed) {
+    local_shard().origin[(int)stage].record(to_micros(elapsed));
+}
+
+void metrics_record_tunnel(uint64_t bytes, std::chrono::steady_clock::duration lifetime) {
+    MetricsShard& shard = local_shard();
+    uint64_t us = to_micros(lifetime);
+    shard.tunnel_lifetime.record(us);
+    shard.tunnel_throughput.record(us == 0 ? 0 : (uint64_t)(bytes * 1e6 / us));
+}
+
+void metrics_render(std::string& out) {
+    HistogramTotal requests[REQUEST_OUTCOMES];
+    HistogramTotal origin[ORIGIN_STAGES];
+    HistogramTotal response_bytes;
+    HistogramTotal tunnel_lifetime;
+    HistogramTotal tunnel_throughput;
+    {
+        std::lock_guard<std::mutex> guard(shards_lock);
+        for (const MetricsShard* shard : shards) {
+            for (int i = 0; i < REQUEST_OUTCOMES; i++) requests[i].add(shard->requests[i]);
+            for (int i = 0; i < ORIGIN_STAGES; i++) origin[i].add(shard->origin[i]);
+            response_bytes.add(shard->response_bytes);
+            tunnel_lifetime.add(shard->tunnel_lifetime);
+            tunnel_throughput.add(shard->tunnel_throughput);
+        }
+    }
+
+    append_header(out, "proxy_request_duration_seconds", "histogram", "Time from parsed request to last response byte sent, by outcome.");
+    for (int i = 0; i < REQUEST_OUTCOMES; i++) {
+        append_histogram(out, "proxy_request_duration_seconds", std::string("outcome=\"") + outcome_labels[i] + "\"", requests[i], 1e-6, METRICS_DURATION_MAX_BITS);
+    }
+    append_header(out, "proxy_response_size_bytes", "histogram", "Response bytes sent to clients per request.");
+    append_histogram(out, "proxy_response_size_bytes", "", response_bytes, 1, METRICS_SIZE_MAX_BITS);
+
+    const char* stage_names[] = {"proxy_origin_dns_seconds", "proxy_origin_connect_seconds", "proxy_origin_first_byte_seconds"};
+    const char* stage_help[] = {
+        "Time taken by each getaddrinfo call.",
+        "Time to establish a new origin connection.",
+        "Time from sending a request to an origin to receiving the first byte of its response.",
+    };
+    for (int i = 0; i < ORIGIN_STAGES; i++) {
+        append_header(out, stage_names[i], "histogram", stage_help[i]);
+        append_histogram(out, stage_names[i], "", origin[i], 1e-6, METRICS_DURATION_MAX_BITS);
+    }
+
+    append_header(out, "proxy_tunnel_duration_seconds", "histogram", "How long each closed CONNECT tunnel was open.");
+    append_histogram(out, "proxy_tunnel_duration_seconds", "", tunnel_lifetime, 1e-6, METRICS_TUNNEL_MAX_BITS);
+    append_header(out, "proxy_tunnel_throughput_bytes_per_second", "histogram", "Bytes each closed CONNECT tunnel relayed both ways, over its lifetime.");
+    append_histogram(out, "proxy_tunnel_throughput_bytes_per_second", "", tunnel_throughput, 1, METRICS_TUNNEL_MAX_BITS);
+}
+
+void metrics_append(std::string& out, const char* name, const char* type, const char* help, double value) {
+    append_header(out, name, type, help);
+    char line[256];
+    snprintf(line, sizeof(line), "%s %.17g\n", name, value);
+    out += line;
+}
+
+int metrics_serve(int port, std::function<std::string()> render) {
+    socket_t listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener == INVALID_SOCKET_VAL) return -1;
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);     // local scrapers only
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 16) < 0) {
+        close_socket(listener);
+        return -1;
+    }
+
+    std::thread([listener, render]() {
+        while (true) {
+            socket_t client = accept(listener, nullptr, nullptr);
+            if (client == INVALID_SOCKET_VAL) {
+                log_message(LogLevel::WARN, "Error in accepting on the admin port");
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));   // e.g. out of descriptors; don't spin
+                continue;
+            }
+            serve_scrape(client, render);
+            shutdown(client, SD_BOTH);
+            close_socket(client);
+        }
+    }).detach();
+    return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * proxy_metrics.h -- per-thread request metrics and the admin endpoint.
+ */
+#include <string>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+#ifndef PROXY_METRICS
+#define PROXY_METRICS
+
+#define HIST_SUB_BITS 2             //each power of two is split into 1<<HIST_SUB_BITS buckets, so a bucket is at most 25% wide
+#define HIST_MAX_BITS 40            //values up to 2^40 (12 days in microseconds, 1 TB in bytes) get a bucket
+#define HIST_BUCKETS (((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + 1)   //the last bucket takes everything larger
+#define METRICS_DURATION_MAX_BITS 25    //largest duration bucket exported, about 33 s
+#define METRICS_SIZE_MAX_BITS 30        //largest size bucket exported, 1 GB
+#define METRICS_TUNNEL_MAX_BITS 32      //largest tunnel duration (about 71 minutes) and throughput (4 GB/s) bucket exported
+#define ADMIN_REQUEST_TIMEOUT 2         //seconds the admin port waits for a scrape request
+
+// How a client request was answered
+enum class RequestOutcome : uint8_t { HIT, MISS, REVALIDATED, COALESCED, ERR };
+#define REQUEST_OUTCOMES 5
+
+// "HIT", "MISS", "REVALIDATED", "COALESCED" or "ERROR"
+const char* outcome_name(RequestOutcome outcome);
+
+// The timed steps of a fetch from an origin server
+enum class OriginStage : uint8_t {
+    DNS,            // a getaddrinfo call
+    CONNECT,        // TCP connect, from the first SYN to established
+    FIRST_BYTE,     // from the request's last byte sent to the response's first byte received
+};
+#define ORIGIN_STAGES 3
+
+/*
+   Metrics are kept per thread: each thread that records gets its own set
+   of histograms, registered once and written only by that thread, so
+   recording is a few relaxed stores with no lock and no shared cache line.
+   A scrape sums every thread's set. Histograms are log-linear, like HDR
+   histograms: each power of two is split into 1<<HIST_SUB_BITS equal
+   buckets, so relative precision is the same from microseconds to minutes.
+   A thread's set outlives the thread, so its counts are never lost.
+ */
+
+// Records one answered request: which way it went, the response bytes sent
+// and the time from parsed request to last byte sent.
+void metrics_record_request(RequestOutcome outcome, size_t bytes, std::chrono::steady_clock::duration latency);
+
+void metrics_record_origin(OriginStage stage, std::chrono::steady_clock::duration elapsed);
+
+// Records one closed CONNECT tunnel: how long it was open and the bytes it
+// relayed both ways, from which its mean throughput is taken.
+void metrics_record_tunnel(uint64_t bytes, std::chrono::steady_clock::duration lifetime);
+
+// Appends the recorded metrics to out in Prometheus text format: request
+// duration by outcome, response size, the origin stage timings, and tunnel
+// lifetime and throughput.
+void metrics_render(std::string& out);
+
+// Appends one unlabelled sample, with its HELP and TYPE lines. type is
+// "counter" or "gauge".
+void metrics_append(std::string& out, const char* name, const char* type, const char* help, double value);
+
+// Serves GET /metrics on 127.0.0.1:port from a background thread, answering
+// with whatever render returns. Returns -1 if the port can't be bound.
+int metrics_serve(int port, std::function<std::string()> render);
+
+#endif
@@ -4,197 +4,340 @@
 */
 
 #include "proxy_parse.h"
+#include "proxy_log.h"
 #include <string>
-#include <vector>
-#include <sstream>
-#include <cstring> // For strstr, strtok_r
+#include <cstring> // For memchr
+#include <cctype>
 
-#define DEFAULT_NHDRS 8
-#define MAX_REQ_LEN 65535
 #define MIN_REQ_LEN 4
 
-static const std::string root_abs_path = "/";
+static const std::string_view root_abs_path = "/";
 
-#ifdef _WIN32
-// strtok_r is not available on Windows, so we use strtok_s
-char* strtok_r(char* str, const char* delim, char** saveptr) {
-    return strtok_s(str, delim, saveptr);
+static bool header_name_equals(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return false;
+    }
+    return true;
 }
-#endif
 
-void ParsedRequest::set_header(const std::string& key, const std::string& value) {
-    remove_header(key);
-    headers.push_back({key, value});
+static void trim_ows(const char* buf, uint32_t& off, uint32_t& len) {
+    while (len > 0 && (buf[off] == ' ' || buf[off] == '\t')) {
+        off++;
+        len--;
+    }
+    while (len > 0 && (buf[off + len - 1] == ' ' || buf[off + len - 1] == '\t')) len--;
+}
+
+void ParsedRequest::reset() {
+    state_ = REQUEST_LINE;
+    line_start_ = 0;
+    scanned_ = 0;
+    mark_ = SCAN_NOT_FOUND;
+    length_ = 0;
+    base_ = nullptr;
+    method = protocol = host = port = path = version = std::string_view();
+    num_headers = 0;
+    owned_.clear();
+}
+
+void ParsedRequest::set_header(std::string_view key, std::string_view value) {
+    owned_.emplace_back(value);
+    std::string_view owned_value = owned_.back();
+    for (size_t i = 0; i < num_headers; i++) {
+        if (header_name_equals(headers[i].key, key)) {
+            headers[i].value = owned_value;
+            headers[i].line = std::string_view();
+            // Any later duplicates go, so the header has exactly this value
+            for (size_t j = num_headers; j-- > i + 1;) {
+                if (header_name_equals(headers[j].key, key)) {
+                    std::copy(headers + j + 1, headers + num_headers, headers + j);
+                    num_headers--;
+                }
+            }
+            return;
+        }
+    }
+    if (num_headers == MAX_REQUEST_HEADERS) return;
+    owned_.emplace_back(key);
+    headers[num_headers++] = {owned_.back(), owned_value, std::string_view()};
 }
 
-ParsedRequest::ParsedHeader* ParsedRequest::get_header(const std::string& key) {
-    for (auto& header : headers) {
-        if (strcasecmp(header.key.c_str(), key.c_str()) == 0) {
-            return &header;
+const ParsedRequest::ParsedHeader* ParsedRequest::get_header(std::string_view key) const {
+    for (size_t i = 0; i < num_headers; i++) {
+        if (header_name_equals(headers[i].key, key)) {
+            return &headers[i];
         }
     }
     return nullptr;
 }
 
-bool ParsedRequest::remove_header(const std::string& key) {
-    auto it = std::remove_if(headers.begin(), headers.end(),
+bool ParsedRequest::remove_header(std::string_view key) {
+    auto end = std::remove_if(headers, headers + num_headers,
         [&](const ParsedHeader& h) {
-            return strcasecmp(h.key.c_str(), key.c_str()) == 0;
+            return header_name_equals(h.key, key);
         });
-    if (it != headers.end()) {
-        headers.erase(it, headers.end());
-        return true;
-    }
-    return false;
+    size_t kept = end - headers;
+    if (kept == num_headers) return false;
+    num_headers = kept;
+    return true;
 }
 
-std::string ParsedRequest::unparse() {
-    std::stringstream ss;
-    ss << method << " " << protocol << "://" << host;
+std::string ParsedRequest::unparse() const {
+    std::string out;
+    out.reserve(method.size() + protocol.size() + host.size() + port.size() + path.size() + version.size() + 8 + headers_length());
+    out.append(method).append(" ").append(protocol).append("://").append(host);
     if (!port.empty()) {
-        ss << ":" << port;
+        out.append(":").append(port);
     }
-    ss << path << " " << version << "\r\n";
-    ss << unparse_headers();
-    return ss.str();
+    out.append(path).append(" ").append(version).append("\r\n");
+    write_headers(out);
+    return out;
 }
 
-std::string ParsedRequest::unparse_headers() {
-    std::stringstream ss;
-    for (const auto& header : headers) {
-        ss << header.key << ": " << header.value << "\r\n";
-    }
-    ss << "\r\n";
-    return ss.str();
+std::string ParsedRequest::unparse_headers() const {
+    std::string out;
+    write_headers(out);
+    return out;
 }
 
-int ParsedRequest::parse(const char* buf, int buflen) {
-     char *full_addr;
-     char *saveptr;
-     char *index;
-     char *currentHeader;
-
-     if (buflen < MIN_REQ_LEN || buflen > MAX_REQ_LEN) {
-          std::cerr << "invalid buflen " << buflen << std::endl;
-          return -1;
-      }
-
-     /* Create NUL terminated tmp buffer */
-     auto tmp_buf = std::make_unique<char[]>(buflen + 1);
-     memcpy(tmp_buf.get(), buf, buflen);
-     tmp_buf[buflen] = '\0';
-   
-     index = strstr(tmp_buf.get(), "\r\n\r\n");
-     if (index == NULL) {
-          std::cerr << "invalid request line, no end of header" << std::endl;
-          return -1;
-      }
-
-    index = strstr(tmp_buf.get(), "\r\n");
-    std::string request_line(tmp_buf.get(), index - tmp_buf.get());
-    auto req_line_buf = std::make_unique<char[]>(request_line.length() + 1);
-    strcpy(req_line_buf.get(), request_line.c_str());
-
-     /* Parse request line */
-    char* method_ptr = strtok_r(req_line_buf.get(), " ", &saveptr);
-    if (method_ptr == nullptr) {
-        std::cerr << "invalid request line, no whitespace" << std::endl;
-        return -1;
+size_t ParsedRequest::headers_length() const {
+    size_t len = 2;
+    for (size_t i = 0; i < num_headers; i++) {
+        const ParsedHeader& h = headers[i];
+        len += h.line.empty() ? h.key.size() + h.value.size() + 4 : h.line.size();
     }
-    this->method = method_ptr;
-
-    if (this->method != "GET") {
-        std::cerr << "invalid request line, method not 'GET': " << this->method << std::endl;
-        return -1;
-     }
-
-     full_addr = strtok_r(NULL, " ", &saveptr);
+    return len;
+}
 
-     if (full_addr == NULL) {
-        std::cerr << "invalid request line, no full address" << std::endl;
-        return -1;
+void ParsedRequest::write_headers(std::string& out) const {
+    out.reserve(out.size() + headers_length());
+    // A run of received lines still adjacent in the buffer, not yet copied
+    const char* run = nullptr;
+    size_t run_len = 0;
+    for (size_t i = 0; i < num_headers; i++) {
+        const ParsedHeader& h = headers[i];
+        if (!h.line.empty() && h.line.data() == run + run_len) {
+            run_len += h.line.size();
+            continue;
+        }
+        if (run_len > 0) out.append(run, run_len);
+        run = nullptr;
+        run_len = 0;
+        if (!h.line.empty()) {
+            run = h.line.data();
+            run_len = h.line.size();
+            continue;
+        }
+        out.append(h.key).append(": ").append(h.value).append("\r\n");
     }
+    if (run_len > 0) out.append(run, run_len);
+    out.append("\r\n");
+}
 
-    char* version_ptr = full_addr + strlen(full_addr) + 1;
-    if (version_ptr == nullptr || *version_ptr == '\0') {
-        std::cerr << "invalid request line, missing version" << std::endl;
-        return -1;
-    }
-    this->version = version_ptr;
+// "METHOD SP absolute-URI SP HTTP/x.y", or "CONNECT SP host:port SP HTTP/x.y"
+bool ParsedRequest::parse_request_line(const char* buf, Span line, size_t first_space) {
+    const char* start = buf + line.off;
+    const char* end = start + line.len;
 
-    if (this->version.rfind("HTTP/", 0) != 0) {
-        std::cerr << "invalid request line, unsupported version " << this->version << std::endl;
-        return -1;
+    const char* sp1 = first_space == SCAN_NOT_FOUND ? nullptr : buf + first_space;
+    if (sp1 == nullptr || sp1 == start) {
+        log_message(LogLevel::DEBUG, "invalid request line, no whitespace");
+        return false;
     }
-
-    char* protocol_ptr = strtok_r(full_addr, "://", &saveptr);
-    if (protocol_ptr == nullptr) {
-        std::cerr << "invalid request line, missing protocol" << std::endl;
-        return -1;
+    const char* sp2 = (const char*)memchr(sp1 + 1, ' ', end - sp1 - 1);
+    if (sp2 == nullptr || sp2 == sp1 + 1) {
+        log_message(LogLevel::DEBUG, "invalid request line, no full address");
+        return false;
+    }
+    if (end - sp2 < 6 || memcmp(sp2 + 1, "HTTP/", 5) != 0) {
+        log_message(LogLevel::DEBUG, "invalid request line, unsupported version %.*s", (int)(end - sp2 - 1), sp2 + 1);
+        return false;
     }
-    this->protocol = protocol_ptr;
 
-    const char* rem = full_addr + strlen(protocol_ptr) + strlen("://");
-     size_t abs_uri_len = strlen(rem);
+    method_ = {line.off, (uint32_t)(sp1 - start)};
+    target_ = {(uint32_t)(sp1 + 1 - buf), (uint32_t)(sp2 - sp1 - 1)};
+    version_ = {(uint32_t)(sp2 + 1 - buf), (uint32_t)(end - sp2 - 1)};
+    return true;
+}
 
-    char* host_ptr = strtok_r(nullptr, "/", &saveptr);
-    if (host_ptr == nullptr) {
-        std::cerr << "invalid request line, missing host" << std::endl;
-        return -1;
+bool ParsedRequest::parse_header_line(const char* buf, Span line, size_t colon_pos) {
+    if (colon_pos == SCAN_NOT_FOUND) {
+        // Not a header; skip it
+        return true;
     }
+    const char* start = buf + line.off;
+    const char* colon = buf + colon_pos;
+    if (num_headers == MAX_REQUEST_HEADERS) {
+        log_message(LogLevel::DEBUG, "too many headers");
+        return false;
+    }
+    Span key{line.off, (uint32_t)(colon - start)};
+    Span value{(uint32_t)(colon + 1 - buf), (uint32_t)(line.len - key.len - 1)};
+    trim_ows(buf, value.off, value.len);
+    header_spans_[num_headers] = {{line.off, line.len + 2}, key, value};
+    num_headers++;
+    return true;
+}
 
-    if (strlen(host_ptr) == abs_uri_len) {
-        std::cerr << "invalid request line, missing absolute path" << std::endl;
-        return -1;
+// Turns the spans into views of buf, splits the target into protocol, host,
+// port and path, and works out the body length.
+bool ParsedRequest::finish_head(const char* buf) {
+    // The views are of this call's buffer; a later call whose buffer has
+    // moved takes them again
+    base_ = buf;
+    for (size_t i = 0; i < num_headers; i++) {
+        const HeaderSpans& spans = header_spans_[i];
+        headers[i] = {view(buf, spans.key), view(buf, spans.value), view(buf, spans.line)};
+    }
+    method = view(buf, method_);
+    version = view(buf, version_);
+
+    std::string_view target = view(buf, target_);
+    std::string_view authority;
+    if (method == "CONNECT") {
+        // Authority-form, "host:port", with no scheme or path
+        if (target.find('/') != std::string_view::npos || target.find(':') == std::string_view::npos) {
+            log_message(LogLevel::DEBUG, "invalid CONNECT target %.*s", (int)target.size(), target.data());
+            return false;
+        }
+        authority = target;
+    }
+    else {
+        size_t scheme_end = target.find("://");
+        if (scheme_end == std::string_view::npos || scheme_end == 0) {
+            log_message(LogLevel::DEBUG, "invalid request line, missing protocol");
+            return false;
+        }
+        protocol = target.substr(0, scheme_end);
+        authority = target.substr(scheme_end + 3);
+        size_t slash = authority.find('/');
+        if (slash != std::string_view::npos) {
+            path = authority.substr(slash);
+            authority = authority.substr(0, slash);
+        }
+        else {
+            path = root_abs_path;
+        }
+    }
+    size_t colon = authority.find(':');
+    host = authority.substr(0, colon);
+    if (host.empty()) {
+        log_message(LogLevel::DEBUG, "invalid request line, missing host");
+        return false;
+    }
+    if (colon != std::string_view::npos) {
+        port = authority.substr(colon + 1);
+        int port_num = 0;
+        for (char c : port) {
+            if (c < '0' || c > '9' || port_num > 65535) {
+                port_num = -1;
+                break;
+            }
+            port_num = port_num * 10 + (c - '0');
+        }
+        if (port_num <= 0 || port_num > 65535) {
+            log_message(LogLevel::DEBUG, "invalid port number: %.*s", (int)port.size(), port.data());
+            return false;
+        }
     }
 
-    char* path_ptr = strtok_r(nullptr, " ", &saveptr);
-    if (path_ptr == nullptr) {
-        this->path = "/";
-    } else {
-        this->path = std::string("/") + path_ptr;
+    if (get_header("Transfer-Encoding") != nullptr) {
+        return false;
+    }
+    size_t body_len = 0;
+    const ParsedHeader* length = get_header("Content-Length");
+    if (length != nullptr) {
+        for (char c : length->value) {
+            if (c < '0' || c > '9' || body_len > MAX_REQ_LEN) return false;
+            body_len = body_len * 10 + (c - '0');
+        }
     }
+    length_ = line_start_ + body_len;
+    return true;
+}
 
-    char* port_ptr = nullptr;
-    char* host_saveptr = nullptr;
-    this->host = strtok_r(host_ptr, ":", &host_saveptr);
-    port_ptr = strtok_r(nullptr, "/", &host_saveptr);
+long ParsedRequest::parse(const char* buf, size_t len) {
+    while (state_ == REQUEST_LINE || state_ == HEADERS) {
+        // One pass finds the line's end and the delimiter that splits it
+        size_t nl_pos = scan_line(buf, scanned_, len, state_ == REQUEST_LINE ? ' ' : ':', mark_);
+        if (nl_pos == len) {
+            scanned_ = len;
+            if (len - line_start_ > MAX_REQ_LEN || line_start_ > MAX_REQ_LEN) {
+                state_ = FAILED;
+                return -1;
+            }
+            return 0;
+        }
+        if (nl_pos == line_start_ || buf[nl_pos - 1] != '\r') {
+            log_message(LogLevel::DEBUG, "invalid request, line not ended by CRLF");
+            state_ = FAILED;
+            return -1;
+        }
+        Span line{(uint32_t)line_start_, (uint32_t)(nl_pos - 1 - line_start_)};
+        size_t mark = mark_;
+        line_start_ = scanned_ = nl_pos + 1;
+        mark_ = SCAN_NOT_FOUND;
+        if (line_start_ > MAX_REQ_LEN) {
+            state_ = FAILED;
+            return -1;
+        }
 
-    if (port_ptr != nullptr) {
-        this->port = port_ptr;
-        try {
-            int port_num = std::stoi(this->port);
-            if (port_num <= 0 || port_num > 65535) {
-                 std::cerr << "invalid port number: " << this->port << std::endl;
-                 return -1;
+        if (state_ == REQUEST_LINE) {
+            if (line.len == 0) continue;        // stray CRLF before the request
+            if (line.len < MIN_REQ_LEN || !parse_request_line(buf, line, mark)) {
+                state_ = FAILED;
+                return -1;
             }
-        } catch (const std::invalid_argument& ia) {
-            std::cerr << "invalid request line, bad port: " << this->port << std::endl;
+            state_ = HEADERS;
+        }
+        else if (line.len == 0) {
+            // The blank line ending the head
+            if (!finish_head(buf)) {
+                state_ = FAILED;
+                return -1;
+            }
+            state_ = BODY;
+        }
+        else if (!parse_header_line(buf, line, mark)) {
+            state_ = FAILED;
             return -1;
         }
     }
 
-     /* Parse headers */
-    currentHeader = strstr(tmp_buf.get(), "\r\n") + 2;
-    while (currentHeader[0] != '\0' && !(currentHeader[0] == '\r' && currentHeader[1] == '\n')) {
-        char* nextHeader = strstr(currentHeader, "\r\n");
-        if (nextHeader == nullptr) break;
+    if (state_ == FAILED) return -1;
+    if (len < length_) return 0;
+    if (buf != base_ && !finish_head(buf)) {
+        // Unreachable in practice: the head already parsed once
+        state_ = FAILED;
+        return -1;
+    }
+    state_ = DONE;
+    return (long)length_;
+}
 
-        char* colon = strchr(currentHeader, ':');
-        if (colon == nullptr || colon > nextHeader) {
-            currentHeader = nextHeader + 2;
-            continue;
+std::string_view find_response_header(std::string_view response, std::string_view key) {
+    size_t end = response.find("\r\n\r\n");
+    if (end == std::string_view::npos) {
+        return {};
+    }
+    std::string_view head = response.substr(0, end + 2);
+
+    // Skip the status line
+    size_t line = head.find("\r\n");
+    while (line != std::string_view::npos && line + 2 < head.size()) {
+        size_t start = line + 2;
+        size_t next = head.find("\r\n", start);
+        if (next == std::string_view::npos) break;
+        std::string_view field = head.substr(start, next - start);
+        size_t colon = field.find(':');
+        if (colon != std::string_view::npos && header_name_equals(field.substr(0, colon), key)) {
+            std::string_view value = field.substr(colon + 1);
+            while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+            while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) value.remove_suffix(1);
+            return value;
         }
-
-        std::string key(currentHeader, colon - currentHeader);
-        char* value_start = colon + 1;
-        while (*value_start == ' ') value_start++;
-        std::string value(value_start, nextHeader - value_start);
-
-        set_header(key, value);
-
-        currentHeader = nextHeader + 2;
+        line = next;
     }
-
-    return 0;
-}
\ No newline at end of file
+    return {};
+}
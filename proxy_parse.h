@@ -3,25 +3,40 @@
  *
  * Written by: Matvey Arye, refactored to C++ by Gemini Code Assist.
  */
+#include "proxy_scan.h"
 #include <iostream>
 #include <string>
 #include <vector>
 #include <memory>
 #include <string_view>
 #include <algorithm>
+#include <deque>
+#include <cstdint>
  
 #ifndef PROXY_PARSE
 #define PROXY_PARSE
 
+#define MAX_REQUEST_HEADERS 100     //headers accepted in one request
+#define MAX_REQ_LEN 65535           //longest request head (or body) accepted
+
 /* 
    ParsedRequest objects are created from parsing a buffer containing a HTTP
    request.
+
+   The parser works in place: the fields and headers are string_views into
+   the caller's buffer, and headers live in a fixed-size table, so parsing
+   does no heap allocation. It is incremental. Call parse() again as more of
+   the request arrives, with the same buffer grown (it may have moved) and it
+   carries on from the line it stopped at. Once parse() reports the request
+   complete, the buffer must stay put and unchanged for as long as the
+   request is used.
  */
 class ParsedRequest {
 public:
     struct ParsedHeader {
-        std::string key;
-        std::string value;
+        std::string_view key;
+        std::string_view value;
+        std::string_view line;      // the header as received, CRLF included; empty once set_header() has changed it
     };
 
     ParsedRequest() = default;
@@ -31,52 +46,104 @@ public:
     ParsedRequest(const ParsedRequest&) = delete;
     ParsedRequest& operator=(const ParsedRequest&) = delete;
 
-    // Parse the request buffer
-    int parse(const char* buf, int buflen);
+    // Parses the request at the start of buf. Returns its length (head plus
+    // any Content-Length body) once all of it is in buf, 0 while more bytes
+    // are needed, or -1 if it is malformed, too large or has a body framing
+    // we don't support.
+    long parse(const char* buf, size_t len);
+
+    // Forgets the parsed request, ready to parse another
+    void reset();
 
     // Unparse the request into a string
-    std::string unparse();
+    std::string unparse() const;
 
     // Unparse only headers into a string
-    std::string unparse_headers();
-
-    // Getters
-    const std::string& get_method() const { return method; }
-    const std::string& get_protocol() const { return protocol; }
-    const std::string& get_host() const { return host; }
-    const std::string& get_port() const { return port; }
-    const std::string& get_path() const { return path; }
-    const std::string& get_version() const { return version; }
-
-    // Header manipulation
-    void set_header(const std::string& key, const std::string& value);
-    ParsedHeader* get_header(std::string_view key);
-    bool remove_header(const std::string& key);
+    std::string unparse_headers() const;
+
+    // Appends the headers and the blank line ending the head to out, which
+    // can be reused across requests. Headers that arrived and weren't changed
+    // are copied as received, a run of adjacent ones in one go; only those
+    // added or changed by set_header() are formatted.
+    void write_headers(std::string& out) const;
+
+    // Length write_headers() will append, for sizing the buffer up front
+    size_t headers_length() const;
+
+    // Getters. For CONNECT, protocol and path are empty and host and port
+    // name the tunnel's target.
+    std::string_view get_method() const { return method; }
+    std::string_view get_protocol() const { return protocol; }
+    std::string_view get_host() const { return host; }
+    std::string_view get_port() const { return port; }
+    std::string_view get_path() const { return path; }
+    std::string_view get_version() const { return version; }
+
+    // Header manipulation. set_header() copies key and value, so they need
+    // not outlive the call; only modified requests pay for that.
+    void set_header(std::string_view key, std::string_view value);
+    const ParsedHeader* get_header(std::string_view key) const;
+    bool remove_header(std::string_view key);
 
 private:
-    std::string method;
-    std::string protocol;
-    std::string host;
-    std::string port;
-    std::string path;
-    std::string version;
-    std::vector<ParsedHeader> headers;
+    // Offsets into the buffer, kept while parsing because the buffer may
+    // move between calls. Turned into views once the request is complete.
+    struct Span {
+        uint32_t off = 0;
+        uint32_t len = 0;
+    };
+    enum State { REQUEST_LINE, HEADERS, BODY, DONE, FAILED };
+
+    bool parse_request_line(const char* buf, Span line, size_t first_space);
+    bool parse_header_line(const char* buf, Span line, size_t colon);
+    bool finish_head(const char* buf);
+    std::string_view view(const char* buf, Span span) const { return std::string_view(buf + span.off, span.len); }
+
+    State state_ = REQUEST_LINE;
+    size_t line_start_ = 0;       // start of the line being parsed
+    size_t scanned_ = 0;          // how far the search for its end has got
+    size_t mark_ = SCAN_NOT_FOUND; // its first ' ' (request line) or ':' (header), once seen
+    size_t length_ = 0;           // head plus body, once the head is parsed
+    const char* base_ = nullptr;  // buffer the views below point into
+
+    Span method_, target_, version_;
+    struct HeaderSpans {
+        Span line, key, value;
+    };
+    HeaderSpans header_spans_[MAX_REQUEST_HEADERS];
+
+    std::string_view method;
+    std::string_view protocol;
+    std::string_view host;
+    std::string_view port;
+    std::string_view path;
+    std::string_view version;
+    ParsedHeader headers[MAX_REQUEST_HEADERS];
+    size_t num_headers = 0;
+    // Storage for keys and values added by set_header()
+    std::deque<std::string> owned_;
 };
 
+/*
+   Returns the value of header key in the head of an HTTP response (the bytes
+   up to the first blank line), or an empty view if the header is absent.
+ */
+std::string_view find_response_header(std::string_view response, std::string_view key);
+
 /* Example usage:
 
    const char *c = 
-   "GET http://www.google.com:80/index.html/ HTTP/1.0\r\nContent-Length:"
-   " 80\r\nIf-Modified-Since: Sat, 29 Oct 1994 19:43:31 GMT\r\n\r\n";
+   "GET http://www.google.com:80/index.html/ HTTP/1.0\r\nAccept:"
+   " text/html\r\nIf-Modified-Since: Sat, 29 Oct 1994 19:43:31 GMT\r\n\r\n";
    
    auto req = std::make_unique<ParsedRequest>();
-   if (req->parse(c, strlen(c)) < 0) {
+   if (req->parse(c, strlen(c)) <= 0) {
        printf("parse failed\n");
        return -1;
    }
 
-   printf("Method:%s\n", req->get_method().c_str());
-   printf("Host:%s\n", req->get_host().c_str());
+   std::cout << "Method:" << req->get_method() << "\n";
+   std::cout << "Host:" << req->get_host() << "\n";
 
    // Turn ParsedRequest into a string. 
    std::string request_str = req->unparse();
@@ -90,7 +157,7 @@ private:
    // such as "If-Modified-Since" which is followed by ":"
    auto* r = req->get_header("If-Modified-Since");
    if (r) {
-       printf("Modified value: %s\n", r->value.c_str());
+       std::cout << "Modified value: " << r->value << "\n";
    }
    
    // Remove a specific header by name. In this case remove
@@ -109,7 +176,7 @@ private:
    // Check the modified Header key value pair
     r = req->get_header("Last-Modified");
     if (r) {
-        printf("Last-Modified value: %s\n", r->value.c_str());
+        std::cout << "Last-Modified value: " << r->value << "\n";
     }
 */
 
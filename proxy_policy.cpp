@@ -0,0 +1,201 @@
+/*
+  proxy_policy.cpp -- LRU and W-TinyLFU cache policies.
+*/
+
+#include "proxy_policy.h"
+#include "proxy_cache.h"
+
+void CacheList::push_front(CacheElement* element) {
+    element->prev = nullptr;
+    element->next = head;
+    if (head) head->prev = element;
+    head = element;
+    if (tail == nullptr) tail = element;
+    bytes += element->charge;
+}
+
+void CacheList::unlink(CacheElement* element) {
+    if (element->prev) element->prev->next = element->next;
+    else head = element->next;
+    if (element->next) element->next->prev = element->prev;
+    else tail = element->prev;
+    element->prev = element->next = nullptr;
+    bytes -= element->charge;
+}
+
+void CacheList::move_to_front(CacheElement* element) {
+    if (element == head) return;
+    unlink(element);
+    push_front(element);
+}
+
+void LruPolicy::on_hit(CacheElement* element) {
+    list_.move_to_front(element);
+}
+
+void LruPolicy::on_insert(CacheElement* element, std::vector<CacheElement*>& evicted) {
+    element->segment = CacheSegment::MAIN;
+    list_.push_front(element);
+    while (list_.bytes > max_size_ && list_.tail != element) {
+        CacheElement* victim = list_.tail;
+        list_.unlink(victim);
+        victim->segment = CacheSegment::NONE;
+        evicted.push_back(victim);
+    }
+}
+
+void LruPolicy::on_remove(CacheElement* element) {
+    list_.unlink(element);
+    element->segment = CacheSegment::NONE;
+}
+
+CacheElement* LruPolicy::pop_victim() {
+    CacheElement* victim = list_.tail;
+    if (victim) on_remove(victim);
+    return victim;
+}
+
+// Odd multipliers giving each sketch row its own hash of the key
+static const uint64_t sketch_seeds[4] = {
+    0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL, 0x9ae16a3b2f90404fULL, 0x9e3779b97f4a7c15ULL
+};
+
+FrequencySketch::FrequencySketch(size_t width) {
+    width_ = 64;
+    while (width_ < width) width_ <<= 1;
+    counters_.assign(4 * width_, 0);
+    sample_size_ = 10 * width_;
+}
+
+size_t FrequencySketch::index(size_t hash, int row) const {
+    uint64_t h = (uint64_t)hash * sketch_seeds[row];
+    h ^= h >> 32;
+    return (size_t)row * width_ + (size_t)(h & (width_ - 1));
+}
+
+void FrequencySketch::increment(size_t hash) {
+    for (int row = 0; row < 4; row++) {
+        uint8_t& counter = counters_[index(hash, row)];
+        if (counter < 15) counter++;
+    }
+    if (++additions_ >= sample_size_) {
+        for (auto& counter : counters_) counter >>= 1;
+        additions_ /= 2;
+    }
+}
+
+unsigned FrequencySketch::estimate(size_t hash) const {
+    unsigned least = 15;
+    for (int row = 0; row < 4; row++) {
+        unsigned counter = counters_[index(hash, row)];
+        if (counter < least) least = counter;
+    }
+    return least;
+}
+
+TinyLfuPolicy::TinyLfuPolicy(size_t max_size)
+    : window_max_(max_size * TINYLFU_WINDOW_PERCENT / 100),
+      main_max_(max_size - window_max_),
+      protected_max_(main_max_ * TINYLFU_PROTECTED_PERCENT / 100),
+      sketch_(max_size / TINYLFU_SKETCH_BYTES_PER_ENTRY) {}
+
+CacheList& TinyLfuPolicy::list_for(CacheSegment segment) {
+    if (segment == CacheSegment::WINDOW) return window_;
+    if (segment == CacheSegment::PROTECTED) return protected_;
+    return probation_;
+}
+
+void TinyLfuPolicy::record_access(size_t hash) {
+    sketch_.increment(hash);
+}
+
+void TinyLfuPolicy::on_hit(CacheElement* element) {
+    if (element->segment == CacheSegment::PROBATION) {
+        // Used again since it was admitted: worth protecting
+        probation_.unlink(element);
+        element->segment = CacheSegment::PROTECTED;
+        protected_.push_front(element);
+        demote_protected();
+        return;
+    }
+    list_for(element->segment).move_to_front(element);
+}
+
+void TinyLfuPolicy::demote_protected() {
+    while (protected_.bytes > protected_max_ && protected_.tail != nullptr) {
+        CacheElement* demoted = protected_.tail;
+        protected_.unlink(demoted);
+        demoted->segment = CacheSegment::PROBATION;
+        probation_.push_front(demoted);
+    }
+}
+
+void TinyLfuPolicy::on_insert(CacheElement* element, std::vector<CacheElement*>& evicted) {
+    element->segment = CacheSegment::WINDOW;
+    window_.push_front(element);
+    while (window_.bytes > window_max_ && window_.tail != nullptr) {
+        CacheElement* candidate = window_.tail;
+        window_.unlink(candidate);
+        admit(candidate, evicted);
+    }
+}
+
+void TinyLfuPolicy::admit(CacheElement* candidate, std::vector<CacheElement*>& evicted) {
+    size_t main_bytes = probation_.bytes + protected_.bytes;
+    if (main_bytes + candidate->charge > main_max_) {
+        // Find the victims that would make room, least valuable first; the
+        // candidate must be more popular than each of them
+        size_t need = main_bytes + candidate->charge - main_max_;
+        unsigned frequency = sketch_.estimate(candidate->url_hash);
+        size_t freed = 0;
+        size_t victims = 0;
+        CacheElement* victim = probation_.tail;
+        bool in_probation = true;
+        while (freed < need) {
+            if (victim == nullptr && in_probation) {
+                victim = protected_.tail;
+                in_probation = false;
+            }
+            if (victim == nullptr || sketch_.estimate(victim->url_hash) >= frequency) {
+                candidate->segment = CacheSegment::NONE;
+                evicted.push_back(candidate);
+                return;
+            }
+            freed += victim->charge;
+            victims++;
+            victim = victim->prev;
+        }
+        for (size_t i = 0; i < victims; i++) {
+            evicted.push_back(pop_main_victim());
+        }
+    }
+    candidate->segment = CacheSegment::PROBATION;
+    probation_.push_front(candidate);
+}
+
+CacheElement* TinyLfuPolicy::pop_main_victim() {
+    CacheList& list = probation_.tail != nullptr ? probation_ : protected_;
+    CacheElement* victim = list.tail;
+    if (victim) on_remove(victim);
+    return victim;
+}
+
+void TinyLfuPolicy::on_remove(CacheElement* element) {
+    list_for(element->segment).unlink(element);
+    element->segment = CacheSegment::NONE;
+}
+
+CacheElement* TinyLfuPolicy::pop_victim() {
+    if (probation_.tail == nullptr && protected_.tail == nullptr) {
+        CacheElement* victim = window_.tail;
+        if (victim) on_remove(victim);
+        return victim;
+    }
+    return pop_main_victim();
+}
+
+std::unique_ptr<CachePolicy> make_cache_policy(const std::string& name, size_t max_size) {
+    if (name == "lru") return std::make_unique<LruPolicy>(max_size);
+    if (name == "tinylfu") return std::make_unique<TinyLfuPolicy>(max_size);
+    return nullptr;
+}
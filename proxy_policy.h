@@ -0,0 +1,159 @@
+/*
+ * proxy_policy.h -- admission and eviction policies for cache shards.
+ */
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+#ifndef PROXY_POLICY
+#define PROXY_POLICY
+
+#define DEFAULT_CACHE_POLICY "tinylfu"
+#define TINYLFU_WINDOW_PERCENT 1        //share of a shard's bytes given to the admission window
+#define TINYLFU_PROTECTED_PERCENT 80    //share of the main area kept for entries hit twice
+#define TINYLFU_SKETCH_BYTES_PER_ENTRY 4096   //shard bytes per sketch counter column
+
+class CacheElement;
+
+// Which list of its policy an element is on
+enum class CacheSegment : uint8_t { NONE, MAIN, WINDOW, PROBATION, PROTECTED };
+
+// An intrusive doubly-linked recency list of CacheElements with a byte total:
+// head is the most recently used, tail the least.
+struct CacheList {
+    CacheElement* head = nullptr;
+    CacheElement* tail = nullptr;
+    size_t bytes = 0;
+
+    void push_front(CacheElement* element);
+    void unlink(CacheElement* element);
+    void move_to_front(CacheElement* element);
+};
+
+/*
+   CachePolicy decides which elements a shard keeps. The shard owns the
+   elements and their index; the policy owns the order they are kept in and
+   picks what leaves. Every call is made with the shard lock held.
+ */
+class CachePolicy {
+public:
+    virtual ~CachePolicy() = default;
+
+    virtual const char* name() const = 0;
+
+    // A lookup of the url with this hash (see CacheElement::url_hash), hit
+    // or miss.
+    virtual void record_access(size_t hash) { (void)hash; }
+
+    // How often the url with this hash has been asked for recently, as far as
+    // the policy keeps count (0 if it doesn't).
+    virtual unsigned frequency(size_t hash) const { (void)hash; return 0; }
+
+    // Bytes the policy allocates for its own state, apart from the elements.
+    virtual size_t bytes() const { return 0; }
+
+    // element was found by a lookup.
+    virtual void on_hit(CacheElement* element) = 0;
+
+    // Takes a new element and appends to evicted whatever must leave so the
+    // shard stays within budget, possibly element itself if it isn't worth
+    // admitting. Evicted elements are already off the policy's lists.
+    virtual void on_insert(CacheElement* element, std::vector<CacheElement*>& evicted) = 0;
+
+    // Forgets an element the shard is dropping for its own reasons.
+    virtual void on_remove(CacheElement* element) = 0;
+
+    // Takes the least valuable element off the policy's lists and returns it,
+    // or nullptr if there is none.
+    virtual CacheElement* pop_victim() = 0;
+};
+
+/*
+   LruPolicy keeps one recency list and evicts from its tail until the new
+   element fits. Everything is admitted.
+ */
+class LruPolicy : public CachePolicy {
+public:
+    explicit LruPolicy(size_t max_size) : max_size_(max_size) {}
+
+    const char* name() const override { return "lru"; }
+    void on_hit(CacheElement* element) override;
+    void on_insert(CacheElement* element, std::vector<CacheElement*>& evicted) override;
+    void on_remove(CacheElement* element) override;
+    CacheElement* pop_victim() override;
+
+private:
+    CacheList list_;
+    size_t max_size_;
+};
+
+/*
+   FrequencySketch is a count-min sketch, with counters capped at 15, estimating
+   how often each key has been asked for recently. Once it has counted ten
+   times as many accesses as it has columns, every counter is halved, so old
+   popularity fades.
+ */
+class FrequencySketch {
+public:
+    explicit FrequencySketch(size_t width);
+
+    void increment(size_t hash);
+    unsigned estimate(size_t hash) const;
+
+    size_t bytes() const { return counters_.capacity(); }
+
+private:
+    size_t index(size_t hash, int row) const;
+
+    std::vector<uint8_t> counters_;   // 4 rows of width_ counters
+    size_t width_;
+    size_t additions_ = 0;
+    size_t sample_size_;
+};
+
+/*
+   TinyLfuPolicy is W-TinyLFU sized in bytes. New elements enter a small LRU
+   window. Elements pushed out of the window are candidates for the main
+   area, a segmented LRU of probation and protected lists. A candidate is
+   admitted only if the frequency sketch says it is asked for more often
+   than every main-area element that would have to go to make room for it;
+   otherwise the candidate itself is dropped. So a one-off scan passes
+   through the window without flushing entries that are used repeatedly.
+   A hit in probation promotes the element to protected, whose overflow is
+   demoted back to probation.
+ */
+class TinyLfuPolicy : public CachePolicy {
+public:
+    explicit TinyLfuPolicy(size_t max_size);
+
+    const char* name() const override { return "tinylfu"; }
+    void record_access(size_t hash) override;
+    unsigned frequency(size_t hash) const override { return sketch_.estimate(hash); }
+    size_t bytes() const override { return sketch_.bytes(); }
+    void on_hit(CacheElement* element) override;
+    void on_insert(CacheElement* element, std::vector<CacheElement*>& evicted) override;
+    void on_remove(CacheElement* element) override;
+    CacheElement* pop_victim() override;
+
+private:
+    CacheList& list_for(CacheSegment segment);
+    void admit(CacheElement* candidate, std::vector<CacheElement*>& evicted);
+    CacheElement* pop_main_victim();
+    void demote_protected();
+
+    CacheList window_;
+    CacheList probation_;
+    CacheList protected_;
+    size_t window_max_;
+    size_t main_max_;
+    size_t protected_max_;
+    FrequencySketch sketch_;
+};
+
+// Returns a new policy by name ("lru" or "tinylfu") for a shard of max_size
+// bytes, or nullptr for an unknown name.
+std::unique_ptr<CachePolicy> make_cache_policy(const std::string& name, size_t max_size);
+
+#endif
@@ -0,0 +1,149 @@
+/*
+  proxy_pool.cpp -- work-stealing worker pool.
+*/
+
+#include "proxy_pool.h"
+
+WorkerPool::~WorkerPool() {
+    drain();
+}
+
+void WorkerPool::start(size_t num_workers, size_t max_queued) {
+    if (num_workers == 0) num_workers = 1;
+    max_queued_ = max_queued;
+    for (size_t i = 0; i < num_workers; i++) workers_.push_back(std::make_unique<Worker>());
+    for (size_t i = 0; i < num_workers; i++) threads_.emplace_back(&WorkerPool::work, this, i);
+}
+
+// Raises peak to at least value
+template <typename T>
+static void raise_to(std::atomic<T>& peak, T value) {
+    T seen = peak.load(std::memory_order_relaxed);
+    while (value > seen && !peak.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+}
+
+bool WorkerPool::submit(std::function<void()> task) {
+    submitted_.fetch_add(1, std::memory_order_relaxed);
+    if (workers_.empty()) {
+        rejected_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    // Claim a place in the queue, then check for a drain: drain() sets
+    // draining_ before its workers look at queued_, so either this task is
+    // refused or they wait for it
+    size_t queued = queued_.load();
+    do {
+        if (queued >= max_queued_) {
+            rejected_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    } while (!queued_.compare_exchange_weak(queued, queued + 1));
+    if (draining_) {
+        queued_.fetch_sub(1);
+        rejected_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    raise_to(max_queued_seen_, queued + 1);
+
+    Worker& worker = *workers_[next_.fetch_add(1, std::memory_order_relaxed) % workers_.size()];
+    {
+        std::lock_guard<std::mutex> guard(worker.lock);
+        worker.tasks.push_back(Task{std::move(task), std::chrono::steady_clock::now()});
+        ready_.fetch_add(1);
+    }
+    wake();
+    return true;
+}
+
+void WorkerPool::wake() {
+    // A worker counts itself idle before it looks at ready_, and this runs
+    // after ready_ went up, so one of the two sees the other. Taking lock_
+    // waits out a worker between its check and its wait.
+    if (idle_.load() == 0) return;
+    { std::lock_guard<std::mutex> guard(lock_); }
+    cv_.notify_one();
+}
+
+bool WorkerPool::take(size_t self, Task& task) {
+    {
+        Worker& own = *workers_[self];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.front());
+            own.tasks.pop_front();
+            ready_.fetch_sub(1);
+            queued_.fetch_sub(1);
+            return true;
+        }
+    }
+    for (size_t i = 1; i < workers_.size(); i++) {
+        Worker& victim = *workers_[(self + i) % workers_.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.back());
+            victim.tasks.pop_back();
+            ready_.fetch_sub(1);
+            queued_.fetch_sub(1);
+            steals_.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkerPool::work(size_t self) {
+    while (true) {
+        Task task;
+        if (!take(self, task)) {
+            std::unique_lock<std::mutex> lock(lock_);
+            idle_.fetch_add(1);
+            cv_.wait(lock, [this]() { return stopping_ || ready_.load() > 0; });
+            idle_.fetch_sub(1);
+            if (ready_.load() > 0) continue;
+            // Stopping: finish once no submit() still holds a place in the
+            // queue, else wait for its task to reach a deque
+            if (queued_.load() == 0) return;
+            lock.unlock();
+            std::this_thread::yield();
+            continue;
+        }
+
+        uint64_t waited = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - task.queued_at).count();
+        busy_.fetch_add(1, std::memory_order_relaxed);
+        total_wait_ns_.fetch_add(waited, std::memory_order_relaxed);
+        raise_to(max_wait_ns_, waited);
+
+        task.run();
+
+        busy_.fetch_sub(1, std::memory_order_relaxed);
+        completed_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void WorkerPool::drain() {
+    draining_ = true;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& thread : threads_) {
+        if (thread.joinable()) thread.join();
+    }
+    threads_.clear();
+}
+
+PoolStats WorkerPool::stats() const {
+    PoolStats stats;
+    stats.workers = workers_.size();
+    stats.busy = busy_.load(std::memory_order_relaxed);
+    stats.queued = queued_.load(std::memory_order_relaxed);
+    stats.max_queued = max_queued_seen_.load(std::memory_order_relaxed);
+    stats.submitted = submitted_.load(std::memory_order_relaxed);
+    stats.rejected = rejected_.load(std::memory_order_relaxed);
+    stats.completed = completed_.load(std::memory_order_relaxed);
+    stats.steals = steals_.load(std::memory_order_relaxed);
+    stats.total_wait_ms = total_wait_ns_.load(std::memory_order_relaxed) / 1e6;
+    stats.max_wait_ms = max_wait_ns_.load(std::memory_order_relaxed) / 1e6;
+    return stats;
+}
@@ -0,0 +1,117 @@
+/*
+ * proxy_pool.h -- fixed-size work-stealing pool for client connections.
+ */
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#ifndef PROXY_POOL
+#define PROXY_POOL
+
+#define POOL_QUEUE_LIMIT 256    //connections waiting for a worker before new ones are turned away
+
+// Counters exposed by WorkerPool.
+struct PoolStats {
+    size_t workers = 0;
+    size_t busy = 0;            // workers running a task right now
+    size_t queued = 0;          // tasks waiting right now
+    size_t max_queued = 0;      // deepest the queue has been
+    size_t submitted = 0;
+    size_t rejected = 0;        // turned away because the queue was full
+    size_t completed = 0;
+    size_t steals = 0;          // tasks a worker took from another's deque
+    double total_wait_ms = 0;   // time tasks spent queued, summed
+    double max_wait_ms = 0;
+
+    double mean_wait_ms() const { return completed + busy ? total_wait_ms / (completed + busy) : 0; }
+};
+
+/*
+   WorkerPool runs tasks on a fixed set of threads. Each worker has its own
+   deque; submit() deals tasks round-robin onto the back of the deques, and a
+   worker takes from the front of its own and, when that is empty, steals
+   from the back of the others', so one worker held up by a slow task
+   doesn't strand the ones queued behind it. Pushing, taking and stealing
+   lock only the deque involved, and the counters are atomic; the pool-wide
+   lock is taken only to put a worker to sleep or wake one. At most
+   max_queued tasks wait at once: submit() refuses the rest so the caller
+   can shed load instead of blocking.
+ */
+class WorkerPool {
+public:
+    WorkerPool() = default;
+    // Drains the pool
+    ~WorkerPool();
+
+    // Disable copy and assignment
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    // Starts num_workers threads.
+    void start(size_t num_workers, size_t max_queued = POOL_QUEUE_LIMIT);
+
+    // Queues task. Returns false, without queueing it, if the queue is full
+    // or the pool is draining.
+    bool submit(std::function<void()> task);
+
+    // Refuses new tasks, lets the queued and running ones finish, and joins
+    // the workers.
+    void drain();
+
+    // True once drain() has begun; long-running tasks should wind down.
+    bool draining() const { return draining_; }
+
+    PoolStats stats() const;
+
+private:
+    struct Task {
+        std::function<void()> run;
+        std::chrono::steady_clock::time_point queued_at;
+    };
+    struct Worker {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    void work(size_t self);
+    // Takes a task from self's deque, or else steals one. Returns false if
+    // every deque is empty.
+    bool take(size_t self, Task& task);
+    // Wakes a sleeping worker, if there is one
+    void wake();
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+    size_t max_queued_ = 0;
+    std::atomic<size_t> next_{0};
+    std::atomic<bool> draining_{false};
+
+    // queued_ counts tasks submitted and not yet taken, ready_ those of them
+    // already in a deque. A worker sleeps only when ready_ is zero.
+    std::atomic<size_t> queued_{0};
+    std::atomic<size_t> ready_{0};
+    std::atomic<size_t> max_queued_seen_{0};
+    std::atomic<size_t> busy_{0};
+    std::atomic<size_t> submitted_{0};
+    std::atomic<size_t> rejected_{0};
+    std::atomic<size_t> completed_{0};
+    std::atomic<size_t> steals_{0};
+    std::atomic<uint64_t> total_wait_ns_{0};
+    std::atomic<uint64_t> max_wait_ns_{0};
+
+    // Only for sleeping: idle_ workers wait on cv_ under lock_
+    std::mutex lock_;
+    std::condition_variable cv_;
+    std::atomic<size_t> idle_{0};
+    bool stopping_ = false;
+};
+
+#endif
@@ -0,0 +1,129 @@
+/*
+  proxy_range.cpp -- Range parsing and 206/416 heads.
+*/
+
+#include "proxy_range.h"
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+bool name_is(std::string_view a, const char* b) {
+    size_t n = strlen(b);
+    if (a.size() != n) return false;
+    for (size_t i = 0; i < n; i++) {
+        if (tolower((unsigned char)a[i]) != b[i]) return false;
+    }
+    return true;
+}
+
+void trim(std::string_view& s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+}
+
+// Parses a run of decimal digits. Returns false if value is empty or holds
+// anything else.
+bool parse_offset(std::string_view value, uint64_t& n) {
+    if (value.empty() || value.size() > 19) return false;
+    n = 0;
+    for (char c : value) {
+        if (c < '0' || c > '9') return false;
+        n = n * 10 + (c - '0');
+    }
+    return true;
+}
+
+// Whether If-Range value still names the stored response: a strong entity
+// tag equal to its ETag, or a date equal to its Last-Modified.
+bool if_range_matches(std::string_view value, std::string_view head) {
+    if (!value.empty() && (value.front() == '"' || value.substr(0, 2) == "W/")) {
+        std::string_view etag = find_response_header(head, "ETag");
+        return value.front() == '"' && value == etag;
+    }
+    std::string_view last_modified = find_response_header(head, "Last-Modified");
+    return !last_modified.empty() && value == last_modified;
+}
+
+}  // namespace
+
+int response_status(std::string_view head) {
+    // "HTTP/1.x NNN ..."
+    if (head.size() < 12 || head.compare(0, 5, "HTTP/") != 0) return 0;
+    return atoi(std::string(head.substr(9, 3)).c_str());
+}
+
+RangeResult select_range(const ParsedRequest& request, std::string_view head, uint64_t length, ByteRange& range) {
+    const ParsedRequest::ParsedHeader* header = request.get_header("Range");
+    if (header == nullptr || response_status(head) != 200 || !find_response_header(head, "Transfer-Encoding").empty()) {
+        return RangeResult::NONE;
+    }
+    const ParsedRequest::ParsedHeader* if_range = request.get_header("If-Range");
+    if (if_range != nullptr) {
+        std::string_view value = if_range->value;
+        trim(value);
+        if (!if_range_matches(value, head)) return RangeResult::NONE;
+    }
+
+    std::string_view spec = header->value;
+    trim(spec);
+    size_t eq = spec.find('=');
+    if (eq == std::string_view::npos) return RangeResult::NONE;
+    std::string_view unit = spec.substr(0, eq);
+    trim(unit);
+    spec.remove_prefix(eq + 1);
+    trim(spec);
+    size_t dash = spec.find('-');
+    if (!name_is(unit, "bytes") || spec.find(',') != std::string_view::npos || dash == std::string_view::npos) {
+        return RangeResult::NONE;
+    }
+
+    std::string_view from = spec.substr(0, dash);
+    std::string_view to = spec.substr(dash + 1);
+    trim(from);
+    trim(to);
+    uint64_t first, last;
+    if (from.empty()) {
+        // The last n bytes
+        uint64_t n;
+        if (!parse_offset(to, n)) return RangeResult::NONE;
+        if (n == 0 || length == 0) return RangeResult::UNSATISFIABLE;
+        range.first = length > n ? length - n : 0;
+        range.last = length - 1;
+        return RangeResult::SATISFIABLE;
+    }
+    if (!parse_offset(from, first)) return RangeResult::NONE;
+    if (to.empty()) last = UINT64_MAX;
+    else if (!parse_offset(to, last) || last < first) return RangeResult::NONE;
+    if (first >= length) return RangeResult::UNSATISFIABLE;
+    range.first = first;
+    range.last = last < length - 1 ? last : length - 1;
+    return RangeResult::SATISFIABLE;
+}
+
+std::string partial_head(std::string_view head, const ByteRange& range, uint64_t length) {
+    std::string out = "HTTP/1.1 206 Partial Content\r\n";
+    // Copy every header but the ones the 206 replaces
+    size_t line = head.find("\r\n");
+    while (line != std::string_view::npos && line + 2 < head.size()) {
+        size_t start = line + 2;
+        size_t next = head.find("\r\n", start);
+        if (next == std::string_view::npos || next == start) break;
+        std::string_view field = head.substr(start, next - start);
+        std::string_view name = field.substr(0, field.find(':'));
+        trim(name);
+        if (!name_is(name, "content-length") && !name_is(name, "content-range")) {
+            out.append(field).append("\r\n");
+        }
+        line = next;
+    }
+    out += "Content-Range: bytes " + std::to_string(range.first) + "-" + std::to_string(range.last) + "/" + std::to_string(length) + "\r\n";
+    out += "Content-Length: " + std::to_string(range.length()) + "\r\n\r\n";
+    return out;
+}
+
+std::string unsatisfiable_head(uint64_t length) {
+    return "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */" + std::to_string(length) +
+           "\r\nContent-Length: 0\r\nConnection: keep-alive\r\n\r\n";
+}
@@ -0,0 +1,47 @@
+/*
+ * proxy_range.h -- byte range requests: Range and If-Range, and the heads of
+ * 206 and 416 responses.
+ */
+#include "proxy_parse.h"
+#include <string>
+#include <string_view>
+#include <cstdint>
+
+#ifndef PROXY_RANGE
+#define PROXY_RANGE
+
+// An inclusive span of body bytes.
+struct ByteRange {
+    uint64_t first = 0;
+    uint64_t last = 0;
+
+    uint64_t length() const { return last - first + 1; }
+};
+
+enum class RangeResult {
+    NONE,            // serve the whole response
+    SATISFIABLE,     // serve range as a 206
+    UNSATISFIABLE,   // answer 416
+};
+
+/*
+   Works out what part of a cached response request asks for. head is the
+   stored response's head and length its body length. Only a single range
+   ("bytes=a-b", "bytes=a-" or "bytes=-n") is served from the cache; several
+   ranges, a malformed Range, an If-Range that doesn't match head's
+   validators, or a stored response that isn't a plain 200 all get the whole
+   response, which RFC 9110 allows.
+ */
+RangeResult select_range(const ParsedRequest& request, std::string_view head, uint64_t length, ByteRange& range);
+
+// Rewrites head, a 200's head, into the head of a 206 carrying range of a
+// body of length bytes.
+std::string partial_head(std::string_view head, const ByteRange& range, uint64_t length);
+
+// The head of a 416 for a body of length bytes.
+std::string unsatisfiable_head(uint64_t length);
+
+// Status code on a response head's status line, or 0 if it has none.
+int response_status(std::string_view head);
+
+#endif
@@ -0,0 +1,200 @@
+/*
+  proxy_resolver.cpp -- resolver thread pool and name cache.
+*/
+
+#include "proxy_resolver.h"
+#include "proxy_metrics.h"
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cctype>
+
+Resolver::Resolver(size_t num_threads, int ttl, int negative_ttl)
+    : num_threads_(num_threads == 0 ? 1 : num_threads), ttl_(ttl), negative_ttl_(negative_ttl) {}
+
+Resolver::~Resolver() {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : threads_) t.join();
+}
+
+std::string Resolver::normalize(std::string_view host) {
+    std::string name(host);
+    for (auto& c : name) c = (char)tolower((unsigned char)c);
+    if (!name.empty() && name.back() == '.') name.pop_back();
+    return name;
+}
+
+ResolvedHostPtr Resolver::cached(std::string_view host) {
+    // Literal addresses need no lookup and aren't worth a cache slot
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, std::string(host).c_str(), &addr.sin_addr) == 1) {
+        auto answer = std::make_shared<ResolvedHost>();
+        answer->addrs.push_back(addr);
+        return answer;
+    }
+
+    std::string name = normalize(host);
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = static_.find(name);
+    if (it != static_.end()) {
+        stats_.hits++;
+        return it->second;
+    }
+    it = cache_.find(name);
+    if (it == cache_.end()) return nullptr;
+    if (it->second->expires <= time(NULL)) {
+        cache_.erase(it);
+        return nullptr;
+    }
+    stats_.hits++;
+    if (it->second->addrs.empty()) stats_.negative_hits++;
+    return it->second;
+}
+
+void Resolver::resolve(std::string_view host, std::function<void(ResolvedHostPtr)> done) {
+    ResolvedHostPtr answer = cached(host);
+    if (answer) {
+        done(answer);
+        return;
+    }
+
+    std::string name = normalize(host);
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        auto it = pending_.find(name);
+        if (it != pending_.end()) {
+            stats_.coalesced++;
+            it->second.push_back(std::move(done));
+            return;
+        }
+        pending_[name].push_back(std::move(done));
+        queue_.push_back(name);
+        if (threads_.empty()) {
+            for (size_t i = 0; i < num_threads_; i++) threads_.emplace_back(&Resolver::worker, this);
+        }
+    }
+    cv_.notify_one();
+}
+
+ResolvedHostPtr Resolver::resolve(std::string_view host) {
+    ResolvedHostPtr answer = cached(host);
+    if (answer) return answer;
+
+    std::mutex done_lock;
+    std::condition_variable done_cv;
+    ResolvedHostPtr result;
+    resolve(host, [&](ResolvedHostPtr r) {
+        std::lock_guard<std::mutex> guard(done_lock);
+        result = std::move(r);
+        done_cv.notify_one();
+    });
+    std::unique_lock<std::mutex> lock(done_lock);
+    done_cv.wait(lock, [&]() { return result != nullptr; });
+    return result;
+}
+
+// Runs the blocking lookup for name. Called without the lock held.
+ResolvedHostPtr Resolver::lookup(const std::string& name) {
+    auto answer = std::make_shared<ResolvedHost>();
+    struct addrinfo hints, *res = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    auto started = std::chrono::steady_clock::now();
+    int rc = getaddrinfo(name.c_str(), nullptr, &hints, &res);
+    metrics_record_origin(OriginStage::DNS, std::chrono::steady_clock::now() - started);
+    if (rc == 0) {
+        for (struct addrinfo* ai = res; ai != nullptr; ai = ai->ai_next) {
+            struct sockaddr_in addr;
+            memcpy(&addr, ai->ai_addr, sizeof(addr));
+            addr.sin_port = 0;
+            answer->addrs.push_back(addr);
+        }
+        freeaddrinfo(res);
+    }
+    answer->expires = time(NULL) + (answer->addrs.empty() ? negative_ttl_ : ttl_);
+    return answer;
+}
+
+void Resolver::store(const std::string& name, const ResolvedHostPtr& answer) {
+    if (cache_.size() >= MAX_DNS_CACHE_ENTRIES) {
+        time_t now = time(NULL);
+        for (auto it = cache_.begin(); it != cache_.end();) {
+            if (it->second->expires <= now) it = cache_.erase(it);
+            else ++it;
+        }
+        // Still full of live entries: make room by dropping any one
+        if (cache_.size() >= MAX_DNS_CACHE_ENTRIES) cache_.erase(cache_.begin());
+    }
+    cache_[name] = answer;
+}
+
+void Resolver::worker() {
+    while (true) {
+        std::string name;
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            cv_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+            if (stopping_) return;
+            name = std::move(queue_.front());
+            queue_.pop_front();
+            stats_.lookups++;
+        }
+
+        ResolvedHostPtr answer = lookup(name);
+
+        std::vector<std::function<void(ResolvedHostPtr)>> waiters;
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            if (answer->addrs.empty()) stats_.failures++;
+            store(name, answer);
+            auto it = pending_.find(name);
+            if (it != pending_.end()) {
+                waiters = std::move(it->second);
+                pending_.erase(it);
+            }
+        }
+        for (auto& done : waiters) done(answer);
+    }
+}
+
+int Resolver::load_hosts(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) return -1;
+
+    std::unordered_map<std::string, std::shared_ptr<ResolvedHost>> entries;
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t hash = line.find('#');
+        if (hash != std::string::npos) line.resize(hash);
+        std::istringstream fields(line);
+        std::string address, name;
+        if (!(fields >> address)) continue;
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) continue;
+
+        while (fields >> name) {
+            auto& entry = entries[normalize(name)];
+            if (!entry) entry = std::make_shared<ResolvedHost>();
+            entry->addrs.push_back(addr);
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(lock_);
+    for (auto& entry : entries) static_[entry.first] = std::move(entry.second);
+    return (int)entries.size();
+}
+
+ResolverStats Resolver::stats() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return stats_;
+}
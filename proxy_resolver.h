@@ -0,0 +1,99 @@
+/*
+ * proxy_resolver.h -- cached, asynchronous resolution of origin host names.
+ */
+#include "proxy_socket.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <ctime>
+#include <cstddef>
+
+#ifndef PROXY_RESOLVER
+#define PROXY_RESOLVER
+
+#define DNS_RESOLVER_THREADS 4       //threads running blocking getaddrinfo calls
+#define DNS_CACHE_TTL 60             //seconds a resolved name is cached
+#define DNS_NEGATIVE_TTL 5           //seconds a failed lookup is cached
+#define MAX_DNS_CACHE_ENTRIES 4096   //names kept in the resolver cache
+
+// The answer for one host name. An empty addrs means the lookup failed.
+struct ResolvedHost {
+    std::vector<struct sockaddr_in> addrs;    // sin_port is left 0
+    time_t expires = 0;                       // 0 for static (hosts file) entries
+};
+
+using ResolvedHostPtr = std::shared_ptr<const ResolvedHost>;
+
+// Counters exposed by Resolver.
+struct ResolverStats {
+    size_t hits = 0;            // answered from the cache, including negative entries
+    size_t negative_hits = 0;   // cache hits on a failed lookup
+    size_t lookups = 0;         // getaddrinfo calls made
+    size_t coalesced = 0;       // requests that joined a lookup already in flight
+    size_t failures = 0;        // lookups that found no address
+};
+
+/*
+   Resolver runs getaddrinfo on a small pool of threads, so a slow DNS server
+   stalls a lookup rather than the connection handler asking for it, and
+   caches the answers: successful ones for DNS_CACHE_TTL seconds and failed
+   ones for DNS_NEGATIVE_TTL. getaddrinfo doesn't report record TTLs, so these
+   are fixed. Concurrent requests for a name share one lookup. Names loaded
+   from a hosts file are answered without ever calling getaddrinfo.
+ */
+class Resolver {
+public:
+    Resolver(size_t num_threads = DNS_RESOLVER_THREADS, int ttl = DNS_CACHE_TTL, int negative_ttl = DNS_NEGATIVE_TTL);
+    ~Resolver();
+
+    // Disable copy and assignment
+    Resolver(const Resolver&) = delete;
+    Resolver& operator=(const Resolver&) = delete;
+
+    // Returns the answer for host if it is a literal IPv4 address or cached
+    // and unexpired, or nullptr otherwise.
+    ResolvedHostPtr cached(std::string_view host);
+
+    // Runs done with the answer for host: inline if it is cached, and
+    // otherwise on a resolver thread once the lookup finishes.
+    void resolve(std::string_view host, std::function<void(ResolvedHostPtr)> done);
+
+    // Blocks until host is resolved.
+    ResolvedHostPtr resolve(std::string_view host);
+
+    // Adds the IPv4 entries of a hosts-format file ("address name
+    // [aliases...]", '#' comments) as static answers. Returns the number of
+    // names loaded, or -1 if the file can't be read.
+    int load_hosts(const std::string& path);
+
+    ResolverStats stats() const;
+
+private:
+    static std::string normalize(std::string_view host);
+    ResolvedHostPtr lookup(const std::string& name);
+    void store(const std::string& name, const ResolvedHostPtr& answer);
+    void worker();
+
+    mutable std::mutex lock_;
+    std::condition_variable cv_;
+    std::unordered_map<std::string, ResolvedHostPtr> cache_;
+    std::unordered_map<std::string, ResolvedHostPtr> static_;
+    // Names queued or being looked up, with everyone waiting on each
+    std::unordered_map<std::string, std::vector<std::function<void(ResolvedHostPtr)>>> pending_;
+    std::deque<std::string> queue_;
+    std::vector<std::thread> threads_;     // started on the first lookup
+    size_t num_threads_;
+    int ttl_;
+    int negative_ttl_;
+    bool stopping_ = false;
+    ResolverStats stats_;
+};
+
+#endif
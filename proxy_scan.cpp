@@ -0,0 +1,120 @@
+/*
+  proxy_scan.cpp -- SSE2/AVX2 line and delimiter search with a scalar fallback.
+*/
+
+#include "proxy_scan.h"
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(PROXY_SCAN_SCALAR)
+#define SCAN_SSE2
+#include <immintrin.h>
+#if defined(__GNUC__)
+// AVX2 code is compiled with a target attribute and only called after a CPU check
+#define SCAN_AVX2
+#endif
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline unsigned lowest_bit(unsigned mask) {
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned)index;
+}
+#else
+static inline unsigned lowest_bit(unsigned mask) {
+    return (unsigned)__builtin_ctz(mask);
+}
+#endif
+
+size_t scan_line_scalar(const char* buf, size_t from, size_t len, char mark, size_t& first_mark) {
+    if (from >= len) return len;
+    const char* nl = (const char*)memchr(buf + from, '\n', len - from);
+    size_t end = nl ? (size_t)(nl - buf) : len;
+    if (first_mark == SCAN_NOT_FOUND) {
+        const char* m = (const char*)memchr(buf + from, mark, end - from);
+        if (m) first_mark = (size_t)(m - buf);
+    }
+    return end;
+}
+
+#ifdef SCAN_SSE2
+// Handles one block's match masks. Returns true once the newline is found.
+static inline bool take_block(size_t at, unsigned nl_mask, unsigned mark_mask, size_t& first_mark, size_t& nl_pos) {
+    if (mark_mask != 0) {
+        unsigned mark_bit = lowest_bit(mark_mask);
+        if (nl_mask == 0 || mark_bit < lowest_bit(nl_mask)) first_mark = at + mark_bit;
+    }
+    if (nl_mask == 0) return false;
+    nl_pos = at + lowest_bit(nl_mask);
+    return true;
+}
+
+static size_t scan_line_sse2(const char* buf, size_t from, size_t len, char mark, size_t& first_mark) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i marks = _mm_set1_epi8(mark);
+    size_t i = from;
+    // Once the mark is found only the newline is left, which memchr does best
+    for (; i + 16 <= len && first_mark == SCAN_NOT_FOUND; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(buf + i));
+        unsigned nl_mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        unsigned mark_mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, marks));
+        size_t nl_pos;
+        if (take_block(i, nl_mask, mark_mask, first_mark, nl_pos)) return nl_pos;
+    }
+    return scan_line_scalar(buf, i, len, mark, first_mark);
+}
+#endif
+
+#ifdef SCAN_AVX2
+__attribute__((target("avx2")))
+static size_t scan_line_avx2(const char* buf, size_t from, size_t len, char mark, size_t& first_mark) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i marks = _mm256_set1_epi8(mark);
+    size_t i = from;
+    for (; i + 32 <= len && first_mark == SCAN_NOT_FOUND; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(buf + i));
+        unsigned nl_mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+        unsigned mark_mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, marks));
+        size_t nl_pos;
+        if (take_block(i, nl_mask, mark_mask, first_mark, nl_pos)) return nl_pos;
+    }
+    if (first_mark != SCAN_NOT_FOUND) return scan_line_scalar(buf, i, len, mark, first_mark);
+    return scan_line_sse2(buf, i, len, mark, first_mark);
+}
+#endif
+
+static ScanLineImpl pick_scan_impl() {
+#ifdef SCAN_AVX2
+    // Runs during static initialization, possibly before libgcc's own CPU probe
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return {scan_line_avx2, "avx2"};
+#endif
+#ifdef SCAN_SSE2
+    return {scan_line_sse2, "sse2"};
+#else
+    return {scan_line_scalar, "scalar"};
+#endif
+}
+
+static const ScanLineImpl scan_impl = pick_scan_impl();
+
+size_t scan_line(const char* buf, size_t from, size_t len, char mark, size_t& first_mark) {
+    return scan_impl.fn(buf, from, len, mark, first_mark);
+}
+
+const char* scan_line_impl() {
+    return scan_impl.name;
+}
+
+size_t scan_line_impls(ScanLineImpl impls[SCAN_MAX_IMPLS]) {
+    size_t n = 0;
+    impls[n++] = {scan_line_scalar, "scalar"};
+#ifdef SCAN_SSE2
+    impls[n++] = {scan_line_sse2, "sse2"};
+#endif
+#ifdef SCAN_AVX2
+    if (__builtin_cpu_supports("avx2")) impls[n++] = {scan_line_avx2, "avx2"};
+#endif
+    return n;
+}
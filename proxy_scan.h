@@ -0,0 +1,44 @@
+/*
+ * proxy_scan.h -- vectorized search for the delimiters of an HTTP head.
+ */
+#include <cstddef>
+
+#ifndef PROXY_SCAN
+#define PROXY_SCAN
+
+#define SCAN_NOT_FOUND ((size_t)-1)
+
+/*
+   scan_line() searches buf[from, len) for the next '\n' and, on the same
+   pass, for the first occurrence of mark before it (':' in a header line,
+   ' ' in the request line). It returns the position of the '\n', or len if
+   there is none yet. first_mark is only written while it is still
+   SCAN_NOT_FOUND, so a line scanned over several reads keeps the mark found
+   in an earlier part of it.
+
+   On x86-64 the search compares 32 bytes at a time with AVX2 when the CPU
+   has it, chosen once at run time, and otherwise 16 at a time with SSE2.
+   Elsewhere it falls back to scan_line_scalar().
+ */
+size_t scan_line(const char* buf, size_t from, size_t len, char mark, size_t& first_mark);
+
+// Portable version of scan_line(), built on memchr.
+size_t scan_line_scalar(const char* buf, size_t from, size_t len, char mark, size_t& first_mark);
+
+// Name of the version scan_line() dispatches to ("avx2", "sse2" or "scalar").
+const char* scan_line_impl();
+
+#define SCAN_MAX_IMPLS 3
+
+using ScanLineFn = size_t (*)(const char* buf, size_t from, size_t len, char mark, size_t& first_mark);
+
+struct ScanLineImpl {
+    ScanLineFn fn;
+    const char* name;
+};
+
+// Fills impls with every version of scan_line() this build and CPU can run,
+// scalar first, so they can be checked against each other. Returns how many.
+size_t scan_line_impls(ScanLineImpl impls[SCAN_MAX_IMPLS]);
+
+#endif
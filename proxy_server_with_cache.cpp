@@ -1,10 +1,7 @@
-// On Windows, winsock2.h must be included before windows.h.
-// proxy_parse.h includes windows.h, so we include socket headers first.
-
-#include <winsock2.h> // For socket functions
-#include <ws2tcpip.h> // For gethostbyname
-
-#include "proxy_parse.h"
+#include "proxy_server_with_cache.h"
+#include "proxy_event_loop.h"
+#include "proxy_uring.h"
+#include "proxy_slices.h"
 #include <iostream>
 #include <string>
 #include <vector>
@@ -14,57 +11,19 @@
 #include <thread>
 #include <condition_variable>
 #include <memory>
+#include <csignal>
+#include <cerrno>
+#include <atomic>
+#include <cstdlib>
 
-#define MAX_BYTES 4096    //max allowed size of request/response
-#define MAX_CLIENTS 400     //max number of client requests served at a time
-#define MAX_SIZE 200*(1<<20)     //size of the cache
-#define MAX_ELEMENT_SIZE 10*(1<<20)     //max size of an element in cache
-
-
-// A C++ class for cache elements. It uses std::string to manage memory automatically.
-class CacheElement {
-public:
-    std::string data;
-    std::string url;
-    time_t lru_time_track;
-    CacheElement* next;
-};
+ProxyCache cache(MAX_SIZE, MAX_ELEMENT_SIZE);
+DiskCache disk_cache;
+UpstreamPool upstream_pool;
+InflightTable inflight;
+Resolver resolver;
 
-using socket_t = SOCKET;
-const socket_t INVALID_SOCKET_VAL = INVALID_SOCKET;
-void close_socket(socket_t s) { closesocket(s); }
 
-class Semaphore {
-public:
-    Semaphore(int count = 0) : count_(count) {}
-
-    void post() {
-        std::unique_lock<std::mutex> lock(mutex_);
-        count_++;
-        cv_.notify_one();
-    }
-
-    void wait() {
-        std::unique_lock<std::mutex> lock(mutex_);
-        cv_.wait(lock, [this]() { return count_ > 0; });
-        count_--;
-    }
-
-private:
-    std::mutex mutex_;
-    std::condition_variable cv_;
-    int count_;
-};
-
-std::mutex cout_lock; // Mutex to protect std::cout and std::cerr
-
-
-CacheElement* find(const std::string& url);
-int add_cache_element(const std::string& data, const std::string& url);
-void remove_cache_element_nolock(); // Internal version that doesn't lock
-void evict_lru_element(); // Public version that locks
-
-int sendErrorMessage(socket_t socket, int status_code)
+std::string error_response(int status_code)
 {
 	char str[1024];
 	char currentTime[50];
@@ -76,134 +35,316 @@ int sendErrorMessage(socket_t socket, int status_code)
 	switch(status_code)
 	{
 		case 400: snprintf(str, sizeof(str), "HTTP/1.1 400 Bad Request\r\nContent-Length: 95\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n<HTML><HEAD><TITLE>400 Bad Request</TITLE></HEAD>\n<BODY><H1>400 Bad Rqeuest</H1>\n</BODY></HTML>", currentTime);
-				  { std::lock_guard<std::mutex> guard(cout_lock); std::cout << "400 Bad Request\n"; }
-				  send(socket, str, strlen(str), 0);
 				  break;
 
 		case 403: snprintf(str, sizeof(str), "HTTP/1.1 403 Forbidden\r\nContent-Length: 112\r\nContent-Type: text/html\r\nConnection: keep-alive\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n<HTML><HEAD><TITLE>403 Forbidden</TITLE></HEAD>\n<BODY><H1>403 Forbidden</H1><br>Permission Denied\n</BODY></HTML>", currentTime);
-				  { std::lock_guard<std::mutex> guard(cout_lock); std::cout << "403 Forbidden\n"; }
-				  send(socket, str, strlen(str), 0);
 				  break;
 
 		case 404: snprintf(str, sizeof(str), "HTTP/1.1 404 Not Found\r\nContent-Length: 91\r\nContent-Type: text/html\r\nConnection: keep-alive\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n<HTML><HEAD><TITLE>404 Not Found</TITLE></HEAD>\n<BODY><H1>404 Not Found</H1>\n</BODY></HTML>", currentTime);
-				  { std::lock_guard<std::mutex> guard(cout_lock); std::cout << "404 Not Found\n"; }
-				  send(socket, str, strlen(str), 0);
 				  break;
 
 		case 500: snprintf(str, sizeof(str), "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 115\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n<HTML><HEAD><TITLE>500 Internal Server Error</TITLE></HEAD>\n<BODY><H1>500 Internal Server Error</H1>\n</BODY></HTML>", currentTime);
-				  //{ std::lock_guard<std::mutex> guard(cout_lock); std::cout << "500 Internal Server Error\n"; }
-				  send(socket, str, strlen(str), 0);
 				  break;
 
 		case 501: snprintf(str, sizeof(str), "HTTP/1.1 501 Not Implemented\r\nContent-Length: 103\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n<HTML><HEAD><TITLE>404 Not Implemented</TITLE></HEAD>\n<BODY><H1>501 Not Implemented</H1>\n</BODY></HTML>", currentTime);
-				  { std::lock_guard<std::mutex> guard(cout_lock); std::cout << "501 Not Implemented\n"; }
-				  send(socket, str, strlen(str), 0);
+				  break;
+
+		case 503: snprintf(str, sizeof(str), "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 111\r\nConnection: close\r\nContent-Type: text/html\r\nRetry-After: 1\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n<HTML><HEAD><TITLE>503 Service Unavailable</TITLE></HEAD>\n<BODY><H1>503 Service Unavailable</H1>\n</BODY></HTML>", currentTime);
 				  break;
 
 		case 505: snprintf(str, sizeof(str), "HTTP/1.1 505 HTTP Version Not Supported\r\nContent-Length: 125\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n<HTML><HEAD><TITLE>505 HTTP Version Not Supported</TITLE></HEAD>\n<BODY><H1>505 HTTP Version Not Supported</H1>\n</BODY></HTML>", currentTime);
-				  { std::lock_guard<std::mutex> guard(cout_lock); std::cout << "505 HTTP Version Not Supported\n"; }
-				  send(socket, str, strlen(str), 0);
 				  break;
 
-		default:  return -1;
+		default:  return "";
 
 	}
-	return 1;
+	return str;
 }
 
-socket_t connectRemoteServer(const std::string& host_addr, int port_num)
+int sendErrorMessage(socket_t socket, int status_code)
 {
-	// Creating Socket for remote server ---------------------------
+	std::string response = error_response(status_code);
+	if(response.empty())
+		return -1;
 
-	socket_t remoteSocket = socket(AF_INET, SOCK_STREAM, 0);
+	log_message(LogLevel::DEBUG, "%.*s", (int)(response.find("\r\n") - 9), response.c_str() + 9);
+	send(socket, response.data(), response.length(), 0);
+	return (int)response.length();
+}
 
-	if( remoteSocket == INVALID_SOCKET_VAL)
-	{
-		{ std::lock_guard<std::mutex> guard(cout_lock); std::cerr << "Error in Creating Socket.\n"; }
-		return -1;
-	}
-	
-	// Get host by the name or ip address provided
+socket_t connectRemoteServer(std::string_view host_addr, int port_num)
+{
+	// Resolve the host through the shared resolver cache
 
-	struct hostent *host = gethostbyname(host_addr.c_str());	
-	if(host == NULL)
+	ResolvedHostPtr host = resolver.resolve(host_addr);
+	if(host->addrs.empty())
 	{
-		{ std::lock_guard<std::mutex> guard(cout_lock); std::cerr << "No such host exists.\n"; }
-		return -1;
+		log_message(LogLevel::WARN, "No such host exists.");
+		return INVALID_SOCKET_VAL;
 	}
 
-	// inserts ip address and port number of host in struct `server_addr`
-	struct sockaddr_in server_addr;
+	// Connect to Remote server, trying each address of the host in turn ---------
 
-	memset(&server_addr, 0, sizeof(server_addr));
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_port = htons(port_num);
+	for(const struct sockaddr_in& addr : host->addrs)
+	{
+		socket_t remoteSocket = socket(AF_INET, SOCK_STREAM, 0);
 
-	memcpy(&server_addr.sin_addr.s_addr, host->h_addr, host->h_length);
+		if( remoteSocket == INVALID_SOCKET_VAL)
+		{
+			log_message(LogLevel::WARN, "Error in Creating Socket.");
+			return INVALID_SOCKET_VAL;
+		}
 
-	// Connect to Remote server ----------------------------------------------------
+		struct sockaddr_in server_addr = addr;
+		server_addr.sin_port = htons(port_num);
 
-	if( connect(remoteSocket, (struct sockaddr*)&server_addr, (socklen_t)sizeof(server_addr)) < 0 )
-	{
-		{ std::lock_guard<std::mutex> guard(cout_lock); std::cerr << "Error in connecting !\n"; }
-		return -1;
+		// A silent origin gets ORIGIN_TIMEOUT seconds to accept; sends after
+		// that are left unbounded, as a tunnel's are
+		set_send_timeout(remoteSocket, ORIGIN_TIMEOUT);
+		auto started = std::chrono::steady_clock::now();
+		if( connect(remoteSocket, (struct sockaddr*)&server_addr, (socklen_t)sizeof(server_addr)) == 0 )
+		{
+			metrics_record_origin(OriginStage::CONNECT, std::chrono::steady_clock::now() - started);
+			set_send_timeout(remoteSocket, 0);
+			return remoteSocket;
+		}
+		close_socket(remoteSocket);
 	}
-	// free(host_addr);
-	return remoteSocket;
+	log_message(LogLevel::WARN, "Error in connecting !");
+	return INVALID_SOCKET_VAL;
 }
 
 
-int handle_request(socket_t clientSocket, ParsedRequest& request, const std::string& tempReq)
+void origin_request(ParsedRequest& request, const CacheEntry* stale, std::string& out)
 {
-	request.set_header("Connection", "close");
+	// Ask the origin to keep the connection open so it can go back to upstream_pool
+	request.set_header("Connection", "keep-alive");
+
+	// A 304 answering the client's own validators could only be relayed to that
+	// client, not cached or shared with followers, so the origin only ever sees ours
+	request.remove_header("If-None-Match");
+	request.remove_header("If-Modified-Since");
+	if(stale != nullptr)
+	{
+		if(!stale->freshness.etag.empty())
+			request.set_header("If-None-Match", stale->freshness.etag);
+		if(!stale->freshness.last_modified.empty())
+			request.set_header("If-Modified-Since", stale->freshness.last_modified);
+	}
 
 	if(request.get_header("Host") == nullptr)
 	{
 		request.set_header("Host", request.get_host());
 	}
 
-    std::string http_request = "GET " + request.get_path() + " " + request.get_version() + "\r\n" + request.unparse_headers();
+	std::string_view path = request.get_path();
+	std::string_view version = request.get_version();
+	out.clear();
+	out.reserve(path.size() + version.size() + 6 + request.headers_length());
+	out.append("GET ").append(path).append(" ").append(version).append("\r\n");
+	request.write_headers(out);
+}
 
+int origin_port(const ParsedRequest& request)
+{
 	int server_port = 80;				// Default Remote Server Port
 	if(!request.get_port().empty())
-		server_port = std::stoi(request.get_port());
+		server_port = std::stoi(std::string(request.get_port()));
+	return server_port;
+}
 
-	socket_t remoteSocketID = connectRemoteServer(request.get_host().c_str(), server_port);
+// How a request was served, for the access log and metrics
+struct AccessRecord {
+	RequestOutcome outcome = RequestOutcome::ERR;
+	size_t bytes = 0;					// response bytes sent to the client
+};
 
-	if(remoteSocketID < 0)
-		return -1;
+// Fetches request from the origin and relays the response to clientSocket,
+// publishing it to fetch for any followers as it streams in. With a stale
+// entry, asks the origin to revalidate it and serves the entry if it answers
+// 304. Sets delimited if the response carried its own length.
+// A large object to be cached in slices isn't relayed: sliced is set to its
+// head, and the caller serves it from there. A response too large to cache
+// that no follower has joined is streamed through without being held.
+int handle_request(socket_t clientSocket, ParsedRequest& request, bool& delimited, const InflightFetchPtr& fetch, const CacheKey& key, const CacheEntryPtr& stale, CacheEntryPtr& sliced, AccessRecord& access)
+{
+	delimited = false;
+	// Kept per thread so its capacity carries over to the next request
+	static thread_local std::string http_request;
+	origin_request(request, stale.get(), http_request);
+	int server_port = origin_port(request);
+
+	// The response is read straight into the slabs the cache will keep
+	BufferChain response_data;
+	char* buffer = nullptr;
+	size_t avail = 0;
+	socket_t remoteSocketID = INVALID_SOCKET_VAL;
+	bool pooled = false;
+	int bytes_received = 0;
+
+	// Try a pooled keep-alive connection first. The origin may have closed it
+	// since it went idle, which only shows up as a failed send or an empty
+	// first read; in that case retry once on a fresh connection.
+	for(int attempt = 0; attempt < 2; attempt++)
+	{
+		remoteSocketID = attempt == 0 ? upstream_pool.acquire(request.get_host(), server_port) : INVALID_SOCKET_VAL;
+		pooled = remoteSocketID != INVALID_SOCKET_VAL;
+		if(!pooled)
+			remoteSocketID = connectRemoteServer(request.get_host(), server_port);
 
-	send(remoteSocketID, http_request.c_str(), http_request.length(), 0);
+		if(remoteSocketID == INVALID_SOCKET_VAL)
+			return -1;
+		// A stalled origin fails the fetch, and with it every follower
+		set_recv_timeout(remoteSocketID, ORIGIN_TIMEOUT);
+
+		if(send(remoteSocketID, http_request.c_str(), http_request.length(), 0) < 0)
+		{
+			close_socket(remoteSocketID);
+			if(pooled) continue;
+			return -1;
+		}
 
-	std::vector<char> buffer(MAX_BYTES);
-	std::string response_data;
-	int bytes_received;
+		// First, receive data from the remote server
+		auto sent_at = std::chrono::steady_clock::now();
+		buffer = response_data.reserve(avail);
+		bytes_received = recv(remoteSocketID, buffer, avail, 0);
+		if(bytes_received <= 0 && pooled)
+		{
+			close_socket(remoteSocketID);
+			continue;
+		}
+		if(bytes_received > 0)
+			metrics_record_origin(OriginStage::FIRST_BYTE, std::chrono::steady_clock::now() - sent_at);
+		break;
+	}
 
-	// First, receive data from the remote server
-	bytes_received = recv(remoteSocketID, buffer.data(), MAX_BYTES - 1, 0);
+	ResponseFramer framer;
+	bool client_ok = true;
+	access.outcome = RequestOutcome::MISS;
+	size_t sent = 0;
+	bool head_seen = false;
+	bool oversized = false;				// too large to cache whole
+	bool streaming = false;				// sent bytes are dropped rather than held
+	size_t streamed = 0;				// bytes sent and dropped
 
-	while(bytes_received > 0)
+	while(true)
 	{
-		// Send the received data to the client
-		int bytes_sent_to_client = send(clientSocket, buffer.data(), bytes_received, 0);
-		
-		if (bytes_sent_to_client < 0)
+		if(bytes_received <= 0)
 		{
-			{ std::lock_guard<std::mutex> guard(cout_lock); std::cerr << "Error in sending data to client socket.\n"; }
+			// A reset or timeout isn't the end of a body delimited by close
+			if(bytes_received == 0)
+				framer.on_eof();
+			break;
+		}
+
+		// Only keep the bytes that belong to this response
+		response_data.commit(framer.feed(buffer, bytes_received));
+		if(framer.complete() || framer.failed())
 			break;
-        }
 
-		response_data.append(buffer.data(), bytes_received);
-		bytes_received = recv(remoteSocketID, buffer.data(), MAX_BYTES - 1, 0);
+		// Hold the response back until its status is in, in case it is a 304
+		// for our revalidation; then forward it as it arrives
+		if(framer.has_status())
+		{
+			bool too_large = response_data.size() > MAX_ELEMENT_SIZE;
+			if(!head_seen)
+			{
+				head_seen = true;
+				sliced = slice_response(remoteSocketID, request, framer, response_data);
+				if(sliced != nullptr)
+				{
+					// The slice fetchers own the origin connection now
+					fetch->complete_sliced(sliced);
+					return 0;
+				}
+				std::string head = response_data.copy(0, framer.head_length());
+				std::string length(find_response_header(head, "Content-Length"));
+				too_large = too_large || strtoull(length.c_str(), nullptr, 10) > MAX_ELEMENT_SIZE;
+			}
+			// It won't be cached, so once nobody else is following it there
+			// is no need to hold it
+			if(too_large && !oversized)
+			{
+				oversized = true;
+				streaming = inflight.remove_unshared(key.text, fetch);
+			}
+			if(!streaming)
+				fetch->publish(response_data);
+			if(!send_chain_all(clientSocket, response_data, sent))
+			{
+				log_message(LogLevel::WARN, "Error in sending data to client socket.");
+				client_ok = false;
+				break;
+			}
+			sent = response_data.size();
+			access.bytes = streamed + sent;
+			if(streaming)
+			{
+				streamed += sent;
+				sent = 0;
+				response_data.clear();
+			}
+		}
+
+		buffer = response_data.reserve(avail);
+		bytes_received = recv(remoteSocketID, buffer, avail, 0);
 	} 
-	add_cache_element(response_data, tempReq);
-	{ std::lock_guard<std::mutex> guard(cout_lock); std::cout << "Request handled and cached." << std::endl; }
-	
- 	close_socket(remoteSocketID);
+
+	// Hand the connection back only if the response ended cleanly by framing
+	if(client_ok && framer.reusable())
+		upstream_pool.release(request.get_host(), server_port, remoteSocketID);
+	else
+ 		close_socket(remoteSocketID);
+
+	if(!client_ok)
+		return 0;
+	if(!framer.has_status())
+		return sent == 0 ? -1 : 0;		// Nothing usable came back
+
+	bool revalidated = stale != nullptr && framer.complete() && framer.status() == 304;
+	if(revalidated)
+	{
+		// The origin confirmed our copy; serve it in place of the 304
+		std::string head = response_data.copy(0, response_data.size());
+		CacheEntryPtr entry = cache.refresh(key, stale, head);
+		if(entry->sliced_length != 0)
+		{
+			sliced = entry;
+			fetch->complete_sliced(entry);
+			access.outcome = RequestOutcome::REVALIDATED;
+			return 0;
+		}
+		response_data = entry->data;
+		sent = 0;
+		access.outcome = RequestOutcome::REVALIDATED;
+		log_message(LogLevel::DEBUG, "Cached copy revalidated.");
+	}
+
+	if(!streaming)
+		fetch->publish(response_data);
+	if(!send_chain_all(clientSocket, response_data, sent))
+	{
+		log_message(LogLevel::WARN, "Error in sending data to client socket.");
+		return 0;
+	}
+	access.bytes = streamed + response_data.size();
+
+	if(revalidated)
+	{
+		delimited = stale->delimited;
+		fetch->complete(delimited);
+	}
+	else if(framer.complete())
+	{
+		delimited = framer.delimited();
+		fetch->complete(delimited);
+		if(!oversized && add_cache_element(std::move(response_data), request, delimited))
+			log_message(LogLevel::DEBUG, "Request handled and cached.");
+	}
 	return 0;
 }
 
-int checkHTTPversion(const std::string& msg)
+int checkHTTPversion(std::string_view msg)
 {
 	int version = -1;
 
@@ -222,132 +363,623 @@ int checkHTTPversion(const std::string& msg)
 }
 
 
-void thread_fn(socket_t socket, Semaphore* semaphore)
+bool client_keep_alive(const ParsedRequest& request)
 {
-	// The semaphore is already waited on in main, we just need to post it when we're done.
-	int bytes_send_client;
-	auto buffer = std::make_unique<char[]>(MAX_BYTES);
-	int total_bytes_received = 0;
-	bool request_received = false;
+	std::string value;
+	const ParsedRequest::ParsedHeader* header = request.get_header("Connection");
+	if(header == nullptr)
+		header = request.get_header("Proxy-Connection");
+	if(header != nullptr)
+	{
+		value = std::string(header->value);
+		for(auto& c : value) c = (char)tolower((unsigned char)c);
+	}
+
+	if(value.find("close") != std::string::npos)
+		return false;
+	if(value.find("keep-alive") != std::string::npos)
+		return true;
+	return request.get_version() == "HTTP/1.1";
+}
 
-	bytes_send_client = recv(socket, buffer.get(), MAX_BYTES, 0); // Receiving the Request of client by proxy server
-	if (bytes_send_client > 0) {
-		request_received = true;
-		total_bytes_received += bytes_send_client;
+// Sends the response reader produces to socket. Returns true if all of it
+// was sent.
+bool send_slices(socket_t socket, SliceReader& reader, AccessRecord& access)
+{
+	size_t from, to;
+	while(true)
+	{
+		SliceState state = reader.read(from, to, true);
+		if(state == SliceState::DONE)
+		{
+			access.bytes = reader.sent();
+			return true;
+		}
+		if(state == SliceState::FAILED)
+		{
+			log_message(LogLevel::WARN, "A slice of a cached object couldn't be fetched.");
+			// Nothing sent yet, so the client can still get a clean error
+			if(reader.sent() == 0)
+			{
+				access.outcome = RequestOutcome::ERR;
+				access.bytes = std::max(sendErrorMessage(socket, 500), 0);
+			}
+			return false;
+		}
+		if(state == SliceState::READY)
+		{
+			if(!send_chain_all(socket, reader.chain(), from, to))
+			{
+				access.bytes = reader.sent();
+				return false;
+			}
+			reader.consumed(to - from);
+			access.bytes = reader.sent();
+		}
 	}
-	
-	while(bytes_send_client > 0)
+}
+
+// Streams another client's in-flight fetch of the same object to socket.
+// Returns true if the response was delimited.
+bool follow_fetch(socket_t socket, ParsedRequest& request, InflightFetch& fetch, AccessRecord& access)
+{
+	size_t& offset = access.bytes;
+	BufferChain response;		// shares the fetch's slabs
+	while(true)
 	{
-        //loop until u find "\r\n\r\n" in the buffer
-		if(strstr(buffer.get(), "\r\n\r\n") == NULL)
-		{	
-			bytes_send_client = recv(socket, buffer.get() + total_bytes_received, MAX_BYTES - total_bytes_received, 0);
-			if (bytes_send_client > 0) total_bytes_received += bytes_send_client;
+		FetchState state = fetch.read(response, true);
+		if(state == FetchState::FAILED)
+		{
+			// Nothing sent yet, so the client can still get a clean error
+			if(offset == 0)
+			{
+				access.outcome = RequestOutcome::ERR;
+				access.bytes = std::max(sendErrorMessage(socket, 500), 0);
+			}
+			return false;
+		}
+		if(offset < response.size())
+		{
+			if(!send_chain_all(socket, response, offset))
+				return false;
+			offset = response.size();
+			continue;
+		}
+		// DONE, and every byte has been sent
+		log_message(LogLevel::DEBUG, "Data retrieved from an in-flight fetch");
+		if(CacheEntryPtr head = fetch.sliced())
+		{
+			std::unique_ptr<SliceReader> reader = open_cached(request, head);
+			return reader != nullptr && send_slices(socket, *reader, access);
 		}
-		else{
+		return fetch.delimited();
+	}
+}
+
+// Serves one parsed request and records how in access. Returns true if the
+// response was delimited, so the client connection can carry another request
+// after it. looked_up, if set, is what find(key) already returned.
+bool serve_request(socket_t socket, ParsedRequest& request, const CacheKey& key, AccessRecord& access, std::optional<CacheEntryPtr> looked_up)
+{
+	if(request.get_method() != "GET")
+	{
+		log_message(LogLevel::DEBUG, "This code doesn't support any method other than GET");
+		access.bytes = std::max(sendErrorMessage(socket, 501), 0); // Not Implemented
+		return false;
+	}
+	if( request.get_host().empty() || request.get_path().empty() || (checkHTTPversion(request.get_version()) != 1) )
+	{
+		access.bytes = std::max(sendErrorMessage(socket, 500), 0);			// 500 Internal Error
+		return false;
+	}
+
+	//checking for the request in cache 
+	// temp pins the entry, so a concurrent eviction can't free it mid-send
+	CacheEntryPtr temp = looked_up ? *looked_up : find(key);
+
+	// A stale entry, or one the client wants checked, goes to the origin for revalidation
+	if( temp != NULL && temp->fresh(time(NULL)) && !request_wants_revalidation(request)){
+		//request found in cache, so sending the response to client from proxy's cache
+		access.outcome = RequestOutcome::HIT;
+		// Slices, or a range, are sent a piece at a time
+		if(std::unique_ptr<SliceReader> reader = open_cached(request, temp))
+			return send_slices(socket, *reader, access);
+		if(!send_chain_all(socket, temp->data, 0))
+			return false;
+		access.bytes = temp->data.size();
+		log_message(LogLevel::DEBUG, "Data retrieved from the Cache");
+		return temp->delimited;
+	}
+
+	// This is a cache miss. Only the first miss for a key goes to the origin;
+	// concurrent misses follow its fetch. A range of an object we can't serve
+	// is the origin's to answer, and its 206 can't be shared or cached, so it
+	// gets a fetch of its own.
+	bool leader = true;
+	InflightFetchPtr fetch;
+	if(request.get_header("Range") != nullptr)
+	{
+		fetch = std::make_shared<InflightFetch>();
+		temp = nullptr;
+	}
+	else
+		fetch = inflight.join(key.text, leader);
+	if(!leader)
+	{
+		access.outcome = RequestOutcome::COALESCED;
+		return follow_fetch(socket, request, *fetch, access);
+	}
+
+	bool delimited = false;
+	CacheEntryPtr sliced;
+	int status = handle_request(socket, request, delimited, fetch, key, temp, sliced, access);
+	fetch->fail();		// No-op if the response completed
+	inflight.remove(key.text, fetch);
+	if(status == -1)
+	{	
+		access.outcome = RequestOutcome::ERR;
+		access.bytes = std::max(sendErrorMessage(socket, 500), 0);
+		return false;
+	}
+	if(sliced != nullptr)
+	{
+		std::unique_ptr<SliceReader> reader = open_cached(request, sliced);
+		return reader != nullptr && send_slices(socket, *reader, access);
+	}
+	return delimited;
+}
+
+// Opens a CONNECT tunnel from the client on socket to the requested host and
+// port, and relays it until both sides have finished, it idles out or the
+// pool drains. early is whatever the client sent after the CONNECT head.
+void serve_connect(socket_t socket, const ParsedRequest& request, std::string_view early, const std::string& client, WorkerPool* pool)
+{
+	auto started = std::chrono::steady_clock::now();
+	CacheKey key = make_cache_key(request);		// only for its "CONNECT host:port", for the access log
+	int port = origin_port(request);
+	socket_t remoteSocketID = INVALID_SOCKET_VAL;
+	int status = 0;
+	if(checkHTTPversion(request.get_version()) != 1)
+		status = 500;
+	else if(!tunnel_admit(port))
+	{
+		log_message(LogLevel::DEBUG, "CONNECT to port %d is not allowed", port);
+		status = 403;
+	}
+	else if((remoteSocketID = connectRemoteServer(request.get_host(), port)) == INVALID_SOCKET_VAL)
+		status = 500;
+	if(status != 0)
+	{
+		size_t bytes = std::max(sendErrorMessage(socket, status), 0);
+		auto latency = std::chrono::steady_clock::now() - started;
+		metrics_record_request(RequestOutcome::ERR, bytes, latency);
+		log_access(client.c_str(), key.url(), outcome_name(RequestOutcome::ERR), bytes,
+			std::chrono::duration<double, std::milli>(latency).count());
+		return;
+	}
+
+	set_nonblocking(socket);
+	set_nonblocking(remoteSocketID);
+	TunnelRelay relay(socket, remoteSocketID, TUNNEL_ESTABLISHED, std::string(early));
+	pollfd_t fds[2];
+	fds[0].fd = socket;
+	fds[1].fd = remoteSocketID;
+	while(relay.pump())
+	{
+		fds[0].events = (relay.wants_read(TunnelRelay::CLIENT) ? POLLIN : 0) | (relay.wants_write(TunnelRelay::CLIENT) ? POLLOUT : 0);
+		fds[1].events = (relay.wants_read(TunnelRelay::ORIGIN) ? POLLIN : 0) | (relay.wants_write(TunnelRelay::ORIGIN) ? POLLOUT : 0);
+		fds[0].revents = fds[1].revents = 0;
+		// Wake at least once a second to notice an idle tunnel or a draining pool
+		int ready = poll_sockets(fds, 2, 1000);
+		if(ready < 0 && errno != EINTR)
+			break;
+		if((fds[0].revents | fds[1].revents) & POLLERR)
+			break;		// reset by one side
+		if(pool->draining())
+			break;
+		if(ready == 0 && time(NULL) - relay.last_active() > TUNNEL_IDLE_TIMEOUT)
+		{
+			relay.expire();
 			break;
 		}
 	}
+	close_socket(remoteSocketID);
+	log_access(client.c_str(), key.url(), "TUNNEL", relay.bytes_to_client(),
+		std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count());
+}
 
-	if (request_received) {
-		std::string tempReq(buffer.get());
-		
-		//checking for the request in cache 
-		CacheElement* temp = find(tempReq);
+void thread_fn(socket_t socket, const std::string& client, WorkerPool* pool, std::string pending, std::optional<CacheEntryPtr> looked_up)
+{
+	int bytes_send_client = 0;
+	auto buffer = std::make_unique<char[]>(MAX_BYTES);
+	int requests_served = 0;
+	ParsedRequest request;		// reused for every request on the connection
 
-		if( temp != NULL){
-			//request found in cache, so sending the response to client from proxy's cache
-			send(socket, temp->data.c_str(), temp->data.length(), 0);
-			{ std::lock_guard<std::mutex> guard(cout_lock); std::cout << "Data retrieved from the Cache\n\n"; }
+	set_recv_timeout(socket, CLIENT_IDLE_TIMEOUT);
+
+	// Serve requests in the order they arrive, including ones the client
+	// pipelined behind the current request.
+	while(requests_served < MAX_REQUESTS_PER_CONNECTION)
+	{
+		// The parser picks up where it stopped as each read arrives
+		request.reset();
+		long request_len;
+		while((request_len = request.parse(pending.data(), pending.size())) == 0)
+		{
+			bytes_send_client = recv(socket, buffer.get(), MAX_BYTES, 0); // Receiving the Request of client by proxy server
+			if(bytes_send_client <= 0)
+				break;
+			pending.append(buffer.get(), bytes_send_client);
 		}
-		else // This is a cache miss, handle the request
+
+		if(request_len == 0)
 		{
-			//Parsing the request
-			ParsedRequest request;
-			
-			//ParsedRequest_parse returns 0 on success and -1 on failure.On success it stores parsed request in
-			// the request
-			if (request.parse(buffer.get(), total_bytes_received) < 0)
-			{
-				{ std::lock_guard<std::mutex> guard(cout_lock); std::cerr << "Parsing failed\n"; }
-			}
-			else
-			{	
-				if(request.get_method() == "GET")
-				{
-					if( !request.get_host().empty() && !request.get_path().empty() && (checkHTTPversion(request.get_version()) == 1) )
-					{
-						if(handle_request(socket, request, tempReq) == -1)
-						{	
-							sendErrorMessage(socket, 500);
-						}
-					}
-					else
-						sendErrorMessage(socket, 500);			// 500 Internal Error
-				}
-				else
-				{
-					{ std::lock_guard<std::mutex> guard(cout_lock); std::cout << "This code doesn't support any method other than GET\n"; }
-					sendErrorMessage(socket, 501); // Not Implemented
+			// The client closed, errored or idled out between requests
+			if (requests_served == 0 && pending.empty()) {
+				if (bytes_send_client == 0) {
+					log_message(LogLevel::DEBUG, "Client connected and then disconnected without sending data.");
+				} else { // bytes_send_client < 0
+					log_message(LogLevel::WARN, "Error in receiving from client on initial recv.");
 				}
 			}
+			break;
+		}
+		if(request_len < 0)
+		{
+			log_message(LogLevel::WARN, "Parsing failed");
+			sendErrorMessage(socket, 400);
+			break;
 		}
-	} else {
-		// This block handles the case where no request was received at all.
-		if (bytes_send_client == 0) {
-			{ std::lock_guard<std::mutex> guard(cout_lock); std::cout << "Client connected and then disconnected without sending data.\n"; }
-		} else { // bytes_send_client < 0
-			{ std::lock_guard<std::mutex> guard(cout_lock); std::cerr << "Error in receiving from client on initial recv.\n"; }
+		requests_served++;
+
+		if(request.get_method() == "CONNECT")
+		{
+			// The connection becomes the tunnel, so nothing can follow it
+			serve_connect(socket, request, std::string_view(pending).substr(request_len), client, pool);
+			break;
 		}
+
+		// A draining pool finishes the request in hand, then hangs up
+		bool keep_alive = client_keep_alive(request) && !pool->draining();
+		auto started = std::chrono::steady_clock::now();
+		CacheKey key = cache.key_for(request);
+		AccessRecord access;
+		bool delimited = serve_request(socket, request, key, access, looked_up);
+		looked_up.reset();
+		auto latency = std::chrono::steady_clock::now() - started;
+		metrics_record_request(access.outcome, access.bytes, latency);
+		log_access(client.c_str(), key.url(), outcome_name(access.outcome), access.bytes,
+			std::chrono::duration<double, std::milli>(latency).count());
+		if(!delimited || !keep_alive)
+			break;
+		pending.erase(0, request_len);
 	}
 	
 	shutdown(socket, SD_BOTH);
 	close_socket(socket);
-	semaphore->post(); // Release the semaphore slot
-	{ std::lock_guard<std::mutex> guard(cout_lock); std::cout << "Client connection closed, semaphore released." << std::endl; }
+	log_message(LogLevel::DEBUG, "Client connection closed.");
 }
 
 
+// Everything the admin port serves: the request metrics, then the counters
+// the cache, its disk tier and the connection pools keep. pool is null in
+// epoll mode.
+static std::string render_metrics(const WorkerPool* pool)
+{
+	std::string out;
+	metrics_render(out);
+
+	CacheStats cs = cache.stats();
+	metrics_append(out, "proxy_cache_hits_total", "counter", "Lookups that found an entry in memory or on disk.", cs.hits);
+	metrics_append(out, "proxy_cache_misses_total", "counter", "Lookups that found no entry in memory or on disk.", cs.misses);
+	metrics_append(out, "proxy_cache_insertions_total", "counter", "Responses added to the memory cache.", cs.insertions);
+	metrics_append(out, "proxy_cache_evictions_total", "counter", "Entries evicted from the memory cache to make room.", cs.evictions);
+	metrics_append(out, "proxy_cache_rejections_total", "counter", "New entries the cache policy declined to keep.", cs.rejections);
+	metrics_append(out, "proxy_cache_size_bytes", "gauge", "Bytes allocated for cached entries.", cs.size);
+	metrics_append(out, "proxy_cache_body_bytes", "gauge", "Response bytes held by cached entries.", cs.body_bytes);
+	metrics_append(out, "proxy_cache_capacity_bytes", "gauge", "The memory cache's byte budget.", MAX_SIZE);
+	metrics_append(out, "proxy_cache_entries", "gauge", "Entries in the memory cache.", cs.count);
+
+	if(disk_cache.enabled())
+	{
+		DiskStats ds = disk_cache.stats();
+		metrics_append(out, "proxy_disk_hits_total", "counter", "Memory misses answered from the disk tier.", ds.hits);
+		metrics_append(out, "proxy_disk_writes_total", "counter", "Entries written to the disk tier.", ds.writes);
+		metrics_append(out, "proxy_disk_written_bytes_total", "counter", "Bytes written to the disk tier.", ds.bytes_written);
+		metrics_append(out, "proxy_disk_dropped_total", "counter", "Demotions dropped because the write queue was full.", ds.dropped);
+		metrics_append(out, "proxy_disk_entries", "gauge", "Entries in the disk tier.", ds.entries);
+	}
+
+	SlabStats ss = slab_allocator().stats();
+	metrics_append(out, "proxy_slab_reserved_bytes", "gauge", "Bytes of slab arenas taken from the system.", ss.reserved);
+	metrics_append(out, "proxy_slab_in_use_bytes", "gauge", "Bytes of slab blocks handed out.", ss.in_use);
+
+	UpstreamStats us = upstream_pool.stats();
+	metrics_append(out, "proxy_upstream_reused_total", "counter", "Origin requests sent on a pooled connection.", us.hits);
+	metrics_append(out, "proxy_upstream_connects_total", "counter", "Origin requests that needed a new connection.", us.misses);
+
+	ResolverStats rs = resolver.stats();
+	metrics_append(out, "proxy_dns_cache_hits_total", "counter", "Name lookups answered from the resolver cache.", rs.hits);
+	metrics_append(out, "proxy_dns_lookups_total", "counter", "getaddrinfo calls made.", rs.lookups);
+	metrics_append(out, "proxy_dns_failures_total", "counter", "Lookups that found no address.", rs.failures);
+
+	if(pool)
+	{
+		PoolStats ps = pool->stats();
+		metrics_append(out, "proxy_workers_busy", "gauge", "Worker threads serving a connection.", ps.busy);
+		metrics_append(out, "proxy_workers_queued", "gauge", "Connections waiting for a worker.", ps.queued);
+		metrics_append(out, "proxy_workers_taken_total", "counter", "Connections a worker has taken from the queue.", ps.completed + ps.busy);
+		metrics_append(out, "proxy_workers_wait_seconds_total", "counter", "Time taken connections spent waiting for a worker, summed.", ps.total_wait_ms / 1000);
+		metrics_append(out, "proxy_workers_wait_max_seconds", "gauge", "Longest a connection has waited for a worker.", ps.max_wait_ms / 1000);
+		metrics_append(out, "proxy_workers_rejected_total", "counter", "Connections turned away because the queue was full.", ps.rejected);
+	}
+
+	TunnelStats ts = tunnel_stats();
+	metrics_append(out, "proxy_tunnels_total", "counter", "CONNECT tunnels opened.", ts.opened);
+	metrics_append(out, "proxy_tunnels_active", "gauge", "CONNECT tunnels open now.", ts.active);
+	metrics_append(out, "proxy_tunnels_refused_total", "counter", "CONNECTs refused because the port isn't allowed.", ts.refused);
+	metrics_append(out, "proxy_tunnel_idle_timeouts_total", "counter", "Tunnels closed for passing no bytes for too long.", ts.idle_timeouts);
+	metrics_append(out, "proxy_tunnel_client_bytes_total", "counter", "Bytes relayed from clients to origins through tunnels.", ts.client_bytes);
+	metrics_append(out, "proxy_tunnel_origin_bytes_total", "counter", "Bytes relayed from origins to clients through tunnels.", ts.origin_bytes);
+
+	SliceStats sl = slice_stats();
+	metrics_append(out, "proxy_sliced_objects_total", "counter", "Large responses cached as a head and fixed-size slices.", sl.objects);
+	metrics_append(out, "proxy_slices_total", "counter", "Slices fetched from origins.", sl.slices);
+	metrics_append(out, "proxy_slice_range_fetches_total", "counter", "Slices fetched on their own with a Range request.", sl.range_fetches);
+	metrics_append(out, "proxy_slice_failures_total", "counter", "Slice fetches that failed.", sl.failures);
+	metrics_append(out, "proxy_partial_responses_total", "counter", "206 responses served from the cache.", sl.partial);
+	metrics_append(out, "proxy_unsatisfiable_ranges_total", "counter", "416 responses to ranges past the end of a cached object.", sl.unsatisfiable);
+
+#ifdef PROXY_HAVE_URING
+	UringStats ur = uring_stats();
+	metrics_append(out, "proxy_uring_enters_total", "counter", "io_uring_enter calls, each submitting a batch.", ur.enters);
+	metrics_append(out, "proxy_uring_submitted_total", "counter", "Operations submitted to io_uring.", ur.submitted);
+	metrics_append(out, "proxy_uring_completions_total", "counter", "io_uring completions reaped.", ur.completions);
+	metrics_append(out, "proxy_uring_hits_total", "counter", "Cache hits served by the io_uring loops.", ur.hits);
+	metrics_append(out, "proxy_uring_handoffs_total", "counter", "Connections the io_uring loops handed to the worker pool.", ur.handoffs);
+	metrics_append(out, "proxy_uring_zc_sends_total", "counter", "Zero-copy sendmsgs, each carrying a batch of slabs.", ur.zc_sends);
+#endif
+
+	LogStats ls = log_stats();
+	metrics_append(out, "proxy_log_dropped_total", "counter", "Log lines dropped because the writer fell behind.", ls.dropped);
+	return out;
+}
+
+// Saves the cache to the disk tier, if there is one, so the next run starts
+// warm. Returns -1 if the save failed.
+static int save_cache()
+{
+	if(!disk_cache.enabled())
+		return 0;
+	log_message(LogLevel::INFO, "Saving %zu cached responses for a warm restart", cache.count());
+	if(cache.persist() < 0)
+	{
+		log_message(LogLevel::ERR, "Can't save disk cache index");
+		return -1;
+	}
+	return 0;
+}
+
+#ifndef _WIN32
+static int shutdown_pipe[2];
+static std::atomic<bool> stopping{false};
+static std::atomic<socket_t> draining_listener{INVALID_SOCKET_VAL};   // set while the thread-mode accept loop runs
+
+static void on_shutdown_signal(int)
+{
+	char c = 0;
+	ssize_t n = write(shutdown_pipe[1], &c, 1); // Async-signal-safe hand-off to shutdown_watcher
+	(void)n;
+}
+
+// Waits for SIGINT or SIGTERM. In thread mode it stops the accept loop,
+// which drains the worker pool and saves the cache. Event loops aren't
+// drained, so then it saves the cache itself and exits.
+static void shutdown_watcher()
+{
+	char c;
+	while(read(shutdown_pipe[0], &c, 1) < 0 && errno == EINTR) {}
+	stopping = true;
+	socket_t listener = draining_listener;
+	if(listener != INVALID_SOCKET_VAL)
+	{
+		shutdown(listener, SHUT_RDWR); // Wakes the blocked accept()
+		return;
+	}
+	int status = save_cache() < 0 ? 1 : 0;
+	log_flush();		// _exit skips the atexit flush
+	_exit(status);
+}
+#endif
+
 int main(int argc, char* argv[]) {
 
+#ifdef _WIN32
     WSADATA wsaData;
     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-        { std::lock_guard<std::mutex> guard(cout_lock); std::cerr << "WSAStartup failed.\n"; }
+        log_message(LogLevel::ERR, "WSAStartup failed.");
         return 1;
     }
+#else
+    signal(SIGPIPE, SIG_IGN); // A client hanging up mid-send must not kill the proxy
+#endif
 
 	int port_number = 8080;
 	socket_t proxy_socketId;
 	socket_t client_socketId;
-	int client_len;
+	socklen_t client_len;
 	struct sockaddr_in server_addr, client_addr; // Address of client and server to be assigned
+	std::string io_mode = "threads";
+	int num_loops = std::thread::hardware_concurrency();
+	std::string disk_dir;
+	uint64_t disk_size = DISK_CACHE_DEFAULT_SIZE;
 
-    Semaphore semaphore(MAX_CLIENTS);
+	int num_workers = MAX_CLIENTS;
+    WorkerPool pool;
+	int admin_port = 0;
 
-	if(argc == 2)        //checking whether two arguments are received or not
+	if(argc >= 2)        //checking whether the port argument is received or not
 	{
 		port_number = atoi(argv[1]);
 	}
 	else
 	{
-		{ std::lock_guard<std::mutex> guard(cout_lock); std::cout << "Usage: " << argv[0] << " <port_number>\n"; }
+		log_message(LogLevel::ERR, "Usage: %s <port_number> [--io=threads|epoll|uring] [--loops=N] [--workers=N] [--hosts=FILE] [--cache-policy=lru|tinylfu] [--disk-cache=DIR] [--disk-cache-size=N[G|M]] [--log-level=debug|info|warn|error] [--admin-port=N] [--connect-ports=LIST]", argv[0]);
 		exit(1);
 	}
 
-	{ std::lock_guard<std::mutex> guard(cout_lock); std::cout << "Setting Proxy Server Port : " << port_number << std::endl; }
+	for(int i = 2; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if(arg.rfind("--io=", 0) == 0)
+			io_mode = arg.substr(5);
+		else if(arg.rfind("--loops=", 0) == 0)
+			num_loops = atoi(arg.c_str() + 8);
+		else if(arg.rfind("--workers=", 0) == 0)
+			num_workers = atoi(arg.c_str() + 10);
+		else if(arg.rfind("--hosts=", 0) == 0)
+		{
+			int loaded = resolver.load_hosts(arg.substr(8));
+			if(loaded < 0)
+			{
+				log_message(LogLevel::ERR, "Can't read hosts file: %s", arg.c_str() + 8);
+				exit(1);
+			}
+			log_message(LogLevel::INFO, "Loaded %d names from %s", loaded, arg.c_str() + 8);
+		}
+		else if(arg.rfind("--cache-policy=", 0) == 0)
+		{
+			if(cache.set_policy(arg.substr(15)) < 0)
+			{
+				log_message(LogLevel::ERR, "Unknown cache policy: %s", arg.c_str() + 15);
+				exit(1);
+			}
+		}
+		else if(arg.rfind("--disk-cache=", 0) == 0)
+			disk_dir = arg.substr(13);
+		else if(arg.rfind("--disk-cache-size=", 0) == 0)
+		{
+			// Gigabytes unless followed by M
+			char* unit;
+			disk_size = strtoull(arg.c_str() + 18, &unit, 10);
+			disk_size <<= (*unit == 'M' || *unit == 'm') ? 20 : 30;
+		}
+		else if(arg.rfind("--admin-port=", 0) == 0)
+			admin_port = atoi(arg.c_str() + 13);
+		else if(arg.rfind("--connect-ports=", 0) == 0)
+		{
+			if(tunnel_set_ports(arg.substr(16)) < 0)
+			{
+				log_message(LogLevel::ERR, "Bad port list: %s", arg.c_str() + 16);
+				exit(1);
+			}
+		}
+		else if(arg.rfind("--log-level=", 0) == 0)
+		{
+			LogLevel level;
+			if(!log_parse_level(arg.substr(12), level))
+			{
+				log_message(LogLevel::ERR, "Unknown log level: %s", arg.c_str() + 12);
+				exit(1);
+			}
+			log_set_level(level);
+		}
+		else
+		{
+			log_message(LogLevel::ERR, "Unknown option: %s", arg.c_str());
+			exit(1);
+		}
+	}
+	if(io_mode == "uring")
+	{
+		// The socket path stays as a fallback where io_uring can't run
+#ifdef PROXY_HAVE_URING
+		if(!uring_available())
+		{
+			log_message(LogLevel::WARN, "io_uring is unavailable; serving with --io=threads");
+			io_mode = "threads";
+		}
+#else
+		log_message(LogLevel::WARN, "This build has no io_uring support; serving with --io=threads");
+		io_mode = "threads";
+#endif
+	}
+	if(num_loops <= 0)
+		num_loops = 1;
+	if(num_workers <= 0)
+		num_workers = 1;
+
+	if(!disk_dir.empty())
+	{
+		if(disk_cache.open(disk_dir, disk_size) < 0)
+		{
+			log_message(LogLevel::ERR, "Can't open disk cache: %s", disk_dir.c_str());
+			exit(1);
+		}
+		cache.set_lower_tier(&disk_cache);
+		cache.warm_from_lower_tier();
+		log_message(LogLevel::INFO, "Disk cache: %s (%llu MB), %zu entries restored", disk_dir.c_str(), (unsigned long long)(disk_size >> 20), disk_cache.stats().restored);
+	}
+
+#ifndef _WIN32
+	if(pipe(shutdown_pipe) == 0)
+	{
+		signal(SIGINT, on_shutdown_signal);
+		signal(SIGTERM, on_shutdown_signal);
+		std::thread(shutdown_watcher).detach();
+	}
+#endif
+
+	if(admin_port > 0)
+	{
+		const WorkerPool* metrics_pool = io_mode != "epoll" ? &pool : nullptr;
+		if(metrics_serve(admin_port, [metrics_pool]() { return render_metrics(metrics_pool); }) < 0)
+		{
+			log_message(LogLevel::ERR, "Admin port is not free");
+			exit(1);
+		}
+		log_message(LogLevel::INFO, "Serving metrics on 127.0.0.1:%d/metrics", admin_port);
+	}
+
+	log_message(LogLevel::INFO, "Setting Proxy Server Port : %d", port_number);
+	slice_fetch_start();
+	upstream_pool.start_sweeper();
+
+	if(io_mode == "epoll")
+	{
+#ifdef __linux__
+		return run_event_loops(port_number, num_loops);
+#else
+		log_message(LogLevel::ERR, "--io=epoll is only available on Linux");
+		exit(1);
+#endif
+	}
+#ifdef PROXY_HAVE_URING
+	else if(io_mode == "uring")
+	{
+		// Whatever the rings don't serve themselves goes to the workers
+		pool.start(num_workers);
+		return run_uring_loops(port_number, num_loops, &pool);
+	}
+#endif
+	else if(io_mode != "threads")
+	{
+		log_message(LogLevel::ERR, "Unknown I/O mode: %s", io_mode.c_str());
+		exit(1);
+	}
 
     //creating the proxy socket
 	proxy_socketId = socket(AF_INET, SOCK_STREAM, 0);
 
 	if( proxy_socketId == INVALID_SOCKET_VAL)
 	{
-		{ std::lock_guard<std::mutex> guard(cout_lock); std::cerr << "Failed to create socket.\n"; }
+		log_message(LogLevel::ERR, "Failed to create socket.");
 		exit(1);
 	}
 
-	char reuse = 1;
-	if (setsockopt(proxy_socketId, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0)
-        { std::lock_guard<std::mutex> guard(cout_lock); std::cerr << "setsockopt(SO_REUSEADDR) failed\n"; }
+	int reuse = 1;
+	if (setsockopt(proxy_socketId, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) < 0)
+        log_message(LogLevel::WARN, "setsockopt(SO_REUSEADDR) failed");
 
 	memset(&server_addr, 0, sizeof(server_addr));
 	server_addr.sin_family = AF_INET;
@@ -357,23 +989,26 @@ int main(int argc, char* argv[]) {
     // Binding the socket
 	if( bind(proxy_socketId, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0 )
 	{
-		{ std::lock_guard<std::mutex> guard(cout_lock); std::cerr << "Port is not free\n"; }
+		log_message(LogLevel::ERR, "Port is not free");
 		exit(1);
 	}
-	{ std::lock_guard<std::mutex> guard(cout_lock); std::cout << "Binding on port: " << port_number << std::endl; }
+	log_message(LogLevel::INFO, "Binding on port: %d", port_number);
 
     // Proxy socket listening to the requests
 	int listen_status = listen(proxy_socketId, MAX_CLIENTS);
 
 	if(listen_status < 0 )
 	{
-		{ std::lock_guard<std::mutex> guard(cout_lock); std::cerr << "Error while Listening !\n"; }
+		log_message(LogLevel::ERR, "Error while Listening !");
 		exit(1);
 	}
 
-	std::vector<std::thread> threads;
+	pool.start(num_workers);
+#ifndef _WIN32
+	draining_listener = proxy_socketId;
+#endif
 
-    // Infinite Loop for accepting connections
+    // Loop accepting connections until SIGINT or SIGTERM
 	while(1)
 	{
 		
@@ -381,120 +1016,78 @@ int main(int argc, char* argv[]) {
 		client_len = sizeof(client_addr); 
 
         // Accepting the connections
-		client_socketId = accept(proxy_socketId, (struct sockaddr*)&client_addr,(socklen_t*)&client_len);	// Accepts connection
+		client_socketId = accept(proxy_socketId, (struct sockaddr*)&client_addr, &client_len);	// Accepts connection
 		if(client_socketId == INVALID_SOCKET_VAL)
 		{
-			{ std::lock_guard<std::mutex> guard(cout_lock); std::cerr << "Error in Accepting connection !\n"; }
+#ifndef _WIN32
+			if(stopping)
+				break;
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+#endif
+			log_message(LogLevel::ERR, "Error in Accepting connection !");
 			exit(1);
 		}
+		// A miss is relayed as the origin's bytes arrive; each piece goes
+		// out at once rather than waiting for the last one's ACK
+		set_nodelay(client_socketId);
 
 		// Getting IP address and port number of client
 		struct sockaddr_in* client_pt = (struct sockaddr_in*)&client_addr;
 		struct in_addr ip_addr = client_pt->sin_addr;
 		char str[INET_ADDRSTRLEN];										// INET_ADDRSTRLEN: Default ip address size
 		inet_ntop( AF_INET, &ip_addr, str, INET_ADDRSTRLEN );
-		{ std::lock_guard<std::mutex> guard(cout_lock); std::cout << "Client is connected with port number: " << ntohs(client_addr.sin_port) << " and ip address: " << str << std::endl; }
+		log_message(LogLevel::DEBUG, "Client is connected with port number: %u and ip address: %s", (unsigned)ntohs(client_addr.sin_port), str);
 		
-		semaphore.wait();
-        // Create a new thread for the client and detach it immediately.
-        // This allows the main loop to continue accepting new connections without blocking.
-        // The detached thread is responsible for its own cleanup.
-        std::thread(thread_fn, client_socketId, &semaphore).detach();
+		// Hand the connection to a worker; when too many are already
+		// waiting for one, turn it away rather than stop accepting
+		std::string client = std::string(str) + ":" + std::to_string(ntohs(client_addr.sin_port));
+		if(!pool.submit([client_socketId, client, &pool]() { thread_fn(client_socketId, client, &pool); }))
+		{
+			sendErrorMessage(client_socketId, 503);
+			shutdown(client_socketId, SD_BOTH);
+			close_socket(client_socketId);
+		}
 	}
+
+	PoolStats pool_stats = pool.stats();
+	log_message(LogLevel::INFO, "Draining %zu connections", pool_stats.busy + pool_stats.queued);
+	pool.drain();
+	slice_fetch_drain();
+	pool_stats = pool.stats();
+	log_message(LogLevel::INFO, "Served %zu connections, turned away %zu, mean queue wait %.3f ms", pool_stats.completed, pool_stats.rejected, pool_stats.mean_wait_ms());
+	int status = save_cache();
 	close_socket(proxy_socketId);
+#ifdef _WIN32
     WSACleanup();
- 	return 0;
+#endif
+ 	return status < 0 ? 1 : 0;
 }
 
-std::mutex cache_lock;
-CacheElement* head = nullptr;
-int cache_size = 0;
-
-CacheElement* find(const std::string& url){
+CacheEntryPtr find(const CacheKey& key){
 
-// Checks for url in the cache if found returns pointer to the respective cache element or else returns NULL
-    CacheElement* site=NULL;
-	std::lock_guard<std::mutex> guard(cache_lock);
-
-    if(head!=NULL){
-        site = head;
-        while (site!=NULL)
-        {
-            if(site->url == url){
-				{ std::lock_guard<std::mutex> guard(cout_lock); std::cout << "\nurl found\n"; }
-				// Updating the time_track
-				site->lru_time_track = time(NULL);
-				break;
-            }
-            site=site->next;
-        }       
+// Checks for key in the cache if found returns a reference to the respective cache entry or else returns NULL
+    CacheEntryPtr site = cache.find(key);
+    if(site != NULL){
+		log_message(LogLevel::DEBUG, "url found");
     }
 	else {
-    { std::lock_guard<std::mutex> guard(cout_lock); std::cout << "\nurl not found\n"; }
+		log_message(LogLevel::DEBUG, "url not found");
 	}
     return site;
 }
 
 void evict_lru_element() {
-	std::lock_guard<std::mutex> guard(cache_lock);
-	remove_cache_element_nolock();
-}
-
-void remove_cache_element_nolock(){
-    // If cache is not empty searches for the node which has the least lru_time_track and deletes it
-    CacheElement * p ;  	// Cache_element Pointer (Prev. Pointer)
-	CacheElement * q ;		// Cache_element Pointer (Next Pointer)
-	CacheElement * temp;	// Cache element to remove
-
-	if( head != NULL) { // Cache != empty
-		for (q = head, p = head, temp =head ; q -> next != NULL; 
-			q = q -> next) { // Iterate through entire cache and search for oldest time track
-			if(( (q -> next) -> lru_time_track) < (temp -> lru_time_track)) {
-				temp = q -> next;
-				p = q;
-			}
-		}
-		if(temp == head) { 
-			head = head -> next; /*Handle the base case*/
-		} else {
-			p->next = temp->next;	
-		}
-		cache_size -= (temp->data.length() + temp->url.length() + sizeof(CacheElement)); //updating the cache size
-		{ std::lock_guard<std::mutex> guard(cout_lock); std::cout << "Cache element evicted. New size: " << cache_size << std::endl; }
-		delete temp; // Use delete for objects allocated with new
-	} 
+	cache.evict_lru();
+	log_message(LogLevel::DEBUG, "Cache element evicted. New size: %zu", cache.size());
 }
 
-int add_cache_element(const std::string& data, const std::string& url){
-    // Adds element to the cache
-	std::lock_guard<std::mutex> guard(cache_lock);
-
-    int data_size = data.length();
-    int element_size = data_size + url.length() + sizeof(CacheElement); // Size of the new element
-    if(element_size>MAX_ELEMENT_SIZE){
-        // If element size is greater than MAX_ELEMENT_SIZE we don't add the element to the cache
-        { std::lock_guard<std::mutex> guard(cout_lock); std::cerr << "Element too large for cache.\n"; }
+int add_cache_element(BufferChain data, const ParsedRequest& request, bool delimited){
+    // Adds element to the cache, evicting least recently used elements to make room
+    if(!cache.add(std::move(data), request, delimited)){
+        log_message(LogLevel::DEBUG, "Element not cached (not storable, too large or Vary: *).");
         return 0;
     }
-    else
-    {   
-		while(cache_size + element_size > MAX_SIZE){
-            remove_cache_element_nolock();
-        }
-        CacheElement* element = new (std::nothrow) CacheElement();
-        if (!element) {
-            { std::lock_guard<std::mutex> guard(cout_lock); std::cerr << "Failed to allocate memory for cache element.\n"; }
-            return 0;
-        }
-        
-        element->data = data;
-        element->url = url;
-		element->lru_time_track = time(NULL);
-        element->next = head;
-        head = element;
-        cache_size+=element_size;
-		{ std::lock_guard<std::mutex> guard(cout_lock); std::cout << "Element added to cache. New size: " << cache_size << std::endl; }
-        return 1;
-    }
-    return 0;
-}
\ No newline at end of file
+	log_message(LogLevel::DEBUG, "Element added to cache. New size: %zu", cache.size());
+    return 1;
+}
@@ -0,0 +1,78 @@
+/*
+ * proxy_server_with_cache.h -- declarations shared by the proxy's connection
+ * handlers (thread-per-connection and event loop).
+ */
+
+#include "proxy_socket.h"
+#include "proxy_parse.h"
+#include "proxy_cache.h"
+#include "proxy_disk.h"
+#include "proxy_upstream.h"
+#include "proxy_inflight.h"
+#include "proxy_resolver.h"
+#include "proxy_pool.h"
+#include "proxy_log.h"
+#include "proxy_metrics.h"
+#include "proxy_tunnel.h"
+#include <string>
+#include <optional>
+#include <mutex>
+#include <cstring>
+
+#ifndef PROXY_SERVER_WITH_CACHE
+#define PROXY_SERVER_WITH_CACHE
+
+#define MAX_BYTES 4096    //max allowed size of request/response
+#define MAX_CLIENTS 400     //max number of client requests served at a time
+#define MAX_SIZE 200*(1<<20)     //size of the cache
+#define MAX_ELEMENT_SIZE 10*(1<<20)     //max size of an element in cache
+#define MAX_REQUESTS_PER_CONNECTION 100     //requests served on one client connection before closing it
+#define CLIENT_IDLE_TIMEOUT 15     //seconds a keep-alive client connection may sit idle
+#define MAX_CLIENT_BUFFER (2*MAX_REQ_LEN)     //bytes read ahead from a client; any request, head and body, fits
+
+extern ProxyCache cache;
+extern DiskCache disk_cache;
+extern UpstreamPool upstream_pool;
+extern InflightTable inflight;
+extern Resolver resolver;
+
+CacheEntryPtr find(const CacheKey& key);
+int add_cache_element(BufferChain data, const ParsedRequest& request, bool delimited);
+void evict_lru_element();
+
+int checkHTTPversion(std::string_view msg);
+
+// Whether the client asked to keep its connection open after this request:
+// HTTP/1.1 unless it sent "Connection: close", HTTP/1.0 only with
+// "Connection: keep-alive". Must be called before origin_request() rewrites
+// the Connection header.
+bool client_keep_alive(const ParsedRequest& request);
+
+// Returns the canned response for an error status, or an empty string for a
+// status we have no page for.
+std::string error_response(int status_code);
+
+// Sends the canned page for status_code. Returns its length, or -1 if there
+// is no page for the status.
+int sendErrorMessage(socket_t socket, int status_code);
+
+// Rewrites request for the origin server (adds Connection: keep-alive and
+// Host, and replaces the client's validators with stale's, if given) and
+// writes the bytes to send it into out, replacing its contents but keeping
+// its capacity for the next request.
+void origin_request(ParsedRequest& request, const CacheEntry* stale, std::string& out);
+
+// Serves the requests on one client connection until it closes; client is
+// its address, for the access log. When another I/O backend hands over a
+// connection, pending holds the bytes it already read from it, and
+// looked_up what find() returned for the first request in them.
+void thread_fn(socket_t socket, const std::string& client, WorkerPool* pool, std::string pending = std::string(), std::optional<CacheEntryPtr> looked_up = std::nullopt);
+
+// Opens a blocking connection to host_addr:port_num. Returns
+// INVALID_SOCKET_VAL if the host can't be resolved or reached.
+socket_t connectRemoteServer(std::string_view host_addr, int port_num);
+
+// Effective origin port of request: its explicit port, or 80.
+int origin_port(const ParsedRequest& request);
+
+#endif
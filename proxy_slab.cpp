@@ -0,0 +1,71 @@
+/*
+  proxy_slab.cpp -- size-class slab allocator.
+*/
+
+#include "proxy_slab.h"
+#include <new>
+
+static uint32_t class_for(size_t capacity) {
+    uint32_t size_class = 0;
+    while (size_class + 1 < SLAB_CLASSES && ((size_t)SLAB_MIN_BLOCK << size_class) - sizeof(BufferSlab) < capacity) {
+        size_class++;
+    }
+    return size_class;
+}
+
+BufferSlab* SlabAllocator::allocate(size_t capacity) {
+    uint32_t size_class = class_for(capacity);
+    SizeClass& sc = classes_[size_class];
+    size_t block_size = (size_t)SLAB_MIN_BLOCK << size_class;
+
+    std::lock_guard<std::mutex> guard(sc.lock);
+    if (sc.free.empty()) {
+        // Carve a new arena; it is never freed, so its blocks are only ever
+        // handed out again
+        char* arena = new char[SLAB_ARENA_SIZE];
+        sc.free.reserve(sc.free.size() + SLAB_ARENA_SIZE / block_size);
+        for (size_t off = SLAB_ARENA_SIZE; off >= block_size; off -= block_size) {
+            sc.free.push_back(reinterpret_cast<BufferSlab*>(arena + off - block_size));
+        }
+        sc.arenas++;
+    }
+    BufferSlab* slab = sc.free.back();
+    sc.free.pop_back();
+    sc.in_use++;
+    new (slab) BufferSlab();
+    slab->refs.store(1, std::memory_order_relaxed);
+    slab->size_class = size_class;
+    return slab;
+}
+
+void SlabAllocator::release(BufferSlab* slab) {
+    SizeClass& sc = classes_[slab->size_class];
+    slab->~BufferSlab();
+    std::lock_guard<std::mutex> guard(sc.lock);
+    sc.free.push_back(slab);
+    sc.in_use--;
+}
+
+SlabStats SlabAllocator::stats() const {
+    SlabStats stats;
+    for (uint32_t i = 0; i < SLAB_CLASSES; i++) {
+        const SizeClass& sc = classes_[i];
+        SlabClassStats class_stats;
+        class_stats.block_size = (size_t)SLAB_MIN_BLOCK << i;
+        {
+            std::lock_guard<std::mutex> guard(sc.lock);
+            class_stats.arenas = sc.arenas;
+            class_stats.in_use = sc.in_use;
+            class_stats.free = sc.free.size();
+        }
+        stats.reserved += class_stats.arenas * SLAB_ARENA_SIZE;
+        stats.in_use += class_stats.in_use * class_stats.block_size;
+        stats.classes.push_back(class_stats);
+    }
+    return stats;
+}
+
+SlabAllocator& slab_allocator() {
+    static SlabAllocator* allocator = new SlabAllocator();
+    return *allocator;
+}
@@ -0,0 +1,110 @@
+/*
+ * proxy_slab.h -- size-class slab allocator for response bodies.
+ */
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+#ifndef PROXY_SLAB
+#define PROXY_SLAB
+
+#define SLAB_ARENA_SIZE (1<<20)     //bytes taken from the system at a time, carved into blocks of one class
+#define SLAB_MIN_BLOCK 512          //smallest block; each class doubles it
+#define SLAB_CLASSES 6              //512 bytes to 16KB
+#define SLAB_MAX_BLOCK (SLAB_MIN_BLOCK << (SLAB_CLASSES - 1))
+
+// Header at the start of every block; the payload follows it.
+struct BufferSlab {
+    std::atomic<uint32_t> refs;
+    uint32_t size_class;
+    uint64_t pad;               // keeps the payload 16-byte aligned
+
+    char* data() { return reinterpret_cast<char*>(this + 1); }
+    const char* data() const { return reinterpret_cast<const char*>(this + 1); }
+    size_t capacity() const { return block_size() - sizeof(BufferSlab); }
+    size_t block_size() const { return (size_t)SLAB_MIN_BLOCK << size_class; }
+};
+
+// Occupancy of one size class.
+struct SlabClassStats {
+    size_t block_size = 0;
+    size_t arenas = 0;
+    size_t in_use = 0;          // blocks handed out
+    size_t free = 0;            // blocks carved and waiting for reuse
+
+    double occupancy() const { return in_use + free ? (double)in_use / (in_use + free) : 0; }
+};
+
+struct SlabStats {
+    std::vector<SlabClassStats> classes;   // smallest block first
+    size_t reserved = 0;        // bytes of arenas taken from the system
+    size_t in_use = 0;          // bytes of blocks handed out
+
+    // Share of reserved memory sitting in free blocks
+    double fragmentation() const { return reserved ? 1.0 - (double)in_use / reserved : 0; }
+};
+
+/*
+   SlabAllocator hands out blocks in SLAB_CLASSES power-of-two sizes. Each
+   class carves SLAB_ARENA_SIZE arenas into blocks of its size and keeps
+   freed blocks on a free list for reuse, so a long-running cache that churns
+   through bodies of every size reuses the same memory instead of leaving
+   holes across the heap. Arenas are never given back; the memory reserved
+   by a class is its peak use.
+
+   Blocks are refcounted in their header through SlabRef, so a block
+   shared by a cache entry, an in-flight fetch and the clients sending from
+   it carries no separate control block.
+ */
+class SlabAllocator {
+public:
+    // Returns a block whose payload holds at least capacity bytes (at most
+    // a full block's), with a count of one reference.
+    BufferSlab* allocate(size_t capacity);
+    void release(BufferSlab* slab);
+
+    SlabStats stats() const;
+
+private:
+    struct SizeClass {
+        mutable std::mutex lock;
+        std::vector<BufferSlab*> free;
+        size_t arenas = 0;
+        size_t in_use = 0;
+    };
+
+    SizeClass classes_[SLAB_CLASSES];
+};
+
+// The allocator for every BufferChain. Never destroyed, so chains released
+// by other static objects at exit still have somewhere to go.
+SlabAllocator& slab_allocator();
+
+// An owning reference to a block, like a shared_ptr to it.
+class SlabRef {
+public:
+    SlabRef() = default;
+    explicit SlabRef(BufferSlab* slab) : slab_(slab) {}
+    SlabRef(const SlabRef& other) : slab_(other.slab_) {
+        if (slab_) slab_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    SlabRef(SlabRef&& other) noexcept : slab_(other.slab_) { other.slab_ = nullptr; }
+    SlabRef& operator=(SlabRef other) noexcept {
+        std::swap(slab_, other.slab_);
+        return *this;
+    }
+    ~SlabRef() {
+        if (slab_ && slab_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) slab_allocator().release(slab_);
+    }
+
+    BufferSlab* operator->() const { return slab_; }
+    BufferSlab* get() const { return slab_; }
+
+private:
+    BufferSlab* slab_ = nullptr;
+};
+
+#endif
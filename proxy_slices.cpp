@@ -0,0 +1,397 @@
+/*
+  proxy_slices.cpp -- sliced large objects: slice fetches and SliceReader.
+*/
+
+#include "proxy_slices.h"
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+
+#define MAX_CACHED_HEAD 65536       //longest cached head searched for its end
+#define SLICE_RECV_BUFFER 16384     //bytes read at a time while looking for a head or skipping a body
+
+namespace {
+
+std::atomic<size_t> objects{0};
+std::atomic<size_t> slices{0};
+std::atomic<size_t> range_fetches{0};
+std::atomic<size_t> failures{0};
+std::atomic<size_t> partial{0};
+std::atomic<size_t> unsatisfiable{0};
+
+// Runs slice fetches, which block on origin sockets
+WorkerPool fetchers;
+
+uint64_t slice_bytes(const CacheEntry& head, uint64_t index) {
+    return std::min<uint64_t>(CACHE_SLICE_SIZE, head.sliced_length - index * CACHE_SLICE_SIZE);
+}
+
+// The validator to send in If-Range: a strong ETag, or else Last-Modified
+std::string_view if_range_value(std::string_view head) {
+    std::string_view etag = find_response_header(head, "ETag");
+    if (!etag.empty() && etag.front() == '"') return etag;
+    return find_response_header(head, "Last-Modified");
+}
+
+// Whether a response from the origin is the same version of the object as
+// head: any ETag and Last-Modified it carries match head's.
+bool same_version(std::string_view response, std::string_view head) {
+    for (const char* name : {"ETag", "Last-Modified"}) {
+        std::string_view value = find_response_header(response, name);
+        if (!value.empty() && value != find_response_header(head, name)) return false;
+    }
+    return true;
+}
+
+// Reads the next length body bytes of the response on s into chain, taking
+// them from carry first (bytes already read and framed), publishing them to
+// fetch as they arrive. Returns false if the origin fails, ends the body
+// early, or the fetchers are draining.
+bool read_body(socket_t s, ResponseFramer& framer, std::string& carry, BufferChain& chain, size_t length, InflightFetch& fetch) {
+    size_t n = std::min(carry.size(), length);
+    chain.append(carry.data(), n);
+    carry.erase(0, n);
+    while (chain.size() < length) {
+        if (fetchers.draining()) return false;
+        fetch.publish(chain);
+        size_t avail;
+        char* buffer = chain.reserve(avail);
+        int got = recv(s, buffer, (int)std::min(avail, length - chain.size()), 0);
+        if (got <= 0) return false;
+        size_t used = framer.feed(buffer, got);
+        chain.commit(used);
+        if (used < (size_t)got || framer.failed()) return false;
+    }
+    fetch.publish(chain);
+    return true;
+}
+
+// Reads and drops the next length body bytes of the response on s
+bool skip_body(socket_t s, ResponseFramer& framer, std::string& carry, uint64_t length) {
+    size_t n = (size_t)std::min<uint64_t>(carry.size(), length);
+    carry.erase(0, n);
+    length -= n;
+    char buffer[SLICE_RECV_BUFFER];
+    while (length > 0) {
+        if (fetchers.draining()) return false;
+        int got = recv(s, buffer, (int)std::min<uint64_t>(sizeof(buffer), length), 0);
+        if (got <= 0) return false;
+        size_t used = framer.feed(buffer, got);
+        if (used < (size_t)got || framer.failed()) return false;
+        length -= used;
+    }
+    return true;
+}
+
+// Sends request on a connection to host:port, pooled if one is idle, and
+// reads the response up to the end of its head. Returns the socket, or
+// INVALID_SOCKET_VAL; head gets the head and carry any body bytes read
+// after it.
+socket_t request_head(const std::string& host, int port, const std::string& request, ResponseFramer& framer, std::string& head, std::string& carry) {
+    char buffer[SLICE_RECV_BUFFER];
+    // A pooled connection may have been closed by the origin while idle;
+    // retry once on a fresh one, as handle_request does
+    for (int attempt = 0; attempt < 2; attempt++) {
+        socket_t s = attempt == 0 ? upstream_pool.acquire(host, port) : INVALID_SOCKET_VAL;
+        bool pooled = s != INVALID_SOCKET_VAL;
+        if (!pooled) s = connectRemoteServer(host, port);
+        if (s == INVALID_SOCKET_VAL) return s;
+        set_recv_timeout(s, SLICE_FETCH_TIMEOUT);
+
+        framer = ResponseFramer();
+        std::string got;
+        bool sent = send(s, request.data(), (int)request.size(), 0) == (long)request.size();
+        while (sent && !framer.has_status() && !framer.failed()) {
+            int n = recv(s, buffer, sizeof(buffer), 0);
+            if (n <= 0) break;
+            got.append(buffer, framer.feed(buffer, n));
+        }
+        if (framer.has_status()) {
+            head = got.substr(0, framer.head_length());
+            carry = got.substr(framer.head_length());
+            return s;
+        }
+        close_socket(s);
+        if (!pooled || !got.empty()) break;
+    }
+    return INVALID_SOCKET_VAL;
+}
+
+// Hands s back to the pool if its response ended cleanly, else closes it
+void finish_origin(const std::string& host, int port, socket_t s, const ResponseFramer& framer) {
+    if (framer.reusable()) upstream_pool.release(host, port, s);
+    else close_socket(s);
+}
+
+void end_slice(const CacheKey& key, const InflightFetchPtr& fetch, bool ok) {
+    if (ok) fetch->complete(true);
+    else {
+        fetch->fail();
+        failures++;
+    }
+    inflight.remove(key.text, fetch);
+}
+
+// Fetches slice index of head on its own, with a Range request, into fetch
+// and the cache. If the origin ignores the range and sends the whole
+// object, the slice is cut out of that instead.
+void fetch_range(SliceReader::Origin origin, CacheEntryPtr head, uint64_t index, CacheKey key, InflightFetchPtr fetch) {
+    range_fetches++;
+    std::string stored = head->data.copy(0, head->data.size());
+    uint64_t first = index * CACHE_SLICE_SIZE;
+    uint64_t length = slice_bytes(*head, index);
+
+    // The request ends with a blank line; the range goes in front of it
+    std::string request = origin.request.substr(0, origin.request.size() - 2);
+    request += "Range: bytes=" + std::to_string(first) + "-" + std::to_string(first + length - 1) + "\r\n";
+    request.append("If-Range: ").append(if_range_value(stored)).append("\r\n\r\n");
+
+    ResponseFramer framer;
+    std::string response, carry;
+    socket_t s = request_head(origin.host, origin.port, request, framer, response, carry);
+    if (s == INVALID_SOCKET_VAL) {
+        end_slice(key, fetch, false);
+        return;
+    }
+
+    bool ok = same_version(response, stored);
+    if (ok && framer.status() == 206) {
+        std::string expected = "bytes " + std::to_string(first) + "-" + std::to_string(first + length - 1) + "/" + std::to_string(head->sliced_length);
+        ok = find_response_header(response, "Content-Range") == expected;
+    }
+    else if (ok && framer.status() == 200) {
+        // No range support after all: read up to the slice, then drop the rest
+        ok = find_response_header(response, "Content-Length") == std::to_string(head->sliced_length) &&
+             skip_body(s, framer, carry, first);
+    }
+    else ok = false;
+
+    BufferChain chain;
+    ok = ok && read_body(s, framer, carry, chain, (size_t)length, *fetch);
+    finish_origin(origin.host, origin.port, s, framer);
+    if (ok) {
+        cache.add_slice(key, *head, std::move(chain));
+        slices++;
+    }
+    end_slice(key, fetch, ok);
+}
+
+// The slice fetch behind the ones readers of index join, or a private one
+// if someone else is already fetching it
+InflightFetchPtr join_slice(const CacheKey& key) {
+    bool leader;
+    InflightFetchPtr fetch = inflight.join(key.text, leader);
+    return leader ? fetch : std::make_shared<InflightFetch>();
+}
+
+// Reads the rest of the response on s, whose head is head, slice by slice
+// into the cache, starting with the slice fetch first. carry holds the body
+// bytes read with the head.
+void stream_slices(std::string host, int port, socket_t s, ResponseFramer framer, std::string carry, CacheEntryPtr head, InflightFetchPtr first) {
+    set_recv_timeout(s, SLICE_FETCH_TIMEOUT);
+    uint64_t count = (head->sliced_length + CACHE_SLICE_SIZE - 1) / CACHE_SLICE_SIZE;
+    CacheKey key = make_slice_key(*head, 0);
+    InflightFetchPtr fetch = std::move(first);
+    for (uint64_t index = 0; index < count; index++) {
+        // A reader that has every byte of this slice looks for the next one
+        // in the inflight table straight away, so it goes in first
+        CacheKey next_key;
+        InflightFetchPtr next;
+        if (index + 1 < count) {
+            next_key = make_slice_key(*head, index + 1);
+            next = join_slice(next_key);
+        }
+        BufferChain chain;
+        if (!read_body(s, framer, carry, chain, (size_t)slice_bytes(*head, index), *fetch)) {
+            close_socket(s);
+            end_slice(key, fetch, false);
+            if (next) end_slice(next_key, next, false);
+            return;
+        }
+        cache.add_slice(key, *head, std::move(chain));
+        slices++;
+        end_slice(key, fetch, true);
+        key = std::move(next_key);
+        fetch = std::move(next);
+    }
+    finish_origin(host, port, s, framer);
+}
+
+}  // namespace
+
+SliceReader::SliceReader(CacheEntryPtr entry, size_t head_length, std::string response_head, uint64_t first, uint64_t end, Origin origin)
+    : entry_(std::move(entry)), origin_(std::move(origin)), pos_(first), end_(end) {
+    head_.append(response_head);
+    if (entry_->sliced_length == 0) {
+        // Cached whole: the body is the rest of the entry's data
+        chain_.share_from(entry_->data);
+        skip_ = head_length;
+        length_ = entry_->data.size() - head_length;
+        opened_ = true;
+    }
+}
+
+void SliceReader::watch(const void* owner, std::function<void()> wake) {
+    owner_ = owner;
+    wake_ = std::move(wake);
+}
+
+// Opens the slice holding pos_: from the cache if it is there, else by
+// following or starting its fetch.
+void SliceReader::open_slice() {
+    uint64_t index = pos_ / CACHE_SLICE_SIZE;
+    base_ = index * CACHE_SLICE_SIZE;
+    skip_ = 0;
+    length_ = slice_bytes(*entry_, index);
+    opened_ = true;
+    fetch_.reset();
+    chain_.clear();
+
+    CacheKey key = make_slice_key(*entry_, index);
+    CacheEntryPtr slice = cache.find(key);
+    if (slice && slice->data.size() == length_) {
+        chain_.share_from(slice->data);
+        return;
+    }
+    bool leader;
+    fetch_ = inflight.join(key.text, leader);
+    if (leader) fetch_slice(index, key);
+    if (wake_) fetch_->watch(owner_, wake_);
+}
+
+void SliceReader::fetch_slice(uint64_t index, const CacheKey& key) {
+    InflightFetchPtr fetch = fetch_;
+    bool queued = fetchers.submit([origin = origin_, entry = entry_, index, key, fetch]() {
+        fetch_range(origin, entry, index, key, fetch);
+    });
+    if (!queued) {
+        log_message(LogLevel::WARN, "Slice fetchers are busy; can't fetch a slice");
+        end_slice(key, fetch, false);
+    }
+}
+
+SliceState SliceReader::read(size_t& from, size_t& to, bool wait) {
+    if (head_off_ < head_.size()) {
+        current_ = &head_;
+        from = head_off_;
+        to = head_.size();
+        return SliceState::READY;
+    }
+    if (pos_ >= end_) return SliceState::DONE;
+    if (!opened_ || pos_ >= base_ + length_) open_slice();
+
+    current_ = &chain_;
+    size_t at = skip_ + (size_t)(pos_ - base_);
+    if (chain_.size() <= at && fetch_) {
+        FetchState state = fetch_->read(chain_, wait);
+        if (state == FetchState::FAILED) return SliceState::FAILED;
+        if (chain_.size() <= at) {
+            // A slice that ended short is as good as failed
+            return state == FetchState::DONE ? SliceState::FAILED : SliceState::WAIT;
+        }
+    }
+    if (chain_.size() <= at) return SliceState::FAILED;
+    from = at;
+    to = std::min(chain_.size(), skip_ + (size_t)(std::min(end_, base_ + length_) - base_));
+    return SliceState::READY;
+}
+
+void SliceReader::consumed(size_t n) {
+    if (current_ == &head_) head_off_ += n;
+    else pos_ += n;
+    sent_ += n;
+}
+
+uint64_t slice_length(std::string_view head) {
+    if (response_status(head) != 200 || !find_response_header(head, "Transfer-Encoding").empty() ||
+        !find_response_header(head, "Content-Range").empty() || find_response_header(head, "Accept-Ranges") == "none" ||
+        if_range_value(head).empty()) {
+        return 0;
+    }
+    std::string value(find_response_header(head, "Content-Length"));
+    char* rest;
+    uint64_t length = strtoull(value.c_str(), &rest, 10);
+    if (value.empty() || *rest != '\0' || length <= SLICE_THRESHOLD) return 0;
+    return length;
+}
+
+std::unique_ptr<SliceReader> open_cached(ParsedRequest& request, const CacheEntryPtr& entry) {
+    std::string head = entry->data.copy(0, MAX_CACHED_HEAD);
+    size_t head_end = head.find("\r\n\r\n");
+    if (head_end == std::string::npos) return nullptr;
+    head.resize(head_end + 4);
+    uint64_t length = entry->sliced_length ? entry->sliced_length : entry->data.size() - head.size();
+
+    ByteRange range;
+    RangeResult result = select_range(request, head, length, range);
+    if (result == RangeResult::NONE && entry->sliced_length == 0) return nullptr;
+
+    std::string response_head;
+    uint64_t first = 0, end = length;
+    if (result == RangeResult::SATISFIABLE) {
+        response_head = partial_head(head, range, length);
+        first = range.first;
+        end = range.last + 1;
+        partial++;
+    }
+    else if (result == RangeResult::UNSATISFIABLE) {
+        response_head = unsatisfiable_head(length);
+        first = end = 0;
+        unsatisfiable++;
+    }
+    else response_head = head;
+
+    SliceReader::Origin origin;
+    if (entry->sliced_length) {
+        request.remove_header("Range");
+        request.remove_header("If-Range");
+        origin_request(request, nullptr, origin.request);
+        origin.host = std::string(request.get_host());
+        origin.port = origin_port(request);
+    }
+    return std::make_unique<SliceReader>(entry, head.size(), std::move(response_head), first, end, std::move(origin));
+}
+
+CacheEntryPtr slice_response(socket_t origin, const ParsedRequest& request, const ResponseFramer& framer, const BufferChain& response) {
+    std::string head = response.copy(0, framer.head_length());
+    uint64_t length = slice_length(head);
+    if (length == 0) return nullptr;
+    CacheEntryPtr entry = cache.add_sliced(head, request, length);
+    if (!entry) return nullptr;
+
+    // Readers of the first slice follow this fetch from the start
+    CacheKey key = make_slice_key(*entry, 0);
+    InflightFetchPtr first = join_slice(key);
+    std::string carry = response.copy(framer.head_length(), response.size());
+    bool queued = fetchers.submit([host = std::string(request.get_host()), port = origin_port(request), origin, framer,
+                                   carry = std::move(carry), entry, first]() {
+        stream_slices(host, port, origin, framer, carry, entry, first);
+    });
+    if (!queued) {
+        // The head stays cached; its slices will be fetched by range
+        log_message(LogLevel::WARN, "Slice fetchers are busy; relaying a large response uncached");
+        end_slice(key, first, false);
+        return nullptr;
+    }
+    objects++;
+    return entry;
+}
+
+void slice_fetch_start(size_t num_threads) {
+    fetchers.start(num_threads);
+}
+
+void slice_fetch_drain() {
+    fetchers.drain();
+}
+
+SliceStats slice_stats() {
+    SliceStats stats;
+    stats.objects = objects;
+    stats.slices = slices;
+    stats.range_fetches = range_fetches;
+    stats.failures = failures;
+    stats.partial = partial;
+    stats.unsatisfiable = unsatisfiable;
+    return stats;
+}
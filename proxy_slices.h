@@ -0,0 +1,139 @@
+/*
+ * proxy_slices.h -- large objects cached in fixed-size slices, and cached
+ * bodies served a byte range at a time.
+ */
+#include "proxy_server_with_cache.h"
+#include "proxy_range.h"
+#include <string>
+#include <memory>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+#ifndef PROXY_SLICES
+#define PROXY_SLICES
+
+#define SLICE_THRESHOLD (8*(1<<20))     //bodies longer than this are cached in slices rather than whole
+#define SLICE_FETCH_THREADS 16          //threads fetching slices from origins
+#define SLICE_FETCH_TIMEOUT 30          //seconds a slice fetch waits on a silent origin
+
+// Counters kept over every sliced object and ranged response.
+struct SliceStats {
+    size_t objects = 0;         // large responses cached as a head and slices
+    size_t slices = 0;          // slices fetched from origins and offered to the cache
+    size_t range_fetches = 0;   // slices fetched on their own, with a Range request
+    size_t failures = 0;        // slice fetches that failed
+    size_t partial = 0;         // 206 responses served from the cache
+    size_t unsatisfiable = 0;   // 416 responses
+};
+
+enum class SliceState {
+    READY,      // bytes are ready to send
+    WAIT,       // the slice being read is still arriving; a watch callback will say when there's more
+    DONE,       // the whole response has been produced
+    FAILED,     // a slice couldn't be fetched; the response can't be finished
+};
+
+/*
+   SliceReader produces a response from a cached entry: a head, then a span
+   of the entry's body. The body comes from the entry's own data when it
+   was cached whole, or slice by slice when it was cached in slices. A slice
+   missing from the cache is fetched from the origin with a Range request,
+   shared through the InflightTable like any other fetch, so it is streamed
+   to every reader waiting for it and then cached. A slice that is already
+   being fetched, including by the fetch that first brought the object in,
+   is followed rather than fetched twice.
+
+   read() never copies: it points at bytes of a slice, which the caller
+   sends and then reports with consumed(). At most one slice is held at a
+   time, so memory stays bounded however large the object is.
+ */
+class SliceReader {
+public:
+    // Where and how to fetch a missing slice: the request for the whole
+    // object, as sent to the origin, without Range or If-Range.
+    struct Origin {
+        std::string host;
+        int port = 80;
+        std::string request;
+    };
+
+    // Produces response_head and then body bytes [first, end) of entry,
+    // whose own head is head_length bytes.
+    SliceReader(CacheEntryPtr entry, size_t head_length, std::string response_head, uint64_t first, uint64_t end, Origin origin);
+
+    // Disable copy and assignment
+    SliceReader(const SliceReader&) = delete;
+    SliceReader& operator=(const SliceReader&) = delete;
+
+    // Registers wake with every slice fetch the reader waits on, as
+    // InflightFetch::watch(); for an event loop, which reads without waiting.
+    void watch(const void* owner, std::function<void()> wake);
+
+    // Finds the next bytes to send: chain()[from, to). With wait set, blocks
+    // until there are some rather than returning WAIT.
+    SliceState read(size_t& from, size_t& to, bool wait);
+    const BufferChain& chain() const { return *current_; }
+
+    // Marks n bytes of the last read() as sent.
+    void consumed(size_t n);
+
+    // Bytes of the response sent so far
+    uint64_t sent() const { return sent_; }
+
+private:
+    void open_slice();
+    void fetch_slice(uint64_t index, const CacheKey& key);
+
+    CacheEntryPtr entry_;
+    Origin origin_;
+    BufferChain head_;            // the response head, sent first
+    size_t head_off_ = 0;
+    uint64_t pos_;                // next body byte to produce
+    uint64_t end_;
+    uint64_t sent_ = 0;
+
+    // The slice being read (for an entry cached whole, its data), and where
+    // in the body it starts
+    BufferChain chain_;
+    uint64_t base_ = 0;           // body offset of the slice's first byte
+    size_t skip_ = 0;             // chain_ offset of that byte
+    uint64_t length_ = 0;         // body bytes in the slice
+    bool opened_ = false;
+    InflightFetchPtr fetch_;      // set while the slice is still arriving
+    const BufferChain* current_ = &head_;
+
+    const void* owner_ = nullptr;
+    std::function<void()> wake_;
+};
+
+// Body length of the response whose head is head if it should be cached in
+// slices: a 200 with a Content-Length over SLICE_THRESHOLD and a validator
+// (a strong ETag or Last-Modified) to fetch the rest by range with, from an
+// origin that doesn't refuse ranges. 0 otherwise.
+uint64_t slice_length(std::string_view head);
+
+// Returns a reader for the response to request from entry when one is
+// needed: entry is cached in slices, or request asks for a range of it (a
+// 206 or 416). Returns nullptr when entry's data is to be sent as it is.
+// Rewrites request into the origin request slice fetches are made with.
+std::unique_ptr<SliceReader> open_cached(ParsedRequest& request, const CacheEntryPtr& entry);
+
+// Takes over an origin response that should be cached in slices, once its
+// head is in: caches the head and hands origin, with the bytes of response
+// read past the head, to a slice fetcher that reads the rest of the body
+// slice by slice into the cache. Returns the head to serve the response
+// from, or nullptr if the response isn't to be sliced, in which case origin
+// is left with the caller. origin must be blocking.
+CacheEntryPtr slice_response(socket_t origin, const ParsedRequest& request, const ResponseFramer& framer, const BufferChain& response);
+
+// Starts the slice fetcher threads. Until they are, nothing is cached in
+// slices.
+void slice_fetch_start(size_t num_threads = SLICE_FETCH_THREADS);
+
+// Lets the running slice fetches wind down and joins the threads.
+void slice_fetch_drain();
+
+SliceStats slice_stats();
+
+#endif
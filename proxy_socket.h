@@ -0,0 +1,98 @@
+/*
+ * proxy_socket.h -- socket headers and helpers for Winsock and BSD sockets.
+ */
+
+// On Windows, winsock2.h must be included before windows.h.
+// proxy_parse.h includes windows.h, so we include socket headers first.
+#ifdef _WIN32
+#include <winsock2.h> // For socket functions
+#include <ws2tcpip.h> // For getaddrinfo
+#else
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <cerrno>
+#endif
+
+#ifndef PROXY_SOCKET
+#define PROXY_SOCKET
+
+#ifdef _WIN32
+using socket_t = SOCKET;
+const socket_t INVALID_SOCKET_VAL = INVALID_SOCKET;
+inline void close_socket(socket_t s) { closesocket(s); }
+inline int poll_sockets(WSAPOLLFD* fds, unsigned long n, int timeout_ms) { return WSAPoll(fds, n, timeout_ms); }
+using pollfd_t = WSAPOLLFD;
+inline int set_recv_timeout(socket_t s, int seconds) {
+    DWORD ms = seconds * 1000;
+    return setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&ms, sizeof(ms));
+}
+inline int set_send_timeout(socket_t s, int seconds) {
+    DWORD ms = seconds * 1000;
+    return setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char*)&ms, sizeof(ms));
+}
+using iovec_t = WSABUF;
+inline void set_iovec(iovec_t& v, const char* data, size_t len) { v.buf = (CHAR*)data; v.len = (ULONG)len; }
+inline long send_iovec(socket_t s, iovec_t* iov, int n) {
+    DWORD sent = 0;
+    if (WSASend(s, iov, (DWORD)n, &sent, 0, NULL, NULL) != 0) return -1;
+    return (long)sent;
+}
+inline int set_nonblocking(socket_t s) {
+    u_long on = 1;
+    return ioctlsocket(s, FIONBIO, &on);
+}
+// Sends each write as soon as it is made, instead of holding a short one back
+// until the last is acknowledged
+inline int set_nodelay(socket_t s) {
+    BOOL on = TRUE;
+    return setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+}
+// Whether the last failed call on a non-blocking socket only needs retrying later
+inline bool socket_would_block() { return WSAGetLastError() == WSAEWOULDBLOCK; }
+#else
+using socket_t = int;
+const socket_t INVALID_SOCKET_VAL = -1;
+#define SD_BOTH SHUT_RDWR
+#define SD_SEND SHUT_WR
+inline void close_socket(socket_t s) { close(s); }
+inline int poll_sockets(struct pollfd* fds, nfds_t n, int timeout_ms) { return poll(fds, n, timeout_ms); }
+using pollfd_t = struct pollfd;
+inline int set_recv_timeout(socket_t s, int seconds) {
+    struct timeval tv;
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+    return setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+// On Linux this also bounds a blocking connect()
+inline int set_send_timeout(socket_t s, int seconds) {
+    struct timeval tv;
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+    return setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+using iovec_t = struct iovec;
+inline void set_iovec(iovec_t& v, const char* data, size_t len) { v.iov_base = (void*)data; v.iov_len = len; }
+inline long send_iovec(socket_t s, iovec_t* iov, int n) {
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    return sendmsg(s, &msg, 0);
+}
+inline int set_nonblocking(socket_t s) { return fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK); }
+inline int set_nodelay(socket_t s) {
+    int on = 1;
+    return setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+inline bool socket_would_block() { return errno == EAGAIN || errno == EWOULDBLOCK; }
+#endif
+
+#endif
@@ -0,0 +1,215 @@
+/*
+  proxy_tunnel.cpp -- the CONNECT tunnel relay.
+*/
+
+#include "proxy_tunnel.h"
+#include "proxy_metrics.h"
+#include "proxy_log.h"
+#include <atomic>
+#include <bitset>
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+
+std::atomic<size_t> opened{0};
+std::atomic<size_t> active{0};
+std::atomic<size_t> refused{0};
+std::atomic<size_t> idle_timeouts{0};
+std::atomic<size_t> copied{0};
+std::atomic<uint64_t> client_bytes{0};
+std::atomic<uint64_t> origin_bytes{0};
+
+// Parses a comma-separated list of ports into ports. Returns false if an
+// entry isn't a port number.
+bool parse_ports(const std::string& list, std::bitset<65536>& ports) {
+    size_t at = 0;
+    while (at <= list.size()) {
+        size_t end = std::min(list.find(',', at), list.size());
+        std::string entry = list.substr(at, end - at);
+        char* rest;
+        long port = strtol(entry.c_str(), &rest, 10);
+        if (entry.empty() || *rest != '\0' || port <= 0 || port > 65535) return false;
+        ports.set(port);
+        at = end + 1;
+    }
+    return true;
+}
+
+std::bitset<65536> default_ports() {
+    std::bitset<65536> ports;
+    parse_ports(TUNNEL_DEFAULT_PORTS, ports);
+    return ports;
+}
+
+// Set once at startup, before any tunnel is served
+std::bitset<65536> allowed_ports = default_ports();
+
+// A call that failed only because a signal arrived, to be made again
+bool interrupted() {
+#ifdef _WIN32
+    return false;
+#else
+    return errno == EINTR;
+#endif
+}
+
+}  // namespace
+
+TunnelRelay::TunnelRelay(socket_t client, socket_t origin, std::string to_client, std::string to_origin)
+    : last_active_(time(NULL)), opened_(std::chrono::steady_clock::now()) {
+    up_.from = client;
+    up_.to = origin;
+    up_.preamble = std::move(to_origin);
+    down_.from = origin;
+    down_.to = client;
+    down_.preamble = std::move(to_client);
+    open_flow(up_);
+    open_flow(down_);
+    if (up_.buffer || down_.buffer) copied++;
+    opened++;
+    active++;
+}
+
+TunnelRelay::~TunnelRelay() {
+#ifdef __linux__
+    for (Flow* flow : {&up_, &down_}) {
+        if (flow->pipe[0] >= 0) {
+            close(flow->pipe[0]);
+            close(flow->pipe[1]);
+        }
+    }
+#endif
+    metrics_record_tunnel(up_.bytes + down_.bytes, age());
+    active--;
+}
+
+// Gives flow a pipe to splice through, or a buffer if it can't have one
+void TunnelRelay::open_flow(Flow& flow) {
+#ifdef __linux__
+    if (pipe2(flow.pipe, O_NONBLOCK | O_CLOEXEC) == 0) return;
+    flow.pipe[0] = flow.pipe[1] = -1;
+    log_message(LogLevel::WARN, "Can't make a pipe for a tunnel; relaying it by copying");
+#endif
+    flow.buffer.reset(new char[TUNNEL_BUFFER_SIZE]);
+}
+
+// Delivers what flow holds and reads more, until a socket would block, the
+// source has finished, or TUNNEL_PUMP_MAX bytes have been read. Returns
+// false if either socket failed.
+bool TunnelRelay::move(Flow& flow, std::atomic<uint64_t>& total) {
+    size_t budget = TUNNEL_PUMP_MAX;
+    while (true) {
+        long n;
+        if (flow.preamble_off < flow.preamble.size()) {
+            n = send(flow.to, flow.preamble.data() + flow.preamble_off, (int)(flow.preamble.size() - flow.preamble_off), 0);
+            if (n < 0) {
+                if (interrupted()) continue;
+                return socket_would_block();
+            }
+            flow.preamble_off += n;
+            continue;
+        }
+
+        if (flow.held > 0) {
+#ifdef __linux__
+            if (flow.pipe[0] >= 0)
+                n = splice(flow.pipe[0], nullptr, flow.to, nullptr, flow.held, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            else
+#endif
+                n = send(flow.to, flow.buffer.get() + flow.held_off, (int)flow.held, 0);
+            if (n < 0) {
+                if (interrupted()) continue;
+                return socket_would_block();
+            }
+            flow.held -= n;
+            flow.held_off += n;
+            flow.bytes += n;
+            total += n;
+            last_active_ = time(NULL);
+            continue;
+        }
+
+        if (flow.eof) {
+            // Everything the source sent has been delivered; pass its FIN on
+            if (!flow.shut) {
+                shutdown(flow.to, SD_SEND);
+                flow.shut = true;
+            }
+            return true;
+        }
+        if (budget == 0) return true;
+
+        // The pipe (or buffer) is empty, so a read that would block means
+        // the source has nothing more for now
+#ifdef __linux__
+        if (flow.pipe[1] >= 0)
+            n = splice(flow.from, nullptr, flow.pipe[1], nullptr, std::min(budget, (size_t)TUNNEL_SPLICE_MAX), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        else
+#endif
+            n = recv(flow.from, flow.buffer.get(), (int)std::min(budget, (size_t)TUNNEL_BUFFER_SIZE), 0);
+        if (n == 0) {
+            flow.eof = true;
+            continue;
+        }
+        if (n < 0) {
+            if (interrupted()) continue;
+            return socket_would_block();
+        }
+        flow.held = n;
+        flow.held_off = 0;
+        budget -= std::min(budget, (size_t)n);
+        last_active_ = time(NULL);
+    }
+}
+
+bool TunnelRelay::pump() {
+    if (failed_) return false;
+    if (!move(up_, client_bytes) || !move(down_, origin_bytes)) {
+        failed_ = true;
+        return false;
+    }
+    return !(up_.shut && down_.shut);
+}
+
+bool TunnelRelay::wants_read(Side side) const {
+    const Flow& flow = side == CLIENT ? up_ : down_;
+    // Nothing is read while the last read, or the preamble, is undelivered
+    return !failed_ && !flow.eof && flow.held == 0 && flow.preamble_off == flow.preamble.size();
+}
+
+bool TunnelRelay::wants_write(Side side) const {
+    const Flow& flow = side == CLIENT ? down_ : up_;
+    return !failed_ && (flow.held > 0 || flow.preamble_off < flow.preamble.size());
+}
+
+void TunnelRelay::expire() {
+    if (failed_) return;
+    failed_ = true;
+    idle_timeouts++;
+}
+
+int tunnel_set_ports(const std::string& list) {
+    std::bitset<65536> ports;
+    if (!parse_ports(list, ports)) return -1;
+    allowed_ports = ports;
+    return 0;
+}
+
+bool tunnel_admit(int port) {
+    if (port > 0 && port <= 65535 && allowed_ports.test(port)) return true;
+    refused++;
+    return false;
+}
+
+TunnelStats tunnel_stats() {
+    TunnelStats stats;
+    stats.opened = opened;
+    stats.active = active;
+    stats.refused = refused;
+    stats.idle_timeouts = idle_timeouts;
+    stats.copied = copied;
+    stats.client_bytes = client_bytes;
+    stats.origin_bytes = origin_bytes;
+    return stats;
+}
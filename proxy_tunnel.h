@@ -0,0 +1,117 @@
+/*
+ * proxy_tunnel.h -- CONNECT tunnels: relaying raw bytes between a client and
+ * an origin.
+ */
+#include "proxy_socket.h"
+#include <string>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <cstdint>
+#include <cstddef>
+
+#ifndef PROXY_TUNNEL
+#define PROXY_TUNNEL
+
+#define TUNNEL_IDLE_TIMEOUT 300         //seconds a tunnel may pass no bytes either way before it is closed
+#define TUNNEL_SPLICE_MAX (64*1024)     //bytes asked of one splice() into a pipe; a pipe holds 64 KB by default
+#define TUNNEL_BUFFER_SIZE (64*1024)    //bytes each direction buffers when it can't splice
+#define TUNNEL_PUMP_MAX (1<<20)         //bytes moved each way per pump(), so one busy tunnel can't hog an event loop
+#define TUNNEL_DEFAULT_PORTS "443"      //ports CONNECT may reach unless --connect-ports says otherwise
+#define TUNNEL_ESTABLISHED "HTTP/1.1 200 Connection Established\r\n\r\n"
+
+// Counters kept over every tunnel.
+struct TunnelStats {
+    size_t opened = 0;
+    size_t active = 0;
+    size_t refused = 0;             // CONNECTs to a port not allowed
+    size_t idle_timeouts = 0;       // closed after TUNNEL_IDLE_TIMEOUT
+    size_t copied = 0;              // relayed through a buffer because no pipe could be made
+    uint64_t client_bytes = 0;      // relayed from clients to origins
+    uint64_t origin_bytes = 0;      // relayed from origins to clients
+};
+
+/*
+   TunnelRelay moves bytes both ways between a client and an origin until
+   both have finished sending. On Linux each direction splice()s from one
+   socket into a pipe and from the pipe into the other socket, so the
+   payload stays in the kernel and is never copied into the proxy; elsewhere,
+   or if no pipe can be made, it goes through a buffer with recv and send.
+
+   The sockets must be non-blocking. pump() moves whatever they allow right
+   now and never waits, so the same relay serves a thread polling both
+   sockets and an event loop: after each pump(), wait for the events that
+   wants_read() and wants_write() ask for.
+
+   Half-closes are passed on: once one side has sent FIN and every byte it
+   sent before has been delivered, the other side's socket is shut for
+   writing, and the tunnel carries on the other way. The relay never closes
+   the sockets; its owner does, once pump() returns false.
+ */
+class TunnelRelay {
+public:
+    enum Side { CLIENT, ORIGIN };
+
+    // to_client and to_origin are sent ahead of anything relayed: the
+    // "200 Connection Established" line, and any bytes the client sent
+    // after its CONNECT head.
+    TunnelRelay(socket_t client, socket_t origin, std::string to_client, std::string to_origin);
+    ~TunnelRelay();
+
+    // Disable copy and assignment
+    TunnelRelay(const TunnelRelay&) = delete;
+    TunnelRelay& operator=(const TunnelRelay&) = delete;
+
+    // Moves what both sockets allow without blocking. Returns false once the
+    // tunnel is over: both directions have been closed, or either socket
+    // failed.
+    bool pump();
+
+    bool wants_read(Side side) const;
+    bool wants_write(Side side) const;
+
+    // Marks the tunnel as ended for idling past TUNNEL_IDLE_TIMEOUT
+    void expire();
+
+    time_t last_active() const { return last_active_; }
+    uint64_t bytes_to_client() const { return down_.bytes; }
+    uint64_t bytes_to_origin() const { return up_.bytes; }
+    std::chrono::steady_clock::duration age() const { return std::chrono::steady_clock::now() - opened_; }
+
+private:
+    // One direction of the tunnel
+    struct Flow {
+        socket_t from;
+        socket_t to;
+        std::string preamble;           // sent before anything relayed
+        size_t preamble_off = 0;
+        int pipe[2] = {-1, -1};         // splice path
+        std::unique_ptr<char[]> buffer; // copy path
+        size_t held = 0;                // bytes read from `from` and not yet written to `to`
+        size_t held_off = 0;            // start of them in buffer
+        bool eof = false;               // `from` has finished sending
+        bool shut = false;              // `to` has been shut for writing
+        uint64_t bytes = 0;             // bytes written to `to`, preamble excluded
+    };
+
+    bool move(Flow& flow, std::atomic<uint64_t>& total);
+    void open_flow(Flow& flow);
+
+    Flow up_;                   // client to origin
+    Flow down_;                 // origin to client
+    bool failed_ = false;
+    time_t last_active_;
+    std::chrono::steady_clock::time_point opened_;
+};
+
+// Sets the ports CONNECT may reach from a comma-separated list, replacing
+// TUNNEL_DEFAULT_PORTS. Returns -1 if an entry isn't a port number.
+int tunnel_set_ports(const std::string& list);
+
+// Whether a CONNECT to port is allowed; refusals are counted.
+bool tunnel_admit(int port);
+
+TunnelStats tunnel_stats();
+
+#endif
@@ -0,0 +1,322 @@
+/*
+  proxy_upstream.cpp -- response framing and the origin connection pool.
+*/
+
+#include "proxy_upstream.h"
+#include "proxy_parse.h"
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+
+#define MAX_HEAD_LEN 65536      //longest response head or chunk line we accept
+
+// Reads up to and including the next CRLF into line_ (without the CRLF).
+// Returns true once a full line is available.
+bool ResponseFramer::take_line(const char* data, size_t len, size_t& i) {
+    while (i < len) {
+        char c = data[i++];
+        line_ += c;
+        if (c == '\n' && line_.size() >= 2 && line_[line_.size() - 2] == '\r') {
+            line_.resize(line_.size() - 2);
+            return true;
+        }
+        if (line_.size() > MAX_HEAD_LEN) {
+            state_ = FAILED;
+            return false;
+        }
+    }
+    return false;
+}
+
+// Decides how the body is framed once the whole head is in line_.
+bool ResponseFramer::parse_head() {
+    std::string_view head(line_);
+    // "HTTP/1.x NNN ..."
+    if (head.size() < 12 || head.compare(0, 5, "HTTP/") != 0) {
+        return false;
+    }
+    status_ = atoi(std::string(head.substr(9, 3)).c_str());
+    bool http10 = head.compare(0, 8, "HTTP/1.0") == 0;
+
+    std::string_view connection = find_response_header(head, "Connection");
+    std::string conn_value(connection);
+    for (auto& c : conn_value) c = (char)tolower((unsigned char)c);
+    if (conn_value.find("close") != std::string::npos) keep_alive_ = false;
+    else if (http10 && conn_value.find("keep-alive") == std::string::npos) keep_alive_ = false;
+
+    if (status_ >= 100 && status_ < 200) {
+        // Interim response; the real one follows on the same connection
+        line_.clear();
+        state_ = HEAD;
+        return true;
+    }
+    if (status_ == 204 || status_ == 304) {
+        state_ = DONE;
+        return true;
+    }
+
+    std::string te(find_response_header(head, "Transfer-Encoding"));
+    for (auto& c : te) c = (char)tolower((unsigned char)c);
+    if (te.find("chunked") != std::string::npos) {
+        state_ = CHUNK_SIZE;
+        return true;
+    }
+
+    std::string_view length = find_response_header(head, "Content-Length");
+    if (!length.empty()) {
+        char* end = nullptr;
+        std::string len_str(length);
+        unsigned long long n = strtoull(len_str.c_str(), &end, 10);
+        if (end == len_str.c_str() || *end != '\0') {
+            return false;
+        }
+        remaining_ = n;
+        state_ = remaining_ == 0 ? DONE : BODY_LENGTH;
+        return true;
+    }
+
+    // No framing: the body runs until the origin closes
+    keep_alive_ = false;
+    until_close_ = true;
+    state_ = BODY_UNTIL_CLOSE;
+    return true;
+}
+
+size_t ResponseFramer::feed(const char* data, size_t len) {
+    size_t i = 0;
+    while (i < len && state_ != DONE && state_ != FAILED) {
+        switch (state_) {
+            case HEAD: {
+                line_.append(data + i, len - i);
+                size_t end = line_.find("\r\n\r\n");
+                if (end == std::string::npos) {
+                    i = len;
+                    if (line_.size() > MAX_HEAD_LEN) state_ = FAILED;
+                    break;
+                }
+                // Give back whatever followed the head
+                size_t extra = line_.size() - (end + 4);
+                i = len - extra;
+                line_.resize(end + 4);
+                if (!parse_head()) {
+                    state_ = FAILED;
+                    break;
+                }
+                if (state_ != HEAD) {
+                    head_length_ = consumed_ + i;
+                    line_.clear();
+                }
+                break;
+            }
+            case BODY_LENGTH: {
+                size_t n = std::min(remaining_, len - i);
+                i += n;
+                remaining_ -= n;
+                if (remaining_ == 0) state_ = DONE;
+                break;
+            }
+            case CHUNK_SIZE:
+                if (take_line(data, len, i)) {
+                    char* end = nullptr;
+                    unsigned long long n = strtoull(line_.c_str(), &end, 16);
+                    if (end == line_.c_str()) {
+                        state_ = FAILED;
+                        break;
+                    }
+                    line_.clear();
+                    remaining_ = n;
+                    state_ = remaining_ == 0 ? TRAILER : CHUNK_DATA;
+                }
+                break;
+            case CHUNK_DATA: {
+                size_t n = std::min(remaining_, len - i);
+                i += n;
+                remaining_ -= n;
+                if (remaining_ == 0) state_ = CHUNK_DATA_END;
+                break;
+            }
+            case CHUNK_DATA_END:
+                if (take_line(data, len, i)) {
+                    state_ = line_.empty() ? CHUNK_SIZE : FAILED;
+                    line_.clear();
+                }
+                break;
+            case TRAILER:
+                if (take_line(data, len, i)) {
+                    if (line_.empty()) state_ = DONE;
+                    line_.clear();
+                }
+                break;
+            case BODY_UNTIL_CLOSE:
+                i = len;
+                break;
+            default:
+                break;
+        }
+    }
+    consumed_ += i;
+    return i;
+}
+
+void ResponseFramer::on_eof() {
+    if (state_ == BODY_UNTIL_CLOSE) {
+        state_ = DONE;
+    }
+    else if (state_ != DONE) {
+        state_ = FAILED;
+    }
+    keep_alive_ = false;
+}
+
+UpstreamPool::UpstreamPool(size_t max_idle_per_origin, int idle_timeout)
+    : max_idle_per_origin_(max_idle_per_origin), idle_timeout_(idle_timeout) {}
+
+UpstreamPool::~UpstreamPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        stopping_ = true;
+    }
+    stop_.notify_all();
+    if (sweeper_.joinable()) sweeper_.join();
+    for (auto& entry : idle_) {
+        for (auto& conn : entry.second) close_socket(conn.fd);
+    }
+}
+
+std::string UpstreamPool::origin_key(std::string_view host, int port) {
+    std::string key(host);
+    for (auto& c : key) c = (char)tolower((unsigned char)c);
+    return key + ":" + std::to_string(port);
+}
+
+// An idle connection should have nothing to read. Readable means the origin
+// closed it (EOF) or sent bytes we never asked for; either way it's unusable.
+bool UpstreamPool::healthy(socket_t s) {
+    pollfd_t pfd;
+    pfd.fd = s;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll_sockets(&pfd, 1, 0) == 0;
+}
+
+socket_t UpstreamPool::acquire(std::string_view host, int port) {
+    std::string key = origin_key(host, port);
+    std::vector<socket_t> stale;
+    socket_t found = INVALID_SOCKET_VAL;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        auto it = idle_.find(key);
+        time_t now = time(NULL);
+        while (it != idle_.end() && !it->second.empty()) {
+            IdleConnection conn = it->second.back();
+            it->second.pop_back();
+            if (now - conn.idle_since > idle_timeout_) {
+                stats_.evicted_idle++;
+                stale.push_back(conn.fd);
+            }
+            else if (!healthy(conn.fd)) {
+                stats_.evicted_unhealthy++;
+                stale.push_back(conn.fd);
+            }
+            else {
+                found = conn.fd;
+                break;
+            }
+        }
+        if (it != idle_.end() && it->second.empty()) idle_.erase(it);
+        if (found != INVALID_SOCKET_VAL) stats_.hits++;
+        else stats_.misses++;
+    }
+    for (socket_t s : stale) close_socket(s);
+    return found;
+}
+
+void UpstreamPool::release(std::string_view host, int port, socket_t s) {
+    std::string key = origin_key(host, port);
+    std::vector<socket_t> stale;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        auto& conns = idle_[key];
+        time_t now = time(NULL);
+
+        // Oldest connections sit at the front; drop the ones that timed out
+        size_t expired = 0;
+        while (expired < conns.size() && now - conns[expired].idle_since > idle_timeout_) {
+            stale.push_back(conns[expired].fd);
+            expired++;
+        }
+        conns.erase(conns.begin(), conns.begin() + expired);
+        stats_.evicted_idle += expired;
+
+        if (conns.size() >= max_idle_per_origin_) {
+            stats_.discarded++;
+            stale.push_back(s);
+        }
+        else {
+            conns.push_back({s, now});
+            stats_.released++;
+        }
+    }
+    for (socket_t fd : stale) close_socket(fd);
+}
+
+void UpstreamPool::sweep() {
+    std::vector<socket_t> stale;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        time_t now = time(NULL);
+
+        // One poll checks every idle connection, as healthy() does one
+        std::vector<pollfd_t> pfds;
+        for (auto& entry : idle_) {
+            for (auto& conn : entry.second) {
+                pollfd_t pfd;
+                pfd.fd = conn.fd;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                pfds.push_back(pfd);
+            }
+        }
+        if (!pfds.empty() && poll_sockets(pfds.data(), pfds.size(), 0) < 0) return;
+
+        size_t i = 0;
+        for (auto it = idle_.begin(); it != idle_.end();) {
+            auto& conns = it->second;
+            size_t kept = 0;
+            for (auto& conn : conns) {
+                const pollfd_t& pfd = pfds[i++];
+                if (now - conn.idle_since > idle_timeout_) {
+                    stats_.evicted_idle++;
+                    stale.push_back(conn.fd);
+                }
+                else if (pfd.revents != 0) {
+                    stats_.evicted_unhealthy++;
+                    stale.push_back(conn.fd);
+                }
+                else {
+                    conns[kept++] = conn;
+                }
+            }
+            conns.resize(kept);
+            if (conns.empty()) it = idle_.erase(it);
+            else ++it;
+        }
+    }
+    for (socket_t s : stale) close_socket(s);
+}
+
+void UpstreamPool::start_sweeper() {
+    sweeper_ = std::thread([this]() {
+        std::unique_lock<std::mutex> guard(lock_);
+        while (!stop_.wait_for(guard, std::chrono::seconds(UPSTREAM_SWEEP_INTERVAL), [this]() { return stopping_; })) {
+            guard.unlock();
+            sweep();
+            guard.lock();
+        }
+    });
+}
+
+UpstreamStats UpstreamPool::stats() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return stats_;
+}
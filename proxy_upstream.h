@@ -0,0 +1,132 @@
+/*
+ * proxy_upstream.h -- persistent connections to origin servers.
+ */
+#include "proxy_socket.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <ctime>
+#include <cstddef>
+
+#ifndef PROXY_UPSTREAM
+#define PROXY_UPSTREAM
+
+#define MAX_IDLE_PER_ORIGIN 16       //idle upstream connections kept per host:port
+#define ORIGIN_IDLE_TIMEOUT 30       //seconds an idle upstream connection is kept
+#define UPSTREAM_SWEEP_INTERVAL 5    //seconds between sweeps of every origin's idle connections
+#define ORIGIN_TIMEOUT 30            //seconds an origin may take to accept a connection, or between bytes of a response
+
+/*
+   ResponseFramer follows an HTTP/1.x response as it streams in and works out
+   where it ends: after the head for 1xx/204/304, after Content-Length bytes,
+   after the last chunk and trailers of a chunked body, or at EOF when the
+   origin gives no length. Only a response that ended by framing, without
+   "Connection: close", leaves the connection reusable.
+ */
+class ResponseFramer {
+public:
+    // Consumes the next len bytes of the response and returns how many of
+    // them belong to it; anything past the end of the response is not consumed.
+    size_t feed(const char* data, size_t len);
+
+    // The origin closed the connection. Completes a body delimited by close;
+    // for any other state the response was truncated.
+    void on_eof();
+
+    bool complete() const { return state_ == DONE; }
+    bool failed() const { return state_ == FAILED; }
+    // Once complete, whether the connection can carry another request
+    bool reusable() const { return state_ == DONE && keep_alive_; }
+    // Once complete, whether the response carried its own length (so a client
+    // can tell where it ends without the connection closing)
+    bool delimited() const { return state_ == DONE && !until_close_; }
+    int status() const { return status_; }
+    // Whether the head of the final (non-1xx) response has been parsed
+    bool has_status() const { return status_ >= 200; }
+    // Once has_status(), the bytes fed up to the end of the final head,
+    // counting any interim responses before it
+    size_t head_length() const { return head_length_; }
+
+private:
+    enum State { HEAD, BODY_LENGTH, CHUNK_SIZE, CHUNK_DATA, CHUNK_DATA_END, TRAILER, BODY_UNTIL_CLOSE, DONE, FAILED };
+
+    bool parse_head();
+    bool take_line(const char* data, size_t len, size_t& i);
+
+    State state_ = HEAD;
+    std::string line_;            // head bytes, or the current chunk-size/trailer line
+    size_t remaining_ = 0;        // bytes left in the body or current chunk
+    size_t consumed_ = 0;         // bytes fed and kept, before the current feed()
+    size_t head_length_ = 0;
+    int status_ = 0;
+    bool keep_alive_ = true;
+    bool until_close_ = false;
+};
+
+// Counters exposed by UpstreamPool.
+struct UpstreamStats {
+    size_t hits = 0;              // requests served on a pooled connection
+    size_t misses = 0;            // requests that needed a new connection
+    size_t released = 0;          // connections returned to the pool
+    size_t evicted_idle = 0;      // closed after ORIGIN_IDLE_TIMEOUT
+    size_t evicted_unhealthy = 0; // closed because the origin hung up or sent stray bytes
+    size_t discarded = 0;         // closed because the pool for that origin was full
+};
+
+/*
+   UpstreamPool keeps idle keep-alive connections per (host, port). acquire()
+   hands out the most recently used healthy one; release() puts a connection
+   back once its response has been fully framed. sweep() closes the idle
+   connections of every origin that timed out or went unhealthy, so ones to
+   an origin that is never asked for again don't linger.
+ */
+class UpstreamPool {
+public:
+    UpstreamPool(size_t max_idle_per_origin = MAX_IDLE_PER_ORIGIN, int idle_timeout = ORIGIN_IDLE_TIMEOUT);
+    ~UpstreamPool();
+
+    // Disable copy and assignment
+    UpstreamPool(const UpstreamPool&) = delete;
+    UpstreamPool& operator=(const UpstreamPool&) = delete;
+
+    // Returns a pooled connection to host:port, or INVALID_SOCKET_VAL on a
+    // pool miss.
+    socket_t acquire(std::string_view host, int port);
+
+    // Returns s to the pool for host:port, or closes it if the pool is full.
+    void release(std::string_view host, int port, socket_t s);
+
+    // Closes every idle connection that timed out or that the origin hung
+    // up, and forgets origins left with none.
+    void sweep();
+
+    // Starts a thread that sweeps every UPSTREAM_SWEEP_INTERVAL seconds
+    // until the pool is destroyed.
+    void start_sweeper();
+
+    UpstreamStats stats() const;
+
+private:
+    struct IdleConnection {
+        socket_t fd;
+        time_t idle_since;
+    };
+
+    static std::string origin_key(std::string_view host, int port);
+    static bool healthy(socket_t s);
+
+    mutable std::mutex lock_;
+    std::unordered_map<std::string, std::vector<IdleConnection>> idle_;
+    size_t max_idle_per_origin_;
+    int idle_timeout_;
+    UpstreamStats stats_;
+    std::thread sweeper_;
+    std::condition_variable stop_;
+    bool stopping_ = false;
+};
+
+#endif
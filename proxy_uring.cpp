@@ -0,0 +1,870 @@
+/*
+  proxy_uring.cpp -- io_uring loops for the proxy server (Linux only).
+*/
+
+#include "proxy_uring.h"
+
+#ifdef PROXY_HAVE_URING
+
+#include "proxy_server_with_cache.h"
+#include "proxy_event_loop.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <cerrno>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <unordered_set>
+#include <chrono>
+#include <ctime>
+
+namespace {
+
+std::atomic<size_t> enters{0};
+std::atomic<size_t> submitted{0};
+std::atomic<size_t> completions{0};
+std::atomic<size_t> hits{0};
+std::atomic<size_t> handoffs{0};
+std::atomic<size_t> zc_sends{0};
+
+int uring_setup(unsigned entries, io_uring_params* p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+int uring_register(int fd, unsigned opcode, const void* arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+/*
+   Ring owns one io_uring instance: its submission and completion queues
+   mapped into the process. SQEs are queued with sqe() and go to the kernel
+   together at the next submit(), so a whole batch of completions' worth of
+   work costs one io_uring_enter. A full queue is submitted early. If the
+   kernel won't take it because its completion queue is full, the waiting
+   completions are copied out and kept for the next reap(), and the queue is
+   submitted again.
+ */
+class Ring {
+public:
+    Ring() = default;
+    ~Ring();
+
+    // Disable copy and assignment
+    Ring(const Ring&) = delete;
+    Ring& operator=(const Ring&) = delete;
+
+    // Sets up a ring with entries SQEs. Returns -1, with errno set, on failure.
+    int open(unsigned entries);
+    int fd() const { return fd_; }
+
+    // A zeroed SQE to fill in. When the queue is full, submits what is
+    // queued first. If the ring has become unusable, returns a scratch SQE
+    // that is never submitted; the next submit() reports the failure.
+    io_uring_sqe* sqe();
+
+    // Makes room for n more SQEs (at most the size of the queue), submitting
+    // what is queued as needed, so n linked SQEs go in without being split.
+    void reserve(unsigned n);
+
+    // SQEs that can be queued before the queue is full
+    unsigned space() const { return sq_entries_ - (tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE)); }
+
+    // Submits the queued SQEs and waits for at least wait completions.
+    // Returns -1, with errno set, if the ring is unusable.
+    int submit(unsigned wait);
+
+    // Calls handler with every completion waiting, those set aside while
+    // making room for SQEs first.
+    template <class Handler>
+    void reap(Handler handler);
+
+    int register_op(unsigned opcode, const void* arg, unsigned nr) { return uring_register(fd_, opcode, arg, nr); }
+
+private:
+    // Copies the waiting completions out of the completion queue, so the
+    // kernel has room to post more
+    void stash();
+
+    int fd_ = -1;
+    int error_ = 0;                 // errno of the failure that made the ring unusable
+    void* sq_ring_ = MAP_FAILED;
+    void* cq_ring_ = MAP_FAILED;
+    size_t sq_ring_len_ = 0;
+    size_t cq_ring_len_ = 0;
+    io_uring_sqe* sqes_ = (io_uring_sqe*)MAP_FAILED;
+    size_t sqes_len_ = 0;
+
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned tail_ = 0;             // SQEs queued, ahead of *sq_tail_ until the next submit
+
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+    std::deque<io_uring_cqe> stashed_;     // completions taken out by stash(), oldest first
+    io_uring_sqe scratch_;
+};
+
+Ring::~Ring() {
+    if (sqes_ != MAP_FAILED) munmap(sqes_, sqes_len_);
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_len_);
+    if (sq_ring_ != MAP_FAILED) munmap(sq_ring_, sq_ring_len_);
+    if (fd_ >= 0) close(fd_);
+}
+
+int Ring::open(unsigned entries) {
+    // Only this thread submits, and completions can wait until it next
+    // enters the kernel rather than interrupting it. Kernels that don't
+    // know those flags get a plain ring.
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = entries * 4;
+    fd_ = uring_setup(entries, &p);
+    if (fd_ < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4;
+        fd_ = uring_setup(entries, &p);
+    }
+    if (fd_ < 0) return -1;
+
+    sq_ring_len_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_len_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_ring_len_ = cq_ring_len_ = std::max(sq_ring_len_, cq_ring_len_);
+    }
+    sq_ring_ = mmap(nullptr, sq_ring_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) return -1;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring_ = sq_ring_;
+    }
+    else {
+        cq_ring_ = mmap(nullptr, cq_ring_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+        if (cq_ring_ == MAP_FAILED) return -1;
+    }
+    sqes_len_ = p.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = (io_uring_sqe*)mmap(nullptr, sqes_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) return -1;
+
+    char* sq = static_cast<char*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sq_entries_ = p.sq_entries;
+    tail_ = *sq_tail_;
+
+    char* cq = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+    return 0;
+}
+
+void Ring::reserve(unsigned n) {
+    while (space() < n && error_ == 0) {
+        unsigned free = space();
+        if (submit(0) < 0) break;
+        // Still full: the kernel refused the batch until it can post
+        // completions, or couldn't allocate for it
+        if (space() == free) stash();
+    }
+}
+
+io_uring_sqe* Ring::sqe() {
+    reserve(1);
+    if (space() == 0) {
+        memset(&scratch_, 0, sizeof(scratch_));
+        return &scratch_;
+    }
+    unsigned index = tail_ & sq_mask_;
+    io_uring_sqe* e = &sqes_[index];
+    memset(e, 0, sizeof(*e));
+    sq_array_[index] = index;
+    tail_++;
+    return e;
+}
+
+int Ring::submit(unsigned wait) {
+    if (error_ != 0) {
+        errno = error_;
+        return -1;
+    }
+    // Completions already stashed are waiting to be reaped
+    if (!stashed_.empty()) wait = 0;
+    __atomic_store_n(sq_tail_, tail_, __ATOMIC_RELEASE);
+    unsigned pending = tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (pending == 0 && wait == 0) return 0;
+    // Asking for events, even none, also moves completions the kernel had
+    // to hold back into the queue once stash() has made room
+    int n = uring_enter(fd_, pending, wait, IORING_ENTER_GETEVENTS);
+    enters.fetch_add(1, std::memory_order_relaxed);
+    if (n < 0) {
+        // Interrupted, or the completion queue is full; reaping makes room
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) return 0;
+        error_ = errno;
+        return -1;
+    }
+    submitted.fetch_add(n, std::memory_order_relaxed);
+    return n;
+}
+
+void Ring::stash() {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) stashed_.push_back(cqes_[head & cq_mask_]);
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
+
+template <class Handler>
+void Ring::reap(Handler handler) {
+    while (true) {
+        // Copied out and released first, so the handler can queue more work.
+        // Stashed completions are older than any still in the queue.
+        io_uring_cqe cqe;
+        if (!stashed_.empty()) {
+            cqe = stashed_.front();
+            stashed_.pop_front();
+        }
+        else {
+            unsigned head = *cq_head_;
+            if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) break;
+            cqe = cqes_[head & cq_mask_];
+            __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        }
+        completions.fetch_add(1, std::memory_order_relaxed);
+        handler(cqe);
+    }
+}
+
+// The low bits of an SQE's user_data say what it was for. A connection's own
+// operations carry its address alongside; a registered file slot being
+// emptied carries the slot above the tag.
+enum : uint64_t {
+    TAG_IGNORE = 0,     // completions nothing waits for
+    TAG_RECV = 1,
+    TAG_SEND = 2,
+    TAG_REGISTER = 3,   // the connection's socket going into its file slot
+    TAG_ACCEPT = 4,
+    TAG_TIMER = 5,
+    TAG_UNREGISTER = 6,
+    TAG_MASK = 7,
+};
+
+enum class UringState {
+    READ_REQUEST,   // reading the client's next request
+    SEND_HIT,       // sending a cache hit
+    HANDOFF,        // waiting for the ring's operations to end before handing the socket to a worker
+    CLOSING,        // waiting for them to end before closing it
+};
+
+struct UringConn {
+    UringState state = UringState::READ_REQUEST;
+    int fd;
+    int slot = -1;                // its registered file slot
+    std::string client;           // the client's address, for the access log
+
+    std::string in;               // bytes read from the client and not yet served
+    long request_len = 0;         // length of the request being served, at the front of in
+    ParsedRequest request;        // parsed in place from in, resuming as bytes arrive
+    int requests_served = 0;
+    bool keep_alive = false;      // the client asked to reuse the connection
+    bool eof = false;             // the client has sent all it will
+    time_t last_active;
+
+    // The hit being sent: out_off bytes of its data are sent, and a send of
+    // batch more is in flight
+    CacheKey key;
+    CacheEntryPtr hit;
+    size_t out_off = 0;
+    size_t batch = 0;
+    size_t batch_sent = 0;
+    bool send_failed = false;
+    // The batch's sendmsg goes from here
+    msghdr msg;
+    iovec_t iov[URING_SEND_BATCH];
+    // When the current request was started; unset once it has been logged
+    std::chrono::steady_clock::time_point started;
+
+    // Operations the ring still owes a completion for. The kernel reads a
+    // zero-copy send's bytes until its notification arrives, so the entries
+    // sent from are held until then.
+    bool registering = false;
+    bool recv_armed = false;
+    bool recv_paused = false;     // the recv was cancelled because in holds enough
+    unsigned sends = 0;
+    unsigned notifs = 0;
+    std::vector<CacheEntryPtr> pinned;
+
+    // What find() returned for the request a worker is handed
+    std::optional<CacheEntryPtr> looked_up;
+
+    UringConn(int s, std::string addr) : fd(s), client(std::move(addr)), last_active(time(NULL)) {}
+
+    // Drops the served request and readies for the next one on the connection
+    void reset() {
+        in.erase(0, request_len);
+        request_len = 0;
+        request.reset();
+        hit.reset();
+        out_off = 0;
+    }
+
+    uint64_t tag(uint64_t op) const { return reinterpret_cast<uintptr_t>(this) | op; }
+};
+
+// Empties a registered file slot
+const int kNoFile = -1;
+
+class UringLoop {
+public:
+    UringLoop(int listen_fd, WorkerPool* pool) : listen_fd_(listen_fd), pool_(pool) {}
+    ~UringLoop();
+
+    // Runs until the ring fails
+    void run();
+
+private:
+    int setup();
+    void arm_accept();
+    void arm_timer();
+    void arm_recv(UringConn* c);
+    void pause_recv(UringConn* c);
+    void resume_recv(UringConn* c);
+    void recycle(unsigned bid);
+
+    void on_completion(const io_uring_cqe& cqe);
+    void on_accept(const io_uring_cqe& cqe);
+    void on_register(UringConn* c, int res);
+    void on_recv(UringConn* c, const io_uring_cqe& cqe);
+    void on_send(UringConn* c, const io_uring_cqe& cqe);
+
+    void next_request(UringConn* c);
+    void start_request(UringConn* c);
+    void send_hit(UringConn* c);
+    void finish(UringConn* c);
+    void log_request(UringConn* c);
+    void handoff(UringConn* c, std::optional<CacheEntryPtr> looked_up);
+    void close_connection(UringConn* c);
+    void release(UringConn* c);
+    void close_idle();
+
+    Ring ring_;
+    int listen_fd_;
+    WorkerPool* pool_;
+    std::unordered_set<UringConn*> conns_;
+    std::vector<int> free_slots_;
+    __kernel_timespec tick_{1, 0};
+
+    // The provided buffer ring client reads land in. The kernel's header
+    // overlays the ring's tail with the first entry's reserved bytes.
+    io_uring_buf* bufs_ = nullptr;
+    size_t bufs_len_ = 0;
+    std::unique_ptr<char[]> recv_buffers_;
+    uint16_t buf_tail_ = 0;
+};
+
+UringLoop::~UringLoop() {
+    for (UringConn* c : conns_) {
+        if (c->fd >= 0) close_socket(c->fd);
+        delete c;
+    }
+    if (bufs_) munmap(bufs_, bufs_len_);
+}
+
+int UringLoop::setup() {
+    if (ring_.open(URING_ENTRIES) < 0) {
+        log_message(LogLevel::ERR, "Can't set up io_uring: %s", strerror(errno));
+        return -1;
+    }
+
+    // Client sockets go in a sparse table of fixed files, so reads and
+    // sends skip the fd lookup
+    io_uring_rsrc_register files;
+    memset(&files, 0, sizeof(files));
+    files.nr = URING_MAX_FILES;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (ring_.register_op(IORING_REGISTER_FILES2, &files, sizeof(files)) < 0) {
+        log_message(LogLevel::ERR, "Can't register io_uring files: %s", strerror(errno));
+        return -1;
+    }
+    for (int slot = URING_MAX_FILES - 1; slot >= 0; slot--) free_slots_.push_back(slot);
+
+    bufs_len_ = URING_RECV_BUFFERS * sizeof(io_uring_buf);
+    void* ring = mmap(nullptr, bufs_len_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        log_message(LogLevel::ERR, "Can't map io_uring buffer ring");
+        return -1;
+    }
+    bufs_ = static_cast<io_uring_buf*>(ring);
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uintptr_t>(bufs_);
+    reg.ring_entries = URING_RECV_BUFFERS;
+    reg.bgid = 0;
+    if (ring_.register_op(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        log_message(LogLevel::ERR, "Can't register io_uring buffer ring: %s", strerror(errno));
+        return -1;
+    }
+    recv_buffers_.reset(new char[(size_t)URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE]);
+    for (unsigned bid = 0; bid < URING_RECV_BUFFERS; bid++) recycle(bid);
+    return 0;
+}
+
+// Gives buffer bid back to the kernel to read into
+void UringLoop::recycle(unsigned bid) {
+    io_uring_buf* b = &bufs_[buf_tail_ & (URING_RECV_BUFFERS - 1)];
+    b->addr = reinterpret_cast<uintptr_t>(recv_buffers_.get() + (size_t)bid * URING_RECV_BUFFER_SIZE);
+    b->len = URING_RECV_BUFFER_SIZE;
+    b->bid = (uint16_t)bid;
+    buf_tail_++;
+    __atomic_store_n(&reinterpret_cast<io_uring_buf_ring*>(bufs_)->tail, buf_tail_, __ATOMIC_RELEASE);
+}
+
+void UringLoop::arm_accept() {
+    io_uring_sqe* e = ring_.sqe();
+    e->opcode = IORING_OP_ACCEPT;
+    e->fd = listen_fd_;
+    e->ioprio = IORING_ACCEPT_MULTISHOT;
+    e->accept_flags = SOCK_CLOEXEC;
+    e->user_data = TAG_ACCEPT;
+}
+
+void UringLoop::arm_timer() {
+    io_uring_sqe* e = ring_.sqe();
+    e->opcode = IORING_OP_TIMEOUT;
+    e->addr = reinterpret_cast<uintptr_t>(&tick_);
+    e->len = 1;
+    e->user_data = TAG_TIMER;
+}
+
+void UringLoop::arm_recv(UringConn* c) {
+    io_uring_sqe* e = ring_.sqe();
+    e->opcode = IORING_OP_RECV;
+    e->fd = c->slot;
+    e->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    e->ioprio = IORING_RECV_MULTISHOT;
+    e->buf_group = 0;
+    e->user_data = c->tag(TAG_RECV);
+    c->recv_armed = true;
+}
+
+void UringLoop::run() {
+    if (setup() < 0) return;
+    arm_accept();
+    arm_timer();
+    while (true) {
+        if (ring_.submit(1) < 0) {
+            log_message(LogLevel::ERR, "io_uring_enter failed: %s", strerror(errno));
+            return;
+        }
+        ring_.reap([this](const io_uring_cqe& cqe) { on_completion(cqe); });
+    }
+}
+
+void UringLoop::on_completion(const io_uring_cqe& cqe) {
+    uint64_t tag = cqe.user_data & TAG_MASK;
+    UringConn* c = reinterpret_cast<UringConn*>(cqe.user_data & ~(uint64_t)TAG_MASK);
+    switch (tag) {
+        case TAG_RECV: on_recv(c, cqe); break;
+        case TAG_SEND: on_send(c, cqe); break;
+        case TAG_REGISTER: on_register(c, cqe.res); break;
+        case TAG_ACCEPT: on_accept(cqe); break;
+        case TAG_TIMER:
+            close_idle();
+            arm_timer();
+            break;
+        case TAG_UNREGISTER:
+            // The slot is empty; a new connection can have it
+            free_slots_.push_back((int)(cqe.user_data >> 3));
+            break;
+        default: break;
+    }
+}
+
+void UringLoop::on_accept(const io_uring_cqe& cqe) {
+    if (!(cqe.flags & IORING_CQE_F_MORE)) arm_accept();
+    if (cqe.res < 0) {
+        if (cqe.res != -EINTR && cqe.res != -ECONNABORTED && cqe.res != -ECANCELED) {
+            log_message(LogLevel::ERR, "Error in Accepting connection !");
+        }
+        return;
+    }
+    int fd = cqe.res;
+    // A hit's head and body go out in one send, but the next response on a
+    // kept-alive connection mustn't wait for the last one's ACK
+    set_nodelay(fd);
+
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    memset(&client_addr, 0, sizeof(client_addr));
+    getpeername(fd, (struct sockaddr*)&client_addr, &client_len);
+    char str[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client_addr.sin_addr, str, INET_ADDRSTRLEN);
+    log_message(LogLevel::DEBUG, "Client is connected with port number: %u and ip address: %s", (unsigned)ntohs(client_addr.sin_port), str);
+
+    UringConn* c = new UringConn(fd, std::string(str) + ":" + std::to_string(ntohs(client_addr.sin_port)));
+    conns_.insert(c);
+    if (free_slots_.empty()) {
+        // Every file slot is taken; a worker serves this one
+        handoff(c, std::nullopt);
+        return;
+    }
+    c->slot = free_slots_.back();
+    free_slots_.pop_back();
+    io_uring_sqe* e = ring_.sqe();
+    e->opcode = IORING_OP_FILES_UPDATE;
+    e->fd = -1;
+    e->addr = reinterpret_cast<uintptr_t>(&c->fd);
+    e->len = 1;
+    e->off = c->slot;
+    e->user_data = c->tag(TAG_REGISTER);
+    c->registering = true;
+}
+
+void UringLoop::on_register(UringConn* c, int res) {
+    c->registering = false;
+    if (res < 0) {
+        free_slots_.push_back(c->slot);
+        c->slot = -1;
+        handoff(c, std::nullopt);
+        return;
+    }
+    if (c->state == UringState::CLOSING) {
+        release(c);
+        return;
+    }
+    arm_recv(c);
+}
+
+void UringLoop::on_recv(UringConn* c, const io_uring_cqe& cqe) {
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe.res > 0 && c->state != UringState::CLOSING) {
+            c->in.append(recv_buffers_.get() + (size_t)bid * URING_RECV_BUFFER_SIZE, cqe.res);
+        }
+        recycle(bid);
+    }
+    if (!more) c->recv_armed = false;
+
+    if (c->state == UringState::HANDOFF || c->state == UringState::CLOSING) {
+        release(c);
+        return;
+    }
+    if (cqe.res == 0) {
+        c->eof = true;
+        if (c->state == UringState::READ_REQUEST) close_connection(c);
+        return;
+    }
+    if (cqe.res < 0 && cqe.res != -ENOBUFS && !(cqe.res == -ECANCELED && c->recv_paused)) {
+        if (cqe.res != -ECONNRESET) log_message(LogLevel::WARN, "Error in receiving from client socket.");
+        close_connection(c);
+        return;
+    }
+    if (cqe.res > 0) {
+        c->last_active = time(NULL);
+        if (c->recv_armed && c->in.size() > MAX_CLIENT_BUFFER) pause_recv(c);
+    }
+    if (!c->recv_armed) resume_recv(c);
+    if (cqe.res > 0 && c->state == UringState::READ_REQUEST) next_request(c);
+}
+
+// Stops reading once in holds more than any one request needs, as while a
+// client pipelines behind a long hit; the rest waits in the socket until
+// the buffered requests are served.
+void UringLoop::pause_recv(UringConn* c) {
+    if (c->recv_paused) return;
+    io_uring_sqe* e = ring_.sqe();
+    e->opcode = IORING_OP_ASYNC_CANCEL;
+    e->fd = -1;
+    e->addr = c->tag(TAG_RECV);
+    e->user_data = TAG_IGNORE;
+    c->recv_paused = true;
+}
+
+// Rearms the recv once it has ended, unless in is still too full.
+void UringLoop::resume_recv(UringConn* c) {
+    if (c->recv_armed || c->eof || c->in.size() > MAX_CLIENT_BUFFER) return;
+    c->recv_paused = false;
+    arm_recv(c);
+}
+
+// Starts on the next request if it is already buffered (pipelined), or waits
+// for more bytes from the client.
+void UringLoop::next_request(UringConn* c) {
+    c->request_len = c->request.parse(c->in.data(), c->in.size());
+    if (c->request_len == 0) {
+        if (c->eof) close_connection(c);
+        else if (c->in.size() > MAX_CLIENT_BUFFER) handoff(c, std::nullopt);    // the worker's parse fails it with a 400
+        else resume_recv(c);
+        return;
+    }
+    if (c->request_len < 0) {
+        // A worker answers it with the 400
+        handoff(c, std::nullopt);
+        return;
+    }
+    start_request(c);
+}
+
+void UringLoop::start_request(UringConn* c) {
+    // Only fresh hits sent whole are served here: anything that needs an
+    // origin, a tunnel, slices or a range goes to a worker
+    const ParsedRequest& request = c->request;
+    if (request.get_method() != "GET" || request.get_host().empty() || request.get_path().empty() ||
+        checkHTTPversion(request.get_version()) != 1 || request.get_header("Range") != nullptr) {
+        handoff(c, std::nullopt);
+        return;
+    }
+    c->key = cache.key_for(request);
+    CacheEntryPtr entry = find(c->key);
+    if (!entry || entry->sliced_length != 0 || !entry->fresh(time(NULL)) || request_wants_revalidation(request)) {
+        handoff(c, std::move(entry));
+        return;
+    }
+
+    c->requests_served++;
+    c->started = std::chrono::steady_clock::now();
+    c->keep_alive = client_keep_alive(request);
+    c->hit = std::move(entry);
+    c->out_off = 0;
+    c->state = UringState::SEND_HIT;
+    send_hit(c);
+}
+
+// Queues the next batch of the hit as one sendmsg over its slabs. A short
+// hit is copied; a long one is sent zero-copy.
+void UringLoop::send_hit(UringConn* c) {
+    const BufferChain& data = c->hit->data;
+    size_t n = data.fill_iov(c->out_off, c->iov, URING_SEND_BATCH);
+    c->batch = 0;
+    c->batch_sent = 0;
+    c->send_failed = false;
+    for (size_t i = 0; i < n; i++) c->batch += c->iov[i].iov_len;
+
+    memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov = c->iov;
+    c->msg.msg_iovlen = n;
+    io_uring_sqe* e = ring_.sqe();
+    e->opcode = IORING_OP_SENDMSG;
+    e->fd = c->slot;
+    e->flags = IOSQE_FIXED_FILE;
+    e->addr = reinterpret_cast<uintptr_t>(&c->msg);
+    e->len = 1;
+    e->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    e->user_data = c->tag(TAG_SEND);
+    c->sends = 1;
+    if (data.size() >= URING_ZC_MIN) {
+        e->opcode = IORING_OP_SENDMSG_ZC;
+        if (c->pinned.empty() || c->pinned.back() != c->hit) c->pinned.push_back(c->hit);
+        zc_sends.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void UringLoop::on_send(UringConn* c, const io_uring_cqe& cqe) {
+    if (cqe.flags & IORING_CQE_F_NOTIF) {
+        // The kernel is done with a zero-copy send's bytes
+        if (--c->notifs == 0) c->pinned.clear();
+        if (c->state == UringState::HANDOFF || c->state == UringState::CLOSING) release(c);
+        return;
+    }
+    if (cqe.flags & IORING_CQE_F_MORE) c->notifs++;
+    c->sends--;
+    if (cqe.res < 0) c->send_failed = true;
+    else c->batch_sent += cqe.res;
+    if (c->sends > 0) return;
+
+    if (c->state == UringState::CLOSING) {
+        release(c);
+        return;
+    }
+    if (c->send_failed || c->batch_sent != c->batch) {
+        c->out_off += c->batch_sent;
+        log_message(LogLevel::WARN, "Error in sending data to client socket.");
+        close_connection(c);
+        return;
+    }
+    c->out_off += c->batch;
+    if (c->out_off < c->hit->data.size()) send_hit(c);
+    else finish(c);
+}
+
+// Completes the current hit, then either closes the connection or moves on
+// to the client's next request.
+void UringLoop::finish(UringConn* c) {
+    log_request(c);
+    log_message(LogLevel::DEBUG, "Data retrieved from the Cache");
+    hits.fetch_add(1, std::memory_order_relaxed);
+    // The client can only find the end of a response that carried its length
+    if (!c->hit->delimited || !c->keep_alive || c->requests_served >= MAX_REQUESTS_PER_CONNECTION) {
+        close_connection(c);
+        return;
+    }
+    c->reset();
+    c->state = UringState::READ_REQUEST;
+    c->last_active = time(NULL);
+    next_request(c);
+}
+
+// Records the current hit in the access log and metrics, once.
+void UringLoop::log_request(UringConn* c) {
+    if (c->started == std::chrono::steady_clock::time_point()) return;
+    auto latency = std::chrono::steady_clock::now() - c->started;
+    metrics_record_request(RequestOutcome::HIT, c->out_off, latency);
+    log_access(c->client.c_str(), c->key.url(), outcome_name(RequestOutcome::HIT), c->out_off,
+               std::chrono::duration<double, std::milli>(latency).count());
+    c->started = std::chrono::steady_clock::time_point();
+}
+
+// Hands the connection, from the request at the front of in, to a worker
+// once the ring has let go of it.
+void UringLoop::handoff(UringConn* c, std::optional<CacheEntryPtr> looked_up) {
+    c->state = UringState::HANDOFF;
+    c->looked_up = std::move(looked_up);
+    if (c->recv_armed) {
+        io_uring_sqe* e = ring_.sqe();
+        e->opcode = IORING_OP_ASYNC_CANCEL;
+        e->fd = -1;
+        e->addr = c->tag(TAG_RECV);
+        e->user_data = TAG_IGNORE;
+    }
+    release(c);
+}
+
+void UringLoop::close_connection(UringConn* c) {
+    if (c->state == UringState::CLOSING) return;
+    log_request(c);
+    c->state = UringState::CLOSING;
+    // Ends the armed recv and any sends
+    shutdown(c->fd, SD_BOTH);
+    release(c);
+}
+
+// Once no operation of the ring uses the socket, empties its file slot and
+// closes it or hands it over; once the kernel is done with every zero-copy
+// send, frees the connection.
+void UringLoop::release(UringConn* c) {
+    if (c->registering || c->recv_armed || c->sends > 0) return;
+    if (c->fd >= 0) {
+        if (c->slot >= 0) {
+            io_uring_sqe* e = ring_.sqe();
+            e->opcode = IORING_OP_FILES_UPDATE;
+            e->fd = -1;
+            e->addr = reinterpret_cast<uintptr_t>(&kNoFile);
+            e->len = 1;
+            e->off = c->slot;
+            e->user_data = ((uint64_t)c->slot << 3) | TAG_UNREGISTER;
+            c->slot = -1;
+        }
+        if (c->state == UringState::HANDOFF) {
+            handoffs.fetch_add(1, std::memory_order_relaxed);
+            int fd = c->fd;
+            WorkerPool* pool = pool_;
+            std::string client = c->client;
+            std::optional<CacheEntryPtr> looked_up = std::move(c->looked_up);
+            if (!pool_->submit([fd, client, pool, pending = std::move(c->in), looked_up]() mutable {
+                    thread_fn(fd, client, pool, std::move(pending), std::move(looked_up));
+                })) {
+                sendErrorMessage(fd, 503);
+                shutdown(fd, SD_BOTH);
+                close_socket(fd);
+            }
+        }
+        else {
+            close_socket(c->fd);
+            log_message(LogLevel::DEBUG, "Client connection closed.");
+        }
+        c->fd = -1;
+    }
+    if (c->notifs > 0) return;
+    conns_.erase(c);
+    delete c;
+}
+
+void UringLoop::close_idle() {
+    time_t now = time(NULL);
+    std::vector<UringConn*> idle;
+    for (UringConn* c : conns_) {
+        if (c->state == UringState::READ_REQUEST && now - c->last_active > CLIENT_IDLE_TIMEOUT) idle.push_back(c);
+    }
+    for (UringConn* c : idle) close_connection(c);
+}
+
+}  // namespace
+
+bool uring_available() {
+    Ring ring;
+    if (ring.open(8) < 0) {
+        log_message(LogLevel::WARN, "Can't set up io_uring: %s", strerror(errno));
+        return false;
+    }
+    const unsigned max_ops = 256;
+    std::vector<char> buf(sizeof(io_uring_probe) + max_ops * sizeof(io_uring_probe_op), 0);
+    io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buf.data());
+    if (ring.register_op(IORING_REGISTER_PROBE, probe, max_ops) < 0) {
+        log_message(LogLevel::WARN, "Can't probe io_uring: %s", strerror(errno));
+        return false;
+    }
+    // Zero-copy sendmsg came after multishot recv and provided buffer
+    // rings, so a kernel that has it has everything
+    const unsigned needed[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_SENDMSG_ZC,
+                               IORING_OP_FILES_UPDATE, IORING_OP_ASYNC_CANCEL, IORING_OP_TIMEOUT};
+    for (unsigned op : needed) {
+        if (op >= probe->ops_len || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            log_message(LogLevel::WARN, "This kernel's io_uring lacks operation %u", op);
+            return false;
+        }
+    }
+    return true;
+}
+
+int run_uring_loops(int port_number, int num_loops, WorkerPool* pool) {
+    // Open every listener up front so a busy port is reported before any
+    // loop starts serving.
+    std::vector<int> listeners;
+    for (int i = 0; i < num_loops; i++) {
+        int fd = open_listener(port_number);
+        if (fd < 0) {
+            for (int l : listeners) close_socket(l);
+            return 1;
+        }
+        listeners.push_back(fd);
+    }
+    log_message(LogLevel::INFO, "Binding on port: %d with %d io_uring loops", port_number, num_loops);
+
+    std::vector<std::thread> threads;
+    for (int fd : listeners) {
+        threads.emplace_back([fd, pool]() { UringLoop(fd, pool).run(); });
+    }
+    for (auto& t : threads) t.join();
+    for (int fd : listeners) close_socket(fd);
+    return 1;
+}
+
+UringStats uring_stats() {
+    UringStats stats;
+    stats.enters = enters;
+    stats.submitted = submitted;
+    stats.completions = completions;
+    stats.hits = hits;
+    stats.handoffs = handoffs;
+    stats.zc_sends = zc_sends;
+    return stats;
+}
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * proxy_uring.h -- an io_uring front end for client connections (Linux only).
+ */
+#include "proxy_pool.h"
+#include <cstdint>
+#include <cstddef>
+
+#ifndef PROXY_URING
+#define PROXY_URING
+
+// Built on Linux when the kernel headers describe io_uring. The rings are
+// driven with raw system calls, so liburing isn't needed.
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define PROXY_HAVE_URING
+#endif
+#endif
+
+#ifdef PROXY_HAVE_URING
+
+#define URING_ENTRIES 1024              //submission queue slots per ring; the completion queue gets four times as many
+#define URING_RECV_BUFFERS 1024         //buffers in each ring's provided buffer ring for client reads; a power of two
+#define URING_RECV_BUFFER_SIZE 4096     //bytes in each of them
+#define URING_MAX_FILES 4096            //registered file slots per ring, one per client connection
+#define URING_ZC_MIN (64*1024)          //hits at least this long are sent zero-copy; shorter ones are copied in one sendmsg
+#define URING_SEND_BATCH 64             //slabs sent by one sendmsg; the next batch goes once it completes
+
+// Counters kept over every ring.
+struct UringStats {
+    size_t enters = 0;              // io_uring_enter calls, each submitting a batch
+    size_t submitted = 0;           // SQEs those calls submitted
+    size_t completions = 0;         // CQEs reaped
+    size_t hits = 0;                // cache hits served by the rings
+    size_t handoffs = 0;            // connections handed to the worker pool
+    size_t zc_sends = 0;            // zero-copy sendmsgs
+};
+
+// Whether this kernel can run the io_uring backend: it lets the process set
+// up a ring, and supports the operations the backend needs (zero-copy
+// sendmsg, which came after multishot recv).
+bool uring_available();
+
+/*
+   Runs num_loops io_uring threads, each with its own SO_REUSEPORT listener
+   on port_number. A ring accepts with a multishot accept and reads each
+   client with a multishot recv into a ring of provided buffers. Clients are
+   registered as fixed files. Everything a batch of completions produces goes
+   to the kernel in one io_uring_enter. Fresh cache hits are served on the
+   ring. Each batch of a hit's slabs goes in one sendmsg, zero-copy when the
+   body is at least URING_ZC_MIN long. Any other request hands the
+   connection, and the bytes read from it, to pool, which serves it with
+   thread_fn as thread mode does.
+
+   Only returns (with a non-zero status) if the listeners or rings can't be
+   set up.
+ */
+int run_uring_loops(int port_number, int num_loops, WorkerPool* pool);
+
+UringStats uring_stats();
+
+#endif
+
+#endif